@@ -1,17 +1,75 @@
 #include "image-lib.h"
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
 #include <assert.h>
 #include <time.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sched.h>
+#include <unistd.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <strings.h>
+#include <jpeglib.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <poll.h>
+#endif
 
 /* the image-list file path */
 #define IMAGE_LIST "/image-list.txt"
 /* the directories wher output files will be placed */
 #define OLD_IMAGE_DIR "/old_photo_PAR_A"
 
+/* parameters of the old photo filter chain */
+#define CONTRAST_LEVEL	-20
+#define SMOOTH_WEIGHT	20
+#define SEPIA_RED		100
+#define SEPIA_GREEN		60
+#define SEPIA_BLUE		0
+/* quality of the outputs in each format (see output_format_set()) */
+#define JPEG_QUALITY	70
+#define WEBP_QUALITY	80
+#define HEIF_QUALITY	50
+#define PNG_LEVEL		6
+/* bytes of a HEIF searched for the size of its image */
+#define HEIF_HEADER_SIZE	(64 * 1024)
+
+/* suffix of an output while it's written (renamed when complete) */
+#define TEMP_SUFFIX		".part"
+/* held locked shared by every run writing into the output directory */
+#define LOCK_FILE		"/.lock"
+/* the manifest, in the output directory, and its first line */
+#define MANIFEST_FILE	"/.manifest"
+#define MANIFEST_HEADER	"# old-photo-paral manifest 1 "
+/* repeated lines tolerated before the manifest is compacted */
+#define MANIFEST_SLACK	1024
+
+/* huge page size the pool buffers are rounded to with MAP_HUGETLB */
+#define POOL_HUGE_PAGE	(2 * 1024 * 1024)
+/* files asyncWriter has in flight, and queued before writer_submit() waits */
+#define WRITER_INFLIGHT		32
+#define WRITER_MAX_QUEUED	64
+/* entries a fileList starts with (doubles when full) */
+#define FILE_LIST_SIZE		256
+/* entries read between wake-ups of the threads waiting for them */
+#define FILE_LIST_BATCH		64
+/* bytes of inotify events read at a time when watching */
+#define WATCH_EVENTS_SIZE	(16 * 1024)
+/* longest file name kept with a trace event (the rest is cut) */
+#define TRACE_DETAIL		32
+/* scanlines decoded at a time by old_photo_filter_stream() */
+#define STREAM_BAND_ROWS 16
+
 /******************************************************************************
  * texture_image()
  *
@@ -33,20 +91,74 @@ gdImagePtr  texture_image(gdImagePtr in_img, gdImagePtr texture_img){
 	heigth = in_img->sy;
 
 
-	gdImageSetInterpolationMethod(texture_img, GD_BILINEAR_FIXED);
-    gdImagePtr scalled_pattern = gdImageScale(texture_img, width, heigth);
+	/* a texture already at the image size (e.g. from a textureCache) is used
+	 * as is, without touching it */
+	gdImagePtr scalled_pattern = texture_img;
+	if (texture_img->sx != width || texture_img->sy != heigth) {
+		gdImageSetInterpolationMethod(texture_img, GD_BILINEAR_FIXED);
+		scalled_pattern = gdImageScale(texture_img, width, heigth);
+	}
 
 
 	out_img =  gdImageClone (in_img);
 
 	gdImageCopy(out_img, scalled_pattern, 0, 0, 0, 0, width, heigth);
-	gdImageDestroy(scalled_pattern);
+	if (scalled_pattern != texture_img) {
+		gdImageDestroy(scalled_pattern);
+	}
 	return(out_img);		
 } 
 
 
 
 
+/* smoothing used by smooth_image() and the old photo filter, and the weight
+ * of the (first) smoothing stage of the pipeline (see pipeline_set()) */
+static int smooth_mode = SMOOTH_FAST;
+static int smooth_weight = SMOOTH_WEIGHT;
+
+static void smooth_image_rows(gdImagePtr in_img, gdImagePtr out_img);
+
+/******************************************************************************
+ * smooth_select()
+ *
+ * Arguments: mode - SMOOTH_FAST or SMOOTH_GD
+ * Returns: (void)
+ * Side-Effects: must be called before any thread is filtering
+ *
+ * Description: chooses between the dedicated smoothing kernel (default) and
+ * 				gdImageSmooth(), to compare the two. With SMOOTH_GD the old
+ * 				photo filter goes through the stage chain.
+ *
+ *****************************************************************************/
+void smooth_select(int mode){
+
+	smooth_mode = mode;
+}
+
+/******************************************************************************
+ * copy_image_attributes()
+ *
+ * Arguments: out_img - image made from in_img
+ *            in_img - image it was made from
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: copies to a new image what gdImageClone() would keep of
+ * 				in_img besides its pixels and the encoders use: the alpha
+ * 				flags, the resolution (JFIF density) and interlacing
+ * 				(progressive JPEG)
+ *
+ *****************************************************************************/
+void copy_image_attributes(gdImagePtr out_img, gdImagePtr in_img){
+
+	out_img->alphaBlendingFlag = in_img->alphaBlendingFlag;
+	out_img->saveAlphaFlag = in_img->saveAlphaFlag;
+	out_img->res_x = in_img->res_x;
+	out_img->res_y = in_img->res_y;
+	out_img->interlace = in_img->interlace;
+}
+
 /******************************************************************************
  * smooth_image()
  *
@@ -54,19 +166,33 @@ gdImagePtr  texture_image(gdImagePtr in_img, gdImagePtr texture_img){
  * Returns: out - pointer to smoother image, or NULL in case of failure
  * Side-Effects: none
  *
- * Description: creates clone of image smoother
+ * Description: creates clone of image smoother. Truecolor images are smoothed
+ * 				straight from the rows of in into a new image with the
+ * 				integer smoothing kernel (same output as gdImageSmooth());
+ * 				with SMOOTH_GD, for palette images, or if the pipeline
+ * 				smooths with another weight, gdImageSmooth() is used
  *
  *****************************************************************************/
 gdImagePtr  smooth_image(gdImagePtr in_img){
 	
 	gdImagePtr out_img;
+
+	if (smooth_mode == SMOOTH_FAST && in_img->trueColor && smooth_weight == SMOOTH_WEIGHT) {
+		out_img = gdImageCreateTrueColor(in_img->sx, in_img->sy);
+		if (!out_img) {
+			return NULL;
+		}
+		copy_image_attributes(out_img, in_img);
+		smooth_image_rows(in_img, out_img);
+		return(out_img);
+	}
 	
 	out_img =  gdImageClone (in_img);
 	if (!out_img) {
 		return NULL;
 	}
 
-	int ret = gdImageSmooth(out_img, 20);
+	int ret = gdImageSmooth(out_img, SMOOTH_WEIGHT);
 
 
 	if (!out_img) {
@@ -98,7 +224,7 @@ gdImagePtr  contrast_image(gdImagePtr in_img){
 		return NULL;
 	}
 
-	int ret = gdImageContrast(out_img, -20);
+	int ret = gdImageContrast(out_img, CONTRAST_LEVEL);
 
 
 	return(out_img);		
@@ -125,7 +251,7 @@ gdImagePtr  sepia_image(gdImagePtr in_img){
 		return NULL;
 	}
 
-	int ret = gdImageColor(out_img, 100, 60, 0, 0);
+	int ret = gdImageColor(out_img, SEPIA_RED, SEPIA_GREEN, SEPIA_BLUE, 0);
 
 
 	return(out_img);		
@@ -135,296 +261,5961 @@ gdImagePtr  sepia_image(gdImagePtr in_img){
 
 
 /******************************************************************************
- * read_png_file()
+ * blend_pixel()
  *
- * Arguments: file_name - name of file with data for PNG image
- * Returns: img - the image read from file or NULL if failure to read
+ * Arguments: dst - truecolor pixel already in the image
+ *            src - truecolor pixel being drawn over it
+ * Returns: (int) the resulting truecolor pixel
  * Side-Effects: none
  *
- * Description: reads a PNG image from a file
+ * Description: same arithmetic as gdAlphaBlend(), which is what
+ * 				gdImageSetPixel() applies on images with alpha blending on,
+ * 				inlined so the fused kernel doesn't pay a call per pixel
  *
  *****************************************************************************/
-gdImagePtr read_png_file(char * file_name){
+static inline int blend_pixel(int dst, int src){
 
-	FILE * fp;
-	gdImagePtr read_img;
+	int src_alpha = gdTrueColorGetAlpha(src);
+	int dst_alpha, src_weight, dst_weight, tot_weight;
 
-	fp = fopen(file_name, "rb");
-   	if (!fp) {
-        fprintf(stderr, "Can't read image %s\n", file_name);
-        return NULL;
-    }
-    read_img = gdImageCreateFromPng(fp);
-    fclose(fp);
-  	if (read_img == NULL) {
-    	return NULL;
-    }
+	if (src_alpha == gdAlphaOpaque) {
+		return src;
+	}
+	dst_alpha = gdTrueColorGetAlpha(dst);
+	if (src_alpha == gdAlphaTransparent) {
+		return dst;
+	}
+	if (dst_alpha == gdAlphaTransparent) {
+		return src;
+	}
 
-	return read_img;
+	src_weight = gdAlphaTransparent - src_alpha;
+	dst_weight = (gdAlphaTransparent - dst_alpha) * src_alpha / gdAlphaMax;
+	tot_weight = src_weight + dst_weight;
+
+	return gdTrueColorAlpha(
+		(gdTrueColorGetRed(src) * src_weight + gdTrueColorGetRed(dst) * dst_weight) / tot_weight,
+		(gdTrueColorGetGreen(src) * src_weight + gdTrueColorGetGreen(dst) * dst_weight) / tot_weight,
+		(gdTrueColorGetBlue(src) * src_weight + gdTrueColorGetBlue(dst) * dst_weight) / tot_weight,
+		src_alpha * dst_alpha / gdAlphaMax);
 }
 
 /******************************************************************************
- * write_png_file()
+ * color_map_init()
  *
- * Arguments: img - pointer to image to be written
- *            file_name - name of file where to save PNG image
- * Returns: (bool) 1 in case of success, 0 in case of failure to write
+ * Arguments: map - map to start
+ * Returns: (void)
  * Side-Effects: none
  *
- * Description: writes a PNG image to a file
+ * Description: starts an empty map (every value to itself)
  *
  *****************************************************************************/
-int write_png_file(gdImagePtr write_img, char * file_name){
-	FILE * fp;
+void color_map_init(colorMap *map){
 
-	fp = fopen(file_name, "wb");
-	if (fp == NULL) {
-		return 0;
+	for (int c = 0; c < 3; c++) {
+		for (int v = 0; v < 256; v++) {
+			map->lut[c][v] = (unsigned char) v;
+		}
 	}
-	gdImagePng(write_img, fp);
-	fclose(fp);
+	map->steps = 0;
+}
 
+/******************************************************************************
+ * color_map_table()
+ *
+ * Arguments: map - map to add to
+ *            table - value of each red, green and blue value after the
+ *                    operation
+ * Returns: (bool) 1 in case of success, 0 if map has COLOR_MAP_STEPS already
+ * Side-Effects: none
+ *
+ * Description: adds a point operation after the ones in map: its table is
+ * 				composed with the tables of map, and kept for the pixels
+ * 				with alpha (see color_map_pixel())
+ *
+ *****************************************************************************/
+int color_map_table(colorMap *map, const unsigned char table[3][256]){
+
+	if (map->steps == COLOR_MAP_STEPS) {
+		return 0;
+	}
+	memcpy(map->step[map->steps++], table, sizeof(map->step[0]));
+	for (int c = 0; c < 3; c++) {
+		for (int v = 0; v < 256; v++) {
+			map->lut[c][v] = table[c][map->lut[c][v]];
+		}
+	}
 	return 1;
 }
 
 /******************************************************************************
- * read_jpeg_file()
+ * color_map_contrast()
  *
- * Arguments: file_name - name of file with data for JPEG image
- * Returns: img - the image read from file or NULL if failure to read
+ * Arguments: map - map to add to
+ *            contrast - contrast level as given to gdImageContrast()
+ * Returns: (bool) 1 in case of success, 0 if map is full
  * Side-Effects: none
  *
- * Description: reads a JPEG image from a file
+ * Description: adds gdImageContrast(): its formula, with the same double
+ * 				operations in the same order, for every channel value
  *
  *****************************************************************************/
-gdImagePtr read_jpeg_file(char * file_name){
+int color_map_contrast(colorMap *map, double contrast){
 
-	FILE * fp;
-	gdImagePtr read_img;
+	unsigned char table[3][256];
+	double f;
 
-	fp = fopen(file_name, "rb");
-   	if (!fp) {
-        fprintf(stderr, "Can't read image %s\n", file_name);
-        return NULL;
-    }
-    read_img = gdImageCreateFromJpeg(fp);
-    fclose(fp);
-  	if (read_img == NULL) {
-    	return NULL;
-    }
+	contrast = (double) (100.0 - contrast) / 100.0;
+	contrast = contrast * contrast;
 
-	return read_img;
+	for (int v = 0; v < 256; v++) {
+		f = (double) v / 255.0;
+		f = f - 0.5;
+		f = f * contrast;
+		f = f + 0.5;
+		f = f * 255.0;
+		f = (f > 255.0) ? 255.0 : ((f < 0.0) ? 0.0 : f);
+		table[0][v] = table[1][v] = table[2][v] = (unsigned char) (int) f;
+	}
+	return color_map_table(map, table);
 }
 
 /******************************************************************************
- * write_jpeg_file()
+ * color_map_shift()
  *
- * Arguments: img - pointer to image to be written
- *            file_name - name of file where to save JPEG image
- * Returns: (bool) 1 in case of success, 0 in case of failure to write
+ * Arguments: map - map to add to
+ *            red, green, blue - added to each channel
+ * Returns: (bool) 1 in case of success, 0 if map is full
  * Side-Effects: none
  *
- * Description: writes a JPEG image to a file
+ * Description: adds gdImageColor() (with alpha 0): the shift of each channel,
+ * 				clamped to 0..255
  *
  *****************************************************************************/
-int write_jpeg_file(gdImagePtr write_img, char * file_name){
-	FILE * fp;
+int color_map_shift(colorMap *map, int red, int green, int blue){
 
-	fp = fopen(file_name, "wb");
-	if (fp == NULL) {
-		return 0;
-	}
-	gdImageJpeg(write_img, fp, 70);
-	fclose(fp);
+	unsigned char table[3][256];
+	int shift[3] = {red, green, blue};
 
-	return 1;
+	for (int c = 0; c < 3; c++) {
+		for (int v = 0; v < 256; v++) {
+			int f = v + shift[c];
+			table[c][v] = (unsigned char) ((f > 255) ? 255 : ((f < 0) ? 0 : f));
+		}
+	}
+	return color_map_table(map, table);
 }
 
 /******************************************************************************
- * read_heif_file()
+ * color_map_pixel()
  *
- * Arguments: file_name - name of file with data for HEIF image
- * Returns: img - the image read from file or NULL if failure to read
+ * Arguments: map - map to apply
+ *            p - truecolor pixel
+ * Returns: (int) the pixel after every operation of map
  * Side-Effects: none
  *
- * Description: reads a HEIF image from a file
+ * Description: an opaque pixel is a lookup per channel in the composed
+ * 				tables; a fully transparent one is kept (each operation
+ * 				is drawn with its alpha). Any other goes through the
+ * 				operations one at a time, each blended over the pixel as
+ * 				gdImageSetPixel() does.
  *
  *****************************************************************************/
-gdImagePtr read_heif_file(char * file_name){
-
-	FILE * fp;
-	gdImagePtr read_img;
+static inline int color_map_pixel(const colorMap *map, int p){
 
-	fp = fopen(file_name, "rb");
-   	if (!fp) {
-        fprintf(stderr, "Can't read image %s\n", file_name);
-        return NULL;
-    }
-    read_img = gdImageCreateFromHeif(fp);
-    fclose(fp);
-  	if (read_img == NULL) {
-    	return NULL;
-    }
+	int alpha = gdTrueColorGetAlpha(p);
 
-	return read_img;
+	if (alpha == gdAlphaOpaque) {
+		return gdTrueColorAlpha(map->lut[0][gdTrueColorGetRed(p)],
+			map->lut[1][gdTrueColorGetGreen(p)], map->lut[2][gdTrueColorGetBlue(p)], gdAlphaOpaque);
+	}
+	if (alpha == gdAlphaTransparent) {
+		return p;
+	}
+	for (int s = 0; s < map->steps; s++) {
+		p = blend_pixel(p, gdTrueColorAlpha(map->step[s][0][gdTrueColorGetRed(p)],
+			map->step[s][1][gdTrueColorGetGreen(p)], map->step[s][2][gdTrueColorGetBlue(p)], gdTrueColorGetAlpha(p)));
+	}
+	return p;
 }
 
 /******************************************************************************
- * write_heif_file()
+ * color_map_row()
  *
- * Arguments: img - pointer to image to be written
- *            file_name - name of file where to save HEIF image
- * Returns: (bool) 1 in case of success, 0 in case of failure to write
+ * Arguments: map - map to apply
+ *            src - row of truecolor pixels
+ *            dst - row where the result is stored (may be src)
+ *            width - number of pixels in the row
+ * Returns: (void)
  * Side-Effects: none
  *
- * Description: writes a HEIF image to a file
+ * Description: applies every operation of map to one row
  *
  *****************************************************************************/
-int write_heif_file(gdImagePtr write_img, char * file_name){
-	FILE * fp;
+void color_map_row(const colorMap *map, const int *src, int *dst, int width){
 
-	fp = fopen(file_name, "wb");
-	if (fp == NULL) {
-		return 0;
+	for (int x = 0; x < width; x++) {
+		dst[x] = color_map_pixel(map, src[x]);
 	}
-	gdImageHeif(write_img, fp);
-	fclose(fp);
+}
 
-	return 1;
+/* kinds of pipeline stage */
+#define PIPE_CONTRAST	0
+#define PIPE_BRIGHTNESS	1
+#define PIPE_SEPIA		2
+#define PIPE_SMOOTH		3
+#define PIPE_TEXTURE	4
+#define PIPE_KINDS		5
+
+/* a stage of the filter pipeline (see pipeline_set()) */
+typedef struct {
+
+	int kind;
+	int arg[3];
+
+} pipeStage;
+
+/* the old photo filter */
+#define DEFAULT_STAGES { \
+	{PIPE_CONTRAST, {CONTRAST_LEVEL, 0, 0}}, \
+	{PIPE_SMOOTH, {SMOOTH_WEIGHT, 0, 0}}, \
+	{PIPE_TEXTURE, {0, 0, 0}}, \
+	{PIPE_SEPIA, {SEPIA_RED, SEPIA_GREEN, SEPIA_BLUE}} }
+
+static const pipeStage default_stages[] = DEFAULT_STAGES;
+
+/* the pipeline in use, set by pipeline_set(); the format of the outputs
+ * and the quality of each format (the JPEG one also by pipeline_set()),
+ * set by output_format_set() */
+static pipeStage pipe_stages[PIPELINE_STAGES] = DEFAULT_STAGES;
+static int pipe_nr = sizeof(default_stages) / sizeof(default_stages[0]);
+static int out_format = FORMAT_JPEG;
+static int format_quality[FORMATS] = {JPEG_QUALITY, PNG_LEVEL, WEBP_QUALITY, HEIF_QUALITY};
+
+/* row operation of the compiled pipeline: a texture blend, or point stages
+ * composed in a colorMap with the kernel that applies it (and what the
+ * kernel needs: the contrast in 16.16 fixed point, or the shift as a
+ * pixel) */
+typedef struct rowOp {
+
+	int stage;
+	int texture;
+	pipeStage first;
+	colorMap map;
+	int fixed_a, fixed_b;
+	int shift;
+	void (*row)(const struct rowOp *op, const int *src, int *dst, int width);
+
+} rowOp;
+
+/******************************************************************************
+ * map_row()
+ *
+ * Arguments: op - point operation
+ *            src - row of truecolor pixels
+ *            dst - row where the result is stored (may be src)
+ *            width - number of pixels in the row
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: applies a point operation of the pipeline to one row, one
+ * 				lookup per channel
+ *
+ *****************************************************************************/
+static void map_row(const rowOp *op, const int *src, int *dst, int width){
+
+	color_map_row(&op->map, src, dst, width);
 }
 
 /******************************************************************************
- * create_directory()
+ * texture_row()
  *
- * Arguments: file_name - name of directory to be created
- * Returns: (bool) 1 if the directory already exists or succesfully created
- *                 0 in case of failure to create
+ * Arguments: row - row of truecolor pixels, changed in place
+ *            tex - row of the texture, already at the image size
+ *            width - number of pixels in the row
+ *            transparent - transparent color of the texture (or -1)
+ * Returns: (void)
  * Side-Effects: none
  *
- * Description: Create a directory. 
+ * Description: texture stage for one row: the texture is drawn over the
+ * 				row with alpha blending, as gdImageCopy() does
  *
  *****************************************************************************/
-int create_directory(char * dir_name){
+static void texture_row(int *row, const int *tex, int width, int transparent){
 
-	DIR * d = opendir(dir_name);
-	if (d == NULL){
-		if (mkdir(dir_name, 0777)!=0){
-			return 0;
+	for (int x = 0; x < width; x++) {
+		if (tex[x] != transparent) {
+			row[x] = blend_pixel(row[x], tex[x]);
 		}
-	}else{
-		fprintf(stderr, "%s directory already existent\n", dir_name);
-		closedir(d);
 	}
-	return 1;
+}
+
+/* adds a neighbour to the smoothing sums; gdImageConvolution() reads fully
+ * transparent pixels as transparent black */
+static inline void smooth_add(int p, int weight, int *r, int *g, int *b){
+
+	if (gdTrueColorGetAlpha(p) == gdAlphaTransparent) return;
+	*r += weight * gdTrueColorGetRed(p);
+	*g += weight * gdTrueColorGetGreen(p);
+	*b += weight * gdTrueColorGetBlue(p);
 }
 
 /******************************************************************************
- * readFiles()
+ * SMOOTH_SPAN()
  *
- * Arguments: dir - name of directory to look for image-list.txt and read it
- * Returns: (char **) -         array of filenames in image-list.txt
- *          int nn_files -      number of files
- * Side-Effects: allocs an array of strings
+ * Arguments: name - name of the function to define
+ *            weight - weight of the center pixel, a constant or a variable
  *
- * Description: Reads all picture names names in image-list.txt in the given
- * 				directory
+ * Description: defines a smoothing stage (gdImageSmooth() with weight) for
+ * 				part of a row: 3x3 with weight in the center and 1 around it,
+ * 				the image edge repeated outside the image. The function gets
+ * 				the arguments of smooth_span().
+ *
+ * 				Defined twice, for SMOOTH_WEIGHT (the divisor a constant the
+ * 				compiler turns into a multiply) and for the weight of any
+ * 				pipeline.
  *
  *****************************************************************************/
-char **readFiles(char *dir, int *nn_files) {
+#define SMOOTH_SPAN(name, weight) \
+static void name(const int *up, const int *mid, const int *down, int *dst, int width, int x0, int x1){ \
+\
+	int xl, xr, c, r, g, b; \
+\
+	for (int x = x0; x < x1; x++) { \
+\
+		c = mid[x]; \
+		if (gdTrueColorGetAlpha(c) == gdAlphaTransparent) { \
+			/* the result is transparent too, so the pixel is kept */ \
+			dst[x] = c; \
+			continue; \
+		} \
+\
+		xl = x > 0 ? x - 1 : 0; \
+		xr = x + 1 < width ? x + 1 : x; \
+		r = g = b = 0; \
+		smooth_add(up[xl], 1, &r, &g, &b); \
+		smooth_add(up[x], 1, &r, &g, &b); \
+		smooth_add(up[xr], 1, &r, &g, &b); \
+		smooth_add(mid[xl], 1, &r, &g, &b); \
+		smooth_add(c, (weight), &r, &g, &b); \
+		smooth_add(mid[xr], 1, &r, &g, &b); \
+		smooth_add(down[xl], 1, &r, &g, &b); \
+		smooth_add(down[x], 1, &r, &g, &b); \
+		smooth_add(down[xr], 1, &r, &g, &b); \
+\
+		dst[x] = blend_pixel(c, gdTrueColorAlpha(r / ((weight) + 8), g / ((weight) + 8), \
+			b / ((weight) + 8), gdTrueColorGetAlpha(c))); \
+	} \
+}
 
-	char buffer[256];						/* allocate buffer*/
-	char outFileName[256];					/* another buffer to check out file existence */
-	FILE *listFp;
-	char **files;
+SMOOTH_SPAN(smooth_span_fixed, SMOOTH_WEIGHT)
+SMOOTH_SPAN(smooth_span_any, smooth_weight)
 
-	/* get the image-list path */
-	sprintf(buffer, "%s%s", dir, IMAGE_LIST);
-	char *img = strrchr(buffer, '/') + 1;
-	/* open it */
-	listFp = fopen(buffer, "rb");
-	*nn_files = 0;
+/******************************************************************************
+ * smooth_span()
+ *
+ * Arguments: up, mid, down - rows above, at and below the row to smooth
+ *            dst - row where the result is stored
+ *            width - number of pixels in the rows
+ *            x0, x1 - pixels to smooth, from x0 to x1 (excluding)
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: smoothing stage of the pipeline for part of a row, the
+ * 				SMOOTH_SPAN() for its weight (picked by simd_select())
+ *
+ *****************************************************************************/
+static void (*smooth_span)(const int *up, const int *mid, const int *down, int *dst, int width, int x0, int x1) = smooth_span_fixed;
+
+/* smoothing stage for a whole row */
+static void smooth_row(const int *up, const int *mid, const int *down, int *dst, int width){
+
+	smooth_span(up, mid, down, dst, width, 0, width);
+}
+
+/*
+ * Vectorized row kernels.
+ *
+ * They work on 8 (AVX2) or 4 (SSE4.1) pixels at a time, in 32 bit lanes, and
+ * handle the common case of opaque pixels (all JPEG images); a group with any
+ * alpha goes through the scalar kernel above. For opaque pixels:
+ *  - contrast is (v * A - B) >> 16 clamped to 0..255, with A and B the
+ *    contrast formula in 16.16 fixed point; the pipeline is compiled with it
+ *    only if it gives the contrast table for all 256 values;
+ *  - the texture blend (gdAlphaBlend() over an opaque pixel) is
+ *    (t * (127 - a) + p * a) / 127, the division done as * 33027 >> 22 (exact
+ *    for every value it can take);
+ *  - a colour shift (sepia, brightness) with no negative channel is a
+ *    saturated add of the shift to each byte of the pixel;
+ *  - smoothing sums the 3x3 neighbourhood in 16 bit lanes (the sum is at most
+ *    255 * (weight + 8)) and divides it with a multiply-high and a
+ *    shift, with constants simd_select() checks are exact for every sum.
+ * So the output is the same as the scalar kernels, and so as gd's.
+ */
+static int smooth_div_m;
+static int smooth_div_s;
 
-	int imgLen = 256 - strlen(dir) - strlen(IMAGE_LIST);
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
 
-	/* count the number of files*/
-	while ( fgets(img, imgLen, listFp) != NULL ) {
+__attribute__((target("avx2")))
+static void contrast_row_avx2(const rowOp *op, const int *src, int *dst, int width){
 
-		/* clean fgets() \n*/
-		img[strcspn(img, "\n")] = '\0';
+	const __m256i alpha = _mm256_set1_epi32(0x7F000000);
+	const __m256i byte = _mm256_set1_epi32(0xFF);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i a = _mm256_set1_epi32(op->fixed_a);
+	const __m256i b = _mm256_set1_epi32(op->fixed_b);
+	__m256i p, r, g, bl;
+	int x = 0;
 
-		/* check out file existence */
-		sprintf(outFileName, "%s%s%s", dir,  OLD_IMAGE_DIR, img - 1);
-		if (isFileExists(outFileName)) {
-			fprintf(stdout, "Found file:\t%s\n", outFileName);
+	for (; x + 8 <= width; x += 8) {
+		p = _mm256_loadu_si256((const __m256i *) (src + x));
+		if (!_mm256_testz_si256(p, alpha)) {
+			map_row(op, src + x, dst + x, 8);
 			continue;
 		}
+		r = _mm256_and_si256(_mm256_srli_epi32(p, 16), byte);
+		g = _mm256_and_si256(_mm256_srli_epi32(p, 8), byte);
+		bl = _mm256_and_si256(p, byte);
+		r = _mm256_srai_epi32(_mm256_sub_epi32(_mm256_mullo_epi32(r, a), b), 16);
+		g = _mm256_srai_epi32(_mm256_sub_epi32(_mm256_mullo_epi32(g, a), b), 16);
+		bl = _mm256_srai_epi32(_mm256_sub_epi32(_mm256_mullo_epi32(bl, a), b), 16);
+		r = _mm256_min_epi32(_mm256_max_epi32(r, zero), byte);
+		g = _mm256_min_epi32(_mm256_max_epi32(g, zero), byte);
+		bl = _mm256_min_epi32(_mm256_max_epi32(bl, zero), byte);
+		p = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(r, 16), _mm256_slli_epi32(g, 8)), bl);
+		_mm256_storeu_si256((__m256i *) (dst + x), p);
+	}
+	map_row(op, src + x, dst + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void texture_row_avx2(int *row, const int *tex, int width, int transparent){
+
+	const __m256i alpha = _mm256_set1_epi32(0x7F000000);
+	const __m256i byte = _mm256_set1_epi32(0xFF);
+	const __m256i max = _mm256_set1_epi32(gdAlphaMax);
+	const __m256i div = _mm256_set1_epi32(33027);
+	__m256i p, t, a, ia, r, g, b;
+	int x = 0;
+
+	if (transparent >= 0) {
+		texture_row(row, tex, width, transparent);
+		return;
+	}
 
-		/* check if file exists*/
-		if (!isFileExists(buffer)) {
-			fprintf(stdout, "Not able to locate - %s\n", buffer);
+	for (; x + 8 <= width; x += 8) {
+		p = _mm256_loadu_si256((const __m256i *) (row + x));
+		if (!_mm256_testz_si256(p, alpha)) {
+			texture_row(row + x, tex + x, 8, transparent);
 			continue;
 		}
+		t = _mm256_loadu_si256((const __m256i *) (tex + x));
+		a = _mm256_srli_epi32(t, 24);
+		ia = _mm256_sub_epi32(max, a);
+		r = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(t, 16), byte), ia),
+			_mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(p, 16), byte), a));
+		g = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(t, 8), byte), ia),
+			_mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(p, 8), byte), a));
+		b = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(t, byte), ia),
+			_mm256_mullo_epi32(_mm256_and_si256(p, byte), a));
+		r = _mm256_srli_epi32(_mm256_mullo_epi32(r, div), 22);
+		g = _mm256_srli_epi32(_mm256_mullo_epi32(g, div), 22);
+		b = _mm256_srli_epi32(_mm256_mullo_epi32(b, div), 22);
+		p = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(r, 16), _mm256_slli_epi32(g, 8)), b);
+		_mm256_storeu_si256((__m256i *) (row + x), p);
+	}
+	texture_row(row + x, tex + x, width - x, transparent);
+}
+
+__attribute__((target("avx2")))
+static void shift_row_avx2(const rowOp *op, const int *src, int *dst, int width){
 
-		/* check if file exists and is JPEG format */
-		if ((strcmp(strrchr(img, '.'), ".jpeg") && strcmp(strrchr(img, '.'), ".jpg"))) {
-			fprintf(stdout, "Only supports JPEG format - %s\n", buffer);
+	const __m256i alpha = _mm256_set1_epi32(0x7F000000);
+	const __m256i shift = _mm256_set1_epi32(op->shift);
+	__m256i p;
+	int x = 0;
+
+	for (; x + 8 <= width; x += 8) {
+		p = _mm256_loadu_si256((const __m256i *) (src + x));
+		if (!_mm256_testz_si256(p, alpha)) {
+			map_row(op, src + x, dst + x, 8);
 			continue;
 		}
-		
-		(*nn_files)++;
+		_mm256_storeu_si256((__m256i *) (dst + x), _mm256_adds_epu8(p, shift));
 	}
+	map_row(op, src + x, dst + x, width - x);
+}
 
-	/* create array of filenames */
-	files = (char **) malloc(*nn_files * sizeof(char *));
-
-	fseek(listFp, 0, SEEK_SET);
-	int i = 0;
+__attribute__((target("avx2")))
+static void smooth_row_avx2(const int *up, const int *mid, const int *down, int *dst, int width){
 
-	while ( fgets(img, imgLen, listFp) != NULL ) {
+	const __m256i alpha = _mm256_set1_epi32(0x7F000000);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i weight = _mm256_set1_epi16(smooth_weight - 1);
+	const __m256i m = _mm256_set1_epi16((short) smooth_div_m);
+	const __m128i s = _mm_cvtsi32_si128(smooth_div_s);
+	__m256i v[9], any, lo, hi;
+	int x = 1;
 
-		/* clean fget() \n */
-		img[strcspn(img, "\n")] = '\0';
+	smooth_span(up, mid, down, dst, width, 0, 1);
 
-		/* check out file existence */
-		sprintf(outFileName, "%s%s%s", dir,  OLD_IMAGE_DIR, img - 1);
-		if (isFileExists(outFileName)) {
+	for (; x + 9 <= width; x += 8) {
+		v[0] = _mm256_loadu_si256((const __m256i *) (up + x - 1));
+		v[1] = _mm256_loadu_si256((const __m256i *) (up + x));
+		v[2] = _mm256_loadu_si256((const __m256i *) (up + x + 1));
+		v[3] = _mm256_loadu_si256((const __m256i *) (mid + x - 1));
+		v[4] = _mm256_loadu_si256((const __m256i *) (mid + x));
+		v[5] = _mm256_loadu_si256((const __m256i *) (mid + x + 1));
+		v[6] = _mm256_loadu_si256((const __m256i *) (down + x - 1));
+		v[7] = _mm256_loadu_si256((const __m256i *) (down + x));
+		v[8] = _mm256_loadu_si256((const __m256i *) (down + x + 1));
+		any = v[0];
+		for (int k = 1; k < 9; k++) any = _mm256_or_si256(any, v[k]);
+		if (!_mm256_testz_si256(any, alpha)) {
+			smooth_span(up, mid, down, dst, width, x, x + 8);
 			continue;
 		}
 
-		/* check if file exists*/
-		if (!isFileExists(buffer)) {
+		/* box sum of the 9 pixels plus (weight - 1) times the center */
+		lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(v[4], zero), weight);
+		hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(v[4], zero), weight);
+		for (int k = 0; k < 9; k++) {
+			lo = _mm256_add_epi16(lo, _mm256_unpacklo_epi8(v[k], zero));
+			hi = _mm256_add_epi16(hi, _mm256_unpackhi_epi8(v[k], zero));
+		}
+		lo = _mm256_srl_epi16(_mm256_mulhi_epu16(lo, m), s);
+		hi = _mm256_srl_epi16(_mm256_mulhi_epu16(hi, m), s);
+		_mm256_storeu_si256((__m256i *) (dst + x), _mm256_packus_epi16(lo, hi));
+	}
+	smooth_span(up, mid, down, dst, width, x, width);
+}
+
+__attribute__((target("sse4.1")))
+static void contrast_row_sse4(const rowOp *op, const int *src, int *dst, int width){
+
+	const __m128i alpha = _mm_set1_epi32(0x7F000000);
+	const __m128i byte = _mm_set1_epi32(0xFF);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i a = _mm_set1_epi32(op->fixed_a);
+	const __m128i b = _mm_set1_epi32(op->fixed_b);
+	__m128i p, r, g, bl;
+	int x = 0;
+
+	for (; x + 4 <= width; x += 4) {
+		p = _mm_loadu_si128((const __m128i *) (src + x));
+		if (!_mm_testz_si128(p, alpha)) {
+			map_row(op, src + x, dst + x, 4);
 			continue;
 		}
+		r = _mm_and_si128(_mm_srli_epi32(p, 16), byte);
+		g = _mm_and_si128(_mm_srli_epi32(p, 8), byte);
+		bl = _mm_and_si128(p, byte);
+		r = _mm_srai_epi32(_mm_sub_epi32(_mm_mullo_epi32(r, a), b), 16);
+		g = _mm_srai_epi32(_mm_sub_epi32(_mm_mullo_epi32(g, a), b), 16);
+		bl = _mm_srai_epi32(_mm_sub_epi32(_mm_mullo_epi32(bl, a), b), 16);
+		r = _mm_min_epi32(_mm_max_epi32(r, zero), byte);
+		g = _mm_min_epi32(_mm_max_epi32(g, zero), byte);
+		bl = _mm_min_epi32(_mm_max_epi32(bl, zero), byte);
+		p = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r, 16), _mm_slli_epi32(g, 8)), bl);
+		_mm_storeu_si128((__m128i *) (dst + x), p);
+	}
+	map_row(op, src + x, dst + x, width - x);
+}
+
+__attribute__((target("sse4.1")))
+static void texture_row_sse4(int *row, const int *tex, int width, int transparent){
 
-		/* check if file exists and is JPEG format */
-		if ((strcmp(strrchr(img, '.'), ".jpeg") && strcmp(strrchr(img, '.'), ".jpg"))) {
+	const __m128i alpha = _mm_set1_epi32(0x7F000000);
+	const __m128i byte = _mm_set1_epi32(0xFF);
+	const __m128i max = _mm_set1_epi32(gdAlphaMax);
+	const __m128i div = _mm_set1_epi32(33027);
+	__m128i p, t, a, ia, r, g, b;
+	int x = 0;
+
+	if (transparent >= 0) {
+		texture_row(row, tex, width, transparent);
+		return;
+	}
+
+	for (; x + 4 <= width; x += 4) {
+		p = _mm_loadu_si128((const __m128i *) (row + x));
+		if (!_mm_testz_si128(p, alpha)) {
+			texture_row(row + x, tex + x, 4, transparent);
 			continue;
 		}
+		t = _mm_loadu_si128((const __m128i *) (tex + x));
+		a = _mm_srli_epi32(t, 24);
+		ia = _mm_sub_epi32(max, a);
+		r = _mm_add_epi32(_mm_mullo_epi32(_mm_and_si128(_mm_srli_epi32(t, 16), byte), ia),
+			_mm_mullo_epi32(_mm_and_si128(_mm_srli_epi32(p, 16), byte), a));
+		g = _mm_add_epi32(_mm_mullo_epi32(_mm_and_si128(_mm_srli_epi32(t, 8), byte), ia),
+			_mm_mullo_epi32(_mm_and_si128(_mm_srli_epi32(p, 8), byte), a));
+		b = _mm_add_epi32(_mm_mullo_epi32(_mm_and_si128(t, byte), ia),
+			_mm_mullo_epi32(_mm_and_si128(p, byte), a));
+		r = _mm_srli_epi32(_mm_mullo_epi32(r, div), 22);
+		g = _mm_srli_epi32(_mm_mullo_epi32(g, div), 22);
+		b = _mm_srli_epi32(_mm_mullo_epi32(b, div), 22);
+		p = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r, 16), _mm_slli_epi32(g, 8)), b);
+		_mm_storeu_si128((__m128i *) (row + x), p);
+	}
+	texture_row(row + x, tex + x, width - x, transparent);
+}
+
+__attribute__((target("sse4.1")))
+static void shift_row_sse4(const rowOp *op, const int *src, int *dst, int width){
 
-		files[i] = (char *) malloc((strlen(buffer) + 1) * sizeof(char));
-		sprintf(files[i++], "%s", buffer);
-		
+	const __m128i alpha = _mm_set1_epi32(0x7F000000);
+	const __m128i shift = _mm_set1_epi32(op->shift);
+	__m128i p;
+	int x = 0;
+
+	for (; x + 4 <= width; x += 4) {
+		p = _mm_loadu_si128((const __m128i *) (src + x));
+		if (!_mm_testz_si128(p, alpha)) {
+			map_row(op, src + x, dst + x, 4);
+			continue;
+		}
+		_mm_storeu_si128((__m128i *) (dst + x), _mm_adds_epu8(p, shift));
 	}
+	map_row(op, src + x, dst + x, width - x);
+}
 
-	fclose(listFp);
-	return files;
+__attribute__((target("sse4.1")))
+static void smooth_row_sse4(const int *up, const int *mid, const int *down, int *dst, int width){
+
+	const __m128i alpha = _mm_set1_epi32(0x7F000000);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i weight = _mm_set1_epi16(smooth_weight - 1);
+	const __m128i m = _mm_set1_epi16((short) smooth_div_m);
+	const __m128i s = _mm_cvtsi32_si128(smooth_div_s);
+	__m128i v[9], any, lo, hi;
+	int x = 1;
+
+	smooth_span(up, mid, down, dst, width, 0, 1);
+
+	for (; x + 5 <= width; x += 4) {
+		v[0] = _mm_loadu_si128((const __m128i *) (up + x - 1));
+		v[1] = _mm_loadu_si128((const __m128i *) (up + x));
+		v[2] = _mm_loadu_si128((const __m128i *) (up + x + 1));
+		v[3] = _mm_loadu_si128((const __m128i *) (mid + x - 1));
+		v[4] = _mm_loadu_si128((const __m128i *) (mid + x));
+		v[5] = _mm_loadu_si128((const __m128i *) (mid + x + 1));
+		v[6] = _mm_loadu_si128((const __m128i *) (down + x - 1));
+		v[7] = _mm_loadu_si128((const __m128i *) (down + x));
+		v[8] = _mm_loadu_si128((const __m128i *) (down + x + 1));
+		any = v[0];
+		for (int k = 1; k < 9; k++) any = _mm_or_si128(any, v[k]);
+		if (!_mm_testz_si128(any, alpha)) {
+			smooth_span(up, mid, down, dst, width, x, x + 4);
+			continue;
+		}
 
+		/* box sum of the 9 pixels plus (weight - 1) times the center */
+		lo = _mm_mullo_epi16(_mm_unpacklo_epi8(v[4], zero), weight);
+		hi = _mm_mullo_epi16(_mm_unpackhi_epi8(v[4], zero), weight);
+		for (int k = 0; k < 9; k++) {
+			lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v[k], zero));
+			hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v[k], zero));
+		}
+		lo = _mm_srl_epi16(_mm_mulhi_epu16(lo, m), s);
+		hi = _mm_srl_epi16(_mm_mulhi_epu16(hi, m), s);
+		_mm_storeu_si128((__m128i *) (dst + x), _mm_packus_epi16(lo, hi));
+	}
+	smooth_span(up, mid, down, dst, width, x, width);
 }
+#endif
+
+/* row kernels of each stage, for each instruction set */
+typedef struct {
+
+	const char *name;
+	void (*contrast)(const rowOp *op, const int *src, int *dst, int width);
+	void (*texture)(int *row, const int *tex, int width, int transparent);
+	void (*shift)(const rowOp *op, const int *src, int *dst, int width);
+	void (*smooth)(const int *up, const int *mid, const int *down, int *dst, int width);
+
+} rowKernels;
+
+static rowKernels kernels = {"scalar", map_row, texture_row, map_row, smooth_row};
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+static int kernels_selected = 0;
+
+/* the compiled pipeline: row operations, the first pipe_split of them ahead
+ * of the smoothing (pipe_smooth 0: none), whether there is a texture blend
+ * ahead of it and after it, and whether the fused filter can run it at all
+ * (pipe_fused 0: more than one smoothing) */
+static rowOp pipe_ops[PIPELINE_STAGES];
+static int pipe_ops_nr = 0;
+static int pipe_split = 0;
+static int pipe_smooth = 0;
+static int pipe_texture[2] = {0, 0};
+static int pipe_fused = 1;
+
+/* stage each kind of pipeline stage is timed as */
+static const int pipe_timed[PIPE_KINDS] = {
+	STAGE_CONTRAST, STAGE_CONTRAST, STAGE_SEPIA, STAGE_SMOOTH, STAGE_TEXTURE
+};
 
 /******************************************************************************
- * destroyFiles()
- * 
- * Arguments:	files - array of filenames
- * Returns: 	(void)
- * 
- * Description: function o free the array of filenames
- * 
- ******************************************************************************/
-void destroyFiles(char **files, int nn_files) {
-	for (int i = 0; i < nn_files; i++) {
-		free(files[i]);
-	}
-	free(files);
+ * pipeline_compile()
+ *
+ * Arguments: (none)
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: turns the stages of the pipeline into row operations for the
+ * 				kernels in use. Point stages next to each other are composed
+ * 				into one colorMap; a map of a single stage gets the
+ * 				specialized kernel of its kind when there is one (fixed point
+ * 				contrast, saturating shift) and the lookup otherwise. The
+ * 				stages ahead of the first smoothing are applied to the rows
+ * 				it reads, the rest to the smoothed row.
+ *
+ *****************************************************************************/
+static void pipeline_compile(void){
+
+	rowOp *op = NULL;
+	int smooths = 0;
+	double contrast;
+
+	pipe_ops_nr = 0;
+	pipe_texture[0] = pipe_texture[1] = 0;
+
+	for (int i = 0; i < pipe_nr; i++) {
+		const pipeStage *stage = &pipe_stages[i];
+
+		if (stage->kind == PIPE_SMOOTH) {
+			if (smooths++ == 0) pipe_split = pipe_ops_nr;
+			op = NULL;
+			continue;
+		}
+
+		/* a new operation, unless it's composed into the last one */
+		if (stage->kind == PIPE_TEXTURE || op == NULL || op->map.steps == COLOR_MAP_STEPS) {
+			op = &pipe_ops[pipe_ops_nr++];
+			op->stage = pipe_timed[stage->kind];
+			op->texture = (stage->kind == PIPE_TEXTURE);
+			op->first = *stage;
+			op->row = map_row;
+			color_map_init(&op->map);
+		}
+		if (stage->kind == PIPE_TEXTURE) {
+			pipe_texture[smooths > 0] = 1;
+			op = NULL;
+		} else if (stage->kind == PIPE_CONTRAST) {
+			color_map_contrast(&op->map, stage->arg[0]);
+		} else if (stage->kind == PIPE_BRIGHTNESS) {
+			color_map_shift(&op->map, stage->arg[0], stage->arg[0], stage->arg[0]);
+		} else {
+			color_map_shift(&op->map, stage->arg[0], stage->arg[1], stage->arg[2]);
+		}
+	}
+	pipe_smooth = (smooths > 0);
+	pipe_fused = (smooths <= 1);
+	if (!pipe_smooth) pipe_split = pipe_ops_nr;
+
+	/* specialized kernels for the maps of a single stage */
+	for (int i = 0; i < pipe_ops_nr; i++) {
+		op = &pipe_ops[i];
+		if (op->texture || op->map.steps != 1) continue;
+
+		if (op->first.kind == PIPE_CONTRAST) {
+			/* fixed point contrast, used only if it gives the table for
+			 * every value */
+			int exact = 1;
+			contrast = (double) (100.0 - op->first.arg[0]) / 100.0;
+			contrast = contrast * contrast;
+			op->fixed_a = (int) (contrast * 65536.0 + 0.5);
+			op->fixed_b = (int) (127.5 * (contrast - 1.0) * 65536.0 + 0.5);
+			for (int v = 0; v < 256; v++) {
+				int f = (v * op->fixed_a - op->fixed_b) >> 16;
+				f = (f > 255) ? 255 : ((f < 0) ? 0 : f);
+				if (f != op->map.lut[0][v]) exact = 0;
+			}
+			if (exact) op->row = kernels.contrast;
+		} else {
+			int r = op->first.arg[0];
+			int g = (op->first.kind == PIPE_BRIGHTNESS) ? r : op->first.arg[1];
+			int b = (op->first.kind == PIPE_BRIGHTNESS) ? r : op->first.arg[2];
+			if (r >= 0 && g >= 0 && b >= 0) {
+				op->shift = gdTrueColorAlpha(r, g, b, 0);
+				op->row = kernels.shift;
+			}
+		}
+	}
+}
+
+/******************************************************************************
+ * simd_select()
+ *
+ * Arguments: level - SIMD_AUTO, SIMD_SCALAR, SIMD_SSE4 or SIMD_AVX2
+ * Returns: (int) the level in use: the one asked for, or the best one the
+ *          CPU supports if it doesn't support it (or for SIMD_AUTO)
+ * Side-Effects: changes the kernels used by the old photo filter, must be
+ *               called before any thread is filtering
+ *
+ * Description: picks the row kernels of the old photo filter by CPU feature,
+ * 				and compiles the pipeline with them
+ *
+ *****************************************************************************/
+int simd_select(int level){
+
+	int cpu = SIMD_SCALAR;
+	int smooth_exact = 0;
+	int max_sum = 255 * (smooth_weight + 8);
+
+	kernels_selected = 1;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) cpu = SIMD_AVX2;
+	else if (__builtin_cpu_supports("sse4.1")) cpu = SIMD_SSE4;
+#endif
+	if (level == SIMD_AUTO || level > cpu) level = cpu;
+
+	/* smoothing divisor as multiply-high (>> 16) and shift, used only if
+	 * the sums fit 16 bits and it divides every sum exactly */
+	for (smooth_div_s = 15; smooth_div_s >= 0 && max_sum <= 0xFFFF && smooth_weight >= 1; smooth_div_s--) {
+		long long m = ((1LL << (16 + smooth_div_s)) + smooth_weight + 8 - 1) / (smooth_weight + 8);
+		if (m > 0xFFFF) continue;
+		smooth_div_m = (int) m;
+		smooth_exact = 1;
+		for (int n = 0; n <= max_sum && smooth_exact; n++) {
+			if ((int) (((long long) n * m) >> (16 + smooth_div_s)) != n / (smooth_weight + 8)) smooth_exact = 0;
+		}
+		break;
+	}
+	smooth_span = (smooth_weight == SMOOTH_WEIGHT) ? smooth_span_fixed : smooth_span_any;
+
+	kernels.name = "scalar";
+	kernels.contrast = map_row;
+	kernels.texture = texture_row;
+	kernels.shift = map_row;
+	kernels.smooth = smooth_row;
+
+#if defined(__x86_64__) || defined(__i386__)
+	if (level == SIMD_AVX2) {
+		kernels.name = "avx2";
+		kernels.contrast = contrast_row_avx2;
+		kernels.texture = texture_row_avx2;
+		kernels.shift = shift_row_avx2;
+		if (smooth_exact) kernels.smooth = smooth_row_avx2;
+	} else if (level == SIMD_SSE4) {
+		kernels.name = "sse4.1";
+		kernels.contrast = contrast_row_sse4;
+		kernels.texture = texture_row_sse4;
+		kernels.shift = shift_row_sse4;
+		if (smooth_exact) kernels.smooth = smooth_row_sse4;
+	}
+#endif
+
+	pipeline_compile();
+
+	return level;
+}
+
+/******************************************************************************
+ * simd_name()
+ *
+ * Arguments: (none)
+ * Returns: (const char *) name of the kernels in use
+ * Side-Effects: none
+ *
+ * Description: name of the kernels picked by simd_select(), for reports
+ *
+ *****************************************************************************/
+const char *simd_name(void){
+
+	return kernels.name;
+}
+
+/* picks the kernels on first use if simd_select() wasn't called */
+static void simd_default(void){
+
+	if (!kernels_selected) simd_select(SIMD_AUTO);
+}
+
+/* stages pipeline_set() knows: name, arguments (with their range), and the
+ * arguments of a stage given without them (defaults 0: they're needed) */
+static const struct {
+
+	const char *name;
+	int args;
+	int min, max;
+	int defaults;
+	int arg[3];
+
+} pipe_kinds[PIPE_KINDS] = {
+	{"contrast", 1, -100, 100, 1, {CONTRAST_LEVEL, 0, 0}},
+	{"brightness", 1, -255, 255, 0, {0, 0, 0}},
+	{"sepia", 3, -255, 255, 3, {SEPIA_RED, SEPIA_GREEN, SEPIA_BLUE}},
+	{"smooth", 1, 1, 200, 1, {SMOOTH_WEIGHT, 0, 0}},
+	{"texture", 0, 0, 0, 0, {0, 0, 0}}
+};
+
+/******************************************************************************
+ * pipeline_set()
+ *
+ * Arguments: description - stages of the filter, see image-lib.h
+ * Returns: (bool) 1 in case of success, 0 if description is wrong (and the
+ *          pipeline is left as it was)
+ * Side-Effects: must be called before simd_select() and before any thread
+ *               is filtering
+ *
+ * Description: parses a pipeline description and sets it as the filter
+ *
+ *****************************************************************************/
+int pipeline_set(const char *description){
+
+	pipeStage stages[PIPELINE_STAGES];
+	const char *p = description;
+	const char *separators = ", \t\r\n";
+	int nr = 0, quality = 0, weight = 0;
+	int kind, args, arg[3];
+	size_t len;
+	char *end;
+
+	memset(stages, 0, sizeof(stages));
+
+	for (p += strspn(p, separators); *p != '\0'; p += strspn(p, separators)) {
+
+		len = strcspn(p, "=, \t\r\n");
+		args = 0;
+		if (p[len] == '=') {
+			do {
+				long v = strtol(p + len + 1, &end, 10);
+				if (end == p + len + 1 || args == 3) {
+					args = -1;
+					break;
+				}
+				arg[args++] = (int) v;
+				len = end - p;
+			} while (p[len] == ':');
+		}
+
+		/* the encoder parameter, anywhere */
+		if (strncmp(p, "quality=", 8) == 0 && args == 1 && arg[0] >= 1 && arg[0] <= 100
+			&& (p[len] == '\0' || strchr(separators, p[len]) != NULL)) {
+			quality = arg[0];
+			p += len;
+			continue;
+		}
+
+		for (kind = 0; kind < PIPE_KINDS; kind++) {
+			size_t n = strlen(pipe_kinds[kind].name);
+			if (strncmp(p, pipe_kinds[kind].name, n) == 0 && (p[n] == '=' || p[n] == '\0' || strchr(separators, p[n]) != NULL)) {
+				break;
+			}
+		}
+		if (args == 0 && kind < PIPE_KINDS && pipe_kinds[kind].defaults) {
+			args = pipe_kinds[kind].args;
+			memcpy(arg, pipe_kinds[kind].arg, sizeof(arg));
+		}
+		if (kind == PIPE_KINDS || args != pipe_kinds[kind].args || nr == PIPELINE_STAGES
+			|| (p[len] != '\0' && strchr(separators, p[len]) == NULL)) {
+			fprintf(stderr, "Bad pipeline stage %.*s\n", (int) strcspn(p, separators), p);
+			return 0;
+		}
+		for (int i = 0; i < args; i++) {
+			if (arg[i] < pipe_kinds[kind].min || arg[i] > pipe_kinds[kind].max) {
+				fprintf(stderr, "Pipeline stage %s out of range (%d to %d)\n",
+					pipe_kinds[kind].name, pipe_kinds[kind].min, pipe_kinds[kind].max);
+				return 0;
+			}
+			stages[nr].arg[i] = arg[i];
+		}
+		stages[nr++].kind = kind;
+		if (kind == PIPE_SMOOTH && weight == 0) weight = arg[0];
+		p += len;
+	}
+
+	if (nr == 0) {
+		fprintf(stderr, "Empty pipeline\n");
+		return 0;
+	}
+
+	memcpy(pipe_stages, stages, sizeof(stages));
+	pipe_nr = nr;
+	if (quality > 0) format_quality[FORMAT_JPEG] = quality;
+	smooth_weight = (weight > 0) ? weight : SMOOTH_WEIGHT;
+	return 1;
+}
+
+/******************************************************************************
+ * pipeline_load()
+ *
+ * Arguments: file_name - file with a pipeline description
+ * Returns: (bool) 1 in case of success, 0 in case of failure
+ * Side-Effects: as pipeline_set()
+ *
+ * Description: sets the pipeline described in a file: stages one per line
+ * 				(or as on the command line), '#' to the end of the line is
+ * 				a comment
+ *
+ *****************************************************************************/
+int pipeline_load(const char *file_name){
+
+	char buffer[4096];
+	size_t n;
+	char *p;
+	FILE *fp = fopen(file_name, "r");
+
+	if (fp == NULL) {
+		fprintf(stderr, "Impossible to read pipeline %s\n", file_name);
+		return 0;
+	}
+	n = fread(buffer, 1, sizeof(buffer) - 1, fp);
+	fclose(fp);
+	if (n == sizeof(buffer) - 1) {
+		fprintf(stderr, "Pipeline %s is too long\n", file_name);
+		return 0;
+	}
+	buffer[n] = '\0';
+
+	for (p = strchr(buffer, '#'); p != NULL; p = strchr(p, '#')) {
+		while (*p != '\0' && *p != '\n') *p++ = ' ';
+	}
+	return pipeline_set(buffer);
+}
+
+/******************************************************************************
+ * pipeline_fused()
+ *
+ * Arguments: (none)
+ * Returns: (bool) 1 if the fused filter (old_photo_filter_rows()) can run the
+ *          pipeline, 0 if it goes through gd stage by stage
+ * Side-Effects: none
+ *
+ * Description: tells whether images may be split in bands
+ *
+ *****************************************************************************/
+int pipeline_fused(void){
+
+	pthread_once(&kernels_once, simd_default);
+	return pipe_fused;
+}
+
+/******************************************************************************
+ * pipeline_describe()
+ *
+ * Arguments: buffer - where the description is stored
+ *            len - size of buffer
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: describes the pipeline in use as pipeline_set() takes it
+ *
+ *****************************************************************************/
+void pipeline_describe(char *buffer, size_t len){
+
+	size_t n = 0;
+
+	buffer[0] = '\0';
+	for (int i = 0; i < pipe_nr && n < len; i++) {
+		const pipeStage *stage = &pipe_stages[i];
+		n += snprintf(buffer + n, len - n, "%s", pipe_kinds[stage->kind].name);
+		for (int a = 0; a < pipe_kinds[stage->kind].args && n < len; a++) {
+			n += snprintf(buffer + n, len - n, "%c%d", a ? ':' : '=', stage->arg[a]);
+		}
+		if (n < len) n += snprintf(buffer + n, len - n, ",");
+	}
+	if (n < len) snprintf(buffer + n, len - n, "quality=%d", format_quality[FORMAT_JPEG]);
+}
+
+/* pixel of the texture as gdImageScale() reads it: bg outside the image, and
+ * for the transparent color */
+static inline int texture_pixel(gdImagePtr texture_img, long x, long y, int bg){
+
+	if (x < 0 || y < 0 || x >= texture_img->sx || y >= texture_img->sy) {
+		return bg;
+	}
+	int c = texture_img->tpixels[y][x];
+	if (c == texture_img->transparent) {
+		return (bg == -1) ? gdTrueColorAlpha(0, 0, 0, 127) : bg;
+	}
+	return c;
+}
+
+/******************************************************************************
+ * texture_scale_row()
+ *
+ * Arguments: texture - pointer to texture image (truecolor)
+ *            width, heigth - size the texture is scaled to
+ *            y - row of the scaled texture
+ *            dst - where the row is stored (width pixels)
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: row y of gdImageScale(texture, width, heigth) with
+ * 				GD_BILINEAR_FIXED, with the same 24.8 fixed point arithmetic,
+ * 				so a texture can be scaled one row at a time
+ *
+ *****************************************************************************/
+static void texture_scale_row(gdImagePtr texture_img, int width, int heigth, int y, int *dst){
+
+	long f_dx = (long) (((float) texture_img->sx / (float) width) * 256);
+	long f_dy = (long) (((float) texture_img->sy / (float) heigth) * 256);
+	long f_a = ((long) y << 8) * f_dy >> 8;
+	long m = f_a >> 8;
+	long f_f = f_a - (m << 8);
+
+	for (long x = 0; x < width; x++) {
+		long f_b = (x << 8) * f_dx >> 8;
+		long n = f_b >> 8;
+		long f_g = f_b - (n << 8);
+		long w[4];
+		int p[4];
+
+		w[0] = ((256 - f_f) * (256 - f_g)) >> 8;
+		w[1] = ((256 - f_f) * f_g) >> 8;
+		w[2] = (f_f * (256 - f_g)) >> 8;
+		w[3] = (f_f * f_g) >> 8;
+
+		/* neighbours outside the texture (or transparent) take the first */
+		p[0] = texture_pixel(texture_img, n, m, 0);
+		p[1] = texture_pixel(texture_img, n + 1, m, p[0]);
+		p[2] = texture_pixel(texture_img, n, m + 1, p[0]);
+		p[3] = texture_pixel(texture_img, n + 1, m + 1, p[0]);
+
+		long r = 0, g = 0, b = 0, a = 0;
+		for (int i = 0; i < 4; i++) {
+			r += (w[i] * (gdTrueColorGetRed(p[i]) << 8)) >> 8;
+			g += (w[i] * (gdTrueColorGetGreen(p[i]) << 8)) >> 8;
+			b += (w[i] * (gdTrueColorGetBlue(p[i]) << 8)) >> 8;
+			a += (w[i] * (gdTrueColorGetAlpha(p[i]) << 8)) >> 8;
+		}
+		dst[x] = gdTrueColorAlpha((unsigned char) (r >> 8), (unsigned char) (g >> 8),
+			(unsigned char) (b >> 8), (unsigned char) (a >> 8));
+	}
+}
+
+/******************************************************************************
+ * struct traceEvent
+ *
+ * Description: an event of the trace: what, from when to when, and the file
+ * 				the thread was on (copied, the list may be gone at exit)
+ *
+ *****************************************************************************/
+typedef struct {
+
+	const char *name;
+	long long start;
+	long long end;
+	char detail[TRACE_DETAIL];
+
+} traceEvent;
+
+/******************************************************************************
+ * struct traceRing
+ *
+ * Description: events of one thread. Only that thread writes to its ring,
+ * 				so recording an event takes no lock; when the ring is full
+ * 				the oldest events are overwritten. Rings stay in the list
+ * 				after their thread ends, until trace_write().
+ *
+ *****************************************************************************/
+typedef struct traceRing {
+
+	traceEvent *events;
+	unsigned capacity;
+	unsigned long long recorded;
+	int tid;
+	char name[TRACE_DETAIL];
+	char detail[TRACE_DETAIL];
+	struct traceRing *next;
+
+} traceRing;
+
+/* set by trace_start(): every thread records its events */
+static int tracing = 0;
+static unsigned trace_capacity;
+static traceRing *trace_rings = NULL;
+static int trace_tids = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread traceRing *thread_ring = NULL;
+
+long long stage_clock(void);
+
+/* CLOCK_MONOTONIC in nanoseconds */
+static inline long long clock_ns(void){
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/******************************************************************************
+ * trace_start()
+ *
+ * Arguments: events - events kept per thread (the latest ones)
+ * Returns: (void)
+ * Side-Effects: must be called before the threads are created
+ *
+ * Description: starts recording trace events in every thread
+ *
+ *****************************************************************************/
+void trace_start(unsigned events){
+
+	trace_capacity = events;
+	tracing = 1;
+}
+
+/* the ring of the calling thread, created on its first event */
+static traceRing *trace_ring(void){
+
+	traceRing *ring = thread_ring;
+
+	if (ring == NULL) {
+		ring = (traceRing *) calloc(1, sizeof(traceRing));
+		if (!ring) return NULL;
+		ring->events = (traceEvent *) malloc(trace_capacity * sizeof(traceEvent));
+		if (!ring->events) {
+			free(ring);
+			return NULL;
+		}
+		ring->capacity = trace_capacity;
+		pthread_mutex_lock(&trace_lock);
+		ring->tid = ++trace_tids;
+		ring->next = trace_rings;
+		trace_rings = ring;
+		pthread_mutex_unlock(&trace_lock);
+		sprintf(ring->name, "thread_%d", ring->tid);
+		thread_ring = ring;
+	}
+	return ring;
+}
+
+/******************************************************************************
+ * trace_thread()
+ *
+ * Arguments: name - name of the calling thread in the trace
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: names the calling thread (only when tracing)
+ *
+ *****************************************************************************/
+void trace_thread(const char *name){
+
+	traceRing *ring;
+
+	if (!tracing || (ring = trace_ring()) == NULL) return;
+	snprintf(ring->name, TRACE_DETAIL, "%s", name);
+}
+
+/******************************************************************************
+ * trace_detail()
+ *
+ * Arguments: detail - file the calling thread is on (NULL: none)
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: the events of the calling thread carry detail from now on
+ * 				(only its last TRACE_DETAIL - 1 characters)
+ *
+ *****************************************************************************/
+void trace_detail(const char *detail){
+
+	traceRing *ring;
+	size_t len;
+
+	if (!tracing || (ring = trace_ring()) == NULL) return;
+	if (detail == NULL) {
+		ring->detail[0] = '\0';
+		return;
+	}
+	len = strlen(detail);
+	if (len >= TRACE_DETAIL) detail += len - (TRACE_DETAIL - 1);
+	strcpy(ring->detail, detail);
+}
+
+/******************************************************************************
+ * trace_event()
+ *
+ * Arguments: name - what happened (a string that lives until trace_write())
+ *            start, end - when (stage_clock())
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: records an event of the calling thread, if tracing: a
+ * 				copy to its own ring, no lock
+ *
+ *****************************************************************************/
+void trace_event(const char *name, long long start, long long end){
+
+	traceRing *ring;
+	traceEvent *event;
+
+	if (!tracing || (ring = trace_ring()) == NULL) return;
+	event = &ring->events[ring->recorded++ % ring->capacity];
+	event->name = name;
+	event->start = start;
+	event->end = end;
+	memcpy(event->detail, ring->detail, TRACE_DETAIL);
+}
+
+/******************************************************************************
+ * trace_write()
+ *
+ * Arguments: file_name - where to write the trace
+ * Returns: (bool) 1 in case of success, 0 otherwise
+ * Side-Effects: the threads must be done with their events
+ *
+ * Description: writes the events of every thread in the Chrome trace event
+ * 				format (chrome://tracing, ui.perfetto.dev): a complete
+ * 				event ("X") for each, with the file as argument, and the
+ * 				name of each thread. Times are in microseconds from the
+ * 				first event.
+ *
+ *****************************************************************************/
+int trace_write(const char *file_name){
+
+	FILE *fp = fopen(file_name, "w");
+	const char *sep = "";
+	unsigned long long dropped = 0;
+	long long origin = LLONG_MAX;
+
+	if (!fp) {
+		return 0;
+	}
+	for (traceRing *ring = trace_rings; ring != NULL; ring = ring->next) {
+		unsigned long long first = (ring->recorded > ring->capacity) ? ring->recorded - ring->capacity : 0;
+		for (unsigned long long i = first; i < ring->recorded; i++) {
+			if (ring->events[i % ring->capacity].start < origin) origin = ring->events[i % ring->capacity].start;
+		}
+	}
+	fprintf(fp, "{\"traceEvents\":[\n");
+	for (traceRing *ring = trace_rings; ring != NULL; ring = ring->next) {
+		unsigned long long first = (ring->recorded > ring->capacity) ? ring->recorded - ring->capacity : 0;
+
+		dropped += first;
+		fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", sep, ring->tid, ring->name);
+		sep = ",\n";
+		for (unsigned long long i = first; i < ring->recorded; i++) {
+			traceEvent *event = &ring->events[i % ring->capacity];
+			fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+				event->name, ring->tid, (event->start - origin) / 1e3, (event->end - event->start) / 1e3);
+			if (event->detail[0] != '\0') {
+				fprintf(fp, ",\"args\":{\"file\":\"");
+				for (const char *c = event->detail; *c; c++) {
+					if (*c == '"' || *c == '\\') fputc('\\', fp);
+					if ((unsigned char) *c >= 0x20) fputc(*c, fp);
+				}
+				fprintf(fp, "\"}");
+			}
+			fputc('}', fp);
+		}
+	}
+	fprintf(fp, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":%llu}}\n", dropped);
+
+	return fclose(fp) == 0;
+}
+
+/* hardware counters of the calling thread (see perf_open()): the group
+ * leader, where each counter is in a read of the group (-1: not open) and
+ * the values at the last read */
+static __thread int perf_fd = -1;
+static __thread int perf_fds[PERF_COUNTERS] = {-1, -1, -1, -1};
+static __thread int perf_slot[PERF_COUNTERS] = {-1, -1, -1, -1};
+static __thread int perf_nr = 0;
+static __thread long long perf_last[PERF_COUNTERS];
+
+static const char *perf_names[PERF_COUNTERS] = {
+	"cycles", "instructions", "llc_misses", "branch_misses"
+};
+
+/* reads the group of the calling thread into values (0 for a counter that
+ * isn't open) */
+static int perf_read(long long *values){
+
+	uint64_t buf[1 + PERF_COUNTERS];
+
+	if (read(perf_fd, buf, sizeof(buf)) < (ssize_t) ((1 + perf_nr) * sizeof(uint64_t))) {
+		return 0;
+	}
+	for (int c = 0; c < PERF_COUNTERS; c++) {
+		values[c] = (perf_slot[c] >= 0) ? (long long) buf[1 + perf_slot[c]] : 0;
+	}
+	return 1;
+}
+
+/* adds the counters since the last read to stage of sink */
+static void perf_add(stageTimes *sink, int stage){
+
+	long long now[PERF_COUNTERS];
+
+	if (!perf_read(now)) return;
+	for (int c = 0; c < PERF_COUNTERS; c++) {
+		sink->events[stage][c] += now[c] - perf_last[c];
+		perf_last[c] = now[c];
+	}
+}
+
+/******************************************************************************
+ * perf_open()
+ *
+ * Arguments: (none)
+ * Returns: (int) bit c set for each PERF_* counter open, 0 if none (errno
+ *          tells why)
+ * Side-Effects: none
+ *
+ * Description: opens the hardware counters of the calling thread (user
+ * 				space only) as one group, read with a single system call.
+ * 				From then on every stage of the thread with a sink also
+ * 				gets its counters. A counter the CPU or the hypervisor
+ * 				doesn't have is left out; without cycles there is nothing.
+ *
+ *****************************************************************************/
+int perf_open(void){
+
+	int mask = 0;
+
+#ifdef __linux__
+	static const unsigned long long configs[PERF_COUNTERS] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+	};
+	struct perf_event_attr attr;
+
+	if (perf_fd >= 0) perf_close();
+	for (int c = 0; c < PERF_COUNTERS; c++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = configs[c];
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		int fd = (int) syscall(__NR_perf_event_open, &attr, 0, -1, perf_fd, 0);
+		if (fd < 0) {
+			if (c == 0) return 0;
+			continue;
+		}
+		if (c == 0) perf_fd = fd;
+		perf_fds[c] = fd;
+		perf_slot[c] = perf_nr++;
+		mask |= 1 << c;
+	}
+	if (!perf_read(perf_last)) {
+		int err = errno;
+		perf_close();
+		errno = err;
+		return 0;
+	}
+#else
+	errno = ENOSYS;
+#endif
+	return mask;
+}
+
+/******************************************************************************
+ * perf_close()
+ *
+ * Arguments: (none)
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: closes the counters of the calling thread, if open
+ *
+ *****************************************************************************/
+void perf_close(void){
+
+	for (int c = PERF_COUNTERS - 1; c >= 0; c--) {
+		if (perf_fds[c] >= 0) close(perf_fds[c]);
+		perf_fds[c] = -1;
+		perf_slot[c] = -1;
+	}
+	perf_fd = -1;
+	perf_nr = 0;
+}
+
+/******************************************************************************
+ * perf_name()
+ *
+ * Arguments: counter - PERF_*
+ * Returns: (const char *) name of the counter
+ * Side-Effects: none
+ *
+ * Description: names of the counters for reports
+ *
+ *****************************************************************************/
+const char *perf_name(int counter){
+
+	return perf_names[counter];
+}
+
+/* where the stages of each thread are added (see stage_sink()) */
+static __thread stageTimes *thread_sink = NULL;
+
+static const char *stage_names[STAGES] = {
+	"read", "decode", "contrast", "smooth", "texture", "sepia", "encode", "write"
+};
+
+/******************************************************************************
+ * stage_sink()
+ *
+ * Arguments: sink - where the stages the calling thread goes through are
+ *                   added from now on, NULL to stop
+ * Returns: (stageTimes *) the previous sink of the thread
+ * Side-Effects: none
+ *
+ * Description: sets where the calling thread adds its stage times. Only the
+ *              stages of a thread with a sink are timed row by row, so
+ *              without one the filter runs untouched.
+ *
+ *****************************************************************************/
+stageTimes *stage_sink(stageTimes *sink){
+
+	stageTimes *prev = thread_sink;
+	thread_sink = sink;
+	return prev;
+}
+
+/******************************************************************************
+ * stage_clock()
+ *
+ * Arguments: (none)
+ * Returns: (long long) CLOCK_MONOTONIC in nanoseconds
+ * Side-Effects: none
+ *
+ * Description: the clock stage times are measured with (read through the
+ * 				vDSO, no system call). A thread with counters and a sink
+ * 				also takes them as the start of its next stage.
+ *
+ *****************************************************************************/
+long long stage_clock(void){
+
+	if (perf_fd >= 0 && thread_sink != NULL) perf_read(perf_last);
+	return clock_ns();
+}
+
+/******************************************************************************
+ * stage_add()
+ *
+ * Arguments: stage - STAGE_*
+ *            start - stage_clock() when the stage started
+ * Returns: (long long) stage_clock() now, the start of the next stage
+ * Side-Effects: none
+ *
+ * Description: adds the time since start (and the counters, see
+ *              perf_open()) to the sink of the calling thread, if it has
+ *              one, and the stage to the trace
+ *
+ *****************************************************************************/
+long long stage_add(int stage, long long start){
+
+	long long now = clock_ns();
+
+	if (thread_sink != NULL) {
+		thread_sink->ns[stage] += now - start;
+		if (perf_fd >= 0) perf_add(thread_sink, stage);
+	}
+	if (tracing) {
+		trace_event(stage_names[stage], start, now);
+	}
+	return now;
+}
+
+/* stage_add() for the kernels, row by row: only to the sink (a trace event
+ * per row would be far too many) */
+static inline long long stage_lap(stageTimes *sink, int stage, long long start){
+
+	long long now = clock_ns();
+
+	sink->ns[stage] += now - start;
+	if (perf_fd >= 0) perf_add(sink, stage);
+	return now;
+}
+
+/******************************************************************************
+ * stage_name()
+ *
+ * Arguments: stage - STAGE_*
+ * Returns: (const char *) name of the stage
+ * Side-Effects: none
+ *
+ * Description: names of the stages for reports
+ *
+ *****************************************************************************/
+const char *stage_name(int stage){
+
+	return stage_names[stage];
+}
+
+/******************************************************************************
+ * pipeline_row()
+ *
+ * Arguments: ops - row operations of the compiled pipeline
+ *            nr - number of operations
+ *            src - row of truecolor pixels
+ *            dst - row where the result is stored (may be src)
+ *            tex - row of the texture, at the image size (read only if
+ *                  there is a texture blend)
+ *            transparent - transparent color of the texture (or -1)
+ *            width - number of pixels in the row
+ *            sink, t - as for stage_lap() (sink may be NULL)
+ * Returns: (long long) t after the operations, if there is a sink
+ * Side-Effects: none
+ *
+ * Description: applies operations to one row, the first from src into dst
+ * 				and the rest in place; with none, src is copied
+ *
+ *****************************************************************************/
+static long long pipeline_row(const rowOp *ops, int nr, const int *src, int *dst, const int *tex, int transparent, int width, stageTimes *sink, long long t){
+
+	for (int i = 0; i < nr; i++) {
+		if (ops[i].texture) {
+			if (src != dst) memcpy(dst, src, width * sizeof(int));
+			kernels.texture(dst, tex, width, transparent);
+		} else {
+			ops[i].row(&ops[i], src, dst, width);
+		}
+		src = dst;
+		if (sink) t = stage_lap(sink, ops[i].stage, t);
+	}
+	if (src != dst) memcpy(dst, src, width * sizeof(int));
+	return t;
+}
+
+/******************************************************************************
+ * old_photo_filter_rows()
+ *
+ * Arguments: in - pointer to image (truecolor)
+ *            texture - pointer to texture image, already at the image size
+ *                      (if the pipeline has a texture blend)
+ *            out - pointer to truecolor image of the same size as in
+ *            y0, y1 - rows to filter, from y0 to y1 (excluding)
+ * Returns: (bool) 1 in case of success, 0 in case of failure
+ * Side-Effects: writes rows y0 to y1 of out
+ *
+ * Description: the fused old photo filter for a band of rows. Rows are walked
+ * 				top to bottom keeping only the three rows the 3x3 smoothing
+ * 				needs (after the stages ahead of it); the row above and below
+ * 				the band (the halo) are made again from in, so bands filtered
+ * 				separately (even by different threads) give exactly the whole
+ * 				image. The stages after the smoothing are applied to the
+ * 				smoothed row. Only for a pipeline with one smoothing at most
+ * 				(see old_photo_filter()).
+ *
+ *****************************************************************************/
+int old_photo_filter_rows(gdImagePtr in_img, gdImagePtr texture_img, gdImagePtr out_img, int y0, int y1){
+
+	int *rows_buf;
+	int *rows[3];
+	int width, heigth, transparent;
+	const rowOp *after;
+	int after_nr;
+	/* rows are only timed for a thread with a sink */
+	stageTimes *sink = thread_sink;
+	long long t = 0;
+
+	width = in_img->sx;
+	heigth = in_img->sy;
+	transparent = texture_img->transparent;
+
+	pthread_once(&kernels_once, simd_default);
+	after = pipe_ops + pipe_split;
+	after_nr = pipe_ops_nr - pipe_split;
+
+	rows_buf = (int *) malloc(3 * width * sizeof(int));
+	if (!rows_buf) {
+		return 0;
+	}
+
+	if (sink) t = stage_clock();
+	/* row y, through the stages ahead of the smoothing, is kept in rows[y % 3] */
+	for (int i = 0; i < 3; i++) {
+		rows[i] = rows_buf + i * width;
+	}
+	if (y0 > 0) {
+		t = pipeline_row(pipe_ops, pipe_split, in_img->tpixels[y0 - 1], rows[(y0 - 1) % 3],
+			pipe_texture[0] ? texture_img->tpixels[y0 - 1] : NULL, transparent, width, sink, t);
+	}
+	t = pipeline_row(pipe_ops, pipe_split, in_img->tpixels[y0], rows[y0 % 3],
+		pipe_texture[0] ? texture_img->tpixels[y0] : NULL, transparent, width, sink, t);
+
+	for (int y = y0; y < y1; y++) {
+
+		/* the row below is needed before the current one can be smoothed */
+		if (y + 1 < heigth) {
+			t = pipeline_row(pipe_ops, pipe_split, in_img->tpixels[y + 1], rows[(y + 1) % 3],
+				pipe_texture[0] ? texture_img->tpixels[y + 1] : NULL, transparent, width, sink, t);
+		}
+
+		const int *up = rows[(y > 0 ? y - 1 : 0) % 3];
+		const int *mid = rows[y % 3];
+		const int *down = rows[(y + 1 < heigth ? y + 1 : y) % 3];
+		int *dst = out_img->tpixels[y];
+
+		/* smoothing: 3x3 with its weight in the center, 1 around it */
+		if (pipe_smooth) {
+			kernels.smooth(up, mid, down, dst, width);
+			if (sink) t = stage_lap(sink, STAGE_SMOOTH, t);
+		}
+
+		/* the stages after it (texture blend, sepia, ...) */
+		t = pipeline_row(after, after_nr, pipe_smooth ? dst : mid, dst,
+			pipe_texture[1] ? texture_img->tpixels[y] : NULL, transparent, width, sink, t);
+	}
+
+	free(rows_buf);
+	return 1;
+}
+
+/******************************************************************************
+ * smooth_image_rows()
+ *
+ * Arguments: in - pointer to image (truecolor)
+ *            out - pointer to truecolor image of the same size as in
+ * Returns: (void)
+ * Side-Effects: writes every row of out
+ *
+ * Description: smoothing kernel for smooth_image(): each row of out is made
+ * 				from three rows of in, so only those are read at a time
+ *
+ *****************************************************************************/
+static void smooth_image_rows(gdImagePtr in_img, gdImagePtr out_img){
+
+	int heigth = in_img->sy;
+
+	pthread_once(&kernels_once, simd_default);
+
+	for (int y = 0; y < heigth; y++) {
+		kernels.smooth(in_img->tpixels[y > 0 ? y - 1 : 0], in_img->tpixels[y],
+			in_img->tpixels[y + 1 < heigth ? y + 1 : y], out_img->tpixels[y], in_img->sx);
+	}
+}
+
+/******************************************************************************
+ * pipeline_stage_image()
+ *
+ * Arguments: stage - stage of the pipeline
+ *            in - pointer to image
+ *            texture - pointer to texture image
+ * Returns: out - pointer to the image after the stage, or NULL in case of
+ *                failure
+ * Side-Effects: none
+ *
+ * Description: one stage of the pipeline with gd, into a new image, like
+ * 				contrast_image() and the others do for the default one
+ *
+ *****************************************************************************/
+static gdImagePtr pipeline_stage_image(const pipeStage *stage, gdImagePtr in_img, gdImagePtr texture_img){
+
+	gdImagePtr out_img;
+
+	if (stage->kind == PIPE_TEXTURE) {
+		return texture_image(in_img, texture_img);
+	}
+	if (stage->kind == PIPE_SMOOTH && stage->arg[0] == smooth_weight
+		&& smooth_mode == SMOOTH_FAST && in_img->trueColor) {
+		out_img = gdImageCreateTrueColor(in_img->sx, in_img->sy);
+		if (out_img) {
+			copy_image_attributes(out_img, in_img);
+			smooth_image_rows(in_img, out_img);
+		}
+		return(out_img);
+	}
+
+	out_img = gdImageClone(in_img);
+	if (!out_img) {
+		return NULL;
+	}
+	switch (stage->kind) {
+		case PIPE_CONTRAST:
+			gdImageContrast(out_img, stage->arg[0]);
+			break;
+		case PIPE_BRIGHTNESS:
+			gdImageBrightness(out_img, stage->arg[0]);
+			break;
+		case PIPE_SEPIA:
+			gdImageColor(out_img, stage->arg[0], stage->arg[1], stage->arg[2], 0);
+			break;
+		case PIPE_SMOOTH:
+			gdImageSmooth(out_img, stage->arg[0]);
+			break;
+	}
+	return(out_img);
+}
+
+/******************************************************************************
+ * old_photo_filter()
+ *
+ * Arguments: in - pointer to image
+ *            texture - pointer to texture image
+ *            pool - pool to take the output image from (may be NULL)
+ * Returns: out - pointer to image with the old photo filter applied, or NULL
+ *                in case of failure
+ * Side-Effects: none
+ *
+ * Description: does the same as the stages of the pipeline one after the
+ * 				other (by default contrast_image(), smooth_image(),
+ * 				texture_image() and sepia_image()), but in a single pass
+ * 				over the image and into a single output image (see
+ * 				old_photo_filter_rows()).
+ *
+ * 				Tolerance: for truecolor input the output is identical to
+ * 				the stage chain (max difference of 0 per channel), as every
+ * 				stage repeats gd's integer/float arithmetic. Palette input
+ * 				(and every image with SMOOTH_GD, or with a pipeline that
+ * 				smooths more than once) is handed to the stage chain.
+ *
+ *****************************************************************************/
+gdImagePtr  old_photo_filter(gdImagePtr in_img, gdImagePtr texture_img, imagePool *pool){
+
+	gdImagePtr out_img;
+	gdImagePtr scalled_pattern;
+	gdImagePtr aux;
+	int width, heigth;
+	long long start;
+
+	pthread_once(&kernels_once, simd_default);
+	if (!in_img->trueColor || smooth_mode == SMOOTH_GD || !pipe_fused) {
+		long long t = stage_clock();
+		out_img = in_img;
+		for (int i = 0; i < pipe_nr && out_img != NULL; i++) {
+			aux = pipeline_stage_image(&pipe_stages[i], out_img, texture_img);
+			if (out_img != in_img) gdImageDestroy(out_img);
+			out_img = aux;
+			t = stage_add(pipe_timed[pipe_stages[i].kind], t);
+		}
+		return(out_img);
+	}
+
+	width = in_img->sx;
+	heigth = in_img->sy;
+
+	scalled_pattern = texture_img;
+	if ((pipe_texture[0] || pipe_texture[1]) && (texture_img->sx != width || texture_img->sy != heigth)) {
+		long long t = stage_clock();
+		gdImageSetInterpolationMethod(texture_img, GD_BILINEAR_FIXED);
+		scalled_pattern = gdImageScale(texture_img, width, heigth);
+		stage_add(STAGE_TEXTURE, t);
+		if (!scalled_pattern) {
+			return NULL;
+		}
+	}
+
+	out_img = pool_image_create(pool, width, heigth);
+	if (out_img) {
+		copy_image_attributes(out_img, in_img);
+		start = stage_clock();
+		if (!old_photo_filter_rows(in_img, scalled_pattern, out_img, 0, heigth)) {
+			pool_image_destroy(pool, out_img);
+			out_img = NULL;
+		}
+		/* the stages are fused: one event for all of them */
+		if (tracing) trace_event("filter", start, stage_clock());
+	}
+
+	if (scalled_pattern != texture_img) {
+		gdImageDestroy(scalled_pattern);
+	}
+	return(out_img);
+}
+
+
+/* libjpeg error manager that returns to the caller's setjmp() */
+typedef struct {
+	struct jpeg_error_mgr pub;
+	jmp_buf setjmp_buffer;
+} jpegError;
+
+static void jpeg_error_exit(j_common_ptr cinfo){
+
+	jpegError *err = (jpegError *) cinfo->err;
+	longjmp(err->setjmp_buffer, 1);
+}
+
+/* resolution of a JPEG in dpi, as gd reads it (GD_RESOLUTION if unknown) */
+static void jpeg_resolution(struct jpeg_decompress_struct *cinfo, unsigned int *res_x, unsigned int *res_y){
+
+	switch (cinfo->density_unit) {
+	case 1:
+		*res_x = cinfo->X_density;
+		*res_y = cinfo->Y_density;
+		break;
+	case 2:
+		*res_x = (unsigned int) (cinfo->X_density * 2.54 + 0.5);
+		*res_y = (unsigned int) (cinfo->Y_density * 2.54 + 0.5);
+		break;
+	default:
+		*res_x = GD_RESOLUTION;
+		*res_y = GD_RESOLUTION;
+	}
+}
+
+static int fit_size(int width, int heigth, int *fit_width, int *fit_heigth);
+
+/* row buffers of old_photo_filter_stream() for an image width pixels wide:
+ * decoded band (RGB), ring of rows ahead of the smoothing, and one row each
+ * for the decoded pixels, the texture and the filtered pixels, and RGB
+ * output */
+static size_t stream_bytes(int width){
+
+	return (STREAM_BAND_ROWS + 1) * (size_t) width * 3
+		+ (STREAM_BAND_ROWS + 2 + 3) * (size_t) width * sizeof(int);
+}
+
+/* texture row y for old_photo_filter_stream(): scaled into tex, unless the
+ * texture is at the image size already (same) */
+static long long stream_texture_row(gdImagePtr texture_img, int same, int width, int heigth, int y, int *tex, stageTimes *sink, long long t){
+
+	if (!same) {
+		texture_scale_row(texture_img, width, heigth, y, tex);
+		if (sink) t = stage_lap(sink, STAGE_TEXTURE, t);
+	}
+	return t;
+}
+
+/******************************************************************************
+ * old_photo_filter_stream()
+ *
+ * Arguments: in_file - name of the JPEG file to filter
+ *            out_file - name of the JPEG file to write
+ *            texture - pointer to texture image (full size)
+ *            peak - where the bytes of row buffers used are stored
+ *            stats - where input bytes and read time are added (may be NULL)
+ * Returns: 1 in case of success, 0 in case of failure, -1 if the file can't be
+ *          streamed (CMYK JPEG, SMOOTH_GD, a pipeline that smooths more
+ *          than once, or bigger than jpeg_max_dimension()) and nothing was
+ *          written
+ * Side-Effects: writes out_file
+ *
+ * Description: the old photo filter without ever holding the whole image.
+ * 				Scanlines are decoded STREAM_BAND_ROWS at a time into a ring
+ * 				of rows through the stages ahead of the smoothing (the band
+ * 				plus one row of halo on each side for it), the texture is
+ * 				scaled one row at a time, and each filtered row goes
+ * 				straight to the encoder, set up as gdImageJpeg() (with the
+ * 				quality of the pipeline). Memory depends on the
+ * 				width only (the mapped input is page cache the kernel can
+ * 				drop); the output is the same file write_jpeg_file() of
+ * 				old_photo_filter() gives. Decoding is interleaved with the
+ * 				filter, so only the read time goes to stats.
+ *
+ *****************************************************************************/
+int old_photo_filter_stream(char *in_file, char *out_file, gdImagePtr texture_img, size_t *peak, readStats *stats){
+
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_compress_struct cinfo;
+	jpegError jerr;
+	char comment[255];
+	/* volatile: modified between setjmp() and longjmp() */
+	mappedFile map;
+	char part[strlen(out_file) + sizeof(TEMP_SUFFIX)];
+	FILE * volatile out = NULL;
+	char * volatile buf = NULL;
+	volatile int compressing = 0;
+	JSAMPROW band[STREAM_BAND_ROWS];
+	JSAMPROW rgb;
+	int *ring[STREAM_BAND_ROWS + 2];
+	int *scratch, *tex, *dst;
+	int width, heigth, decoded, next_out, same, transparent;
+	unsigned int res_x, res_y;
+	size_t bytes;
+	/* rows are only timed for a thread with a sink */
+	stageTimes *sink = thread_sink;
+	long long t = 0, start;
+
+	pthread_once(&kernels_once, simd_default);
+	if (smooth_mode == SMOOTH_GD || !pipe_fused) {
+		return -1;
+	}
+
+	if (!map_file(in_file, &map, stats)) {
+		fprintf(stderr, "Can't read image %s\n", in_file);
+		return 0;
+	}
+
+	dinfo.err = jpeg_std_error(&jerr.pub);
+	cinfo.err = &jerr.pub;
+	jerr.pub.error_exit = jpeg_error_exit;
+	if (setjmp(jerr.setjmp_buffer)) {
+		if (compressing) jpeg_destroy_compress(&cinfo);
+		jpeg_destroy_decompress(&dinfo);
+		unmap_file(&map);
+		if (out) {
+			fclose(out);
+			unlink(part);
+		}
+		free(buf);
+		return 0;
+	}
+	jpeg_create_decompress(&dinfo);
+	jpeg_mem_src(&dinfo, (unsigned char *) map.data, map.size);
+	jpeg_read_header(&dinfo, TRUE);
+
+	if (dinfo.jpeg_color_space == JCS_CMYK || dinfo.jpeg_color_space == JCS_YCCK
+		|| fit_size(dinfo.image_width, dinfo.image_height, &width, &heigth)) {
+		jpeg_destroy_decompress(&dinfo);
+		unmap_file(&map);
+		return -1;
+	}
+	dinfo.out_color_space = JCS_RGB;
+	jpeg_start_decompress(&dinfo);
+	width = dinfo.output_width;
+	heigth = dinfo.output_height;
+
+	bytes = stream_bytes(width);
+	buf = (char *) malloc(bytes);
+	if (!buf) {
+		longjmp(jerr.setjmp_buffer, 1);
+	}
+	if (peak) *peak = bytes;
+	for (int i = 0; i < STREAM_BAND_ROWS + 2; i++) {
+		ring[i] = (int *) buf + (size_t) i * width;
+	}
+	scratch = (int *) buf + (size_t) (STREAM_BAND_ROWS + 2) * width;
+	tex = scratch + width;
+	dst = tex + width;
+	rgb = (JSAMPROW) (dst + width);
+	for (int i = 0; i < STREAM_BAND_ROWS; i++) {
+		band[i] = rgb + (size_t) (i + 1) * width * 3;
+	}
+
+	/* written under a temporary name, renamed when complete */
+	sprintf(part, "%s%s", out_file, TEMP_SUFFIX);
+	out = fopen(part, "wb");
+	if (!out) {
+		longjmp(jerr.setjmp_buffer, 1);
+	}
+	jpeg_create_compress(&cinfo);
+	compressing = 1;
+	jpeg_stdio_dest(&cinfo, out);
+	cinfo.image_width = width;
+	cinfo.image_height = heigth;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	/* the resolution of the input, as the whole image path keeps it */
+	jpeg_resolution(&dinfo, &res_x, &res_y);
+	cinfo.density_unit = 1;
+	cinfo.X_density = res_x;
+	cinfo.Y_density = res_y;
+	jpeg_set_quality(&cinfo, format_quality[FORMAT_JPEG], TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+	sprintf(comment, "CREATOR: gd-jpeg v1.0 (using IJG JPEG v%d), quality = %d\n", JPEG_LIB_VERSION, format_quality[FORMAT_JPEG]);
+	jpeg_write_marker(&cinfo, JPEG_COM, (unsigned char *) comment, strlen(comment));
+
+	/* a texture at the image size is used as is, like texture_image() */
+	same = (texture_img->sx == width && texture_img->sy == heigth);
+	transparent = same ? texture_img->transparent : -1;
+
+	decoded = 0;
+	next_out = 0;
+	start = stage_clock();
+	if (sink) t = start;
+	while (next_out < heigth) {
+
+		/* decode the next band; row y, through the stages ahead of the
+		 * smoothing, is kept in ring[y % (STREAM_BAND_ROWS + 2)] */
+		int d0 = decoded;
+		while (decoded < heigth && decoded - d0 < STREAM_BAND_ROWS) {
+			decoded += jpeg_read_scanlines(&dinfo, band + (decoded - d0), STREAM_BAND_ROWS - (decoded - d0));
+		}
+		if (sink) t = stage_lap(sink, STAGE_DECODE, t);
+		for (int y = d0; y < decoded; y++) {
+			const JSAMPLE *p = band[y - d0];
+			for (int x = 0; x < width; x++, p += 3) {
+				scratch[x] = gdTrueColor(p[0], p[1], p[2]);
+			}
+			if (sink) t = stage_lap(sink, STAGE_DECODE, t);
+			if (pipe_texture[0]) t = stream_texture_row(texture_img, same, width, heigth, y, tex, sink, t);
+			t = pipeline_row(pipe_ops, pipe_split, scratch, ring[y % (STREAM_BAND_ROWS + 2)],
+				same ? texture_img->tpixels[y] : tex, transparent, width, sink, t);
+		}
+
+		/* every row with the row below it decoded can be filtered */
+		int last = (decoded == heigth) ? heigth : decoded - 1;
+		for (int y = next_out; y < last; y++) {
+			const int *up = ring[(y > 0 ? y - 1 : 0) % (STREAM_BAND_ROWS + 2)];
+			const int *mid = ring[y % (STREAM_BAND_ROWS + 2)];
+			const int *down = ring[(y + 1 < heigth ? y + 1 : y) % (STREAM_BAND_ROWS + 2)];
+
+			if (pipe_smooth) {
+				kernels.smooth(up, mid, down, dst, width);
+				if (sink) t = stage_lap(sink, STAGE_SMOOTH, t);
+			}
+
+			if (pipe_texture[1]) t = stream_texture_row(texture_img, same, width, heigth, y, tex, sink, t);
+			t = pipeline_row(pipe_ops + pipe_split, pipe_ops_nr - pipe_split, pipe_smooth ? dst : mid, dst,
+				same ? texture_img->tpixels[y] : tex, transparent, width, sink, t);
+
+			for (int x = 0; x < width; x++) {
+				rgb[3 * x] = gdTrueColorGetRed(dst[x]);
+				rgb[3 * x + 1] = gdTrueColorGetGreen(dst[x]);
+				rgb[3 * x + 2] = gdTrueColorGetBlue(dst[x]);
+			}
+			jpeg_write_scanlines(&cinfo, &rgb, 1);
+			if (sink) t = stage_lap(sink, STAGE_ENCODE, t);
+		}
+		next_out = last;
+	}
+
+	/* the encoder writes through stdio as it goes: what's left of the
+	 * output is flushed by fclose() */
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	jpeg_finish_decompress(&dinfo);
+	jpeg_destroy_decompress(&dinfo);
+	unmap_file(&map);
+	free(buf);
+	if (sink) t = stage_lap(sink, STAGE_ENCODE, t);
+	if (fclose(out) != 0 || rename(part, out_file) != 0) {
+		unlink(part);
+		return 0;
+	}
+	if (sink) stage_add(STAGE_WRITE, t);
+	/* decoding, the stages and encoding are fused: one event */
+	if (tracing) trace_event("stream", start, stage_clock());
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * texture_cache_create()
+ *
+ * Arguments: texture - pointer to texture image (full size)
+ *            max_entries - how many scaled textures may be kept
+ * Returns: cache - pointer to the new cache, or NULL in case of failure
+ * Side-Effects: sets the interpolation method of texture
+ *
+ * Description: creates an empty cache of textures scaled to image sizes.
+ * 				The texture is only read from here on, so every thread can
+ * 				share it.
+ *
+ *****************************************************************************/
+textureCache *texture_cache_create(gdImagePtr texture_img, int max_entries){
+
+	textureCache *cache = (textureCache *) calloc(1, sizeof(textureCache));
+	if (!cache) {
+		return NULL;
+	}
+
+	/* set once here so scaling never writes to the shared texture */
+	gdImageSetInterpolationMethod(texture_img, GD_BILINEAR_FIXED);
+
+	cache->texture = texture_img;
+	cache->max_entries = (max_entries > 0) ? max_entries : 1;
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->ready, NULL);
+
+	return cache;
+}
+
+/******************************************************************************
+ * texture_cache_get()
+ *
+ * Arguments: cache - pointer to the cache
+ *            width, height - size of the image the texture is for
+ * Returns: scaled - texture scaled to width x height, or NULL in case of
+ *                   failure
+ * Side-Effects: the returned texture is held until texture_cache_release()
+ *
+ * Description: looks up the texture scaled to the given size. On a miss the
+ * 				calling thread scales it (outside the lock) while any other
+ * 				thread asking for the same size waits for it instead of
+ * 				scaling it again. When the cache is full the least recently
+ * 				used texture no thread is holding is evicted. A texture that
+ * 				couldn't be scaled isn't kept: it is scaled again next time.
+ *
+ *****************************************************************************/
+gdImagePtr texture_cache_get(textureCache *cache, int width, int height){
+
+	textureEntry *entry, *lru, **prev, **lru_prev;
+	gdImagePtr scaled;
+
+	pthread_mutex_lock(&cache->lock);
+
+	for (entry = cache->entries; entry != NULL; entry = entry->next) {
+		if (entry->width == width && entry->height == height) {
+			break;
+		}
+	}
+
+	if (entry != NULL) {
+		cache->hits++;
+		entry->refs++;
+		entry->last_use = ++cache->clock;
+		while (entry->img == NULL && !entry->failed) {
+			pthread_cond_wait(&cache->ready, &cache->lock);
+		}
+		scaled = entry->img;
+		if (scaled == NULL && --entry->refs == 0) {
+			/* out of the cache already, the last one waiting frees it */
+			free(entry);
+		}
+		pthread_mutex_unlock(&cache->lock);
+		return scaled;
+	}
+
+	cache->misses++;
+
+	/* make room, evicting the least recently used idle texture */
+	while (cache->nn_entries >= cache->max_entries) {
+		lru = NULL;
+		lru_prev = NULL;
+		for (prev = &cache->entries; *prev != NULL; prev = &(*prev)->next) {
+			if ((*prev)->refs == 0 && (lru == NULL || (*prev)->last_use < lru->last_use)) {
+				lru = *prev;
+				lru_prev = prev;
+			}
+		}
+		/* every texture is in use, go over the cap for now */
+		if (lru == NULL) {
+			break;
+		}
+		*lru_prev = lru->next;
+		if (lru->img) gdImageDestroy(lru->img);
+		free(lru);
+		cache->nn_entries--;
+		cache->evictions++;
+	}
+
+	entry = (textureEntry *) calloc(1, sizeof(textureEntry));
+	if (!entry) {
+		pthread_mutex_unlock(&cache->lock);
+		return NULL;
+	}
+	entry->width = width;
+	entry->height = height;
+	entry->refs = 1;
+	entry->last_use = ++cache->clock;
+	entry->next = cache->entries;
+	cache->entries = entry;
+	cache->nn_entries++;
+
+	pthread_mutex_unlock(&cache->lock);
+
+	scaled = gdImageScale(cache->texture, width, height);
+
+	pthread_mutex_lock(&cache->lock);
+	entry->img = scaled;
+	if (scaled == NULL) {
+		/* out of the cache, so the next image of this size tries again;
+		 * the threads waiting see the failure */
+		for (prev = &cache->entries; *prev != entry; prev = &(*prev)->next);
+		*prev = entry->next;
+		cache->nn_entries--;
+		entry->failed = 1;
+		if (--entry->refs == 0) {
+			free(entry);
+		}
+	}
+	pthread_cond_broadcast(&cache->ready);
+	pthread_mutex_unlock(&cache->lock);
+
+	return scaled;
+}
+
+/******************************************************************************
+ * texture_cache_release()
+ *
+ * Arguments: cache - pointer to the cache
+ *            scaled - texture returned by texture_cache_get()
+ * Returns: (void)
+ * Side-Effects: the texture may be evicted after this
+ *
+ * Description: gives back a texture taken with texture_cache_get()
+ *
+ *****************************************************************************/
+void texture_cache_release(textureCache *cache, gdImagePtr scaled){
+
+	pthread_mutex_lock(&cache->lock);
+	for (textureEntry *entry = cache->entries; entry != NULL; entry = entry->next) {
+		if (entry->img == scaled) {
+			entry->refs--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/******************************************************************************
+ * texture_cache_destroy()
+ *
+ * Arguments: cache - pointer to the cache
+ * Returns: (void)
+ * Side-Effects: frees every scaled texture (not the original texture)
+ *
+ * Description: frees the cache, no thread may be using it
+ *
+ *****************************************************************************/
+void texture_cache_destroy(textureCache *cache){
+
+	textureEntry *entry, *next;
+
+	for (entry = cache->entries; entry != NULL; entry = next) {
+		next = entry->next;
+		if (entry->img) gdImageDestroy(entry->img);
+		free(entry);
+	}
+	pthread_mutex_destroy(&cache->lock);
+	pthread_cond_destroy(&cache->ready);
+	free(cache);
+}
+
+
+/******************************************************************************
+ * queue_create()
+ *
+ * Arguments: size - minimum number of slots (rounded up to a power of two)
+ * Returns: queue - pointer to the new queue, or NULL in case of failure
+ * Side-Effects: none
+ *
+ * Description: creates an empty queue
+ *
+ *****************************************************************************/
+workQueue *queue_create(int size){
+
+	workQueue *queue;
+	size_t slots = 2;
+
+	while (slots < (size_t) size) slots <<= 1;
+
+	queue = (workQueue *) calloc(1, sizeof(workQueue));
+	if (!queue) {
+		return NULL;
+	}
+	queue->cells = (queueCell *) malloc(slots * sizeof(queueCell));
+	if (!queue->cells) {
+		free(queue);
+		return NULL;
+	}
+	for (size_t i = 0; i < slots; i++) {
+		atomic_init(&queue->cells[i].seq, i);
+	}
+	queue->mask = slots - 1;
+
+	return queue;
+}
+
+/******************************************************************************
+ * queue_backoff()
+ *
+ * Arguments: tries - how many times the caller found the queue full/empty
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: spins a little, then yields, then sleeps, so a thread waiting
+ * 				on a queue doesn't burn a core another stage could use
+ *
+ *****************************************************************************/
+static void queue_backoff(int tries){
+
+	struct timespec nap = {0, 50000};
+
+	if (tries < 16) {
+		return;
+	} else if (tries < 64) {
+		sched_yield();
+	} else {
+		nanosleep(&nap, NULL);
+	}
+}
+
+/* adds the time since start to *stall_ns */
+static void add_stall(const struct timespec *start, long long *stall_ns){
+
+	struct timespec now, diff;
+
+	if (!stall_ns) return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	diff = diff_timespec(&now, start);
+	*stall_ns += diff.tv_sec * 1000000000LL + diff.tv_nsec;
+	if (tracing) {
+		long long end = now.tv_sec * 1000000000LL + now.tv_nsec;
+		trace_event("stall", end - (diff.tv_sec * 1000000000LL + diff.tv_nsec), end);
+	}
+}
+
+/******************************************************************************
+ * queue_push()
+ *
+ * Arguments: queue - pointer to the queue
+ *            data - pointer to be queued
+ *            stall_ns - where the time waiting for a free slot is added
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: pushes data, waiting while the queue is full
+ *
+ *****************************************************************************/
+void queue_push(workQueue *queue, void *data, long long *stall_ns){
+
+	struct timespec start;
+	queueCell *cell;
+	size_t pos, seq;
+	long depth, max;
+	int tries = 0;
+
+	pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	while (1) {
+		cell = &queue->cells[pos & queue->mask];
+		seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		if (seq == pos) {
+			/* the slot is free, try to claim it */
+			if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (seq < pos) {
+			/* full: the slot still holds an item from the last lap */
+			if (tries++ == 0) clock_gettime(CLOCK_MONOTONIC, &start);
+			queue_backoff(tries);
+			pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+		} else {
+			pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+		}
+	}
+
+	cell->data = data;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+	if (tries > 0) add_stall(&start, stall_ns);
+
+	/* depth statistics */
+	depth = (long) (pos + 1 - atomic_load_explicit(&queue->tail, memory_order_relaxed));
+	atomic_fetch_add_explicit(&queue->pushes, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&queue->depth_sum, depth, memory_order_relaxed);
+	max = atomic_load_explicit(&queue->max_depth, memory_order_relaxed);
+	while (depth > max && !atomic_compare_exchange_weak_explicit(&queue->max_depth, &max, depth,
+			memory_order_relaxed, memory_order_relaxed));
+}
+
+/******************************************************************************
+ * queue_pop()
+ *
+ * Arguments: queue - pointer to the queue
+ *            data - where the popped pointer is stored
+ *            stall_ns - where the time waiting for an item is added
+ * Returns: (bool) 1 if an item was popped, 0 if the queue is closed and empty
+ * Side-Effects: none
+ *
+ * Description: pops the oldest item, waiting while the queue is empty
+ *
+ *****************************************************************************/
+int queue_pop(workQueue *queue, void **data, long long *stall_ns){
+
+	struct timespec start;
+	queueCell *cell;
+	size_t pos, seq;
+	int tries = 0;
+	int seen_closed = 0;
+
+	pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	while (1) {
+		cell = &queue->cells[pos & queue->mask];
+		seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		if (seq == pos + 1) {
+			/* the slot has an item, try to claim it */
+			if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (seq < pos + 1) {
+			/* empty; once closed was seen, one more look is enough, as
+			 * every push was done before queue_close() */
+			if (seen_closed) {
+				if (tries > 0) add_stall(&start, stall_ns);
+				return 0;
+			}
+			seen_closed = atomic_load_explicit(&queue->closed, memory_order_acquire);
+			if (tries++ == 0) clock_gettime(CLOCK_MONOTONIC, &start);
+			if (!seen_closed) queue_backoff(tries);
+			pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+		} else {
+			pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+		}
+	}
+
+	*data = cell->data;
+	atomic_store_explicit(&cell->seq, pos + queue->mask + 1, memory_order_release);
+
+	if (tries > 0) add_stall(&start, stall_ns);
+
+	return 1;
+}
+
+/******************************************************************************
+ * queue_close()
+ *
+ * Arguments: queue - pointer to the queue
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: marks that nothing else will be pushed, so queue_pop() returns
+ * 				0 once the queue is empty
+ *
+ *****************************************************************************/
+void queue_close(workQueue *queue){
+
+	atomic_store_explicit(&queue->closed, 1, memory_order_release);
+}
+
+/******************************************************************************
+ * queue_destroy()
+ *
+ * Arguments: queue - pointer to the queue
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: frees the queue (not the items still in it)
+ *
+ *****************************************************************************/
+void queue_destroy(workQueue *queue){
+
+	free(queue->cells);
+	free(queue);
+}
+
+/******************************************************************************
+ * mem_budget_create()
+ *
+ * Arguments: bytes - memory the images in flight may take
+ * Returns: budget - pointer to the new budget, or NULL in case of failure
+ * Side-Effects: none
+ *
+ * Description: creates a memory budget with nothing reserved
+ *
+ *****************************************************************************/
+memBudget *mem_budget_create(size_t bytes){
+
+	memBudget *budget = (memBudget *) calloc(1, sizeof(memBudget));
+	if (!budget) {
+		return NULL;
+	}
+	budget->budget = bytes;
+	pthread_mutex_init(&budget->lock, NULL);
+	pthread_cond_init(&budget->freed, NULL);
+
+	return budget;
+}
+
+/* bytes fit the budget: in what's left of it, or alone (an image bigger than
+ * the whole budget still has to go through). lock must be held. */
+static int mem_budget_fits(memBudget *budget, size_t bytes){
+
+	return budget->reserved + bytes <= budget->budget || budget->reserved == 0;
+}
+
+/* reserves bytes; lock must be held */
+static void mem_budget_take(memBudget *budget, size_t bytes){
+
+	budget->reserved += bytes;
+	if (budget->reserved > budget->peak) budget->peak = budget->reserved;
+}
+
+/******************************************************************************
+ * mem_budget_try()
+ *
+ * Arguments: budget - pointer to the budget
+ *            bytes - memory to reserve
+ * Returns: (bool) 1 if bytes were reserved, 0 if they don't fit now (or a
+ *          thread is already waiting for memory)
+ * Side-Effects: none
+ *
+ * Description: reserves memory without waiting
+ *
+ *****************************************************************************/
+int mem_budget_try(memBudget *budget, size_t bytes){
+
+	int ok;
+
+	pthread_mutex_lock(&budget->lock);
+	ok = (budget->waiting == 0 && mem_budget_fits(budget, bytes));
+	if (ok) mem_budget_take(budget, bytes);
+	pthread_mutex_unlock(&budget->lock);
+
+	return ok;
+}
+
+/******************************************************************************
+ * mem_budget_reserve()
+ *
+ * Arguments: budget - pointer to the budget
+ *            bytes - memory to reserve
+ *            wait_ns - where the time waiting is added (may be NULL)
+ * Returns: (void)
+ * Side-Effects: blocks until bytes fit
+ *
+ * Description: reserves memory, waiting for other reservations to be
+ * 				released if it doesn't fit. While a thread waits,
+ * 				mem_budget_try() gives nothing to the others, so a big
+ * 				reservation isn't passed over forever.
+ *
+ *****************************************************************************/
+void mem_budget_reserve(memBudget *budget, size_t bytes, long long *wait_ns){
+
+	long long start, waited;
+
+	pthread_mutex_lock(&budget->lock);
+	if (!mem_budget_fits(budget, bytes)) {
+		start = clock_ns();
+		budget->waits++;
+		budget->waiting++;
+		while (!mem_budget_fits(budget, bytes)) {
+			pthread_cond_wait(&budget->freed, &budget->lock);
+		}
+		budget->waiting--;
+		waited = clock_ns() - start;
+		budget->wait_ns += waited;
+		if (wait_ns) *wait_ns += waited;
+	}
+	mem_budget_take(budget, bytes);
+	pthread_mutex_unlock(&budget->lock);
+}
+
+/******************************************************************************
+ * mem_budget_release()
+ *
+ * Arguments: budget - pointer to the budget
+ *            bytes - memory reserved before
+ * Returns: (void)
+ * Side-Effects: wakes up the threads waiting for memory
+ *
+ * Description: gives back a reservation
+ *
+ *****************************************************************************/
+void mem_budget_release(memBudget *budget, size_t bytes){
+
+	pthread_mutex_lock(&budget->lock);
+	budget->reserved -= bytes;
+	pthread_cond_broadcast(&budget->freed);
+	pthread_mutex_unlock(&budget->lock);
+}
+
+/******************************************************************************
+ * mem_budget_destroy()
+ *
+ * Arguments: budget - pointer to the budget
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: frees the budget
+ *
+ *****************************************************************************/
+void mem_budget_destroy(memBudget *budget){
+
+	pthread_mutex_destroy(&budget->lock);
+	pthread_cond_destroy(&budget->freed);
+	free(budget);
+}
+
+/******************************************************************************
+ * pool_create()
+ *
+ * Arguments: hugepages - 1 to back the buffers with huge pages
+ * Returns: pool - pointer to the new pool, or NULL in case of failure
+ * Side-Effects: none
+ *
+ * Description: creates an empty pool of image buffers
+ *
+ *****************************************************************************/
+imagePool *pool_create(int hugepages){
+
+	imagePool *pool = (imagePool *) calloc(1, sizeof(imagePool));
+	if (!pool) {
+		return NULL;
+	}
+	pool->hugepages = hugepages;
+
+	return pool;
+}
+
+/* releases the pixel memory of a buffer */
+static void pool_buffer_unmap(imagePool *pool, poolBuffer *buffer){
+
+	if (buffer->mem) {
+		munmap(buffer->mem, buffer->capacity);
+		pool->bytes -= buffer->capacity;
+		buffer->mem = NULL;
+		buffer->capacity = 0;
+	}
+}
+
+/******************************************************************************
+ * pool_buffer_map()
+ *
+ * Arguments: pool - pointer to the pool
+ *            buffer - buffer to (re)allocate
+ *            size - bytes needed
+ * Returns: (bool) 1 in case of success, 0 in case of failure
+ * Side-Effects: none
+ *
+ * Description: maps size bytes for the buffer. With huge pages explicit huge
+ * 				pages (MAP_HUGETLB) are tried first; if none are reserved
+ * 				the kernel is asked for transparent huge pages instead.
+ *
+ *****************************************************************************/
+static int pool_buffer_map(imagePool *pool, poolBuffer *buffer, size_t size){
+
+	void *mem = MAP_FAILED;
+
+	pool_buffer_unmap(pool, buffer);
+
+#ifdef MAP_HUGETLB
+	if (pool->hugepages) {
+		size_t huge = (size + POOL_HUGE_PAGE - 1) & ~((size_t) POOL_HUGE_PAGE - 1);
+		mem = mmap(NULL, huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mem != MAP_FAILED) size = huge;
+	}
+#endif
+	buffer->huge = (mem != MAP_FAILED);
+	if (mem == MAP_FAILED) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED) {
+			return 0;
+		}
+#ifdef MADV_HUGEPAGE
+		if (pool->hugepages) madvise(mem, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	buffer->mem = mem;
+	buffer->capacity = size;
+	pool->bytes += size;
+	if (pool->bytes > pool->high_water) pool->high_water = pool->bytes;
+
+	return 1;
+}
+
+/******************************************************************************
+ * pool_image_create()
+ *
+ * Arguments: pool - pointer to the pool (may be NULL)
+ *            sx, sy - size of the image
+ * Returns: img - truecolor image, or NULL in case of failure
+ * Side-Effects: none
+ *
+ * Description: gives an uninitialized truecolor image with its pixels in a
+ * 				buffer of the pool: a free buffer big enough if there is
+ * 				one, otherwise the biggest free buffer grown to the image.
+ * 				Without a pool, or with every buffer in use, the image comes
+ * 				from gdImageCreateTrueColor().
+ *
+ *****************************************************************************/
+gdImagePtr pool_image_create(imagePool *pool, int sx, int sy){
+
+	poolBuffer *buffer = NULL;
+	size_t size = (size_t) sx * sy * sizeof(int);
+	int i;
+
+	if (pool == NULL) {
+		return gdImageCreateTrueColor(sx, sy);
+	}
+
+	/* smallest free buffer that fits, or else the biggest free one */
+	for (i = 0; i < POOL_BUFFERS; i++) {
+		poolBuffer *b = &pool->buffers[i];
+		if (b->in_use) continue;
+		if (buffer == NULL
+			|| (b->capacity >= size && (buffer->capacity < size || b->capacity < buffer->capacity))
+			|| (b->capacity < size && buffer->capacity < size && b->capacity > buffer->capacity)) {
+			buffer = b;
+		}
+	}
+	if (buffer == NULL || sx <= 0 || sy <= 0) {
+		pool->fallbacks++;
+		return gdImageCreateTrueColor(sx, sy);
+	}
+
+	if (buffer->capacity < size) {
+		if (!pool_buffer_map(pool, buffer, size)) {
+			pool->fallbacks++;
+			return gdImageCreateTrueColor(sx, sy);
+		}
+		pool->allocs++;
+	} else {
+		pool->reuses++;
+	}
+
+	if (buffer->nn_rows < sy) {
+		int **rows = (int **) realloc(buffer->rows, sy * sizeof(int *));
+		if (!rows) {
+			pool->fallbacks++;
+			return gdImageCreateTrueColor(sx, sy);
+		}
+		buffer->rows = rows;
+		buffer->nn_rows = sy;
+	}
+	for (i = 0; i < sy; i++) {
+		buffer->rows[i] = (int *) buffer->mem + (size_t) i * sx;
+	}
+
+	/* the fields gdImageCreateTrueColor() sets */
+	memset(&buffer->img, 0, sizeof(gdImage));
+	buffer->img.sx = sx;
+	buffer->img.sy = sy;
+	buffer->img.trueColor = 1;
+	buffer->img.tpixels = buffer->rows;
+	buffer->img.transparent = -1;
+	buffer->img.thick = 1;
+	buffer->img.alphaBlendingFlag = 1;
+	buffer->img.cx2 = sx - 1;
+	buffer->img.cy2 = sy - 1;
+	buffer->img.res_x = GD_RESOLUTION;
+	buffer->img.res_y = GD_RESOLUTION;
+	buffer->img.interpolation_id = GD_BILINEAR_FIXED;
+
+	buffer->in_use = 1;
+	if (++pool->in_use > pool->in_use_high) pool->in_use_high = pool->in_use;
+
+	return &buffer->img;
+}
+
+/******************************************************************************
+ * pool_image_destroy()
+ *
+ * Arguments: pool - pointer to the pool (may be NULL)
+ *            img - image from pool_image_create() or any gd image
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: gives the buffer of img back to the pool, or destroys img if
+ * 				it isn't from the pool
+ *
+ *****************************************************************************/
+void pool_image_destroy(imagePool *pool, gdImagePtr img){
+
+	if (pool != NULL) {
+		for (int i = 0; i < POOL_BUFFERS; i++) {
+			if (&pool->buffers[i].img == img) {
+				pool->buffers[i].in_use = 0;
+				pool->in_use--;
+				return;
+			}
+		}
+	}
+	gdImageDestroy(img);
+}
+
+/******************************************************************************
+ * pool_trim()
+ *
+ * Arguments: pool - pointer to the pool (may be NULL)
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: gives the memory of every free buffer back to the system,
+ * 				so the pool holds only the images in use
+ *
+ *****************************************************************************/
+void pool_trim(imagePool *pool){
+
+	if (pool == NULL) return;
+	for (int i = 0; i < POOL_BUFFERS; i++) {
+		if (!pool->buffers[i].in_use) {
+			pool_buffer_unmap(pool, &pool->buffers[i]);
+		}
+	}
+}
+
+/******************************************************************************
+ * pool_destroy()
+ *
+ * Arguments: pool - pointer to the pool
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: frees every buffer and the pool
+ *
+ *****************************************************************************/
+void pool_destroy(imagePool *pool){
+
+	for (int i = 0; i < POOL_BUFFERS; i++) {
+		pool_buffer_unmap(pool, &pool->buffers[i]);
+		free(pool->buffers[i].rows);
+	}
+	free(pool);
+}
+
+/* operation in flight for a writeRequest */
+#define WRITE_OPEN		0
+#define WRITE_DATA		1
+#define WRITE_CLOSE		2
+
+/******************************************************************************
+ * struct uringRing
+ *
+ * Description: an io_uring set up with the raw syscalls: the submission
+ * 				queue ring, its entries and the completion queue ring, all
+ * 				mmap'ed from the ring fd
+ *
+ *****************************************************************************/
+struct uringRing {
+
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+	unsigned to_submit;
+
+};
+
+#ifdef __NR_io_uring_setup
+
+/* sets up a ring of entries submissions, NULL if the kernel can't */
+static struct uringRing *uring_create(unsigned entries){
+
+	struct io_uring_params params;
+	struct uringRing *ring;
+
+	ring = (struct uringRing *) calloc(1, sizeof(struct uringRing));
+	if (!ring) {
+		return NULL;
+	}
+	memset(&params, 0, sizeof(params));
+	ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) {
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		if (ring->sq_ptr != MAP_FAILED) munmap(ring->sq_ptr, ring->sq_len);
+		if (ring->cq_ptr != MAP_FAILED) munmap(ring->cq_ptr, ring->cq_len);
+		if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_head = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.head);
+	ring->sq_tail = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.tail);
+	ring->sq_mask = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.array);
+	ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + params.cq_off.head);
+	ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + params.cq_off.tail);
+	ring->cq_mask = (unsigned *) ((char *) ring->cq_ptr + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + params.cq_off.cqes);
+
+	return ring;
+}
+
+/* queues the next operation of a request (only one is in flight per request,
+ * and there are fewer requests than submission entries) */
+static void uring_prep(struct uringRing *ring, writeRequest *req){
+
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	switch (req->state) {
+		case WRITE_OPEN:
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (unsigned long) req->path;
+			sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+			sqe->len = 0666;
+			break;
+		case WRITE_DATA:
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->fd = req->fd;
+			sqe->addr = (unsigned long) ((char *) req->data + req->done);
+			sqe->len = req->size - req->done;
+			sqe->off = req->done;
+			break;
+		case WRITE_CLOSE:
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = req->fd;
+			break;
+	}
+	sqe->user_data = (unsigned long) req;
+	ring->sq_array[index] = index;
+	atomic_store_explicit((_Atomic unsigned *) ring->sq_tail, tail + 1, memory_order_release);
+	ring->to_submit++;
+}
+
+/* submits what was queued and waits for at least wait completions */
+static int uring_enter(struct uringRing *ring, unsigned wait){
+
+	int ret = (int) syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+	if (ret >= 0) {
+		ring->to_submit -= ret;
+	}
+	return ret;
+}
+
+static void uring_destroy(struct uringRing *ring){
+
+	munmap(ring->sqes, ring->sqes_len);
+	munmap(ring->cq_ptr, ring->cq_len);
+	munmap(ring->sq_ptr, ring->sq_len);
+	close(ring->fd);
+	free(ring);
+}
+
+#else
+
+static struct uringRing *uring_create(unsigned entries){ (void) entries; return NULL; }
+static void uring_prep(struct uringRing *ring, writeRequest *req){ (void) ring; (void) req; }
+static int uring_enter(struct uringRing *ring, unsigned wait){ (void) ring; (void) wait; return -1; }
+static void uring_destroy(struct uringRing *ring){ (void) ring; }
+
+#endif
+
+/* a request is done: rename it into place, count it and free it */
+static void writer_done(asyncWriter *writer, writeRequest *req){
+
+	/* complete: put it in place */
+	if (!req->failed && rename(req->path, req->target) != 0) {
+		req->failed = 1;
+	}
+	if (req->failed) {
+		fprintf(stderr, "Impossible to write %s image\n", req->target);
+		unlink(req->path);
+		writer->failed++;
+		if (req->written) req->written(req->arg, -1);
+	} else {
+		long long now = stage_clock();
+		writer->writes++;
+		writer->bytes += req->size;
+		if (tracing) {
+			trace_detail(req->target);
+			trace_event("write", req->start, now);
+			trace_detail(NULL);
+		}
+		if (req->written) req->written(req->arg, now - req->start);
+	}
+	gdFree(req->data);
+	free(req->path);
+	free(req->target);
+	free(req);
+}
+
+/* writes a request with plain syscalls */
+static void writer_sync(writeRequest *req){
+
+	ssize_t n;
+
+	req->fd = open(req->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (req->fd < 0) {
+		req->failed = 1;
+		return;
+	}
+	while (req->done < req->size) {
+		n = write(req->fd, (char *) req->data + req->done, req->size - req->done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			req->failed = 1;
+			break;
+		}
+		req->done += n;
+	}
+	if (close(req->fd) != 0) req->failed = 1;
+	req->fd = -1;
+}
+
+/******************************************************************************
+ * writer_uring_complete()
+ *
+ * Arguments: writer - pointer to the writer
+ *            req - request whose operation completed
+ *            res - result of the operation
+ * Returns: (bool) 1 if the request is done, 0 if its next operation was
+ *          queued
+ * Side-Effects: none
+ *
+ * Description: moves a request to its next operation: open -> write (again
+ * 				after a short write) -> close
+ *
+ *****************************************************************************/
+static int writer_uring_complete(asyncWriter *writer, writeRequest *req, int res){
+
+	switch (req->state) {
+		case WRITE_OPEN:
+			/* kernel without these io_uring operations (before 5.6) */
+			if (res == -EINVAL || res == -EOPNOTSUPP) {
+				writer_sync(req);
+				return 1;
+			}
+			if (res < 0) {
+				req->failed = 1;
+				return 1;
+			}
+			req->fd = res;
+			req->state = WRITE_DATA;
+			break;
+		case WRITE_DATA:
+			if (res <= 0) {
+				req->failed = 1;
+				req->state = WRITE_CLOSE;
+			} else if ((req->done += res) == req->size) {
+				req->state = WRITE_CLOSE;
+			}
+			break;
+		case WRITE_CLOSE:
+			/* the descriptor is released even if close failed */
+			req->fd = -1;
+			if (res < 0) req->failed = 1;
+			return 1;
+	}
+	uring_prep(writer->ring, req);
+	return 0;
+}
+
+/* the ring failed for good: takes what completed from it without waiting,
+ * closes the files still open (but not one whose close the kernel took),
+ * drops the ring and fails every request that was in it; returns how many */
+static int writer_uring_abort(asyncWriter *writer, writeRequest *flying){
+
+	struct uringRing *ring = writer->ring;
+	writeRequest *req;
+	unsigned head, tail;
+	int n = 0;
+
+	/* completions already there */
+	head = *ring->cq_head;
+	tail = atomic_load_explicit((_Atomic unsigned *) ring->cq_tail, memory_order_acquire);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		req = (writeRequest *) (unsigned long) cqe->user_data;
+		if (req->state == WRITE_OPEN && cqe->res >= 0) {
+			req->fd = cqe->res;
+			req->state = WRITE_DATA;
+		} else if (req->state == WRITE_CLOSE) {
+			req->fd = -1;
+		}
+	}
+	atomic_store_explicit((_Atomic unsigned *) ring->cq_head, head, memory_order_release);
+
+	/* closes the kernel never took */
+	head = atomic_load_explicit((_Atomic unsigned *) ring->sq_head, memory_order_acquire);
+	for (tail = *ring->sq_tail; head != tail; head++) {
+		req = (writeRequest *) (unsigned long) ring->sqes[ring->sq_array[head & *ring->sq_mask]].user_data;
+		if (req->state == WRITE_CLOSE && req->fd >= 0) {
+			close(req->fd);
+			req->fd = -1;
+		}
+	}
+	uring_destroy(ring);
+	writer->ring = NULL;
+	writer->mode = WRITER_THREAD;
+
+	while (flying != NULL) {
+		req = flying;
+		flying = req->next;
+		if (req->fd >= 0 && req->state != WRITE_CLOSE) close(req->fd);
+		req->failed = 1;
+		writer_done(writer, req);
+		n++;
+	}
+	return n;
+}
+
+/******************************************************************************
+ * writer_thread()
+ *
+ * Arguments: arg - pointer to the asyncWriter
+ * Returns: NULL
+ * Side-Effects: writes the files
+ *
+ * Description: takes every request in the list at once. With io_uring the
+ * 				opens of the whole batch go in one submission, and each
+ * 				completion queues the next operation of its file, so many
+ * 				files are written at the same time; it only blocks on the
+ * 				ring when there's nothing new to submit. Without io_uring
+ * 				the files are written one after the other. If the ring
+ * 				fails for good, the files in it fail and the writer goes
+ * 				on as WRITER_THREAD.
+ *
+ *****************************************************************************/
+static void *writer_thread(void *arg){
+
+	asyncWriter *writer = (asyncWriter *) arg;
+	writeRequest *batch, *req, **prev;
+	writeRequest *flying = NULL;	/* requests in the ring */
+	int inflight = 0;
+	int fresh;
+	long long start;
+
+	trace_thread("writer");
+	while (1) {
+
+		pthread_mutex_lock(&writer->lock);
+		while (writer->head == NULL && inflight == 0 && !writer->closing) {
+			pthread_cond_wait(&writer->more, &writer->lock);
+		}
+		if (writer->head == NULL && inflight == 0) {
+			pthread_mutex_unlock(&writer->lock);
+			break;
+		}
+
+		/* take up to WRITER_INFLIGHT files */
+		batch = NULL;
+		long long now = stage_clock();
+		while (writer->head != NULL && inflight < WRITER_INFLIGHT) {
+			req = writer->head;
+			req->start = now;
+			writer->head = req->next;
+			writer->queued--;
+			req->next = batch;
+			batch = req;
+			inflight++;
+		}
+		if (writer->head == NULL) writer->tail = NULL;
+		pthread_cond_broadcast(&writer->space);
+		pthread_mutex_unlock(&writer->lock);
+
+		if (writer->mode == WRITER_THREAD) {
+			while (batch != NULL) {
+				req = batch;
+				batch = req->next;
+				writer_sync(req);
+				writer_done(writer, req);
+				inflight--;
+			}
+			continue;
+		}
+
+		fresh = (batch != NULL);
+		while (batch != NULL) {
+			req = batch;
+			batch = req->next;
+			uring_prep(writer->ring, req);
+			req->next = flying;
+			flying = req;
+		}
+		if (inflight > writer->max_inflight) writer->max_inflight = inflight;
+		if (writer->ring->to_submit > 0) writer->batches++;
+
+		/* nothing new: wait for a completion instead of spinning */
+		start = stage_clock();
+		if (uring_enter(writer->ring, fresh ? 0 : 1) < 0
+			&& errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			/* the ring is of no use any more: what is in it fails, the
+			 * next files are written with plain syscalls */
+			fprintf(stderr, "io_uring_enter: %s, writing without io_uring\n", strerror(errno));
+			inflight -= writer_uring_abort(writer, flying);
+			flying = NULL;
+			continue;
+		}
+		if (tracing) trace_event("io_uring_enter", start, stage_clock());
+
+		unsigned head = *writer->ring->cq_head;
+		unsigned tail = atomic_load_explicit((_Atomic unsigned *) writer->ring->cq_tail, memory_order_acquire);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &writer->ring->cqes[head & *writer->ring->cq_mask];
+			req = (writeRequest *) (unsigned long) cqe->user_data;
+			if (writer_uring_complete(writer, req, cqe->res)) {
+				for (prev = &flying; *prev != req; prev = &(*prev)->next);
+				*prev = req->next;
+				writer_done(writer, req);
+				inflight--;
+			}
+		}
+		atomic_store_explicit((_Atomic unsigned *) writer->ring->cq_head, head, memory_order_release);
+	}
+
+	return NULL;
+}
+
+/******************************************************************************
+ * writer_create()
+ *
+ * Arguments: mode - WRITER_URING (falls back to WRITER_THREAD) or
+ *                   WRITER_THREAD
+ * Returns: writer - pointer to the new writer, or NULL in case of failure
+ * Side-Effects: starts the writer thread
+ *
+ * Description: creates a writer for output files
+ *
+ *****************************************************************************/
+asyncWriter *writer_create(int mode){
+
+	asyncWriter *writer = (asyncWriter *) calloc(1, sizeof(asyncWriter));
+	if (!writer) {
+		return NULL;
+	}
+
+	writer->mode = WRITER_THREAD;
+	if (mode == WRITER_URING) {
+		writer->ring = uring_create(2 * WRITER_INFLIGHT);
+		if (writer->ring) writer->mode = WRITER_URING;
+	}
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->more, NULL);
+	pthread_cond_init(&writer->space, NULL);
+
+	if (pthread_create(&writer->thread, NULL, writer_thread, writer) != 0) {
+		if (writer->ring) uring_destroy(writer->ring);
+		free(writer);
+		return NULL;
+	}
+	return writer;
+}
+
+/******************************************************************************
+ * writer_submit()
+ *
+ * Arguments: writer - pointer to the writer
+ *            file_name - name of the file to write
+ *            data, size - contents, freed with gdFree() once written
+ *            written, arg - called as written(arg, write_ns) from the writer
+ *                           thread once the file is in place, with the time
+ *                           since it took the file, or with -1 if it
+ *                           couldn't be written (written may be NULL)
+ * Returns: (void)
+ * Side-Effects: data belongs to the writer from here on
+ *
+ * Description: queues a file to be written. It's written under a temporary
+ * 				name and renamed when complete, so a file with the final
+ * 				name is always whole. Only waits if the writer is
+ * 				WRITER_MAX_QUEUED files behind, so encoded images can't pile
+ * 				up in memory.
+ *
+ *****************************************************************************/
+void writer_submit(asyncWriter *writer, const char *file_name, void *data, int size, void (*written)(void *arg, long long write_ns), void *arg){
+
+	writeRequest *req = (writeRequest *) calloc(1, sizeof(writeRequest));
+	char *path = (char *) malloc(strlen(file_name) + sizeof(TEMP_SUFFIX));
+	char *target = strdup(file_name);
+	if (!req || !path || !target) {
+		fprintf(stderr, "Impossible to write %s image\n", file_name);
+		free(req);
+		free(path);
+		free(target);
+		gdFree(data);
+		if (written) written(arg, -1);
+		return;
+	}
+	sprintf(path, "%s%s", file_name, TEMP_SUFFIX);
+	req->path = path;
+	req->target = target;
+	req->written = written;
+	req->arg = arg;
+	req->data = data;
+	req->size = size;
+	req->fd = -1;
+	req->state = WRITE_OPEN;
+
+	pthread_mutex_lock(&writer->lock);
+	while (writer->queued >= WRITER_MAX_QUEUED) {
+		pthread_cond_wait(&writer->space, &writer->lock);
+	}
+	if (writer->tail) writer->tail->next = req;
+	else writer->head = req;
+	writer->tail = req;
+	writer->queued++;
+	pthread_cond_signal(&writer->more);
+	pthread_mutex_unlock(&writer->lock);
+}
+
+/******************************************************************************
+ * writer_finish()
+ *
+ * Arguments: writer - pointer to the writer
+ * Returns: (void)
+ * Side-Effects: stops the writer thread
+ *
+ * Description: waits for every file queued to be written
+ *
+ *****************************************************************************/
+void writer_finish(asyncWriter *writer){
+
+	pthread_mutex_lock(&writer->lock);
+	writer->closing = 1;
+	pthread_cond_signal(&writer->more);
+	pthread_mutex_unlock(&writer->lock);
+
+	pthread_join(writer->thread, NULL);
+}
+
+/******************************************************************************
+ * writer_destroy()
+ *
+ * Arguments: writer - pointer to the writer (finished)
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: frees the writer
+ *
+ *****************************************************************************/
+void writer_destroy(asyncWriter *writer){
+
+	if (writer->ring) uring_destroy(writer->ring);
+	pthread_mutex_destroy(&writer->lock);
+	pthread_cond_destroy(&writer->more);
+	pthread_cond_destroy(&writer->space);
+	free(writer);
+}
+
+/******************************************************************************
+ * map_file()
+ *
+ * Arguments: file_name - name of the file
+ *            map - where the mapping is stored
+ *            stats - where bytes and read time are added (may be NULL)
+ * Returns: (bool) 1 in case of success, 0 in case of failure
+ * Side-Effects: none
+ *
+ * Description: memory-maps a file for sequential reading and faults every
+ * 				page in, so the time to read it is counted here and not in
+ * 				the decoder. No read() copies through stdio buffers.
+ *
+ *****************************************************************************/
+int map_file(const char *file_name, mappedFile *map, readStats *stats){
+
+	long long start;
+	struct stat st;
+	void *data;
+	long page = sysconf(_SC_PAGESIZE);
+	volatile unsigned char touch = 0;
+	int fd;
+
+	start = stage_clock();
+
+	fd = open(file_name, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return 0;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	madvise(data, st.st_size, MADV_WILLNEED);
+
+	map->data = (const unsigned char *) data;
+	map->size = st.st_size;
+	for (size_t i = 0; i < map->size; i += page) {
+		touch += map->data[i];
+	}
+
+	/* what is decoded is what the manifest records */
+	if (stats && stats->identify) {
+		stats->hash = xxh64(map->data, map->size, 0);
+		stats->size = st.st_size;
+		stats->mtime = st.st_mtim;
+	}
+
+	if (stats || thread_sink || tracing) {
+		long long end = stage_add(STAGE_READ, start);
+		if (stats) {
+			stats->bytes += map->size;
+			stats->read_ns += end - start;
+		}
+	}
+	return 1;
+}
+
+/******************************************************************************
+ * unmap_file()
+ *
+ * Arguments: map - mapping from map_file()
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: unmaps a file mapped by map_file()
+ *
+ *****************************************************************************/
+void unmap_file(mappedFile *map){
+
+	munmap((void *) map->data, map->size);
+	map->data = NULL;
+	map->size = 0;
+}
+
+/******************************************************************************
+ * prefetch_file()
+ *
+ * Arguments: file_name - name of the file
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: asks the kernel to start reading a file that will be needed
+ * 				soon. The readahead goes to the page cache, so the mapping
+ * 				can go away right after madvise(MADV_WILLNEED).
+ *
+ *****************************************************************************/
+void prefetch_file(const char *file_name){
+
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(file_name, O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			madvise(data, st.st_size, MADV_WILLNEED);
+			munmap(data, st.st_size);
+		}
+	}
+	close(fd);
+}
+
+/******************************************************************************
+ * read_png_file()
+ *
+ * Arguments: file_name - name of file with data for PNG image
+ * Returns: img - the image read from file or NULL if failure to read
+ * Side-Effects: none
+ *
+ * Description: reads a PNG image from a file
+ *
+ *****************************************************************************/
+gdImagePtr read_png_file(char * file_name){
+
+	FILE * fp;
+	gdImagePtr read_img;
+
+	fp = fopen(file_name, "rb");
+   	if (!fp) {
+        fprintf(stderr, "Can't read image %s\n", file_name);
+        return NULL;
+    }
+    read_img = gdImageCreateFromPng(fp);
+    fclose(fp);
+  	if (read_img == NULL) {
+    	return NULL;
+    }
+
+	return read_img;
+}
+
+/******************************************************************************
+ * write_png_file()
+ *
+ * Arguments: img - pointer to image to be written
+ *            file_name - name of file where to save PNG image
+ * Returns: (bool) 1 in case of success, 0 in case of failure to write
+ * Side-Effects: none
+ *
+ * Description: writes a PNG image to a file
+ *
+ *****************************************************************************/
+int write_png_file(gdImagePtr write_img, char * file_name){
+	FILE * fp;
+
+	fp = fopen(file_name, "wb");
+	if (fp == NULL) {
+		return 0;
+	}
+	gdImagePng(write_img, fp);
+	fclose(fp);
+
+	return 1;
+}
+
+/******************************************************************************
+ * read_jpeg_file()
+ *
+ * Arguments: file_name - name of file with data for JPEG image
+ * Returns: img - the image read from file or NULL if failure to read
+ * Side-Effects: none
+ *
+ * Description: reads a JPEG image from a file
+ *
+ *****************************************************************************/
+gdImagePtr read_jpeg_file(char * file_name){
+
+	FILE * fp;
+	gdImagePtr read_img;
+
+	fp = fopen(file_name, "rb");
+   	if (!fp) {
+        fprintf(stderr, "Can't read image %s\n", file_name);
+        return NULL;
+    }
+    read_img = gdImageCreateFromJpeg(fp);
+    fclose(fp);
+  	if (read_img == NULL) {
+    	return NULL;
+    }
+
+	return read_img;
+}
+
+/* counts the time since start as decoding */
+static void decode_done(readStats *stats, long long start){
+
+	long long end = stage_add(STAGE_DECODE, start);
+
+	if (stats) stats->decode_ns += end - start;
+}
+
+static gdImagePtr decode_jpeg(mappedFile *map, imagePool *pool, readStats *stats);
+
+/* longest side decoded images are brought down to (0: full size) */
+static int max_dimension = 0;
+
+/******************************************************************************
+ * jpeg_max_dimension()
+ *
+ * Arguments: max - longest side of the decoded images, 0 for full size
+ * Returns: (void)
+ * Side-Effects: must be called before any thread is reading
+ *
+ * Description: sets the size read_jpeg_file_pool() decodes images to (see
+ * 				fit_size())
+ *
+ *****************************************************************************/
+void jpeg_max_dimension(int max){
+
+	max_dimension = (max > 0) ? max : 0;
+}
+
+/* size of a width x heigth image with its longest side at max_dimension
+ * (aspect ratio kept); 0 if it already fits */
+static int fit_size(int width, int heigth, int *fit_width, int *fit_heigth){
+
+	if (max_dimension == 0 || (width <= max_dimension && heigth <= max_dimension)) {
+		return 0;
+	}
+	if (width >= heigth) {
+		*fit_width = max_dimension;
+		*fit_heigth = (int) (((long long) heigth * max_dimension + width / 2) / width);
+	} else {
+		*fit_heigth = max_dimension;
+		*fit_width = (int) (((long long) width * max_dimension + heigth / 2) / heigth);
+	}
+	if (*fit_width < 1) *fit_width = 1;
+	if (*fit_heigth < 1) *fit_heigth = 1;
+	return 1;
+}
+
+/******************************************************************************
+ * filter_memory()
+ *
+ * Arguments: width, heigth - size of the image, from its header
+ *            format - its format (see read_image_dimensions())
+ *            streamed - 1 if it goes through old_photo_filter_stream()
+ * Returns: (size_t) bytes the image is expected to take while it's filtered
+ * Side-Effects: none
+ *
+ * Description: estimate of the memory one image takes, for admission
+ * 				control. A streamed image takes its row buffers. Otherwise:
+ * 				the decoded image (at the size libjpeg decodes a JPEG to
+ * 				with jpeg_max_dimension(), other formats at full size), the
+ * 				images the filter works on (input
+ * 				and output when fused; with gd, the one before a stage, the
+ * 				one after and gd's own copy for the smoothing), the scaled
+ * 				texture, and the encoded output (up to a byte a pixel).
+ *
+ *****************************************************************************/
+size_t filter_memory(int width, int heigth, int format, int streamed){
+
+	size_t decoded, pixels;
+	int fit_width = width, fit_heigth = heigth, denom = 1;
+
+	if (streamed) {
+		return stream_bytes(width);
+	}
+
+	/* decoded at 1/denom, then scaled to the fitted size */
+	if (fit_size(width, heigth, &fit_width, &fit_heigth) && format == FORMAT_JPEG) {
+		while (denom < 8 && (width + denom * 2 - 1) / (denom * 2) >= fit_width
+			&& (heigth + denom * 2 - 1) / (denom * 2) >= fit_heigth) {
+			denom *= 2;
+		}
+	}
+	decoded = (size_t) ((width + denom - 1) / denom) * ((heigth + denom - 1) / denom) * sizeof(int);
+	pixels = (size_t) fit_width * fit_heigth;
+
+	pthread_once(&kernels_once, simd_default);
+	return decoded
+		+ pixels * sizeof(int) * ((pipe_fused && smooth_mode == SMOOTH_FAST) ? 1 : 3)
+		+ pixels * sizeof(int)
+		+ pixels;
+}
+
+/* scales img (from pool) to its fitted size with a bicubic filter, keeping
+ * its resolution and flags; NULL in case of failure (img is gone either way) */
+static gdImagePtr fit_image(imagePool *pool, gdImagePtr img){
+
+	gdImagePtr fitted;
+	int width, heigth;
+
+	if (img == NULL || !fit_size(img->sx, img->sy, &width, &heigth)) {
+		return img;
+	}
+	gdImageSetInterpolationMethod(img, GD_BICUBIC);
+	fitted = gdImageScale(img, width, heigth);
+	if (fitted != NULL) {
+		copy_image_attributes(fitted, img);
+	}
+	pool_image_destroy(pool, img);
+	return fitted;
+}
+
+/******************************************************************************
+ * read_jpeg_file_pool()
+ *
+ * Arguments: file_name - name of file with data for JPEG image
+ *            pool - pool to take the image from (may be NULL)
+ *            stats - where read and decode times are added (may be NULL)
+ * Returns: img - the image read from file or NULL if failure to read
+ * Side-Effects: none
+ *
+ * Description: memory-maps a JPEG file (see map_file()) and decodes it from
+ * 				memory straight into a pool buffer, the same way
+ * 				gdImageCreateFromJpeg() does (RGB output, default DCT and
+ * 				upsampling). CMYK/YCCK files are left to
+ * 				gdImageCreateFromJpegPtr().
+ *
+ * 				With jpeg_max_dimension(), a bigger image is decoded with
+ * 				libjpeg's DCT scaling at 1/2, 1/4 or 1/8 of its size (the
+ * 				smallest that is still at least the fitted size, so most of
+ * 				the pixels are never decoded) and then scaled to the fitted
+ * 				size exactly (see fit_image()). The image is then not from
+ * 				the pool.
+ *
+ *****************************************************************************/
+gdImagePtr read_jpeg_file_pool(char * file_name, imagePool *pool, readStats *stats){
+
+	mappedFile map;
+
+	if (!map_file(file_name, &map, stats)) {
+		fprintf(stderr, "Can't read image %s\n", file_name);
+		return NULL;
+	}
+	return decode_jpeg(&map, pool, stats);
+}
+
+/* decodes a mapped JPEG file (see read_jpeg_file_pool()) and unmaps it */
+static gdImagePtr decode_jpeg(mappedFile *map, imagePool *pool, readStats *stats){
+
+	struct jpeg_decompress_struct cinfo;
+	long long start;
+	jpegError jerr;
+	/* volatile: modified between setjmp() and longjmp() */
+	gdImagePtr volatile read_img = NULL;
+	JSAMPLE * volatile row = NULL;
+	int fit_width, fit_heigth;
+
+	start = stage_clock();
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = jpeg_error_exit;
+	if (setjmp(jerr.setjmp_buffer)) {
+		jpeg_destroy_decompress(&cinfo);
+		unmap_file(map);
+		free(row);
+		if (read_img) pool_image_destroy(pool, read_img);
+		return NULL;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, (unsigned char *) map->data, map->size);
+	jpeg_read_header(&cinfo, TRUE);
+
+	if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK) {
+		jpeg_destroy_decompress(&cinfo);
+		read_img = gdImageCreateFromJpegPtr(map->size, (void *) map->data);
+		unmap_file(map);
+		read_img = fit_image(NULL, read_img);
+		decode_done(stats, start);
+		return read_img;
+	}
+	cinfo.out_color_space = JCS_RGB;
+	if (fit_size(cinfo.image_width, cinfo.image_height, &fit_width, &fit_heigth)) {
+		cinfo.scale_num = 1;
+		cinfo.scale_denom = 1;
+		while (cinfo.scale_denom < 8
+			&& (cinfo.image_width + cinfo.scale_denom * 2 - 1) / (cinfo.scale_denom * 2) >= (JDIMENSION) fit_width
+			&& (cinfo.image_height + cinfo.scale_denom * 2 - 1) / (cinfo.scale_denom * 2) >= (JDIMENSION) fit_heigth) {
+			cinfo.scale_denom *= 2;
+		}
+	}
+	jpeg_start_decompress(&cinfo);
+
+	read_img = pool_image_create(pool, cinfo.output_width, cinfo.output_height);
+	row = (JSAMPLE *) malloc(cinfo.output_width * 3);
+	if (read_img == NULL || row == NULL) {
+		longjmp(jerr.setjmp_buffer, 1);
+	}
+	jpeg_resolution(&cinfo, &read_img->res_x, &read_img->res_y);
+
+	while (cinfo.output_scanline < cinfo.output_height) {
+		int *tpix = read_img->tpixels[cinfo.output_scanline];
+		JSAMPROW rowptr = row;
+		const JSAMPLE *p = row;
+		jpeg_read_scanlines(&cinfo, &rowptr, 1);
+		for (JDIMENSION x = 0; x < cinfo.output_width; x++, p += 3) {
+			tpix[x] = gdTrueColor(p[0], p[1], p[2]);
+		}
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	unmap_file(map);
+	free(row);
+	read_img = fit_image(pool, read_img);
+	decode_done(stats, start);
+
+	return read_img;
+}
+
+/******************************************************************************
+ * read_image_file_pool()
+ *
+ * Arguments: file_name - name of the image file (JPEG, PNG, WebP or HEIF)
+ *            pool - pool to take the image from (may be NULL)
+ *            stats - where read and decode times are added (may be NULL)
+ * Returns: img - the truecolor image read from file or NULL if failure to
+ *          read
+ * Side-Effects: none
+ *
+ * Description: memory-maps the file and decodes it as its first bytes say.
+ * 				A JPEG goes through read_jpeg_file_pool()'s decoder; the
+ * 				others through gd's decoders from memory (not into the
+ * 				pool): palette images are made truecolor for the fused
+ * 				filter, and images bigger than jpeg_max_dimension() are
+ * 				scaled to it (decoded at full size first).
+ *
+ *****************************************************************************/
+gdImagePtr read_image_file_pool(char * file_name, imagePool *pool, readStats *stats){
+
+	gdImagePtr read_img = NULL;
+	mappedFile map;
+	long long start;
+
+	if (!map_file(file_name, &map, stats)) {
+		fprintf(stderr, "Can't read image %s\n", file_name);
+		return NULL;
+	}
+	start = stage_clock();
+
+	switch (image_format(map.data, map.size)) {
+		case FORMAT_JPEG:
+			return decode_jpeg(&map, pool, stats);
+		case FORMAT_PNG:
+			read_img = gdImageCreateFromPngPtr(map.size, (void *) map.data);
+			break;
+		case FORMAT_WEBP:
+			read_img = gdImageCreateFromWebpPtr(map.size, (void *) map.data);
+			break;
+		case FORMAT_HEIF:
+			read_img = gdImageCreateFromHeifPtr(map.size, (void *) map.data);
+			break;
+	}
+	unmap_file(&map);
+	if (read_img != NULL && !gdImageTrueColor(read_img) && !gdImagePaletteToTrueColor(read_img)) {
+		gdImageDestroy(read_img);
+		read_img = NULL;
+	}
+	/* the old photo is opaque, as from a JPEG (gd saves the alpha of a
+	 * WebP or PNG when it is written out) */
+	if (read_img != NULL) gdImageSaveAlpha(read_img, 0);
+	read_img = fit_image(NULL, read_img);
+	decode_done(stats, start);
+
+	return read_img;
+}
+
+/* what encoding took in each format (see encode_stats()) */
+static struct {
+
+	atomic_long images;
+	atomic_llong ns;
+	atomic_llong bytes;
+	atomic_llong pixels;
+
+} encoded[FORMATS];
+
+/* encodes an image in memory in a format (the same file gd writes with its
+ * quality), timed as the encode stage from *t (then set to its end) and
+ * counted for encode_stats() */
+static void *encode_image(gdImagePtr img, int format, int *size, long long *t){
+
+	void *data = NULL;
+	long long start = *t;
+
+	switch (format) {
+		case FORMAT_JPEG:
+			data = gdImageJpegPtr(img, size, format_quality[FORMAT_JPEG]);
+			break;
+		case FORMAT_PNG:
+			data = gdImagePngPtrEx(img, size, format_quality[FORMAT_PNG]);
+			break;
+		case FORMAT_WEBP:
+			data = gdImageWebpPtrEx(img, size, format_quality[FORMAT_WEBP]);
+			break;
+		case FORMAT_HEIF:
+			data = gdImageHeifPtrEx(img, size, format_quality[FORMAT_HEIF], GD_HEIF_CODEC_HEVC, GD_HEIF_CHROMA_420);
+			break;
+	}
+	*t = stage_add(STAGE_ENCODE, start);
+	if (data != NULL) {
+		atomic_fetch_add(&encoded[format].images, 1);
+		atomic_fetch_add(&encoded[format].ns, *t - start);
+		atomic_fetch_add(&encoded[format].bytes, *size);
+		atomic_fetch_add(&encoded[format].pixels, (long long) img->sx * img->sy);
+	}
+	return data;
+}
+
+/* write_jpeg_file() in a format */
+static int write_format_file(gdImagePtr write_img, int format, char * file_name){
+	char part[strlen(file_name) + sizeof(TEMP_SUFFIX)];
+	long long t = stage_clock();
+	void *data;
+	int size, ok;
+	FILE * fp;
+
+	data = encode_image(write_img, format, &size, &t);
+	if (data == NULL) {
+		return 0;
+	}
+
+	sprintf(part, "%s%s", file_name, TEMP_SUFFIX);
+	fp = fopen(part, "wb");
+	if (fp == NULL) {
+		gdFree(data);
+		return 0;
+	}
+	ok = (fwrite(data, 1, size, fp) == (size_t) size);
+	gdFree(data);
+	if (fclose(fp) != 0 || !ok || rename(part, file_name) != 0) {
+		unlink(part);
+		return 0;
+	}
+	stage_add(STAGE_WRITE, t);
+
+	return 1;
+}
+
+/* write_jpeg_async() in a format */
+static int write_format_async(asyncWriter *writer, gdImagePtr write_img, int format, char * file_name, void (*written)(void *arg, long long write_ns), void *arg){
+
+	long long t = stage_clock();
+	void *data;
+	int size;
+
+	data = encode_image(write_img, format, &size, &t);
+	if (data == NULL) {
+		return 0;
+	}
+	writer_submit(writer, file_name, data, size, written, arg);
+
+	return 1;
+}
+
+/******************************************************************************
+ * write_jpeg_file()
+ *
+ * Arguments: img - pointer to image to be written
+ *            file_name - name of file where to save JPEG image
+ * Returns: (bool) 1 in case of success, 0 in case of failure to write
+ * Side-Effects: none
+ *
+ * Description: writes a JPEG image to a file, under a temporary name
+ * 				renamed when complete (an interrupted write leaves no file
+ * 				with the final name). Encoded in memory first (the same file
+ * 				gdImageJpeg() writes), so encoding and writing are timed
+ * 				apart.
+ *
+ *****************************************************************************/
+int write_jpeg_file(gdImagePtr write_img, char * file_name){
+
+	return write_format_file(write_img, FORMAT_JPEG, file_name);
+}
+
+/******************************************************************************
+ * write_jpeg_async()
+ *
+ * Arguments: writer - writer to hand the file to
+ *            img - pointer to image to be written
+ *            file_name - name of file where to save JPEG image
+ *            written, arg - see writer_submit()
+ * Returns: (bool) 1 in case of success, 0 in case of failure to encode
+ * Side-Effects: none
+ *
+ * Description: encodes the image to JPEG in memory with gdImageJpegPtr()
+ * 				(same file as write_jpeg_file()) and hands it to the writer
+ *
+ *****************************************************************************/
+int write_jpeg_async(asyncWriter *writer, gdImagePtr write_img, char * file_name, void (*written)(void *arg, long long write_ns), void *arg){
+
+	return write_format_async(writer, write_img, FORMAT_JPEG, file_name, written, arg);
+}
+
+/******************************************************************************
+ * write_image_file()
+ *
+ * Arguments: img - pointer to image to be written
+ *            file_name - name of file where to save it (see output_name())
+ * Returns: (bool) 1 in case of success, 0 in case of failure to write
+ * Side-Effects: none
+ *
+ * Description: write_jpeg_file() in the format of the outputs
+ *
+ *****************************************************************************/
+int write_image_file(gdImagePtr write_img, char * file_name){
+
+	return write_format_file(write_img, out_format, file_name);
+}
+
+/******************************************************************************
+ * write_image_async()
+ *
+ * Arguments: writer - writer to hand the file to
+ *            img - pointer to image to be written
+ *            file_name - name of file where to save it (see output_name())
+ *            written, arg - see writer_submit()
+ * Returns: (bool) 1 in case of success, 0 in case of failure to encode
+ * Side-Effects: none
+ *
+ * Description: write_jpeg_async() in the format of the outputs
+ *
+ *****************************************************************************/
+int write_image_async(asyncWriter *writer, gdImagePtr write_img, char * file_name, void (*written)(void *arg, long long write_ns), void *arg){
+
+	return write_format_async(writer, write_img, out_format, file_name, written, arg);
+}
+
+/******************************************************************************
+ * encode_stats()
+ *
+ * Arguments: format - a FORMAT_ value
+ *            stats - where the counters are stored
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: what encoding whole images in a format took so far
+ *
+ *****************************************************************************/
+void encode_stats(int format, encodeStats *stats){
+
+	stats->images = atomic_load(&encoded[format].images);
+	stats->ns = atomic_load(&encoded[format].ns);
+	stats->bytes = atomic_load(&encoded[format].bytes);
+	stats->pixels = atomic_load(&encoded[format].pixels);
+}
+
+/******************************************************************************
+ * read_heif_file()
+ *
+ * Arguments: file_name - name of file with data for HEIF image
+ * Returns: img - the image read from file or NULL if failure to read
+ * Side-Effects: none
+ *
+ * Description: reads a HEIF image from a file
+ *
+ *****************************************************************************/
+gdImagePtr read_heif_file(char * file_name){
+
+	FILE * fp;
+	gdImagePtr read_img;
+
+	fp = fopen(file_name, "rb");
+   	if (!fp) {
+        fprintf(stderr, "Can't read image %s\n", file_name);
+        return NULL;
+    }
+    read_img = gdImageCreateFromHeif(fp);
+    fclose(fp);
+  	if (read_img == NULL) {
+    	return NULL;
+    }
+
+	return read_img;
+}
+
+/******************************************************************************
+ * write_heif_file()
+ *
+ * Arguments: img - pointer to image to be written
+ *            file_name - name of file where to save HEIF image
+ * Returns: (bool) 1 in case of success, 0 in case of failure to write
+ * Side-Effects: none
+ *
+ * Description: writes a HEIF image to a file
+ *
+ *****************************************************************************/
+int write_heif_file(gdImagePtr write_img, char * file_name){
+	FILE * fp;
+
+	fp = fopen(file_name, "wb");
+	if (fp == NULL) {
+		return 0;
+	}
+	gdImageHeif(write_img, fp);
+	fclose(fp);
+
+	return 1;
+}
+
+/* names of the formats, as --output-format takes them, and the extensions
+ * their files have (the first one for the outputs) */
+static const struct {
+
+	const char *name;
+	const char *ext[3];
+
+} formats[FORMATS] = {
+	{"jpeg", {".jpg", ".jpeg", NULL}},
+	{"png", {".png", NULL, NULL}},
+	{"webp", {".webp", NULL, NULL}},
+	{"heif", {".heic", ".heif", NULL}},
+};
+
+/******************************************************************************
+ * image_format()
+ *
+ * Arguments: data - first bytes of a file
+ *            size - how many (16 are enough)
+ * Returns: (int) FORMAT_JPEG, FORMAT_PNG, FORMAT_WEBP, FORMAT_HEIF or
+ *          FORMAT_UNKNOWN
+ * Side-Effects: none
+ *
+ * Description: tells the format of an image by its magic bytes: the SOI
+ * 				marker of a JPEG, the signature of a PNG, a RIFF file of
+ * 				type WEBP, and an ISO media file (ftyp box) with a HEIF
+ * 				brand
+ *
+ *****************************************************************************/
+int image_format(const void *data, size_t size){
+
+	static const char *heif_brands[] = {"heic", "heix", "hevc", "hevx", "heim", "heis", "mif1", "msf1"};
+	const unsigned char *p = (const unsigned char *) data;
+
+	if (size >= 3 && p[0] == 0xFF && p[1] == 0xD8 && p[2] == 0xFF) {
+		return FORMAT_JPEG;
+	}
+	if (size >= 8 && memcmp(p, "\x89PNG\r\n\x1a\n", 8) == 0) {
+		return FORMAT_PNG;
+	}
+	if (size >= 12 && memcmp(p, "RIFF", 4) == 0 && memcmp(p + 8, "WEBP", 4) == 0) {
+		return FORMAT_WEBP;
+	}
+	if (size >= 12 && memcmp(p + 4, "ftyp", 4) == 0) {
+		for (size_t i = 0; i < sizeof(heif_brands) / sizeof(heif_brands[0]); i++) {
+			if (memcmp(p + 8, heif_brands[i], 4) == 0) return FORMAT_HEIF;
+		}
+	}
+	return FORMAT_UNKNOWN;
+}
+
+/******************************************************************************
+ * read_file_format()
+ *
+ * Arguments: dir_fd - directory file_name is relative to (or AT_FDCWD)
+ *            file_name - name of the file
+ * Returns: (int) its format (see image_format()), FORMAT_UNKNOWN if it
+ *          can't be read
+ * Side-Effects: none
+ *
+ * Description: reads the first bytes of a file and tells its format
+ *
+ *****************************************************************************/
+int read_file_format(int dir_fd, const char *file_name){
+
+	unsigned char head[16];
+	ssize_t n;
+	int fd;
+
+	fd = openat(dir_fd, file_name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return FORMAT_UNKNOWN;
+	}
+	n = pread(fd, head, sizeof(head), 0);
+	close(fd);
+
+	return (n > 0) ? image_format(head, n) : FORMAT_UNKNOWN;
+}
+
+/******************************************************************************
+ * format_name()
+ *
+ * Arguments: format - a FORMAT_ value
+ * Returns: (const char *) its name ("jpeg", "png", "webp", "heif")
+ * Side-Effects: none
+ *
+ * Description: name of a format, as --output-format takes it
+ *
+ *****************************************************************************/
+const char *format_name(int format){
+
+	return (format >= 0 && format < FORMATS) ? formats[format].name : "unknown";
+}
+
+/* big-endian and little-endian integers of a header */
+static inline unsigned int get_be32(const unsigned char *p){
+
+	return ((unsigned int) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline unsigned int get_le24(const unsigned char *p){
+
+	return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+/******************************************************************************
+ * read_image_dimensions()
+ *
+ * Arguments: file_name - name of the file
+ *            width, height - where the size of the image is stored
+ * Returns: (int) its format, FORMAT_UNKNOWN if it isn't an image or its
+ *          size wasn't found
+ * Side-Effects: none
+ *
+ * Description: reads the size of an image from its header, without
+ * 				decoding it. A JPEG goes to read_jpeg_dimensions(); a PNG
+ * 				has it in its IHDR chunk, a WebP in its first chunk (VP8,
+ * 				VP8L or VP8X, each with its own layout). A HEIF has an ispe
+ * 				property for each image item: the largest one in its first
+ * 				HEIF_HEADER_SIZE bytes is taken, the whole image when it is
+ * 				a grid of tiles.
+ *
+ *****************************************************************************/
+int read_image_dimensions(const char *file_name, int *width, int *height){
+
+	unsigned char head[32], *buf;
+	int format, fd;
+	ssize_t n;
+
+	fd = open(file_name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return FORMAT_UNKNOWN;
+	}
+	n = pread(fd, head, sizeof(head), 0);
+	format = (n > 0) ? image_format(head, n) : FORMAT_UNKNOWN;
+
+	switch (format) {
+		case FORMAT_JPEG:
+			close(fd);
+			return read_jpeg_dimensions(file_name, width, height) ? FORMAT_JPEG : FORMAT_UNKNOWN;
+
+		case FORMAT_PNG:
+			if (n < 24 || memcmp(head + 12, "IHDR", 4) != 0) break;
+			*width = (int) get_be32(head + 16);
+			*height = (int) get_be32(head + 20);
+			close(fd);
+			return format;
+
+		case FORMAT_WEBP:
+			if (n >= 30 && memcmp(head + 12, "VP8 ", 4) == 0) {
+				*width = (head[26] | (head[27] << 8)) & 0x3FFF;
+				*height = (head[28] | (head[29] << 8)) & 0x3FFF;
+			} else if (n >= 25 && memcmp(head + 12, "VP8L", 4) == 0) {
+				*width = 1 + (head[21] | ((head[22] & 0x3F) << 8));
+				*height = 1 + ((head[22] >> 6) | (head[23] << 2) | ((head[24] & 0x0F) << 10));
+			} else if (n >= 30 && memcmp(head + 12, "VP8X", 4) == 0) {
+				*width = 1 + (int) get_le24(head + 24);
+				*height = 1 + (int) get_le24(head + 27);
+			} else {
+				break;
+			}
+			close(fd);
+			return format;
+
+		case FORMAT_HEIF:
+			buf = (unsigned char *) malloc(HEIF_HEADER_SIZE);
+			if (buf == NULL) break;
+			n = pread(fd, buf, HEIF_HEADER_SIZE, 0);
+			*width = *height = 0;
+			/* ispe: size, "ispe", version and flags, width, height */
+			for (unsigned char *p = buf + 4; n >= 16 && p + 16 <= buf + n; p++) {
+				p = (unsigned char *) memchr(p, 'i', buf + n - 16 - p + 1);
+				if (p == NULL) break;
+				if (memcmp(p, "ispe", 4) == 0) {
+					unsigned int w = get_be32(p + 8), h = get_be32(p + 12);
+					if ((long long) w * h > (long long) *width * *height) {
+						*width = (int) w;
+						*height = (int) h;
+					}
+				}
+			}
+			free(buf);
+			close(fd);
+			return (*width > 0 && *height > 0) ? format : FORMAT_UNKNOWN;
+	}
+	close(fd);
+	return FORMAT_UNKNOWN;
+}
+
+/******************************************************************************
+ * output_format_set()
+ *
+ * Arguments: description - jpeg, webp, heif or png, optionally followed by
+ *                          :<quality>
+ * Returns: (bool) 1 in case of success, 0 if description is wrong or gd
+ *          can't encode the format (a message is printed)
+ * Side-Effects: must be called before any thread is writing
+ *
+ * Description: sets the format of the outputs and its quality (1 to 100, or
+ * 				the zlib level 0 to 9 for PNG). A 1x1 image is encoded
+ * 				first: a gd (or libheif) built without the encoder only
+ * 				fails on the first output otherwise.
+ *
+ *****************************************************************************/
+int output_format_set(const char *description){
+
+	size_t len = strcspn(description, ":");
+	int format, quality = -1;
+	int size, max;
+	long long t;
+	char *end;
+
+	for (format = 0; format < FORMATS; format++) {
+		if (strlen(formats[format].name) == len && strncasecmp(description, formats[format].name, len) == 0) break;
+	}
+	if (format == FORMATS && len == 3 && strncasecmp(description, "jpg", 3) == 0) format = FORMAT_JPEG;
+	if (format == FORMATS && len == 4 && strncasecmp(description, "heic", 4) == 0) format = FORMAT_HEIF;
+	if (format == FORMATS) {
+		fprintf(stderr, "Unknown output format %.*s\n", (int) len, description);
+		return 0;
+	}
+	max = (format == FORMAT_PNG) ? 9 : 100;
+	if (description[len] == ':') {
+		quality = (int) strtol(description + len + 1, &end, 10);
+		if (end == description + len + 1 || *end != '\0' || quality < (format == FORMAT_PNG ? 0 : 1) || quality > max) {
+			fprintf(stderr, "Output quality of %s out of range (%d to %d)\n", formats[format].name, format == FORMAT_PNG ? 0 : 1, max);
+			return 0;
+		}
+	}
+
+	/* can gd encode it? */
+	gdImagePtr probe = gdImageCreateTrueColor(1, 1);
+	void *data = NULL;
+	if (probe != NULL) {
+		t = clock_ns();
+		data = encode_image(probe, format, &size, &t);
+		gdImageDestroy(probe);
+	}
+	if (data == NULL) {
+		fprintf(stderr, "No %s encoder in this gd\n", formats[format].name);
+		return 0;
+	}
+	gdFree(data);
+	memset(&encoded[format], 0, sizeof(encoded[format]));
+
+	out_format = format;
+	if (quality >= 0) format_quality[format] = quality;
+	return 1;
+}
+
+/******************************************************************************
+ * output_format()
+ *
+ * Arguments: quality - where the quality of the format is stored (may be
+ *                      NULL)
+ * Returns: (int) format of the outputs
+ * Side-Effects: none
+ *
+ * Description: format of the outputs set by output_format_set()
+ *
+ *****************************************************************************/
+int output_format(int *quality){
+
+	if (quality != NULL) *quality = format_quality[out_format];
+	return out_format;
+}
+
+/******************************************************************************
+ * output_name()
+ *
+ * Arguments: file_name - path of an output, named as its input
+ *            len - size of the buffer file_name is in
+ * Returns: (bool) 1 in case of success, 0 if the new name doesn't fit
+ * Side-Effects: changes file_name
+ *
+ * Description: gives the output the extension of its format (the first
+ * 				of formats[]), unless it already has one of them, whatever
+ * 				the case. The extension is appended, never put in place of
+ * 				the input's: a.jpg and a.png must not both be a.webp
+ *
+ *****************************************************************************/
+int output_name(char *file_name, size_t len){
+
+	char *base = strrchr(file_name, '/');
+	char *ext = strrchr(base ? base : file_name, '.');
+
+	if (ext != NULL) {
+		for (int i = 0; i < 3 && formats[out_format].ext[i] != NULL; i++) {
+			if (strcasecmp(ext, formats[out_format].ext[i]) == 0) return 1;
+		}
+	}
+	if (strlen(file_name) + strlen(formats[out_format].ext[0]) + 1 > len) {
+		return 0;
+	}
+	strcat(file_name, formats[out_format].ext[0]);
+	return 1;
+}
+
+/******************************************************************************
+ * create_directory()
+ *
+ * Arguments: file_name - name of directory to be created
+ * Returns: (bool) 1 if the directory already exists or succesfully created
+ *                 0 in case of failure to create
+ * Side-Effects: none
+ *
+ * Description: Create a directory. mkdir() is tried first, so processes
+ * 				creating the same directory at once (shards sharing the
+ * 				output directory) all succeed: the one that loses the race
+ * 				finds it there.
+ *
+ *****************************************************************************/
+int create_directory(char * dir_name){
+
+	if (mkdir(dir_name, 0777) != 0){
+		if (errno != EEXIST || !isDirExists(dir_name)){
+			return 0;
+		}
+		fprintf(stderr, "%s directory already existent\n", dir_name);
+	}
+	return 1;
+}
+
+/******************************************************************************
+ * output_dir_lock()
+ *
+ * Arguments: out_dir - output directory
+ * Returns: (int) descriptor of the lock file, locked shared until closed;
+ *          -1 in case of failure
+ * Side-Effects: creates <out_dir>/.lock, removes the <name>.part files of
+ *               a run that was killed
+ *
+ * Description: every run writing into the output directory holds its lock
+ * 				file shared until it ends, with or without a manifest. The
+ * 				.part files are only removed when the exclusive lock
+ * 				succeeds, so never under a process still writing them.
+ *
+ *****************************************************************************/
+int output_dir_lock(const char *out_dir){
+
+	char path[strlen(out_dir) + sizeof(LOCK_FILE)];
+	size_t suffix = strlen(TEMP_SUFFIX);
+	struct dirent *entry;
+	DIR *dir;
+	int fd;
+
+	sprintf(path, "%s%s", out_dir, LOCK_FILE);
+	fd = open(path, O_RDONLY | O_CREAT, 0666);
+	if (fd < 0) {
+		return -1;
+	}
+	if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+		/* no other run in the directory: what's left is from one killed */
+		dir = opendir(out_dir);
+		if (dir != NULL) {
+			while ((entry = readdir(dir)) != NULL) {
+				size_t len = strlen(entry->d_name);
+				if (len > suffix && strcmp(entry->d_name + len - suffix, TEMP_SUFFIX) == 0) {
+					unlinkat(dirfd(dir), entry->d_name, 0);
+				}
+			}
+			closedir(dir);
+		}
+	}
+	if (flock(fd, LOCK_SH) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/******************************************************************************
+ * readFiles()
+ *
+ * Arguments: dir - name of directory to look for image-list.txt and read it
+ * Returns: (char **) -         array of filenames in image-list.txt
+ *          int nn_files -      number of files
+ * Side-Effects: allocs an array of strings
+ *
+ * Description: Reads all picture names names in image-list.txt in the given
+ * 				directory, in one pass (see fileList to start on the first
+ * 				ones while the list is read)
+ *
+ *****************************************************************************/
+char **readFiles(char *dir, int *nn_files) {
+
+	fileList *list;
+	char **files;
+
+	*nn_files = 0;
+	list = file_list_open(dir, NULL, 0, 0, 1);
+	if (list == NULL) {
+		fprintf(stderr, "Impossible to read %s%s\n", dir, IMAGE_LIST);
+		return NULL;
+	}
+
+	/* one pass over the list, checking each entry once */
+	file_list_filter(list, SORT_NONE);
+
+	files = list->names;
+	*nn_files = list->count;
+	list->names = NULL;
+	list->count = 0;
+	file_list_destroy(list);
+
+	return files;
+}
+
+/******************************************************************************
+ * read_jpeg_dimensions()
+ *
+ * Arguments: file_name - name of file with data for JPEG image
+ *            width, height - where the size of the image is stored
+ * Returns: (bool) 1 in case of success, 0 if the file isn't a JPEG or its
+ *          frame header wasn't found
+ * Side-Effects: none
+ *
+ * Description: reads the size of a JPEG image from its SOF marker, without
+ * 				decoding the image
+ *
+ *****************************************************************************/
+int read_jpeg_dimensions(const char *file_name, int *width, int *height){
+
+	FILE *fp;
+	int c, marker, len;
+	unsigned char sof[5];
+
+	fp = fopen(file_name, "rb");
+	if (!fp) {
+		return 0;
+	}
+
+	/* SOI */
+	if (fgetc(fp) != 0xFF || fgetc(fp) != 0xD8) {
+		fclose(fp);
+		return 0;
+	}
+
+	while (1) {
+		/* markers start with 0xFF, possibly padded with more 0xFF */
+		c = fgetc(fp);
+		if (c != 0xFF) break;
+		while ((marker = fgetc(fp)) == 0xFF);
+		if (marker == EOF || marker == 0xD9 || marker == 0xDA) break;
+
+		/* markers without a segment */
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) continue;
+
+		len = fgetc(fp) << 8;
+		len |= fgetc(fp);
+		if (len < 2) break;
+
+		/* SOF0..SOF15, except DHT, JPG and DAC */
+		if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+			if (fread(sof, 1, 5, fp) != 5) break;
+			*height = (sof[1] << 8) | sof[2];
+			*width = (sof[3] << 8) | sof[4];
+			fclose(fp);
+			return 1;
+		}
+
+		if (fseek(fp, len - 2, SEEK_CUR) != 0) break;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+/* a file name and the key it is sorted by */
+typedef struct {
+
+	char *name;
+	long long key;
+
+} fileKey;
+
+/* largest key first, ties by name so the order is deterministic */
+static int cmpFileKey(const void *a, const void *b) {
+
+	const fileKey *ka = (const fileKey *) a;
+	const fileKey *kb = (const fileKey *) b;
+
+	if (ka->key != kb->key) return (ka->key < kb->key) ? 1 : -1;
+	return strcmp(ka->name, kb->name);
+}
+
+/******************************************************************************
+ * sortFiles()
+ *
+ * Arguments: files - array of filenames
+ *            nn_files - number of files
+ *            mode - SORT_SIZE (file size) or SORT_PIXELS (width x height)
+ * Returns: (void)
+ * Side-Effects: reorders files
+ *
+ * Description: sorts the files largest first, so the biggest images are
+ * 				taken from the queue at the start and the run doesn't end
+ * 				with a single thread busy on a huge image. Files whose size
+ * 				can't be read go to the end.
+ *
+ *****************************************************************************/
+void sortFiles(char **files, int nn_files, int mode) {
+
+	fileKey *keys;
+	struct stat st;
+	int width, height;
+
+	if (mode == SORT_NONE || nn_files < 2) return;
+
+	keys = (fileKey *) malloc(nn_files * sizeof(fileKey));
+	if (!keys) return;
+
+	for (int i = 0; i < nn_files; i++) {
+		keys[i].name = files[i];
+		keys[i].key = -1;
+		if (mode == SORT_SIZE) {
+			if (stat(files[i], &st) == 0) keys[i].key = st.st_size;
+		} else if (read_image_dimensions(files[i], &width, &height) != FORMAT_UNKNOWN) {
+			keys[i].key = (long long) width * height;
+		}
+	}
+
+	qsort(keys, nn_files, sizeof(fileKey), cmpFileKey);
+
+	for (int i = 0; i < nn_files; i++) {
+		files[i] = keys[i].name;
+	}
+	free(keys);
+}
+
+/******************************************************************************
+ * destroyFiles()
+ * 
+ * Arguments:	files - array of filenames
+ * Returns: 	(void)
+ * 
+ * Description: function o free the array of filenames
+ * 
+ ******************************************************************************/
+void destroyFiles(char **files, int nn_files) {
+	for (int i = 0; i < nn_files; i++) {
+		free(files[i]);
+	}
+	free(files);
+}
+
+/* XXH64 primes */
+#define XXH_PRIME1	11400714785074694791ULL
+#define XXH_PRIME2	14029467366897019727ULL
+#define XXH_PRIME3	1609587929392839161ULL
+#define XXH_PRIME4	9650029242287828579ULL
+#define XXH_PRIME5	2870177450012600261ULL
+
+static inline uint64_t xxh_rotl(uint64_t x, int r){
+
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const unsigned char *p){
+
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input){
+
+	acc += input * XXH_PRIME2;
+	acc = xxh_rotl(acc, 31);
+	return acc * XXH_PRIME1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val){
+
+	acc ^= xxh_round(0, val);
+	return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+/******************************************************************************
+ * xxh64()
+ *
+ * Arguments: data, len - bytes to hash
+ *            seed - seed of the hash
+ * Returns: (uint64_t) XXH64 hash of the bytes
+ * Side-Effects: none
+ *
+ * Description: the XXH64 hash (same values as the xxHash library, on little
+ * 				endian machines): four lanes over 32 byte stripes, then the
+ * 				tail, then the avalanche
+ *
+ *****************************************************************************/
+uint64_t xxh64(const void *data, size_t len, uint64_t seed){
+
+	const unsigned char *p = (const unsigned char *) data;
+	const unsigned char *end = p + len;
+	uint64_t h64;
+
+	if (len >= 32) {
+		uint64_t v1 = seed + XXH_PRIME1 + XXH_PRIME2;
+		uint64_t v2 = seed + XXH_PRIME2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH_PRIME1;
+
+		do {
+			v1 = xxh_round(v1, xxh_read64(p));
+			v2 = xxh_round(v2, xxh_read64(p + 8));
+			v3 = xxh_round(v3, xxh_read64(p + 16));
+			v4 = xxh_round(v4, xxh_read64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+
+		h64 = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+		h64 = xxh_merge(h64, v1);
+		h64 = xxh_merge(h64, v2);
+		h64 = xxh_merge(h64, v3);
+		h64 = xxh_merge(h64, v4);
+	} else {
+		h64 = seed + XXH_PRIME5;
+	}
+	h64 += (uint64_t) len;
+
+	for (; p + 8 <= end; p += 8) {
+		h64 ^= xxh_round(0, xxh_read64(p));
+		h64 = xxh_rotl(h64, 27) * XXH_PRIME1 + XXH_PRIME4;
+	}
+	if (p + 4 <= end) {
+		uint32_t v;
+		memcpy(&v, p, sizeof(v));
+		h64 ^= (uint64_t) v * XXH_PRIME1;
+		h64 = xxh_rotl(h64, 23) * XXH_PRIME2 + XXH_PRIME3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h64 ^= (*p) * XXH_PRIME5;
+		h64 = xxh_rotl(h64, 11) * XXH_PRIME1;
+	}
+
+	h64 ^= h64 >> 33;
+	h64 *= XXH_PRIME2;
+	h64 ^= h64 >> 29;
+	h64 *= XXH_PRIME3;
+	h64 ^= h64 >> 32;
+	return h64;
+}
+
+/******************************************************************************
+ * hash_file()
+ *
+ * Arguments: file_name - name of the file
+ *            hash - where the XXH64 hash of its contents is stored
+ * Returns: (bool) 1 in case of success, 0 in case of failure to read
+ * Side-Effects: none
+ *
+ * Description: hashes the contents of a file (mapped, not copied)
+ *
+ *****************************************************************************/
+int hash_file(const char *file_name, uint64_t *hash){
+
+	mappedFile map;
+	struct stat st;
+
+	/* map_file() refuses empty files */
+	if (stat(file_name, &st) == 0 && st.st_size == 0) {
+		*hash = xxh64("", 0, 0);
+		return 1;
+	}
+	if (!map_file(file_name, &map, NULL)) {
+		return 0;
+	}
+	*hash = xxh64(map.data, map.size, 0);
+	unmap_file(&map);
+
+	return 1;
+}
+
+/******************************************************************************
+ * filter_params()
+ *
+ * Arguments: buffer - where the description is stored
+ *            len - size of buffer
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: describes the parameters of the filter and of the encoder,
+ * 				so outputs made with other parameters can be told apart
+ *
+ *****************************************************************************/
+void filter_params(char *buffer, size_t len){
+
+	int n;
+
+	/* the default pipeline keeps the parameters it always had */
+	if (pipe_nr == sizeof(default_stages) / sizeof(default_stages[0]) && format_quality[FORMAT_JPEG] == JPEG_QUALITY
+		&& memcmp(pipe_stages, default_stages, sizeof(default_stages)) == 0) {
+		n = snprintf(buffer, len, "contrast %d smooth %d sepia %d %d %d quality %d",
+			CONTRAST_LEVEL, SMOOTH_WEIGHT, SEPIA_RED, SEPIA_GREEN, SEPIA_BLUE, JPEG_QUALITY);
+	} else {
+		n = snprintf(buffer, len, "pipeline ");
+		pipeline_describe(buffer + n, len - n);
+		n = strlen(buffer);
+	}
+
+	/* full size outputs keep the parameters they always had */
+	if (max_dimension > 0 && n >= 0 && (size_t) n < len) {
+		n += snprintf(buffer + n, len - n, " max %d", max_dimension);
+	}
+
+	/* and so do JPEG outputs */
+	if (out_format != FORMAT_JPEG && n >= 0 && (size_t) n < len) {
+		snprintf(buffer + n, len - n, " output %s %d", formats[out_format].name, format_quality[out_format]);
+	}
+}
+
+/* upper half of a table slot: bits of the key, to skip most entries that
+ * aren't the one looked for without reading them; lower half: index + 1 in
+ * records, 0 for an empty slot */
+#define MANIFEST_TAG(key)	((key) & 0xFFFFFFFF00000000ULL)
+#define MANIFEST_INDEX(slot)	((size_t) ((slot) & 0xFFFFFFFFULL) - 1)
+
+/* slot of name in the table: its entry, or the empty slot it would go in */
+static uint64_t *manifest_slot(manifest *m, const char *name, uint64_t key){
+
+	size_t i = key & m->mask;
+
+	while (m->table[i] != 0) {
+		if (MANIFEST_TAG(m->table[i]) == MANIFEST_TAG(key)) {
+			manifestEntry *e = &m->records[MANIFEST_INDEX(m->table[i])];
+			if (e->key == key && strcmp(e->name, name) == 0) break;
+		}
+		i = (i + 1) & m->mask;
+	}
+	return &m->table[i];
+}
+
+/* hash of a name for the table */
+static uint64_t manifest_key(const char *name){
+
+	return xxh64(name, strlen(name), 0);
+}
+
+/* puts an input done in this run in the table (lock held), so a later
+ * check of the same name in this run sees it. Only a cache of the file:
+ * out of memory, the entry is just left as it was */
+static void manifest_store(manifest *m, const char *name, uint64_t hash, long long size, const struct timespec *mtime){
+
+	uint64_t key = manifest_key(name);
+	manifestEntry *e;
+	uint64_t *slot;
+
+	/* both kept at most half full / with room for one more */
+	if (m->table == NULL || 2 * (m->entries + 1) > m->mask + 1) {
+		size_t mask = m->table ? 2 * m->mask + 1 : 2 * FILE_LIST_SIZE - 1;
+		uint64_t *table = (uint64_t *) calloc(mask + 1, sizeof(uint64_t));
+		if (!table) {
+			return;
+		}
+		free(m->table);
+		m->table = table;
+		m->mask = mask;
+		for (size_t i = 0; i < m->entries; i++) {
+			*manifest_slot(m, m->records[i].name, m->records[i].key) = MANIFEST_TAG(m->records[i].key) | (i + 1);
+		}
+	}
+	if (m->entries == m->capacity) {
+		size_t capacity = m->capacity ? 2 * m->capacity : FILE_LIST_SIZE;
+		manifestEntry *records = (manifestEntry *) realloc(m->records, capacity * sizeof(manifestEntry));
+		if (!records) {
+			return;
+		}
+		m->records = records;
+		m->capacity = capacity;
+	}
+
+	slot = manifest_slot(m, name, key);
+	if (*slot != 0) {
+		e = &m->records[MANIFEST_INDEX(*slot)];
+	} else {
+		e = &m->records[m->entries];
+		if ((e->name = strdup(name)) == NULL) {
+			return;
+		}
+		e->key = key;
+		*slot = MANIFEST_TAG(key) | (m->entries + 1);
+		m->entries++;
+	}
+	e->hash = hash;
+	e->size = size;
+	e->mtime_sec = mtime->tv_sec;
+	e->mtime_nsec = mtime->tv_nsec;
+}
+
+/******************************************************************************
+ * manifest_write()
+ *
+ * Arguments: m - pointer to the manifest
+ * Returns: (bool) 1 in case of success, 0 in case of failure
+ * Side-Effects: replaces the manifest file
+ *
+ * Description: writes the parameters and every entry of the table to a new
+ * 				file and renames it over the manifest, so the manifest is
+ * 				never seen half written
+ *
+ *****************************************************************************/
+static int manifest_write(manifest *m){
+
+	char tmp[strlen(m->path) + sizeof(TEMP_SUFFIX)];
+	FILE *fp;
+
+	sprintf(tmp, "%s%s", m->path, TEMP_SUFFIX);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		return 0;
+	}
+	fprintf(fp, "%s%s\n", MANIFEST_HEADER, m->params);
+	for (size_t i = 0; i < m->entries; i++) {
+		manifestEntry *e = &m->records[i];
+		fprintf(fp, "%016llx %lld %lld.%09ld %s\n", (unsigned long long) e->hash, e->size, e->mtime_sec, e->mtime_nsec, e->name);
+	}
+	if (fclose(fp) != 0 || rename(tmp, m->path) != 0) {
+		unlink(tmp);
+		return 0;
+	}
+	return 1;
+}
+
+/* field parsers for manifest_load(), much cheaper than strtoull() on
+ * millions of lines: skip one space, then read the digits */
+static char *manifest_hex(char *p, uint64_t *value){
+
+	uint64_t v = 0;
+
+	if (*p == ' ') p++;
+	for (;; p++) {
+		if (*p >= '0' && *p <= '9') v = (v << 4) | (uint64_t) (*p - '0');
+		else if (*p >= 'a' && *p <= 'f') v = (v << 4) | (uint64_t) (*p - 'a' + 10);
+		else break;
+	}
+	*value = v;
+	return p;
+}
+
+static char *manifest_dec(char *p, long long *value){
+
+	long long v = 0;
+
+	if (*p == ' ') p++;
+	for (; *p >= '0' && *p <= '9'; p++) {
+		v = v * 10 + (*p - '0');
+	}
+	*value = v;
+	return p;
+}
+
+/******************************************************************************
+ * manifest_load()
+ *
+ * Arguments: m - pointer to the manifest
+ * Returns: (long) lines of entries in the file, -1 if there is no manifest
+ *          or it was made with other parameters
+ * Side-Effects: none
+ *
+ * Description: reads the whole file with one read() and parses it in place:
+ * 				names stay in the buffer, entries go one after the other in
+ * 				records (a later line of the same name replaces its entry)
+ * 				and the table only holds 8 bytes per slot, so loading
+ * 				millions of entries is mostly the read
+ *
+ *****************************************************************************/
+static long manifest_load(manifest *m){
+
+	struct stat st;
+	size_t header = strlen(MANIFEST_HEADER);
+	size_t lines = 0, got = 0;
+	char *p, *end;
+	int fd;
+
+	fd = open(m->path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || (m->buf = (char *) malloc(st.st_size + 1)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	while (got < (size_t) st.st_size) {
+		ssize_t n = read(fd, m->buf + got, st.st_size - got);
+		if (n <= 0) break;
+		got += n;
+	}
+	close(fd);
+	m->buf[got] = '\0';
+	end = m->buf + got;
+
+	/* first line: the parameters */
+	p = strchr(m->buf, '\n');
+	if (p == NULL || strncmp(m->buf, MANIFEST_HEADER, header) != 0
+		|| (size_t) (p - m->buf) != header + strlen(m->params)
+		|| strncmp(m->buf + header, m->params, p - m->buf - header) != 0) {
+		return -1;
+	}
+	p++;
+
+	for (char *q = p; (q = (char *) memchr(q, '\n', end - q)) != NULL; q++) {
+		lines++;
+	}
+	m->mask = 1;
+	while (m->mask < 2 * lines + 1) m->mask <<= 1;
+	m->table = (uint64_t *) calloc(m->mask, sizeof(uint64_t));
+	m->records = (manifestEntry *) malloc((lines + 1) * sizeof(manifestEntry));
+	m->capacity = lines + 1;
+	m->mask--;
+	if (!m->table || !m->records) {
+		return -1;
+	}
+
+	while (p < end) {
+		char *eol = (char *) memchr(p, '\n', end - p);
+		manifestEntry e;
+		char *name;
+
+		/* a last line without \n was being appended when a run stopped */
+		if (eol == NULL) break;
+		*eol = '\0';
+		name = manifest_hex(p, &e.hash);
+		name = manifest_dec(name, &e.size);
+		name = manifest_dec(name, &e.mtime_sec);
+		e.mtime_nsec = 0;
+		if (*name == '.') {
+			long long nsec;
+			name = manifest_dec(name + 1, &nsec);
+			e.mtime_nsec = (long) nsec;
+		}
+		if (*name == ' ' && name[1] != '\0') {
+			e.name = name + 1;
+			e.key = manifest_key(e.name);
+			uint64_t *slot = manifest_slot(m, e.name, e.key);
+			if (*slot == 0) {
+				*slot = MANIFEST_TAG(e.key) | (m->entries + 1);
+				m->records[m->entries++] = e;
+			} else {
+				m->records[MANIFEST_INDEX(*slot)] = e;
+			}
+		}
+		p = eol + 1;
+	}
+	m->loaded = m->entries;
+
+	return lines;
+}
+
+/******************************************************************************
+ * manifest_open()
+ *
+ * Arguments: out_dir - output directory
+ *            params - parameters of this run (see filter_params())
+ * Returns: manifest - pointer to the manifest, or NULL in case of failure
+ *          (or if another process uses one made with other parameters)
+ * Side-Effects: creates or rewrites the manifest file
+ *
+ * Description: loads the manifest of the output directory. A manifest made
+ * 				with other parameters is started over; one with more than
+ * 				twice as many lines as inputs (inputs done again and again)
+ * 				is compacted. Each process holds the file locked shared
+ * 				while it appends to it, and it's only rewritten when the
+ * 				exclusive lock succeeds: a process still appending would
+ * 				go on writing to the file renamed over. Processes sharing
+ * 				the output directory (shards) take turns on a lock of the
+ * 				directory to open it, so two don't both rewrite it.
+ *
+ *****************************************************************************/
+manifest *manifest_open(const char *out_dir, const char *params){
+
+	manifest *m = (manifest *) calloc(1, sizeof(manifest));
+	long lines;
+	int lock_fd, alone, rewrite = 0;
+
+	if (!m) {
+		return NULL;
+	}
+	m->path = (char *) malloc(strlen(out_dir) + strlen(MANIFEST_FILE) + 1);
+	m->params = strdup(params);
+	if (!m->path || !m->params) {
+		free(m->path);
+		free(m->params);
+		free(m);
+		return NULL;
+	}
+	sprintf(m->path, "%s%s", out_dir, MANIFEST_FILE);
+	m->fd = -1;
+	atomic_init(&m->recorded, 0);
+	atomic_init(&m->unchanged, 0);
+	pthread_mutex_init(&m->lock, NULL);
+
+	lock_fd = open(out_dir, O_RDONLY | O_DIRECTORY);
+	if (lock_fd >= 0) flock(lock_fd, LOCK_EX);
+	m->fd = open(m->path, O_WRONLY | O_APPEND | O_CREAT, 0666);
+	if (m->fd < 0) {
+		if (lock_fd >= 0) close(lock_fd);
+		manifest_close(m);
+		return NULL;
+	}
+	/* no other process has it open */
+	alone = (flock(m->fd, LOCK_EX | LOCK_NB) == 0);
+
+	lines = manifest_load(m);
+	if (lines < 0) {
+		/* nothing to trust: start over */
+		free(m->table);
+		free(m->records);
+		m->table = NULL;
+		m->records = NULL;
+		m->mask = 0;
+		m->entries = 0;
+		m->capacity = 0;
+		m->loaded = 0;
+		rewrite = 1;
+	} else if ((size_t) lines > 2 * m->entries + MANIFEST_SLACK) {
+		rewrite = alone;
+	}
+
+	/* a process using other parameters: its lines would be taken for
+	 * ours, so this one goes without */
+	if (rewrite && !alone) {
+		if (lock_fd >= 0) close(lock_fd);
+		manifest_close(m);
+		return NULL;
+	}
+	if (rewrite && manifest_write(m)) {
+		close(m->fd);
+		m->fd = open(m->path, O_WRONLY | O_APPEND | O_CREAT, 0666);
+	}
+	if (m->fd >= 0) flock(m->fd, LOCK_SH);
+	if (lock_fd >= 0) close(lock_fd);
+	if (m->fd < 0) {
+		manifest_close(m);
+		return NULL;
+	}
+	return m;
+}
+
+/* appends an entry in a single write(), on a file opened with O_APPEND, so
+ * threads don't need a lock */
+static int manifest_append(manifest *m, const char *name, uint64_t hash, long long size, const struct timespec *mtime){
+
+	char *line;
+	int len, ok;
+
+	len = snprintf(NULL, 0, "%016llx %lld %lld.%09ld %s\n", (unsigned long long) hash, size,
+		(long long) mtime->tv_sec, (long) mtime->tv_nsec, name);
+	line = (char *) malloc(len + 1);
+	if (!line) {
+		return 0;
+	}
+	sprintf(line, "%016llx %lld %lld.%09ld %s\n", (unsigned long long) hash, size,
+		(long long) mtime->tv_sec, (long) mtime->tv_nsec, name);
+	ok = (write(m->fd, line, len) == len);
+	free(line);
+
+	return ok;
+}
+
+/******************************************************************************
+ * manifest_unchanged()
+ *
+ * Arguments: m - pointer to the manifest
+ *            name - name of the input (relative to the directory)
+ *            file_name - path of the input
+ *            st - stat of the input
+ * Returns: (bool) 1 if the input is the one recorded
+ * Side-Effects: none
+ *
+ * Description: same size and mtime is taken as unchanged; if only the
+ * 				mtime differs (copied or touched) the contents are hashed
+ * 				and compared, and if they're the same the new mtime is
+ * 				recorded so the next run doesn't hash them again
+ *
+ *****************************************************************************/
+int manifest_unchanged(manifest *m, const char *name, const char *file_name, const struct stat *st){
+
+	manifestEntry e;
+	uint64_t *slot, hash;
+
+	pthread_mutex_lock(&m->lock);
+	slot = (m->table != NULL) ? manifest_slot(m, name, manifest_key(name)) : NULL;
+	if (slot == NULL || *slot == 0) {
+		pthread_mutex_unlock(&m->lock);
+		return 0;
+	}
+	e = m->records[MANIFEST_INDEX(*slot)];
+	pthread_mutex_unlock(&m->lock);
+	if (e.size != st->st_size) return 0;
+
+	if (e.mtime_sec != st->st_mtim.tv_sec || e.mtime_nsec != st->st_mtim.tv_nsec) {
+		if (!hash_file(file_name, &hash) || hash != e.hash) return 0;
+		manifest_append(m, name, hash, st->st_size, &st->st_mtim);
+		pthread_mutex_lock(&m->lock);
+		manifest_store(m, name, hash, st->st_size, &st->st_mtim);
+		pthread_mutex_unlock(&m->lock);
+	}
+	atomic_fetch_add(&m->unchanged, 1);
+	return 1;
+}
+
+/******************************************************************************
+ * manifest_record()
+ *
+ * Arguments: m - pointer to the manifest
+ *            name - name of the input (relative to the directory)
+ *            hash, size, mtime - the input as it was read (see readStats)
+ * Returns: (void)
+ * Side-Effects: appends to the manifest file
+ *
+ * Description: records an input whose output was just written (and renamed
+ * 				into place), with the hash taken when it was read: hashing
+ * 				it again here would record a file changed in between with
+ * 				a hash its output doesn't match. Also kept in the table,
+ * 				for a file that shows up again in this run (--watch). Safe
+ * 				to call from any thread.
+ *
+ *****************************************************************************/
+void manifest_record(manifest *m, const char *name, uint64_t hash, long long size, const struct timespec *mtime){
+
+	if (manifest_append(m, name, hash, size, mtime)) {
+		atomic_fetch_add(&m->recorded, 1);
+	}
+	pthread_mutex_lock(&m->lock);
+	manifest_store(m, name, hash, size, mtime);
+	pthread_mutex_unlock(&m->lock);
+}
+
+/******************************************************************************
+ * manifest_close()
+ *
+ * Arguments: m - pointer to the manifest
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: closes the manifest file and frees the manifest
+ *
+ *****************************************************************************/
+void manifest_close(manifest *m){
+
+	if (m->fd >= 0) close(m->fd);
+	/* names of the entries added in this run are copies */
+	for (size_t i = m->loaded; i < m->entries; i++) {
+		free((char *) m->records[i].name);
+	}
+	pthread_mutex_destroy(&m->lock);
+	free(m->table);
+	free(m->records);
+	free(m->buf);
+	free(m->params);
+	free(m->path);
+	free(m);
+}
+
+/* whether an entry (its name in the directory) is in this process' share:
+ * by the hash of the name, the same on every machine */
+static int file_list_mine(fileList *list, const char *entry){
+
+	list->listed++;
+	return list->shards <= 1 || xxh64(entry, strlen(entry), 0) % list->shards == (uint64_t) list->shard;
+}
+
+/* slot of name in the set of names listed: its entry, or the empty slot it
+ * would go in */
+static size_t file_list_slot(fileList *list, const char *name){
+
+	size_t i = xxh64(name, strlen(name), 0) & list->seen_mask;
+
+	while (list->seen[i] != 0 && strcmp(list->names[list->seen[i] - 1], name) != 0) {
+		i = (i + 1) & list->seen_mask;
+	}
+	return i;
+}
+
+/* makes room in the set for one more pending name, keeping it at most half
+ * full (it only holds the entries not done yet, so it stays small) */
+static int file_list_room(fileList *list){
+
+	size_t old_mask = list->seen_mask;
+	int *old_seen = list->seen;
+	long long *old_again = list->again;
+	size_t mask, slot;
+
+	if (old_seen != NULL && 2 * ((size_t) list->pending + 1) <= old_mask + 1) {
+		return 1;
+	}
+	mask = old_seen ? 2 * old_mask + 1 : 2 * FILE_LIST_SIZE - 1;
+	list->seen = (int *) calloc(mask + 1, sizeof(int));
+	list->again = (long long *) calloc(mask + 1, sizeof(long long));
+	if (!list->seen || !list->again) {
+		free(list->seen);
+		free(list->again);
+		list->seen = old_seen;
+		list->again = old_again;
+		return 0;
+	}
+	list->seen_mask = mask;
+	for (size_t i = 0; old_seen != NULL && i <= old_mask; i++) {
+		if (old_seen[i] == 0) continue;
+		slot = file_list_slot(list, list->names[old_seen[i] - 1]);
+		list->seen[slot] = old_seen[i];
+		list->again[slot] = old_again[i];
+	}
+	free(old_seen);
+	free(old_again);
+	return 1;
+}
+
+/* takes the entry in slot i out of the set, moving back the ones after it
+ * that would no longer be found (linear probing, no tombstones) */
+static void file_list_unsee(fileList *list, size_t i){
+
+	size_t j = i, k;
+	const char *name;
+
+	list->pending--;
+	while (1) {
+		list->seen[i] = 0;
+		list->again[i] = 0;
+		while (1) {
+			j = (j + 1) & list->seen_mask;
+			if (list->seen[j] == 0) return;
+			name = list->names[list->seen[j] - 1];
+			k = xxh64(name, strlen(name), 0) & list->seen_mask;
+			/* its home slot isn't in (i, j]: it goes to i */
+			if ((j > i) ? (k <= i || k > j) : (k <= i && k > j)) break;
+		}
+		list->seen[i] = list->seen[j];
+		list->again[i] = list->again[j];
+		i = j;
+	}
+}
+
+/* builds the set again once the entries were moved (none is taken yet, so
+ * every one left is pending) */
+static void file_list_reseen(fileList *list){
+
+	free(list->seen);
+	free(list->again);
+	list->seen = NULL;
+	list->again = NULL;
+	list->seen_mask = 0;
+	list->pending = 0;
+	for (int i = 0; i < list->count; i++) {
+		if (!file_list_room(list)) break;
+		list->seen[file_list_slot(list, list->names[i])] = i + 1;
+		list->pending++;
+	}
+}
+
+/* appends an entry (name belongs to the list from here on), arrived: when
+ * it was seen (CLOCK_MONOTONIC ns), 0 for entries of image-list.txt. A name
+ * whose entry isn't done yet (see file_list_done()) is dropped: the
+ * directory is watched before image-list.txt is read, so a file may show up
+ * both ways, and two threads must never write the same output. A watched
+ * file written again meanwhile is listed again once that entry is done. */
+static int file_list_add(fileList *list, char *name, long long arrived, int wake){
+
+	size_t slot;
+
+	pthread_mutex_lock(&list->lock);
+
+	if (!file_list_room(list)) {
+		pthread_mutex_unlock(&list->lock);
+		free(name);
+		return 0;
+	}
+	slot = file_list_slot(list, name);
+	if (list->seen[slot] != 0) {
+		if (arrived > 0) list->again[slot] = arrived;
+		pthread_mutex_unlock(&list->lock);
+		free(name);
+		return 1;
+	}
+
+	if (list->count == list->capacity) {
+		int capacity = list->capacity ? 2 * list->capacity : FILE_LIST_SIZE;
+		char **names = (char **) realloc(list->names, capacity * sizeof(char *));
+		if (names) list->names = names;
+		long long *times = (long long *) realloc(list->arrived, capacity * sizeof(long long));
+		if (times) list->arrived = times;
+		if (!names || !times) {
+			pthread_mutex_unlock(&list->lock);
+			free(name);
+			return 0;
+		}
+		list->capacity = capacity;
+	}
+	list->arrived[list->count] = arrived;
+	list->names[list->count++] = name;
+	list->seen[slot] = list->count;
+	list->again[slot] = 0;
+	list->pending++;
+	if (wake) {
+		pthread_cond_broadcast(&list->grown);
+	}
+	pthread_mutex_unlock(&list->lock);
+
+	return 1;
+}
+
+#ifdef __linux__
+
+/******************************************************************************
+ * file_list_watch()
+ *
+ * Arguments: list - pointer to the list (watching)
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: appends every file written to (IN_CLOSE_WRITE) or moved into
+ * 				(IN_MOVED_TO) the directory (images or not, see
+ * 				file_list_check()), as soon as inotify reports it,
+ * 				until SIGINT or SIGTERM arrive on the signalfd
+ *
+ *****************************************************************************/
+static void file_list_watch(fileList *list){
+
+	size_t dir_len = strlen(list->dir);
+	char events[WATCH_EVENTS_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[2];
+	struct timespec now;
+
+	fds[0].fd = list->watch_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = list->signal_fd;
+	fds[1].events = POLLIN;
+
+	while (1) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (fds[1].revents & POLLIN) {
+			break;
+		}
+		ssize_t len = read(list->watch_fd, events, sizeof(events));
+		if (len <= 0) {
+			if (len < 0 && errno == EINTR) continue;
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		for (char *p = events; p < events + len; p += sizeof(struct inotify_event) + ((struct inotify_event *) p)->len) {
+			struct inotify_event *event = (struct inotify_event *) p;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				fprintf(stderr, "Watch: too many files at once, some were missed\n");
+				continue;
+			}
+			/* hidden files are left out (editors, partial copies); the
+			 * rest is told by its first bytes when taken */
+			if ((event->mask & IN_ISDIR) || event->len == 0 || event->name[0] == '.') continue;
+			if (!file_list_mine(list, event->name)) continue;
+
+			char *name = (char *) malloc(dir_len + strlen(event->name) + 2);
+			if (!name) continue;
+			sprintf(name, "%s/%s", list->dir, event->name);
+			file_list_add(list, name, now.tv_sec * 1000000000LL + now.tv_nsec, 1);
+		}
+	}
+}
+
+#endif
+
+/******************************************************************************
+ * file_list_thread()
+ *
+ * Arguments: arg - pointer to the fileList
+ * Returns: NULL
+ * Side-Effects: none
+ *
+ * Description: reads image-list.txt once, appending every line of this
+ * 				process' share to the list (doubling the array when full) and waking up threads
+ * 				waiting for entries a batch at a time. When watching, then
+ * 				goes on with the files that show up in the directory.
+ *
+ *****************************************************************************/
+static void *file_list_thread(void *arg){
+
+	fileList *list = (fileList *) arg;
+	size_t dir_len = strlen(list->dir);
+	char *line = NULL;
+	size_t line_cap = 0;
+	ssize_t len;
+	int count = 0;
+	long long start = stage_clock();
+
+	trace_thread("lister");
+	while ((len = getline(&line, &line_cap, list->list_fp)) != -1) {
+
+		/* clean getline() \n */
+		line[strcspn(line, "\n")] = '\0';
+		if (!file_list_mine(list, line)) continue;
+
+		char *name = (char *) malloc(dir_len + strlen(line) + 2);
+		if (!name) break;
+		sprintf(name, "%s/%s", list->dir, line);
+
+		/* wake up the threads waiting at once for the first entries, then
+		 * every FILE_LIST_BATCH, not for every line */
+		count++;
+		if (!file_list_add(list, name, 0, (count & (count - 1)) == 0 || count % FILE_LIST_BATCH == 0)) {
+			break;
+		}
+	}
+	free(line);
+	if (tracing) trace_event("list", start, stage_clock());
+
+#ifdef __linux__
+	if (list->watch_fd >= 0) {
+		pthread_mutex_lock(&list->lock);
+		pthread_cond_broadcast(&list->grown);
+		pthread_mutex_unlock(&list->lock);
+		file_list_watch(list);
+	}
+#endif
+
+	pthread_mutex_lock(&list->lock);
+	list->done = 1;
+	pthread_cond_broadcast(&list->grown);
+	pthread_mutex_unlock(&list->lock);
+
+	return NULL;
+}
+
+/******************************************************************************
+ * file_list_open()
+ *
+ * Arguments: dir - directory with image-list.txt (and the output directory)
+ *            m - manifest of the output directory, or NULL
+ *            watch - 1 to go on with the files that show up in dir
+ *            shard, shards - keep only the entries whose name hashes to
+ *                            shard out of shards (0, 1: all of them)
+ * Returns: list - pointer to the new list, or NULL if image-list.txt can't be
+ *          read
+ * Side-Effects: starts the thread reading image-list.txt. Watching blocks
+ *               SIGINT and SIGTERM in the calling thread (and so in the
+ *               threads it creates afterwards): they end the list instead.
+ *
+ * Description: starts reading the image list of a directory. The output
+ * 				directory should exist already, or outputs aren't looked for.
+ * 				The directory is watched before the list is read, so no file
+ * 				written in the meantime is missed (one found both in the
+ * 				list and by the watch is listed once).
+ * 				If it can't be watched, watch_fd is -1.
+ *
+ *****************************************************************************/
+fileList *file_list_open(char *dir, manifest *m, int watch, int shard, int shards){
+
+	char buffer[strlen(dir) + strlen(IMAGE_LIST) + strlen(OLD_IMAGE_DIR) + 1];
+	fileList *list = (fileList *) calloc(1, sizeof(fileList));
+	if (!list) {
+		return NULL;
+	}
+
+	/* get the image-list path and open it */
+	sprintf(buffer, "%s%s", dir, IMAGE_LIST);
+	list->list_fp = fopen(buffer, "rb");
+	if (!list->list_fp) {
+		free(list);
+		return NULL;
+	}
+	list->dir = dir;
+	list->manifest = m;
+	list->shard = shard;
+	list->shards = shards;
+	list->dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+	sprintf(buffer, "%s%s", dir, OLD_IMAGE_DIR);
+	list->out_fd = open(buffer, O_RDONLY | O_DIRECTORY);
+	atomic_init(&list->skipped, 0);
+	pthread_mutex_init(&list->lock, NULL);
+	pthread_cond_init(&list->grown, NULL);
+
+	list->watch_fd = -1;
+	list->signal_fd = -1;
+#ifdef __linux__
+	if (watch) {
+		sigset_t signals;
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGINT);
+		sigaddset(&signals, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &signals, NULL);
+		list->signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+		list->watch_fd = inotify_init1(IN_CLOEXEC);
+		if (list->watch_fd >= 0 && (list->signal_fd < 0
+			|| inotify_add_watch(list->watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)) {
+			close(list->watch_fd);
+			list->watch_fd = -1;
+		}
+	}
+#else
+	(void) watch;
+#endif
+
+	if (pthread_create(&list->thread, NULL, file_list_thread, list) != 0) {
+		file_list_thread(list);
+		list->joined = 1;
+	}
+	return list;
+}
+
+/******************************************************************************
+ * file_list_get()
+ *
+ * Arguments: list - pointer to the list
+ *            i - index of the entry
+ * Returns: (char *) path of entry i, NULL if the list has fewer entries
+ * Side-Effects: none
+ *
+ * Description: gets an entry, waiting for it to be read if needed
+ *
+ *****************************************************************************/
+char *file_list_get(fileList *list, int i){
+
+	char *name = NULL;
+
+	pthread_mutex_lock(&list->lock);
+	while (i >= list->count && !list->done) {
+		pthread_cond_wait(&list->grown, &list->lock);
+	}
+	if (i < list->count) name = list->names[i];
+	pthread_mutex_unlock(&list->lock);
+
+	return name;
+}
+
+/******************************************************************************
+ * file_list_peek()
+ *
+ * Arguments: list - pointer to the list
+ *            i - index of the entry
+ * Returns: (char *) path of entry i, NULL if it wasn't read (yet)
+ * Side-Effects: none
+ *
+ * Description: gets an entry without waiting
+ *
+ *****************************************************************************/
+char *file_list_peek(fileList *list, int i){
+
+	char *name = NULL;
+
+	pthread_mutex_lock(&list->lock);
+	if (i < list->count) name = list->names[i];
+	pthread_mutex_unlock(&list->lock);
+
+	return name;
+}
+
+/******************************************************************************
+ * file_list_arrival()
+ *
+ * Arguments: list - pointer to the list
+ *            i - index of the entry
+ * Returns: (long long) when entry i showed up in the directory
+ *          (CLOCK_MONOTONIC, in ns), 0 if it came from image-list.txt
+ * Side-Effects: none
+ *
+ * Description: arrival time of a watched entry, to measure its latency
+ *
+ *****************************************************************************/
+long long file_list_arrival(fileList *list, int i){
+
+	long long arrived = 0;
+
+	pthread_mutex_lock(&list->lock);
+	if (i < list->count) arrived = list->arrived[i];
+	pthread_mutex_unlock(&list->lock);
+
+	return arrived;
+}
+
+/******************************************************************************
+ * file_list_done()
+ *
+ * Arguments: list - pointer to the list
+ *            i - index of an entry taken with file_list_get()
+ * Returns: (void)
+ * Side-Effects: may append the entry's name again
+ *
+ * Description: tells the list entry i is finished with (written, failed or
+ * 				skipped), so the same name can be listed again. Calling it
+ * 				twice does nothing. If the file showed up again in the
+ * 				directory meanwhile, it's appended again for
+ * 				file_list_check() to decide if it needs work.
+ *
+ *****************************************************************************/
+void file_list_done(fileList *list, int i){
+
+	char *name = NULL;
+	long long again = 0;
+	size_t slot;
+
+	pthread_mutex_lock(&list->lock);
+	if (list->seen != NULL && i >= 0 && i < list->count) {
+		slot = file_list_slot(list, list->names[i]);
+		if (list->seen[slot] == i + 1) {
+			again = list->again[slot];
+			file_list_unsee(list, slot);
+			if (again > 0) name = strdup(list->names[i]);
+		}
+	}
+	pthread_mutex_unlock(&list->lock);
+
+	if (name != NULL) file_list_add(list, name, again, 1);
+}
+
+/******************************************************************************
+ * file_list_count()
+ *
+ * Arguments: list - pointer to the list
+ * Returns: (int) number of entries read so far
+ * Side-Effects: none
+ *
+ * Description: entries read so far (all of them once the list is done)
+ *
+ *****************************************************************************/
+int file_list_count(fileList *list){
+
+	int count;
+
+	pthread_mutex_lock(&list->lock);
+	count = list->count;
+	pthread_mutex_unlock(&list->lock);
+
+	return count;
+}
+
+/******************************************************************************
+ * file_list_check()
+ *
+ * Arguments: list - pointer to the list
+ *            file_name - path of an entry
+ * Returns: (bool) 1 if the entry is to be processed
+ * Side-Effects: prints why an entry is skipped
+ *
+ * Description: an entry is skipped if its output (see output_name())
+ * 				already exists, if it doesn't exist or if its first bytes
+ * 				aren't those of an image read_image_file_pool() decodes,
+ * 				whatever its name. With a manifest, an
+ * 				existing output only counts if the manifest says the input
+ * 				is the one it was made from; otherwise (changed input, or an
+ * 				output no run finished) it's made again. Uses fstatat()
+ * 				relative to the directories, so each check is two lookups of
+ * 				a name instead of two walks of the whole path.
+ *
+ *****************************************************************************/
+int file_list_check(fileList *list, const char *file_name){
+
+	const char *img = file_name + strlen(list->dir) + 1;
+	char out[strlen(img) + 8];
+	struct stat st;
+	int found;
+
+	if (list->checked) return 1;
+
+	/* check out file existence */
+	strcpy(out, img);
+	output_name(out, sizeof(out));
+	if (list->out_fd >= 0 && fstatat(list->out_fd, out, &st, 0) == 0) {
+		found = 1;
+		if (list->manifest != NULL && fstatat(list->dir_fd, img, &st, 0) == 0
+			&& !manifest_unchanged(list->manifest, img, file_name, &st)) {
+			fprintf(stdout, "Changed file:\t%s\n", file_name);
+			found = 0;
+		}
+		if (found) {
+			fprintf(stdout, "Found file:\t%s%s/%s\n", list->dir, OLD_IMAGE_DIR, out);
+			atomic_fetch_add(&list->skipped, 1);
+			return 0;
+		}
+	}
+
+	/* check if file exists */
+	if (fstatat(list->dir_fd, img, &st, 0) != 0) {
+		fprintf(stdout, "Not able to locate - %s\n", file_name);
+		atomic_fetch_add(&list->skipped, 1);
+		return 0;
+	}
+
+	/* check the format by the first bytes */
+	if (read_file_format(list->dir_fd, img) == FORMAT_UNKNOWN) {
+		fprintf(stdout, "Not a JPEG, PNG, WebP or HEIF image - %s\n", file_name);
+		atomic_fetch_add(&list->skipped, 1);
+		return 0;
+	}
+
+	return 1;
+}
+
+/******************************************************************************
+ * file_list_filter()
+ *
+ * Arguments: list - pointer to the list
+ *            mode - order for sortFiles()
+ * Returns: (void)
+ * Side-Effects: reorders the list
+ *
+ * Description: waits for the whole list, drops the entries
+ * 				file_list_check() turns down and sorts the rest. Needed
+ * 				before sorting, as it takes every entry to sort.
+ *
+ *****************************************************************************/
+void file_list_filter(fileList *list, int mode){
+
+	int n = 0;
+
+	if (!list->joined) {
+		pthread_join(list->thread, NULL);
+		list->joined = 1;
+	}
+
+	for (int i = 0; i < list->count; i++) {
+		if (file_list_check(list, list->names[i])) {
+			list->arrived[n] = list->arrived[i];
+			list->names[n++] = list->names[i];
+		} else {
+			free(list->names[i]);
+		}
+	}
+	list->count = n;
+	list->checked = 1;
+
+	sortFiles(list->names, list->count, mode);
+	file_list_reseen(list);
+}
+
+/* a file of the list and its size, for file_list_balance() */
+typedef struct {
+
+	char *name;
+	long long size;
+	int index;
+
+} shardKey;
+
+/* largest first, ties by name so every process gets the same order */
+static int cmpShardKey(const void *a, const void *b) {
+
+	const shardKey *ka = (const shardKey *) a;
+	const shardKey *kb = (const shardKey *) b;
+
+	if (ka->size != kb->size) return (ka->size < kb->size) ? 1 : -1;
+	return strcmp(ka->name, kb->name);
+}
+
+/******************************************************************************
+ * file_list_balance()
+ *
+ * Arguments: list - pointer to the list (opened with all the entries)
+ *            shard - this process' share (0 to shards - 1)
+ *            shards - processes the list is split across
+ * Returns: (bool) 1 in case of success, 0 if out of memory
+ * Side-Effects: drops the entries of the other shares
+ *
+ * Description: waits for the whole list and splits it by file size: the
+ * 				largest file first, each to the share with the fewest bytes
+ * 				so far (a missing file counts as empty). Keeps the order of
+ * 				the list for its own share.
+ *
+ *****************************************************************************/
+int file_list_balance(fileList *list, int shard, int shards){
+
+	const char *img;
+	long long *bytes;
+	shardKey *keys;
+	char *mine;
+	struct stat st;
+	int n = 0;
+
+	if (!list->joined) {
+		pthread_join(list->thread, NULL);
+		list->joined = 1;
+	}
+	if (shards <= 1 || list->count == 0) return 1;
+
+	keys = (shardKey *) malloc(list->count * sizeof(shardKey));
+	bytes = (long long *) calloc(shards, sizeof(long long));
+	mine = (char *) calloc(list->count, 1);
+	if (!keys || !bytes || !mine) {
+		free(keys);
+		free(bytes);
+		free(mine);
+		return 0;
+	}
+
+	for (int i = 0; i < list->count; i++) {
+		img = list->names[i] + strlen(list->dir) + 1;
+		keys[i].name = list->names[i];
+		keys[i].size = (fstatat(list->dir_fd, img, &st, 0) == 0) ? st.st_size : 0;
+		keys[i].index = i;
+	}
+	qsort(keys, list->count, sizeof(shardKey), cmpShardKey);
+
+	for (int i = 0; i < list->count; i++) {
+		int least = 0;
+		for (int k = 1; k < shards; k++) {
+			if (bytes[k] < bytes[least]) least = k;
+		}
+		bytes[least] += keys[i].size;
+		mine[keys[i].index] = (least == shard);
+	}
+
+	for (int i = 0; i < list->count; i++) {
+		if (mine[i]) {
+			list->arrived[n] = list->arrived[i];
+			list->names[n++] = list->names[i];
+		} else {
+			free(list->names[i]);
+		}
+	}
+	list->count = n;
+	file_list_reseen(list);
+
+	free(keys);
+	free(bytes);
+	free(mine);
+	return 1;
+}
+
+/******************************************************************************
+ * file_list_destroy()
+ *
+ * Arguments: list - pointer to the list
+ * Returns: (void)
+ * Side-Effects: waits for the list thread
+ *
+ * Description: frees the list and every entry
+ *
+ *****************************************************************************/
+void file_list_destroy(fileList *list){
+
+	if (!list->joined) {
+		pthread_join(list->thread, NULL);
+	}
+	destroyFiles(list->names, list->count);
+	free(list->arrived);
+	free(list->seen);
+	free(list->again);
+	fclose(list->list_fp);
+	if (list->watch_fd >= 0) close(list->watch_fd);
+	if (list->signal_fd >= 0) close(list->signal_fd);
+	if (list->dir_fd >= 0) close(list->dir_fd);
+	if (list->out_fd >= 0) close(list->out_fd);
+	pthread_mutex_destroy(&list->lock);
+	pthread_cond_destroy(&list->grown);
+	free(list);
 }
 
 /******************************************************************************
@@ -457,7 +6248,8 @@ int isDirExists(const char *dirname) {
 
 	DIR * aux = opendir(dirname);
 
-	if (ENOENT == errno) {
+	/* errno may be left over from before: only a NULL says it failed */
+	if (aux == NULL) {
 		return 0;
 	}
 	closedir(aux);
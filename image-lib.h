@@ -1,4 +1,8 @@
 #include "gd.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/stat.h>
 
 
 /******************************************************************************
@@ -16,120 +20,1530 @@ gdImagePtr  texture_image(gdImagePtr in_img, gdImagePtr watermark);
 
 
 
+/* smoothing accepted by smooth_select() */
+#define SMOOTH_FAST	0
+#define SMOOTH_GD	1
+
+/******************************************************************************
+ * smooth_select()
+ *
+ * Arguments: mode - SMOOTH_FAST or SMOOTH_GD
+ * Returns: (void)
+ * Side-Effects: must be called before any thread is filtering
+ *
+ * Description: chooses between the dedicated smoothing kernel (default) and
+ * 				gdImageSmooth(). With SMOOTH_GD the old photo filter goes
+ * 				through the stage chain.
+ *
+ *****************************************************************************/
+void smooth_select(int mode);
+
+/******************************************************************************
+ * copy_image_attributes()
+ *
+ * Arguments: out_img - image made from in_img
+ *            in_img - image it was made from
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: alpha flags, resolution and interlacing of in_img, for an
+ * 				image filtered into a new one instead of a gdImageClone()
+ *
+ *****************************************************************************/
+void copy_image_attributes(gdImagePtr out_img, gdImagePtr in_img);
+
+/******************************************************************************
+ * smooth_image()
+ *
+ * Arguments: in - pointer to image
+ * Returns: out - pointer to smoother image, or NULL in case of failure
+ * Side-Effects: none
+ *
+ * Description: creates clone of image smoother
+ *
+ *****************************************************************************/
+gdImagePtr  smooth_image(gdImagePtr in_img);
+
+/******************************************************************************
+ * sepia_image()
+ *
+ * Arguments: in - pointer to image
+ * Returns: out - pointer to sepia image, or NULL in case of failure
+ * Side-Effects: none
+ *
+ * Description: creates clone of image but with sepia color
+ *
+ *****************************************************************************/
+gdImagePtr  sepia_image(gdImagePtr in_img);
+
+
+/******************************************************************************
+ * contrast_image()
+ *
+ * Arguments: in - pointer to image
+ * Returns: out - pointer to transformed image, or NULL in case of failure
+ * Side-Effects: none
+ *
+ * Description: creates clone of image but its contrast reduced
+ *
+ *****************************************************************************/
+gdImagePtr  contrast_image(gdImagePtr in_img);
+
+
+/* point operations one colorMap can compose */
+#define COLOR_MAP_STEPS 4
+
+/******************************************************************************
+ * struct colorMap
+ *
+ * Atributes:	lut - 		value of each red, green and blue value after
+ * 							every operation (opaque pixels)
+ * 				step - 		table of each operation (other pixels)
+ * 				steps - 	number of operations
+ *
+ * Description: point-wise colour operations (contrast, color shift, ...)
+ * 				composed into one lookup per channel
+ *
+ *****************************************************************************/
+typedef struct {
+
+	unsigned char lut[3][256];
+	unsigned char step[COLOR_MAP_STEPS][3][256];
+	int steps;
+
+} colorMap;
+
+/******************************************************************************
+ * color_map_init()
+ *
+ * Arguments: map - map to start
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: starts a map with no operations
+ *
+ *****************************************************************************/
+void color_map_init(colorMap *map);
+
+/******************************************************************************
+ * color_map_table()
+ *
+ * Arguments: map - map to add to
+ *            table - value of each red, green and blue value after the
+ *                    operation
+ * Returns: (bool) 1 in case of success, 0 if map is full
+ * Side-Effects: none
+ *
+ * Description: adds any point operation, given as its table, after the
+ * 				ones in map
+ *
+ *****************************************************************************/
+int color_map_table(colorMap *map, const unsigned char table[3][256]);
+
+/******************************************************************************
+ * color_map_contrast()
+ *
+ * Arguments: map - map to add to
+ *            contrast - contrast level as given to gdImageContrast()
+ * Returns: (bool) 1 in case of success, 0 if map is full
+ * Side-Effects: none
+ *
+ * Description: adds the gdImageContrast() operation
+ *
+ *****************************************************************************/
+int color_map_contrast(colorMap *map, double contrast);
+
+/******************************************************************************
+ * color_map_shift()
+ *
+ * Arguments: map - map to add to
+ *            red, green, blue - added to each channel
+ * Returns: (bool) 1 in case of success, 0 if map is full
+ * Side-Effects: none
+ *
+ * Description: adds the gdImageColor() operation (with alpha 0)
+ *
+ *****************************************************************************/
+int color_map_shift(colorMap *map, int red, int green, int blue);
+
+/******************************************************************************
+ * color_map_row()
+ *
+ * Arguments: map - map to apply
+ *            src - row of truecolor pixels
+ *            dst - row where the result is stored (may be src)
+ *            width - number of pixels in the row
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: applies every operation of map to one row, with the same
+ * 				result as drawing each one in turn with gd
+ *
+ *****************************************************************************/
+void color_map_row(const colorMap *map, const int *src, int *dst, int width);
+
+
+/* stages a pipeline may have */
+#define PIPELINE_STAGES 16
+
+/******************************************************************************
+ * pipeline_set()
+ *
+ * Arguments: description - stages of the filter, in order, separated by
+ *                          commas or blanks, each as name=arguments:
+ *                            contrast=<level>      gdImageContrast()
+ *                            brightness=<n>        gdImageBrightness()
+ *                            sepia=<red>:<green>:<blue>  gdImageColor()
+ *                            smooth=<weight>       gdImageSmooth()
+ *                            texture               the paper texture
+ *                          and quality=<1..100> for the JPEG outputs
+ *                          (as --output-format jpeg:<quality>; kept as it
+ *                          was if not given).
+ *                          contrast, sepia and smooth without arguments
+ *                          take the ones of the old photo filter, the
+ *                          default pipeline:
+ *                          contrast=-20,smooth=20,texture,sepia=100:60:0,quality=70
+ * Returns: (bool) 1 in case of success, 0 if description is wrong (a
+ *          message is printed and the pipeline is left as it was)
+ * Side-Effects: must be called before simd_select() and before any thread
+ *               is filtering
+ *
+ * Description: sets the stages of the filter. simd_select() compiles them
+ * 				for the fused filter: point stages next to each other are
+ * 				composed into one table (see colorMap), and the old photo
+ * 				filter (and any pipeline with one smoothing at most) runs in
+ * 				the fused pass with the specialized kernels. Pipelines that
+ * 				smooth more than once go through gd stage by stage.
+ *
+ *****************************************************************************/
+int pipeline_set(const char *description);
+
+/******************************************************************************
+ * pipeline_load()
+ *
+ * Arguments: file_name - file with a pipeline description
+ * Returns: (bool) 1 in case of success, 0 in case of failure
+ * Side-Effects: as pipeline_set()
+ *
+ * Description: pipeline_set() with a description read from a file (one
+ * 				stage per line, '#' starts a comment)
+ *
+ *****************************************************************************/
+int pipeline_load(const char *file_name);
+
+/******************************************************************************
+ * pipeline_fused()
+ *
+ * Arguments: (none)
+ * Returns: (bool) 1 if old_photo_filter_rows() can run the pipeline (one
+ *          smoothing at most), 0 if it goes through gd stage by stage
+ * Side-Effects: none
+ *
+ * Description: tells whether images may be split in bands
+ *
+ *****************************************************************************/
+int pipeline_fused(void);
+
+/******************************************************************************
+ * pipeline_describe()
+ *
+ * Arguments: buffer - where the description is stored
+ *            len - size of buffer
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: describes the pipeline in use as pipeline_set() takes it,
+ * 				for reports
+ *
+ *****************************************************************************/
+void pipeline_describe(char *buffer, size_t len);
+
+
+/* instruction sets accepted by simd_select() */
+#define SIMD_AUTO	-1
+#define SIMD_SCALAR	0
+#define SIMD_SSE4	1
+#define SIMD_AVX2	2
+
+/******************************************************************************
+ * simd_select()
+ *
+ * Arguments: level - SIMD_AUTO, SIMD_SCALAR, SIMD_SSE4 or SIMD_AVX2
+ * Returns: (int) the level in use: the one asked for, or the best one the
+ *          CPU supports if it doesn't support it (or for SIMD_AUTO)
+ * Side-Effects: changes the kernels used by the old photo filter, must be
+ *               called before any thread is filtering
+ *
+ * Description: picks the row kernels of the old photo filter (contrast,
+ * 				texture blend, colour shift and smoothing) by CPU feature,
+ * 				and compiles the pipeline with them. Every level gives the
+ * 				same output. If never called, SIMD_AUTO is used.
+ *
+ *****************************************************************************/
+int simd_select(int level);
+
+/******************************************************************************
+ * simd_name()
+ *
+ * Arguments: (none)
+ * Returns: (const char *) name of the kernels in use
+ * Side-Effects: none
+ *
+ * Description: name of the kernels picked by simd_select(), for reports
+ *
+ *****************************************************************************/
+const char *simd_name(void);
+
+/* buffers kept by each imagePool (decoded and filtered image in flight) */
+#define POOL_BUFFERS 4
+
+/******************************************************************************
+ * struct poolBuffer
+ *
+ * Atributes:	mem - 		pixel memory (mmap'ed)
+ * 				capacity - 	size of mem in bytes
+ * 				huge - 		set if mem is backed by explicit huge pages
+ * 				rows - 		row pointers into mem, used as img.tpixels
+ * 				nn_rows - 	number of row pointers allocated
+ * 				in_use - 	set while img is given out
+ * 				img - 		the gdImage handed out, pixels in mem
+ *
+ * Description: one reusable pixel buffer of an imagePool
+ *
+ *****************************************************************************/
+typedef struct {
+
+	void *mem;
+	size_t capacity;
+	int huge;
+	int **rows;
+	int nn_rows;
+	int in_use;
+	gdImage img;
+
+} poolBuffer;
+
+/******************************************************************************
+ * struct imagePool
+ *
+ * Atributes:	buffers - 		the pixel buffers
+ * 				hugepages - 	back buffers with huge pages
+ * 				bytes - 		memory currently held by the buffers
+ * 				high_water - 	most memory ever held by the buffers
+ * 				in_use_high - 	most buffers given out at the same time
+ * 				allocs - 		times a buffer had to be (re)allocated
+ * 				reuses - 		times a buffer was reused as it was
+ * 				fallbacks - 	images that didn't fit in the pool
+ *
+ * Description: per thread pool of truecolor images. Buffers grow to the
+ * 				largest image seen and are then reused for every image, so a
+ * 				thread doesn't mmap/munmap (and page fault) full size images
+ * 				for each file. Not thread safe: one pool per thread.
+ *
+ *****************************************************************************/
+typedef struct {
+
+	poolBuffer buffers[POOL_BUFFERS];
+	int hugepages;
+	size_t bytes;
+	size_t high_water;
+	int in_use;
+	int in_use_high;
+	long allocs;
+	long reuses;
+	long fallbacks;
+
+} imagePool;
+
+/******************************************************************************
+ * pool_create()
+ *
+ * Arguments: hugepages - 1 to back the buffers with huge pages
+ * Returns: pool - pointer to the new pool, or NULL in case of failure
+ * Side-Effects: none
+ *
+ * Description: creates an empty pool of image buffers
+ *
+ *****************************************************************************/
+imagePool *pool_create(int hugepages);
+
+/******************************************************************************
+ * pool_image_create()
+ *
+ * Arguments: pool - pointer to the pool (may be NULL)
+ *            sx, sy - size of the image
+ * Returns: img - truecolor image, or NULL in case of failure
+ * Side-Effects: none
+ *
+ * Description: gives an uninitialized truecolor image with its pixels in a
+ * 				buffer of the pool, or from gdImageCreateTrueColor() if
+ * 				there is no pool or every buffer is in use. Free it with
+ * 				pool_image_destroy(), never gdImageDestroy().
+ *
+ *****************************************************************************/
+gdImagePtr pool_image_create(imagePool *pool, int sx, int sy);
+
+/******************************************************************************
+ * pool_image_destroy()
+ *
+ * Arguments: pool - pointer to the pool (may be NULL)
+ *            img - image from pool_image_create() or any gd image
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: gives the buffer of img back to the pool, or destroys img if
+ * 				it isn't from the pool
+ *
+ *****************************************************************************/
+void pool_image_destroy(imagePool *pool, gdImagePtr img);
+
+/******************************************************************************
+ * pool_trim()
+ *
+ * Arguments: pool - pointer to the pool (may be NULL)
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: gives the memory of every free buffer back to the system
+ * 				(with a memory budget, so what's resident follows what's
+ * 				reserved)
+ *
+ *****************************************************************************/
+void pool_trim(imagePool *pool);
+
+/******************************************************************************
+ * pool_destroy()
+ *
+ * Arguments: pool - pointer to the pool
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: frees every buffer and the pool
+ *
+ *****************************************************************************/
+void pool_destroy(imagePool *pool);
+
+/******************************************************************************
+ * struct mappedFile
+ *
+ * Atributes:	data - 		the file contents, mapped read only
+ * 				size - 		size of the file in bytes
+ *
+ * Description: an input file memory-mapped by map_file()
+ *
+ *****************************************************************************/
+typedef struct {
+
+	const unsigned char *data;
+	size_t size;
+
+} mappedFile;
+
+/* stages of an image, timed in a stageTimes */
+#define STAGE_READ		0
+#define STAGE_DECODE	1
+#define STAGE_CONTRAST	2
+#define STAGE_SMOOTH	3
+#define STAGE_TEXTURE	4
+#define STAGE_SEPIA		5
+#define STAGE_ENCODE	6
+#define STAGE_WRITE		7
+#define STAGES			8
+
+/* hardware counters of each stage (see perf_open()) */
+#define PERF_CYCLES			0
+#define PERF_INSTRUCTIONS	1
+#define PERF_LLC_MISSES		2
+#define PERF_BRANCH_MISSES	3
+#define PERF_COUNTERS		4
+
+/******************************************************************************
+ * struct stageTimes
+ *
+ * Atributes:	ns - 		time in each stage (nanoseconds)
+ * 				events - 	hardware counters in each stage (0 without
+ * 							perf_open())
+ *
+ * Description: where the time an image takes in each stage is added. The
+ * 				fused filter does contrast, smoothing, texture and sepia row
+ * 				by row, so those are the sum over the rows.
+ *
+ *****************************************************************************/
+typedef struct {
+
+	long long ns[STAGES];
+	long long events[STAGES][PERF_COUNTERS];
+
+} stageTimes;
+
+/******************************************************************************
+ * stage_sink()
+ *
+ * Arguments: sink - where the stages the calling thread goes through are
+ *                   added from now on, NULL to stop
+ * Returns: (stageTimes *) the previous sink of the thread
+ * Side-Effects: none
+ *
+ * Description: sets where the calling thread adds its stage times. Only the
+ *              stages of a thread with a sink are timed row by row, so
+ *              without one the filter runs untouched.
+ *
+ *****************************************************************************/
+stageTimes *stage_sink(stageTimes *sink);
+
+/******************************************************************************
+ * stage_clock()
+ *
+ * Arguments: (none)
+ * Returns: (long long) CLOCK_MONOTONIC in nanoseconds
+ * Side-Effects: none
+ *
+ * Description: the clock stage times are measured with
+ *
+ *****************************************************************************/
+long long stage_clock(void);
+
+/******************************************************************************
+ * stage_add()
+ *
+ * Arguments: stage - STAGE_*
+ *            start - stage_clock() when the stage started
+ * Returns: (long long) stage_clock() now, the start of the next stage
+ * Side-Effects: none
+ *
+ * Description: adds the time since start to the sink of the calling
+ *              thread, if it has one, and to the trace
+ *
+ *****************************************************************************/
+long long stage_add(int stage, long long start);
+
+/******************************************************************************
+ * stage_name()
+ *
+ * Arguments: stage - STAGE_*
+ * Returns: (const char *) name of the stage
+ * Side-Effects: none
+ *
+ * Description: names of the stages for reports
+ *
+ *****************************************************************************/
+const char *stage_name(int stage);
+
+/******************************************************************************
+ * perf_open()
+ *
+ * Arguments: (none)
+ * Returns: (int) bit c set for each PERF_* counter open, 0 if none (errno
+ *          tells why)
+ * Side-Effects: none
+ *
+ * Description: opens the hardware counters (cycles, instructions, LLC misses,
+ * 				branch misses) of the calling thread with perf_event_open().
+ * 				Every stage of the thread with a sink gets them from then on.
+ * 				Counters the machine doesn't have (or perf_event_paranoid
+ * 				doesn't allow) are left out.
+ *
+ *****************************************************************************/
+int perf_open(void);
+
+/******************************************************************************
+ * perf_close()
+ *
+ * Arguments: (none)
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: closes the counters of the calling thread, if open
+ *
+ *****************************************************************************/
+void perf_close(void);
+
+/******************************************************************************
+ * perf_name()
+ *
+ * Arguments: counter - PERF_*
+ * Returns: (const char *) name of the counter
+ * Side-Effects: none
+ *
+ * Description: names of the counters for reports
+ *
+ *****************************************************************************/
+const char *perf_name(int counter);
+
+/******************************************************************************
+ * trace_start()
+ *
+ * Arguments: events - events kept per thread (the latest ones)
+ * Returns: (void)
+ * Side-Effects: must be called before the threads are created
+ *
+ * Description: starts recording trace events in every thread. Each thread
+ * 				records into a ring of its own, without locks; nothing is
+ * 				written before trace_write().
+ *
+ *****************************************************************************/
+void trace_start(unsigned events);
+
+/******************************************************************************
+ * trace_thread()
+ *
+ * Arguments: name - name of the calling thread in the trace
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: names the calling thread (only when tracing)
+ *
+ *****************************************************************************/
+void trace_thread(const char *name);
+
+/******************************************************************************
+ * trace_detail()
+ *
+ * Arguments: detail - file the calling thread is on (NULL: none)
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: the events of the calling thread carry detail from now on
+ *
+ *****************************************************************************/
+void trace_detail(const char *detail);
+
+/******************************************************************************
+ * trace_event()
+ *
+ * Arguments: name - what happened (a string that lives until trace_write())
+ *            start, end - when (stage_clock())
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: records an event of the calling thread, if tracing. Every
+ * 				stage_add() is one too.
+ *
+ *****************************************************************************/
+void trace_event(const char *name, long long start, long long end);
+
+/******************************************************************************
+ * trace_write()
+ *
+ * Arguments: file_name - where to write the trace
+ * Returns: (bool) 1 in case of success, 0 otherwise
+ * Side-Effects: the threads must be done with their events
+ *
+ * Description: writes the events of every thread in the Chrome trace event
+ * 				format, for chrome://tracing or ui.perfetto.dev
+ *
+ *****************************************************************************/
+int trace_write(const char *file_name);
+
+/******************************************************************************
+ * struct readStats
+ *
+ * Atributes:	bytes - 	bytes of input read
+ * 				read_ns - 	time getting the files into memory (nanoseconds)
+ * 				decode_ns - time decoding them (nanoseconds)
+ * 				identify - 	set to hash every file as it is read
+ * 				hash, size, mtime - 	XXH64, size and modification time of
+ * 							the last file read (with identify), the
+ * 							input as it was decoded, for the manifest
+ *
+ * Description: input counters kept by each thread, so reading the files and
+ * 				decoding them are measured apart
+ *
+ *****************************************************************************/
+typedef struct {
+
+	long long bytes;
+	long long read_ns;
+	long long decode_ns;
+	int identify;
+	uint64_t hash;
+	long long size;
+	struct timespec mtime;
+
+} readStats;
+
+/******************************************************************************
+ * map_file()
+ *
+ * Arguments: file_name - name of the file
+ *            map - where the mapping is stored
+ *            stats - where bytes and read time are added (may be NULL)
+ * Returns: (bool) 1 in case of success, 0 in case of failure
+ * Side-Effects: none
+ *
+ * Description: memory-maps a file for sequential reading and faults every
+ * 				page in, so the time to read it is counted here and not in
+ * 				the decoder
+ *
+ *****************************************************************************/
+int map_file(const char *file_name, mappedFile *map, readStats *stats);
+
+/******************************************************************************
+ * unmap_file()
+ *
+ * Arguments: map - mapping from map_file()
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: unmaps a file mapped by map_file()
+ *
+ *****************************************************************************/
+void unmap_file(mappedFile *map);
+
+/******************************************************************************
+ * prefetch_file()
+ *
+ * Arguments: file_name - name of the file
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: asks the kernel to start reading a file that will be needed
+ * 				soon (madvise(MADV_WILLNEED)), without waiting for it
+ *
+ *****************************************************************************/
+void prefetch_file(const char *file_name);
+
+/******************************************************************************
+ * old_photo_filter_rows()
+ *
+ * Arguments: in - pointer to image (truecolor)
+ *            texture - pointer to texture image, already at the image size
+ *            out - pointer to truecolor image of the same size as in
+ *            y0, y1 - rows to filter, from y0 to y1 (excluding)
+ * Returns: (bool) 1 in case of success, 0 in case of failure
+ * Side-Effects: writes rows y0 to y1 of out
+ *
+ * Description: the fused old photo filter for a band of rows; bands can be
+ * 				filtered by different threads and match the whole image
+ *
+ *****************************************************************************/
+int old_photo_filter_rows(gdImagePtr in_img, gdImagePtr texture, gdImagePtr out_img, int y0, int y1);
+
+/******************************************************************************
+ * old_photo_filter()
+ *
+ * Arguments: in - pointer to image
+ *            texture - pointer to texture image
+ *            pool - pool to take the output image from (may be NULL)
+ * Returns: out - pointer to image with the old photo filter applied, or NULL
+ *                in case of failure
+ * Side-Effects: none
+ *
+ * Description: single pass equivalent of contrast_image(), smooth_image(),
+ * 				texture_image() and sepia_image() applied in this order.
+ * 				Output is identical to the chain (tolerance 0 per channel).
+ * 				Free it with pool_image_destroy().
+ *
+ *****************************************************************************/
+gdImagePtr  old_photo_filter(gdImagePtr in_img, gdImagePtr texture, imagePool *pool);
+
+/******************************************************************************
+ * old_photo_filter_stream()
+ *
+ * Arguments: in_file - name of the JPEG file to filter
+ *            out_file - name of the JPEG file to write
+ *            texture - pointer to texture image (full size)
+ *            peak - where the bytes of row buffers used are stored (or NULL)
+ *            stats - where input bytes and read time are added (may be NULL)
+ * Returns: 1 in case of success, 0 in case of failure, -1 if the file can't be
+ *          streamed (CMYK JPEG, SMOOTH_GD, or bigger than
+ *          jpeg_max_dimension()) and nothing was written
+ * Side-Effects: writes out_file
+ *
+ * Description: decodes, filters and encodes in_file a band of scanlines at a
+ * 				time, so memory depends on the image width only. Same output
+ * 				as old_photo_filter() followed by write_jpeg_file().
+ *
+ *****************************************************************************/
+int old_photo_filter_stream(char *in_file, char *out_file, gdImagePtr texture, size_t *peak, readStats *stats);
+
+
+/******************************************************************************
+ * struct textureEntry
+ *
+ * Atributes:	width, height -	size the texture was scaled to
+ * 				img - 			scaled texture (NULL while being scaled)
+ * 				failed - 		set if scaling failed
+ * 				refs - 			number of threads holding it
+ * 				last_use - 		cache clock at the last lookup (for LRU)
+ * 				next - 			next entry in the cache
+ *
+ * Description: one scaled texture kept by a textureCache
+ *
+ *****************************************************************************/
+typedef struct textureEntry {
+
+	int width;
+	int height;
+	gdImagePtr img;
+	int failed;
+	int refs;
+	unsigned long last_use;
+	struct textureEntry *next;
+
+} textureEntry;
+
+/******************************************************************************
+ * struct textureCache
+ *
+ * Atributes:	texture - 		the original texture, only read
+ * 				entries - 		list of scaled textures
+ * 				nn_entries - 	number of entries
+ * 				max_entries - 	cap on the number of entries
+ * 				clock - 		counter of lookups, orders entries for LRU
+ * 				hits, misses, evictions - counters for the timing report
+ * 				lock, ready - 	protect the cache / wait for a texture
+ * 								being scaled by another thread
+ *
+ * Description: cache of the texture scaled to each image size, shared by all
+ * 				threads. Batches come from a few cameras, so a handful of
+ * 				sizes cover most images and each one is scaled only once.
+ *
+ *****************************************************************************/
+typedef struct {
+
+	gdImagePtr texture;
+	textureEntry *entries;
+	int nn_entries;
+	int max_entries;
+	unsigned long clock;
+	long hits;
+	long misses;
+	long evictions;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+
+} textureCache;
+
+/******************************************************************************
+ * texture_cache_create()
+ *
+ * Arguments: texture - pointer to texture image (full size)
+ *            max_entries - how many scaled textures may be kept
+ * Returns: cache - pointer to the new cache, or NULL in case of failure
+ * Side-Effects: sets the interpolation method of texture
+ *
+ * Description: creates an empty cache of textures scaled to image sizes
+ *
+ *****************************************************************************/
+textureCache *texture_cache_create(gdImagePtr texture, int max_entries);
+
+/******************************************************************************
+ * texture_cache_get()
+ *
+ * Arguments: cache - pointer to the cache
+ *            width, height - size of the image the texture is for
+ * Returns: scaled - texture scaled to width x height, or NULL in case of
+ *                   failure
+ * Side-Effects: the returned texture is held until texture_cache_release()
+ *
+ * Description: looks up (or scales and adds) the texture for the given size,
+ * 				evicting the least recently used one if the cache is full
+ *
+ *****************************************************************************/
+gdImagePtr texture_cache_get(textureCache *cache, int width, int height);
+
+/******************************************************************************
+ * texture_cache_release()
+ *
+ * Arguments: cache - pointer to the cache
+ *            scaled - texture returned by texture_cache_get()
+ * Returns: (void)
+ * Side-Effects: the texture may be evicted after this
+ *
+ * Description: gives back a texture taken with texture_cache_get()
+ *
+ *****************************************************************************/
+void texture_cache_release(textureCache *cache, gdImagePtr scaled);
+
+/******************************************************************************
+ * texture_cache_destroy()
+ *
+ * Arguments: cache - pointer to the cache
+ * Returns: (void)
+ * Side-Effects: frees every scaled texture (not the original texture)
+ *
+ * Description: frees the cache, no thread may be using it
+ *
+ *****************************************************************************/
+void texture_cache_destroy(textureCache *cache);
+
+/******************************************************************************
+ * struct workQueue
+ *
+ * Atributes:	cells - 		ring of slots, each with a sequence number
+ * 				mask - 			number of slots - 1 (a power of two)
+ * 				head, tail - 	next slot to push to / pop from
+ * 				closed - 		set when nothing else will be pushed
+ * 				pushes, depth_sum, max_depth - queue depth seen at each push
+ *
+ * Description: bounded lock-free queue of pointers, for any number of threads
+ * 				pushing and popping (one sequence number per slot tells whose
+ * 				turn it is, as in D. Vyukov's MPMC queue)
+ *
+ *****************************************************************************/
+typedef struct {
+
+	atomic_size_t seq;
+	void *data;
+
+} queueCell;
+
+typedef struct {
+
+	queueCell *cells;
+	size_t mask;
+	atomic_size_t head;
+	atomic_size_t tail;
+	atomic_int closed;
+	atomic_long pushes;
+	atomic_long depth_sum;
+	atomic_long max_depth;
+
+} workQueue;
+
+/******************************************************************************
+ * queue_create()
+ *
+ * Arguments: size - minimum number of slots (rounded up to a power of two)
+ * Returns: queue - pointer to the new queue, or NULL in case of failure
+ * Side-Effects: none
+ *
+ * Description: creates an empty queue
+ *
+ *****************************************************************************/
+workQueue *queue_create(int size);
+
+/******************************************************************************
+ * queue_push()
+ *
+ * Arguments: queue - pointer to the queue
+ *            data - pointer to be queued
+ *            stall_ns - where the time waiting for a free slot is added
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: pushes data, waiting while the queue is full
+ *
+ *****************************************************************************/
+void queue_push(workQueue *queue, void *data, long long *stall_ns);
+
+/******************************************************************************
+ * queue_pop()
+ *
+ * Arguments: queue - pointer to the queue
+ *            data - where the popped pointer is stored
+ *            stall_ns - where the time waiting for an item is added
+ * Returns: (bool) 1 if an item was popped, 0 if the queue is closed and empty
+ * Side-Effects: none
+ *
+ * Description: pops the oldest item, waiting while the queue is empty
+ *
+ *****************************************************************************/
+int queue_pop(workQueue *queue, void **data, long long *stall_ns);
+
+/******************************************************************************
+ * queue_close()
+ *
+ * Arguments: queue - pointer to the queue
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: marks that nothing else will be pushed, so queue_pop() returns
+ * 				0 once the queue is empty
+ *
+ *****************************************************************************/
+void queue_close(workQueue *queue);
+
+/******************************************************************************
+ * queue_destroy()
+ *
+ * Arguments: queue - pointer to the queue
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: frees the queue (not the items still in it)
+ *
+ *****************************************************************************/
+void queue_destroy(workQueue *queue);
+
+/******************************************************************************
+ * struct memBudget
+ *
+ * Atributes:	budget - 	memory the images in flight may take (bytes)
+ * 				reserved - 	memory reserved now
+ * 				peak - 		most memory reserved at once
+ * 				waiting - 	threads waiting for memory
+ * 				waits - 	reservations that had to wait
+ * 				wait_ns - 	time they waited
+ * 				lock, freed - 	protect the budget / signal a release
+ *
+ * Description: admission control: every image reserves an estimate of its
+ * 				memory (see filter_memory()) before it's started, and gives
+ * 				it back when it's done
+ *
+ *****************************************************************************/
+typedef struct {
+
+	size_t budget;
+	size_t reserved;
+	size_t peak;
+	int waiting;
+	long waits;
+	long long wait_ns;
+	pthread_mutex_t lock;
+	pthread_cond_t freed;
+
+} memBudget;
+
+/******************************************************************************
+ * mem_budget_create()
+ *
+ * Arguments: bytes - memory the images in flight may take
+ * Returns: budget - pointer to the new budget, or NULL in case of failure
+ * Side-Effects: none
+ *
+ * Description: creates a memory budget with nothing reserved
+ *
+ *****************************************************************************/
+memBudget *mem_budget_create(size_t bytes);
+
+/******************************************************************************
+ * mem_budget_try()
+ *
+ * Arguments: budget - pointer to the budget
+ *            bytes - memory to reserve
+ * Returns: (bool) 1 if bytes were reserved, 0 if they don't fit now (or a
+ *          thread is already waiting for memory)
+ * Side-Effects: none
+ *
+ * Description: reserves memory without waiting. A reservation bigger than
+ * 				the whole budget fits when nothing else is reserved.
+ *
+ *****************************************************************************/
+int mem_budget_try(memBudget *budget, size_t bytes);
+
+/******************************************************************************
+ * mem_budget_reserve()
+ *
+ * Arguments: budget - pointer to the budget
+ *            bytes - memory to reserve
+ *            wait_ns - where the time waiting is added (may be NULL)
+ * Returns: (void)
+ * Side-Effects: blocks until bytes fit
+ *
+ * Description: reserves memory, waiting for other reservations to be
+ * 				released if it doesn't fit
+ *
+ *****************************************************************************/
+void mem_budget_reserve(memBudget *budget, size_t bytes, long long *wait_ns);
+
+/******************************************************************************
+ * mem_budget_release()
+ *
+ * Arguments: budget - pointer to the budget
+ *            bytes - memory reserved before
+ * Returns: (void)
+ * Side-Effects: wakes up the threads waiting for memory
+ *
+ * Description: gives back a reservation
+ *
+ *****************************************************************************/
+void mem_budget_release(memBudget *budget, size_t bytes);
+
+/******************************************************************************
+ * mem_budget_destroy()
+ *
+ * Arguments: budget - pointer to the budget
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: frees the budget
+ *
+ *****************************************************************************/
+void mem_budget_destroy(memBudget *budget);
+
+/* how asyncWriter does the I/O */
+#define WRITER_URING	0
+#define WRITER_THREAD	1
+
+/******************************************************************************
+ * struct writeRequest
+ *
+ * Atributes:	path - 		name the file is written as (target + ".part")
+ * 				target - 	name it's renamed to once complete
+ * 				data, size - 	contents of the file (freed with gdFree())
+ * 				done - 		bytes already written
+ * 				fd - 		the file while it's open (-1 before and once
+ * 							closed), so it's closed exactly once
+ * 				state - 	operation in flight (open, write or close)
+ * 				failed - 	set if any operation failed
+ * 				written, arg - 	called as written(arg, write_ns) once the
+ * 							file is in place, written(arg, -1) if it
+ * 							failed (may be NULL)
+ * 				start - 	stage_clock() when the writer thread took it
+ * 				next - 		next request in the list
+ *
+ * Description: one output file given to an asyncWriter
+ *
+ *****************************************************************************/
+typedef struct writeRequest {
+
+	char *path;
+	char *target;
+	void *data;
+	size_t size;
+	size_t done;
+	int fd;
+	int state;
+	int failed;
+	void (*written)(void *arg, long long write_ns);
+	void *arg;
+	long long start;
+	struct writeRequest *next;
+
+} writeRequest;
+
+/******************************************************************************
+ * struct asyncWriter
+ *
+ * Atributes:	mode - 		WRITER_URING or WRITER_THREAD
+ * 				ring - 		the io_uring (WRITER_URING only)
+ * 				thread - 	thread doing the I/O
+ * 				lock, more, space - 	protect the list and wake up the
+ * 							writer thread / threads waiting for room
+ * 				head, tail - 	requests not taken by the writer thread yet
+ * 				queued - 	number of requests in the list
+ * 				closing - 	set by writer_finish()
+ * 				writes - 	files written
+ * 				failed - 	files that couldn't be written
+ * 				bytes - 	bytes written
+ * 				batches - 	io_uring_enter() calls that submitted something
+ * 				max_inflight - 	most files being written at the same time
+ *
+ * Description: writes whole files in the background. Threads hand encoded
+ * 				images to it and go back to filtering; a single writer
+ * 				thread opens, writes and closes them, through io_uring in
+ * 				batches when the kernel has it, with plain syscalls
+ * 				otherwise.
+ *
+ *****************************************************************************/
+typedef struct {
+
+	int mode;
+	struct uringRing *ring;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t more;
+	pthread_cond_t space;
+	writeRequest *head;
+	writeRequest *tail;
+	int queued;
+	int closing;
+	long writes;
+	long failed;
+	long long bytes;
+	long batches;
+	int max_inflight;
+
+} asyncWriter;
+
+/******************************************************************************
+ * writer_create()
+ *
+ * Arguments: mode - WRITER_URING (falls back to WRITER_THREAD) or
+ *                   WRITER_THREAD
+ * Returns: writer - pointer to the new writer, or NULL in case of failure
+ * Side-Effects: starts the writer thread
+ *
+ * Description: creates a writer for output files
+ *
+ *****************************************************************************/
+asyncWriter *writer_create(int mode);
+
+/******************************************************************************
+ * writer_submit()
+ *
+ * Arguments: writer - pointer to the writer
+ *            file_name - name of the file to write
+ *            data, size - contents, freed with gdFree() once written
+ *            written, arg - called as written(arg, write_ns) from the writer
+ *                           thread once the file is in place, with the time
+ *                           since it took the file, or with -1 if it
+ *                           couldn't be written (written may be NULL)
+ * Returns: (void)
+ * Side-Effects: data belongs to the writer from here on
+ *
+ * Description: queues a file to be written. Only waits if the writer is
+ * 				WRITER_MAX_QUEUED files behind.
+ *
+ *****************************************************************************/
+void writer_submit(asyncWriter *writer, const char *file_name, void *data, int size, void (*written)(void *arg, long long write_ns), void *arg);
+
+/******************************************************************************
+ * writer_finish()
+ *
+ * Arguments: writer - pointer to the writer
+ * Returns: (void)
+ * Side-Effects: stops the writer thread
+ *
+ * Description: waits for every file queued to be written
+ *
+ *****************************************************************************/
+void writer_finish(asyncWriter *writer);
+
+/******************************************************************************
+ * writer_destroy()
+ *
+ * Arguments: writer - pointer to the writer (finished)
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: frees the writer
+ *
+ *****************************************************************************/
+void writer_destroy(asyncWriter *writer);
+
+/******************************************************************************
+ * write_jpeg_async()
+ *
+ * Arguments: writer - writer to hand the file to
+ *            img - pointer to image to be written
+ *            file_name - name of file where to save JPEG image
+ *            written, arg - see writer_submit()
+ * Returns: (bool) 1 in case of success, 0 in case of failure to encode
+ * Side-Effects: none
+ *
+ * Description: encodes the image to JPEG in memory (as write_jpeg_file()
+ * 				does) and queues it to be written by the writer, so the
+ * 				thread doesn't wait for the disk
+ *
+ *****************************************************************************/
+int write_jpeg_async(asyncWriter *writer, gdImagePtr write_img, char * file_name, void (*written)(void *arg, long long write_ns), void *arg);
+
+/******************************************************************************
+ * read_png_file()
+ *
+ * Arguments: file_name - name of file with data for PNG image
+ * Returns: img - the image read from file or NULL if failure to read
+ * Side-Effects: none
+ *
+ * Description: reads a PNG image from a file
+ *
+ *****************************************************************************/
+gdImagePtr read_png_file(char * file_name);
+
+/******************************************************************************
+ * write_png_file()
+ *
+ * Arguments: img - pointer to image to be written
+ *            file_name - name of file where to save PNG image
+ * Returns: (bool) 1 in case of success, 0 in case of failure to write
+ * Side-Effects: none
+ *
+ * Description: writes a PNG image to a file
+ *
+ *****************************************************************************/
+int write_png_file(gdImagePtr write_img, char * file_name);
+
+
+
+/******************************************************************************
+ * read_jpeg_file()
+ *
+ * Arguments: file_name - name of file with data for JPEG image
+ * Returns: img - the image read from file or NULL if failure to read
+ * Side-Effects: none
+ *
+ * Description: reads a PNG image from a file
+ *
+ *****************************************************************************/
+gdImagePtr read_jpeg_file(char * file_name);
+
+/******************************************************************************
+ * jpeg_max_dimension()
+ *
+ * Arguments: max - longest side of the decoded images, 0 for full size
+ * Returns: (void)
+ * Side-Effects: must be called before any thread is reading
+ *
+ * Description: read_jpeg_file_pool() decodes bigger images with libjpeg's DCT
+ * 				scaling to the nearest power of two size above this one,
+ * 				then scales them to it exactly (aspect ratio kept)
+ *
+ *****************************************************************************/
+void jpeg_max_dimension(int max);
+
+/******************************************************************************
+ * filter_memory()
+ *
+ * Arguments: width, heigth - size of the image, from its header (see
+ *                            read_image_dimensions())
+ *            format - its format (only JPEGs are decoded scaled down)
+ *            streamed - 1 if it goes through old_photo_filter_stream()
+ * Returns: (size_t) bytes the image is expected to take while it's filtered
+ * Side-Effects: none
+ *
+ * Description: estimate of the memory of one image in flight (decoded image,
+ * 				the images of the filter, scaled texture and encoded output,
+ * 				or the row buffers of a streamed image), for the pipeline,
+ * 				smoothing and jpeg_max_dimension() in use
+ *
+ *****************************************************************************/
+size_t filter_memory(int width, int heigth, int format, int streamed);
+
+/******************************************************************************
+ * read_jpeg_file_pool()
+ *
+ * Arguments: file_name - name of file with data for JPEG image
+ *            pool - pool to take the image from (may be NULL)
+ *            stats - where read and decode times are added (may be NULL)
+ * Returns: img - the image read from file or NULL if failure to read
+ * Side-Effects: none
+ *
+ * Description: memory-maps a JPEG file and decodes it from memory straight
+ * 				into a pool buffer, the same way gdImageCreateFromJpeg()
+ * 				does. Free the image with pool_image_destroy().
+ *
+ *****************************************************************************/
+gdImagePtr read_jpeg_file_pool(char * file_name, imagePool *pool, readStats *stats);
+
+/******************************************************************************
+ * write_jpeg_file()
+ *
+ * Arguments: img - pointer to image to be written
+ *            file_name - name of file where to save JPEG image
+ * Returns: (bool) 1 in case of success, 0 in case of failure to write
+ * Side-Effects: none
+ *
+ * Description: writes a JPEG image to a file (under a temporary name,
+ * 				renamed when complete)
+ *
+ *****************************************************************************/
+int write_jpeg_file(gdImagePtr write_img, char * file_name);
+
 /******************************************************************************
- * smooth_image()
+ * read_heif_file()
  *
- * Arguments: in - pointer to image
- * Returns: out - pointer to smoother image, or NULL in case of failure
+ * Arguments: file_name - name of file with data for HEIF image
+ * Returns: img - the image read from file or NULL if failure to read
  * Side-Effects: none
  *
- * Description: creates clone of image smoother
+ * Description: reads a HEIF image from a file
  *
  *****************************************************************************/
-gdImagePtr  smooth_image(gdImagePtr in_img);
+gdImagePtr read_heif_file(char * file_name);
 
 /******************************************************************************
- * sepia_image()
+ * write_heif_file()
  *
- * Arguments: in - pointer to image
- * Returns: out - pointer to sepia image, or NULL in case of failure
+ * Arguments: img - pointer to image to be written
+ *            file_name - name of file where to save HEIF image
+ * Returns: (bool) 1 in case of success, 0 in case of failure to write
  * Side-Effects: none
  *
- * Description: creates clone of image but with sepia color
+ * Description: writes a HEIF image to a file
  *
  *****************************************************************************/
-gdImagePtr  sepia_image(gdImagePtr in_img);
+int write_heif_file(gdImagePtr write_img, char * file_name);
 
+/* formats of the inputs (told by their first bytes) and of the outputs */
+#define FORMAT_UNKNOWN	-1
+#define FORMAT_JPEG		0
+#define FORMAT_PNG		1
+#define FORMAT_WEBP		2
+#define FORMAT_HEIF		3
+#define FORMATS			4
 
 /******************************************************************************
- * contrast_image()
+ * struct encodeStats
  *
- * Arguments: in - pointer to image
- * Returns: out - pointer to transformed image, or NULL in case of failure
+ * Atributes:	images - 	images encoded in the format
+ * 				ns - 		time it took
+ * 				bytes - 	size of the encoded files
+ * 				pixels - 	pixels of the images
+ *
+ * Description: cost of an output format, what it takes to encode and what
+ * 				it saves in bytes (see encode_stats())
+ *
+ *****************************************************************************/
+typedef struct {
+
+	long images;
+	long long ns;
+	long long bytes;
+	long long pixels;
+
+} encodeStats;
+
+/******************************************************************************
+ * image_format()
+ *
+ * Arguments: data - first bytes of a file
+ *            size - how many (16 are enough)
+ * Returns: (int) FORMAT_JPEG, FORMAT_PNG, FORMAT_WEBP, FORMAT_HEIF or
+ *          FORMAT_UNKNOWN
  * Side-Effects: none
  *
- * Description: creates clone of image but its contrast reduced
+ * Description: tells the format of an image by its magic bytes, whatever
+ * 				the name of the file
  *
  *****************************************************************************/
-gdImagePtr  contrast_image(gdImagePtr in_img);
+int image_format(const void *data, size_t size);
 
+/******************************************************************************
+ * read_file_format()
+ *
+ * Arguments: dir_fd - directory file_name is relative to (or AT_FDCWD)
+ *            file_name - name of the file
+ * Returns: (int) its format (see image_format()), FORMAT_UNKNOWN if it
+ *          can't be read
+ * Side-Effects: none
+ *
+ * Description: reads the first bytes of a file and tells its format
+ *
+ *****************************************************************************/
+int read_file_format(int dir_fd, const char *file_name);
 
 /******************************************************************************
- * read_png_file()
+ * format_name()
  *
- * Arguments: file_name - name of file with data for PNG image
- * Returns: img - the image read from file or NULL if failure to read
+ * Arguments: format - a FORMAT_ value
+ * Returns: (const char *) its name ("jpeg", "png", "webp", "heif")
  * Side-Effects: none
  *
- * Description: reads a PNG image from a file
+ * Description: name of a format, as --output-format takes it
  *
  *****************************************************************************/
-gdImagePtr read_png_file(char * file_name);
+const char *format_name(int format);
 
 /******************************************************************************
- * write_png_file()
+ * read_image_dimensions()
  *
- * Arguments: img - pointer to image to be written
- *            file_name - name of file where to save PNG image
- * Returns: (bool) 1 in case of success, 0 in case of failure to write
+ * Arguments: file_name - name of the file
+ *            width, height - where the size of the image is stored
+ * Returns: (int) its format, FORMAT_UNKNOWN if it isn't an image or its
+ *          size wasn't found
  * Side-Effects: none
  *
- * Description: writes a PNG image to a file
+ * Description: reads the size of an image from its header, without
+ * 				decoding it: the SOF of a JPEG, the IHDR of a PNG, the VP8,
+ * 				VP8L or VP8X chunk of a WebP, and the largest ispe of a HEIF
+ * 				(the whole image, not its tiles) in its first 64 KB
  *
  *****************************************************************************/
-int write_png_file(gdImagePtr write_img, char * file_name);
+int read_image_dimensions(const char *file_name, int *width, int *height);
 
+/******************************************************************************
+ * read_image_file_pool()
+ *
+ * Arguments: file_name - name of the image file (JPEG, PNG, WebP or HEIF)
+ *            pool - pool to take the image from (may be NULL)
+ *            stats - where read and decode times are added (may be NULL)
+ * Returns: img - the truecolor image read from file or NULL if failure to
+ *          read
+ * Side-Effects: none
+ *
+ * Description: memory-maps the file and decodes it as its first bytes say:
+ * 				a JPEG as read_jpeg_file_pool() does, the others with gd's
+ * 				decoders from memory (palette images made truecolor, then
+ * 				scaled to jpeg_max_dimension() if bigger). Free the image
+ * 				with pool_image_destroy().
+ *
+ *****************************************************************************/
+gdImagePtr read_image_file_pool(char * file_name, imagePool *pool, readStats *stats);
 
+/******************************************************************************
+ * output_format_set()
+ *
+ * Arguments: description - jpeg, webp, heif or png, optionally followed by
+ *                          :<quality> (1 to 100; the zlib level 0 to 9 for
+ *                          png)
+ * Returns: (bool) 1 in case of success, 0 if description is wrong or gd
+ *          can't encode the format (a message is printed)
+ * Side-Effects: must be called before any thread is writing
+ *
+ * Description: sets the format of the outputs and its quality. Each format
+ * 				keeps its own quality (by default JPEG 70, WebP 80, HEIF 50,
+ * 				PNG 6). The encoder is tried on a tiny image first, so a gd
+ * 				built without it is told at start.
+ *
+ *****************************************************************************/
+int output_format_set(const char *description);
 
 /******************************************************************************
- * read_jpeg_file()
+ * output_format()
  *
- * Arguments: file_name - name of file with data for JPEG image
- * Returns: img - the image read from file or NULL if failure to read
+ * Arguments: quality - where the quality of the format is stored (may be
+ *                      NULL)
+ * Returns: (int) format of the outputs
  * Side-Effects: none
  *
- * Description: reads a PNG image from a file
+ * Description: format of the outputs set by output_format_set() (JPEG if
+ * 				none)
  *
  *****************************************************************************/
-gdImagePtr read_jpeg_file(char * file_name);
+int output_format(int *quality);
 
 /******************************************************************************
- * write_jpeg_file()
+ * output_name()
+ *
+ * Arguments: file_name - path of an output, named as its input
+ *            len - size of the buffer file_name is in
+ * Returns: (bool) 1 in case of success, 0 if the new name doesn't fit
+ * Side-Effects: changes file_name
+ *
+ * Description: gives the output the extension of its format, unless it
+ * 				already has one of them, after the input's own (so img.jpg
+ * 				stays img.jpg as a JPEG and is img.jpg.webp as a WebP, and
+ * 				img.png is img.png.jpg: inputs of the same name in two
+ * 				formats never share an output)
+ *
+ *****************************************************************************/
+int output_name(char *file_name, size_t len);
+
+/******************************************************************************
+ * write_image_file()
  *
  * Arguments: img - pointer to image to be written
- *            file_name - name of file where to save JPEG image
+ *            file_name - name of file where to save it (see output_name())
  * Returns: (bool) 1 in case of success, 0 in case of failure to write
  * Side-Effects: none
  *
- * Description: writes a PNG image to a file
+ * Description: write_jpeg_file() in the format of the outputs
  *
  *****************************************************************************/
-int write_jpeg_file(gdImagePtr write_img, char * file_name);
+int write_image_file(gdImagePtr write_img, char * file_name);
 
 /******************************************************************************
- * read_heif_file()
+ * write_image_async()
  *
- * Arguments: file_name - name of file with data for HEIF image
- * Returns: img - the image read from file or NULL if failure to read
+ * Arguments: writer - writer to hand the file to
+ *            img - pointer to image to be written
+ *            file_name - name of file where to save it (see output_name())
+ *            written, arg - see writer_submit()
+ * Returns: (bool) 1 in case of success, 0 in case of failure to encode
  * Side-Effects: none
  *
- * Description: reads a HEIF image from a file
+ * Description: write_jpeg_async() in the format of the outputs
  *
  *****************************************************************************/
-gdImagePtr read_heif_file(char * file_name);
+int write_image_async(asyncWriter *writer, gdImagePtr write_img, char * file_name, void (*written)(void *arg, long long write_ns), void *arg);
 
 /******************************************************************************
- * write_heif_file()
+ * encode_stats()
  *
- * Arguments: img - pointer to image to be written
- *            file_name - name of file where to save HEIF image
- * Returns: (bool) 1 in case of success, 0 in case of failure to write
+ * Arguments: format - a FORMAT_ value
+ *            stats - where the counters are stored
+ * Returns: (void)
  * Side-Effects: none
  *
- * Description: writes a HEIF image to a file
+ * Description: what encoding whole images in a format took so far (every
+ * 				thread, whatever --report says; streamed images are encoded
+ * 				a row at a time and not counted)
  *
  *****************************************************************************/
-int write_heif_file(gdImagePtr write_img, char * file_name);
+void encode_stats(int format, encodeStats *stats);
 
 /******************************************************************************
  * create_directory()
@@ -144,21 +1558,74 @@ int write_heif_file(gdImagePtr write_img, char * file_name);
  *****************************************************************************/
 int create_directory(char * dir_name);
 
+/******************************************************************************
+ * output_dir_lock()
+ *
+ * Arguments: out_dir - output directory
+ * Returns: (int) descriptor of the lock file, locked shared until closed;
+ *          -1 in case of failure
+ * Side-Effects: creates <out_dir>/.lock, removes the <name>.part files of
+ *               a run that was killed
+ *
+ * Description: marks the output directory as in use by this run; leftover
+ * 				.part files are removed only if no other run uses it
+ *
+ *****************************************************************************/
+int output_dir_lock(const char *out_dir);
+
 /******************************************************************************
  * readFiles()
  *
  * Arguments: dir - name of directory to look for image-list.txt and read it
  * Returns: (char **) -         array of filenames
  *          int nn_files -      number of files
- *          int total_size -    total size of files in KBytes
  * Side-Effects: allocs an array of strings
  *
  * Description: Reads all picture names names in image-list.txt in the given
- * 				directory
+ * 				directory, in one pass (see fileList to start on the first
+ * 				ones while the list is read)
  *
  *****************************************************************************/
 char **readFiles(char *dir, int *nn_files);
 
+/******************************************************************************
+ * read_jpeg_dimensions()
+ *
+ * Arguments: file_name - name of file with data for JPEG image
+ *            width, height - where the size of the image is stored
+ * Returns: (bool) 1 in case of success, 0 if the file isn't a JPEG or its
+ *          frame header wasn't found
+ * Side-Effects: none
+ *
+ * Description: reads the size of a JPEG image from its SOF marker, without
+ * 				decoding the image
+ *
+ *****************************************************************************/
+int read_jpeg_dimensions(const char *file_name, int *width, int *height);
+
+/* orders accepted by sortFiles() */
+#define SORT_NONE	0
+#define SORT_SIZE	1
+#define SORT_PIXELS	2
+
+/* ways of splitting the list across processes (--shard) */
+#define SHARD_HASH	0
+#define SHARD_SIZE	1
+
+/******************************************************************************
+ * sortFiles()
+ *
+ * Arguments: files - array of filenames
+ *            nn_files - number of files
+ *            mode - SORT_NONE, SORT_SIZE (file size) or SORT_PIXELS
+ * Returns: (void)
+ * Side-Effects: reorders files
+ *
+ * Description: sorts the files largest first
+ *
+ *****************************************************************************/
+void sortFiles(char **files, int nn_files, int mode);
+
 /******************************************************************************
  * destroyFiles()
  * 
@@ -170,6 +1637,398 @@ char **readFiles(char *dir, int *nn_files);
  ******************************************************************************/
 void destroyFiles(char **files, int nn_files);
 
+/******************************************************************************
+ * xxh64()
+ *
+ * Arguments: data, len - bytes to hash
+ *            seed - seed of the hash
+ * Returns: (uint64_t) XXH64 hash of the bytes
+ * Side-Effects: none
+ *
+ * Description: the XXH64 hash (same values as the xxHash library)
+ *
+ *****************************************************************************/
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+/******************************************************************************
+ * hash_file()
+ *
+ * Arguments: file_name - name of the file
+ *            hash - where the XXH64 hash of its contents is stored
+ * Returns: (bool) 1 in case of success, 0 in case of failure to read
+ * Side-Effects: none
+ *
+ * Description: hashes the contents of a file (mapped, not copied)
+ *
+ *****************************************************************************/
+int hash_file(const char *file_name, uint64_t *hash);
+
+/******************************************************************************
+ * filter_params()
+ *
+ * Arguments: buffer - where the description is stored
+ *            len - size of buffer
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: describes the parameters of the filter and of the encoder
+ * 				(and the size, with jpeg_max_dimension()), so outputs made
+ * 				with other parameters can be told apart
+ *
+ *****************************************************************************/
+void filter_params(char *buffer, size_t len);
+
+/******************************************************************************
+ * struct manifestEntry
+ *
+ * Atributes:	name - 		name of the input (relative to the directory)
+ * 				key - 		hash of name
+ * 				hash - 		XXH64 of the input contents
+ * 				size - 		size of the input in bytes
+ * 				mtime_sec, mtime_nsec - 	modification time of the input
+ *
+ * Description: an input whose output was written, as recorded in the
+ * 				manifest
+ *
+ *****************************************************************************/
+typedef struct {
+
+	const char *name;
+	uint64_t key;
+	uint64_t hash;
+	long long size;
+	long long mtime_sec;
+	long mtime_nsec;
+
+} manifestEntry;
+
+/******************************************************************************
+ * struct manifest
+ *
+ * Atributes:	path - 		path of the manifest file
+ * 				params - 	parameters the outputs are made with
+ * 				buf - 		contents of the file as loaded (names point here)
+ * 				records - 	entries, in the order they were first seen
+ * 				entries - 	number of records
+ * 				capacity - 	size of records
+ * 				loaded - 	records read from the file (the names of the
+ * 							ones added later are copies)
+ * 				table - 	index of records by name, open addressing
+ * 				mask - 		size of table minus one (size is a power of 2)
+ * 				fd - 		the file, open for appending new entries (and
+ * 							locked shared while this process runs)
+ * 				recorded - 	entries appended in this run
+ * 				unchanged - inputs found unchanged in this run
+ * 				lock - 		protects records and table
+ *
+ * Description: what was already done in earlier runs, in
+ * 				<output dir>/.manifest. The first line has the parameters;
+ * 				then one line per output written:
+ * 					<xxh64 hex> <size> <mtime sec>.<nsec> <name>
+ * 				New lines are appended as outputs are written (a later line
+ * 				wins), so an interrupted run keeps what it finished. The
+ * 				table gets the entries of this run too, so a file written
+ * 				again while watching is only done again if it changed.
+ *
+ *****************************************************************************/
+typedef struct {
+
+	char *path;
+	char *params;
+	char *buf;
+	manifestEntry *records;
+	size_t entries;
+	size_t capacity;
+	size_t loaded;
+	uint64_t *table;
+	size_t mask;
+	int fd;
+	atomic_long recorded;
+	atomic_long unchanged;
+	pthread_mutex_t lock;
+
+} manifest;
+
+/******************************************************************************
+ * manifest_open()
+ *
+ * Arguments: out_dir - output directory
+ *            params - parameters of this run (see filter_params())
+ * Returns: manifest - pointer to the manifest, or NULL in case of failure
+ *          (or if another process uses one made with other parameters)
+ * Side-Effects: creates or rewrites the manifest file
+ *
+ * Description: loads the manifest of the output directory. A manifest made
+ * 				with other parameters is started over; one with many
+ * 				repeated entries is compacted. Either only when no other
+ * 				process has it open.
+ *
+ *****************************************************************************/
+manifest *manifest_open(const char *out_dir, const char *params);
+
+/******************************************************************************
+ * manifest_unchanged()
+ *
+ * Arguments: m - pointer to the manifest
+ *            name - name of the input (relative to the directory)
+ *            file_name - path of the input
+ *            st - stat of the input
+ * Returns: (bool) 1 if the input is the one recorded
+ * Side-Effects: none
+ *
+ * Description: same size and mtime is taken as unchanged; if only the
+ * 				mtime differs the contents are hashed and compared
+ *
+ *****************************************************************************/
+int manifest_unchanged(manifest *m, const char *name, const char *file_name, const struct stat *st);
+
+/******************************************************************************
+ * manifest_record()
+ *
+ * Arguments: m - pointer to the manifest
+ *            name - name of the input (relative to the directory)
+ *            hash, size, mtime - the input as it was read (see readStats)
+ * Returns: (void)
+ * Side-Effects: appends to the manifest file
+ *
+ * Description: records an input whose output was just written (and renamed
+ * 				into place), as it was when it was read: a file changed
+ * 				since doesn't match the record. Safe to call from any
+ * 				thread.
+ *
+ *****************************************************************************/
+void manifest_record(manifest *m, const char *name, uint64_t hash, long long size, const struct timespec *mtime);
+
+/******************************************************************************
+ * manifest_close()
+ *
+ * Arguments: m - pointer to the manifest
+ * Returns: (void)
+ * Side-Effects: none
+ *
+ * Description: closes the manifest file and frees the manifest
+ *
+ *****************************************************************************/
+void manifest_close(manifest *m);
+
+/******************************************************************************
+ * struct fileList
+ *
+ * Atributes:	dir - 		directory given to file_list_open()
+ * 				dir_fd - 	that directory, for fstatat()
+ * 				out_fd - 	its output directory, for fstatat()
+ * 				manifest - 	what earlier runs did (NULL: existence only)
+ * 				list_fp - 	image-list.txt, read by the list thread
+ * 				names - 	paths of the entries read so far (grows)
+ * 				arrived - 	when each entry showed up (0: from the list)
+ * 				count - 	number of entries in names
+ * 				capacity - 	size of names
+ * 				seen, seen_mask - 	set of the names not done yet (index
+ * 							+ 1 in names, 0 for an empty slot), so
+ * 							none is listed twice at once
+ * 				again - 	for each slot of seen, when the file showed up
+ * 							again while pending (0: it didn't)
+ * 				pending - 	entries in seen
+ * 				done - 		set when image-list.txt was read to the end
+ * 				checked - 	set when only valid entries are left
+ * 				skipped - 	entries file_list_check() turned down
+ * 				shard - 	this process' share of the list (0 to shards - 1)
+ * 				shards - 	processes the list is split across (1: all)
+ * 				listed - 	entries seen, in this share or not
+ * 				thread - 	thread reading image-list.txt
+ * 				watch_fd - 	inotify on the directory, -1 if not watching
+ * 				signal_fd - 	signalfd for SIGINT and SIGTERM (watching)
+ * 				joined - 	set once that thread was joined
+ * 				lock, grown - 	protect the atributes above and wake up
+ * 							threads waiting for an entry
+ *
+ * Description: the entries of image-list.txt, read in one pass by a thread
+ * 				of its own so the first images can be processed while the
+ * 				rest of the list is still being read. When watching, the
+ * 				list doesn't end with image-list.txt: JPEGs written to the
+ * 				directory are appended as they show up, until a signal. Existence is checked
+ * 				by whoever takes an entry (file_list_check()), so the checks
+ * 				run in parallel on the worker threads.
+ *
+ *****************************************************************************/
+typedef struct {
+
+	char *dir;
+	int dir_fd;
+	int out_fd;
+	manifest *manifest;
+	FILE *list_fp;
+	char **names;
+	long long *arrived;
+	int count;
+	int capacity;
+	int *seen;
+	long long *again;
+	size_t seen_mask;
+	int pending;
+	int done;
+	int checked;
+	atomic_int skipped;
+	int shard;
+	int shards;
+	int listed;
+	pthread_t thread;
+	int watch_fd;
+	int signal_fd;
+	int joined;
+	pthread_mutex_t lock;
+	pthread_cond_t grown;
+
+} fileList;
+
+/******************************************************************************
+ * file_list_open()
+ *
+ * Arguments: dir - directory with image-list.txt (and the output directory)
+ *            m - manifest of the output directory, or NULL
+ *            watch - 1 to go on with the files that show up in dir
+ *            shard, shards - keep only the entries whose name hashes to
+ *                            shard out of shards (0, 1: all of them)
+ * Returns: list - pointer to the new list, or NULL if image-list.txt can't be
+ *          read
+ * Side-Effects: starts the thread reading image-list.txt; watching blocks
+ *               SIGINT and SIGTERM in the calling thread
+ *
+ * Description: starts reading the image list of a directory (watch_fd is
+ * 				-1 if it was to be watched and can't be)
+ *
+ *****************************************************************************/
+fileList *file_list_open(char *dir, manifest *m, int watch, int shard, int shards);
+
+/******************************************************************************
+ * file_list_get()
+ *
+ * Arguments: list - pointer to the list
+ *            i - index of the entry
+ * Returns: (char *) path of entry i, NULL if the list has fewer entries
+ * Side-Effects: none
+ *
+ * Description: gets an entry, waiting for it to be read if needed
+ *
+ *****************************************************************************/
+char *file_list_get(fileList *list, int i);
+
+/******************************************************************************
+ * file_list_peek()
+ *
+ * Arguments: list - pointer to the list
+ *            i - index of the entry
+ * Returns: (char *) path of entry i, NULL if it wasn't read (yet)
+ * Side-Effects: none
+ *
+ * Description: gets an entry without waiting
+ *
+ *****************************************************************************/
+char *file_list_peek(fileList *list, int i);
+
+/******************************************************************************
+ * file_list_arrival()
+ *
+ * Arguments: list - pointer to the list
+ *            i - index of the entry
+ * Returns: (long long) when entry i showed up (CLOCK_MONOTONIC, in ns), 0 if
+ *          it came from image-list.txt
+ * Side-Effects: none
+ *
+ * Description: arrival time of a watched entry, to measure its latency
+ *
+ *****************************************************************************/
+long long file_list_arrival(fileList *list, int i);
+
+/******************************************************************************
+ * file_list_done()
+ *
+ * Arguments: list - pointer to the list
+ *            i - index of an entry taken with file_list_get()
+ * Returns: (void)
+ * Side-Effects: may append the entry's name again
+ *
+ * Description: entry i is finished with (written, failed or skipped): its
+ * 				name can be listed again
+ *
+ *****************************************************************************/
+void file_list_done(fileList *list, int i);
+
+/******************************************************************************
+ * file_list_count()
+ *
+ * Arguments: list - pointer to the list
+ * Returns: (int) number of entries read so far
+ * Side-Effects: none
+ *
+ * Description: entries read so far (all of them once the list is done)
+ *
+ *****************************************************************************/
+int file_list_count(fileList *list);
+
+/******************************************************************************
+ * file_list_check()
+ *
+ * Arguments: list - pointer to the list
+ *            file_name - path of an entry
+ * Returns: (bool) 1 if the entry is to be processed
+ * Side-Effects: prints why an entry is skipped
+ *
+ * Description: an entry is skipped if its output already exists (and,
+ * 				with a manifest, the input is the one it was made from), if
+ * 				it doesn't exist or if it isn't a JPEG. Uses fstatat()
+ * 				relative to the directories, so each check is two lookups of
+ * 				a name.
+ *
+ *****************************************************************************/
+int file_list_check(fileList *list, const char *file_name);
+
+/******************************************************************************
+ * file_list_filter()
+ *
+ * Arguments: list - pointer to the list
+ *            mode - order for sortFiles()
+ * Returns: (void)
+ * Side-Effects: reorders the list
+ *
+ * Description: waits for the whole list, drops the entries
+ * 				file_list_check() turns down and sorts the rest. Needed
+ * 				before sorting, as it takes every entry to sort.
+ *
+ *****************************************************************************/
+void file_list_filter(fileList *list, int mode);
+
+/******************************************************************************
+ * file_list_balance()
+ *
+ * Arguments: list - pointer to the list (opened with all the entries)
+ *            shard - this process' share (0 to shards - 1)
+ *            shards - processes the list is split across
+ * Returns: (bool) 1 in case of success, 0 if out of memory
+ * Side-Effects: drops the entries of the other shares
+ *
+ * Description: waits for the whole list and splits it by file size, so
+ * 				every share has about the same bytes to process: largest
+ * 				file first, each to the share with the fewest bytes so far.
+ * 				Only the names and sizes of the inputs decide it, so every
+ * 				process (on any machine seeing the same files) gets the
+ * 				same split.
+ *
+ *****************************************************************************/
+int file_list_balance(fileList *list, int shard, int shards);
+
+/******************************************************************************
+ * file_list_destroy()
+ *
+ * Arguments: list - pointer to the list
+ * Returns: (void)
+ * Side-Effects: waits for the list thread
+ *
+ * Description: frees the list and every entry
+ *
+ *****************************************************************************/
+void file_list_destroy(fileList *list);
+
 /*****************************************************************************
  * isFileExists()
  * 
@@ -0,0 +1,694 @@
+/******************************************************************************
+ * Programacao Concorrente
+ * MEEC 21/22
+ *
+ * Projecto - Parte1
+ *                           old-photo-bench.c
+ *
+ * Benchmark of old-photo-paral: generates a synthetic corpus, runs the
+ * program over a sweep of thread counts and times each filter function.
+ *
+ * Compilacao: make old-photo-bench (make benchmark to run it)
+ *
+ *****************************************************************************/
+
+#include <gd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <math.h>
+#include "image-lib.h"
+
+/* the paper texture file path */
+#define PAPER_TEXTURE "./paper-texture.png"
+/* the directories wher output files will be placed */
+#define OLD_IMAGE_DIR "/old_photo_PAR_A"
+/* the program benchmarked */
+#define PROGRAM "./old-photo-paral"
+/* images in the corpus and runs of each thread count (the median is kept) */
+#define BENCH_IMAGES	24
+#define BENCH_RUNS		3
+/* thread counts of the sweep, up to 16 */
+#define BENCH_THREADS	"1,2,4,8"
+#define MAX_SWEEP		16
+/* a micro-benchmark repeats its function at least this long (seconds) */
+#define MICRO_SECONDS	0.5
+/* size of the image of the micro-benchmarks */
+#define MICRO_WIDTH		1920
+#define MICRO_HEIGTH	1080
+/* --verify: largest difference of a channel and lowest PSNR (dB) accepted
+ * against the gd chain, and rows of each band of the banded filter */
+#define VERIFY_MAX_DIFF	2
+#define VERIFY_MIN_PSNR	48.0
+#define VERIFY_BAND		7
+/* resolution (dpi) given to the verified images, unlike gd's default, so a
+ * path that drops it shows */
+#define VERIFY_RES		300
+
+/* sizes of the corpus, taken in turn: landscape, portrait, square, panorama
+ * and a few big ones */
+static const int corpus_sizes[][2] = {
+	{640, 480}, {1920, 1080}, {480, 640}, {1024, 1024},
+	{2048, 512}, {1080, 1920}, {320, 240}, {3000, 2000},
+	{800, 600}, {512, 2048}, {1600, 1200}, {4000, 3000}
+};
+#define CORPUS_SIZES (int) (sizeof(corpus_sizes) / sizeof(corpus_sizes[0]))
+
+/******************************************************************************
+ * bench_random()
+ *
+ * Arguments:	state - state of the generator
+ *
+ * Return:		(uint32_t) next number
+ *
+ * Description: xorshift32, so the corpus is the same on every machine
+ *
+ *****************************************************************************/
+uint32_t bench_random(uint32_t *state) {
+
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+/******************************************************************************
+ * synthetic_image()
+ *
+ * Arguments:	width, heigth - size of the image
+ * 				seed - 			what makes it different from the others
+ *
+ * Return:		(gdImagePtr) the image, NULL in case of failure
+ *
+ * Description: an image that compresses like a photo: smooth gradients,
+ * 				a few flat shapes with edges, and some noise
+ *
+ *****************************************************************************/
+gdImagePtr synthetic_image(int width, int heigth, uint32_t seed) {
+
+	gdImagePtr img = gdImageCreateTrueColor(width, heigth);
+	uint32_t state = seed * 2654435761u + 1;
+
+	if (img == NULL) return NULL;
+
+	int r0 = bench_random(&state) & 0xff;
+	int g0 = bench_random(&state) & 0xff;
+	int b0 = bench_random(&state) & 0xff;
+	for (int y = 0; y < heigth; y++) {
+		for (int x = 0; x < width; x++) {
+			int noise = (int) (bench_random(&state) & 0x0f) - 8;
+			int r = r0 + 255 * x / width + noise;
+			int g = g0 + 255 * y / heigth + noise;
+			int b = b0 + 255 * (x + y) / (width + heigth) + noise;
+			img->tpixels[y][x] = gdTrueColor(abs(r % 512 - 256) & 0xff, abs(g % 512 - 256) & 0xff, abs(b % 512 - 256) & 0xff);
+		}
+	}
+	for (int i = 0; i < 8; i++) {
+		int x = bench_random(&state) % width;
+		int y = bench_random(&state) % heigth;
+		int color = gdTrueColor(bench_random(&state) & 0xff, bench_random(&state) & 0xff, bench_random(&state) & 0xff);
+		if (i % 2) {
+			gdImageFilledEllipse(img, x, y, width / 4 + 1, heigth / 4 + 1, color);
+		} else {
+			gdImageFilledRectangle(img, x, y, x + width / 5, y + heigth / 6, color);
+		}
+	}
+	return img;
+}
+
+/******************************************************************************
+ * make_corpus()
+ *
+ * Arguments:	dir - 		directory of the corpus
+ * 				images - 	how many images
+ * 				pixels - 	where the pixels of all of them are stored
+ * 				bytes - 	where the bytes of all of them are stored
+ *
+ * Return:		(bool) 1 in case of success, 0 otherwise
+ *
+ * Description: writes the images (bench-NN.jpg) and image-list.txt. The
+ * 				same arguments always give the same files, so a corpus that
+ * 				is already there is kept.
+ *
+ *****************************************************************************/
+int make_corpus(char *dir, int images, long long *pixels, long long *bytes) {
+
+	char name[strlen(dir) + 32];
+	struct stat st;
+	FILE *list;
+
+	if (!isDirExists(dir) && create_directory(dir) == 0) return 0;
+	sprintf(name, "%s/image-list.txt", dir);
+	list = fopen(name, "w");
+	if (list == NULL) return 0;
+
+	*pixels = 0;
+	*bytes = 0;
+	for (int i = 0; i < images; i++) {
+		int width = corpus_sizes[i % CORPUS_SIZES][0];
+		int heigth = corpus_sizes[i % CORPUS_SIZES][1];
+
+		fprintf(list, "bench-%02d.jpg\n", i);
+		sprintf(name, "%s/bench-%02d.jpg", dir, i);
+		if (stat(name, &st) != 0) {
+			gdImagePtr img = synthetic_image(width, heigth, i + 1);
+			if (img == NULL || write_jpeg_file(img, name) == 0) {
+				fprintf(stderr, "Impossible to write %s image\n", name);
+				fclose(list);
+				return 0;
+			}
+			gdImageDestroy(img);
+			stat(name, &st);
+		}
+		*pixels += (long long) width * heigth;
+		*bytes += st.st_size;
+	}
+
+	return fclose(list) == 0;
+}
+
+/* seconds between two times */
+double seconds(const struct timespec *end, const struct timespec *start) {
+
+	struct timespec diff = diff_timespec(end, start);
+	return diff.tv_sec + diff.tv_nsec / 1e9;
+}
+
+/******************************************************************************
+ * run_program()
+ *
+ * Arguments:	program - 	old-photo-paral to run
+ * 				dir - 		directory of the corpus
+ * 				threads - 	number of threads
+ * 				extra - 	more arguments (NULL terminated)
+ *
+ * Return:		(double) wall time in seconds, negative in case of failure
+ *
+ * Description: runs program over the corpus from scratch: outputs of the
+ * 				last run and the timing file are removed first, and the
+ * 				manifest is off, so no image is skipped
+ *
+ *****************************************************************************/
+double run_program(char *program, char *dir, int threads, char **extra) {
+
+	char path[strlen(dir) + 64];
+	char arg_threads[16];
+	char *argv[64];
+	int argc = 0, status;
+	struct timespec start, end;
+	pid_t pid;
+
+	sprintf(path, "rm -rf '%s%s' '%s/timming_%d.txt'", dir, OLD_IMAGE_DIR, dir, threads);
+	if (system(path) != 0) return -1;
+
+	sprintf(arg_threads, "%d", threads);
+	argv[argc++] = program;
+	argv[argc++] = "--manifest";
+	argv[argc++] = "off";
+	for (int i = 0; extra[i] != NULL && argc < 60; i++) {
+		argv[argc++] = extra[i];
+	}
+	argv[argc++] = dir;
+	argv[argc++] = arg_threads;
+	argv[argc] = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid = fork();
+	if (pid < 0) return -1;
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		if (null >= 0) dup2(null, STDOUT_FILENO);
+		execv(program, argv);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return seconds(&end, &start);
+}
+
+/* for qsort() of run times */
+int cmp_seconds(const void *a, const void *b) {
+
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/******************************************************************************
+ * micro()
+ *
+ * Arguments:	out - 		where the result goes
+ * 				name - 		name of the function
+ * 				filter - 	function that filters img
+ * 				img - 		input image
+ * 				texture - 	texture at the size of img
+ *
+ * Return:		(void)
+ *
+ * Description: calls filter for at least MICRO_SECONDS and writes the
+ * 				fastest call (the least disturbed by the rest of the machine)
+ *
+ *****************************************************************************/
+void micro(FILE *out, const char *name, gdImagePtr (*filter)(gdImagePtr, gdImagePtr), gdImagePtr img, gdImagePtr texture) {
+
+	struct timespec start, end, first;
+	double best = -1, total = 0;
+	int calls = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &first);
+	while (calls < 3 || total < MICRO_SECONDS) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		gdImagePtr res = filter(img, texture);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (res == NULL) {
+			fprintf(out, "micro %-16s failed\n", name);
+			return;
+		}
+		if (res != img) gdImageDestroy(res);
+		double t = seconds(&end, &start);
+		if (best < 0 || t < best) best = t;
+		total = seconds(&end, &first);
+		calls++;
+	}
+
+	fprintf(out, "micro %-16s %dx%d\tms %.3f\tmegapixels_per_s %.1f\tcalls %d\n", name, img->sx, img->sy,
+		best * 1e3, img->sx * (double) img->sy / 1e6 / best, calls);
+}
+
+/* the filter functions with the signature micro() takes */
+gdImagePtr bench_contrast(gdImagePtr img, gdImagePtr texture) { (void) texture; return contrast_image(img); }
+gdImagePtr bench_smooth(gdImagePtr img, gdImagePtr texture) { (void) texture; return smooth_image(img); }
+gdImagePtr bench_texture(gdImagePtr img, gdImagePtr texture) { return texture_image(img, texture); }
+gdImagePtr bench_sepia(gdImagePtr img, gdImagePtr texture) { (void) texture; return sepia_image(img); }
+gdImagePtr bench_fused(gdImagePtr img, gdImagePtr texture) { return old_photo_filter(img, texture, NULL); }
+
+/* encodes img to a file in the corpus directory (micro() needs an image back) */
+char *encode_file;
+gdImagePtr bench_encode(gdImagePtr img, gdImagePtr texture) { (void) texture; return write_jpeg_file(img, encode_file) ? img : NULL; }
+gdImagePtr bench_decode(gdImagePtr img, gdImagePtr texture) { (void) img; (void) texture; return read_jpeg_file(encode_file); }
+
+/******************************************************************************
+ * struct verifyPath
+ *
+ * Atributes:	name - 		optimized path
+ * 				max_diff - 	largest difference of a channel so far
+ * 				psnr - 		lowest PSNR so far (dB, INFINITY if identical)
+ * 				images - 	images compared
+ * 				failed - 	images out of the thresholds (or that lost
+ * 							the resolution or interlacing of the input)
+ *
+ * Description: results of one optimized path over the verified images
+ *
+ *****************************************************************************/
+typedef struct {
+
+	char name[32];
+	int max_diff;
+	double psnr;
+	int images;
+	int failed;
+
+} verifyPath;
+
+/******************************************************************************
+ * image_diff()
+ *
+ * Arguments:	a, b - 		truecolor images of the same size
+ * 				max_diff - 	where the largest difference of a channel
+ * 							(red, green, blue or alpha) is stored
+ *
+ * Return:		(double) PSNR of b against a over red, green and blue (dB),
+ * 				INFINITY if they are the same
+ *
+ * Description: compares the pixel buffers, before any JPEG encoding
+ *
+ *****************************************************************************/
+double image_diff(gdImagePtr a, gdImagePtr b, int *max_diff) {
+
+	double sum = 0;
+
+	*max_diff = 0;
+	if (a->sx != b->sx || a->sy != b->sy || !a->trueColor || !b->trueColor) {
+		*max_diff = 255;
+		return 0;
+	}
+	for (int y = 0; y < a->sy; y++) {
+		for (int x = 0; x < a->sx; x++) {
+			int p = a->tpixels[y][x], q = b->tpixels[y][x];
+			int d[4] = {
+				gdTrueColorGetRed(p) - gdTrueColorGetRed(q),
+				gdTrueColorGetGreen(p) - gdTrueColorGetGreen(q),
+				gdTrueColorGetBlue(p) - gdTrueColorGetBlue(q),
+				gdTrueColorGetAlpha(p) - gdTrueColorGetAlpha(q)
+			};
+			for (int c = 0; c < 4; c++) {
+				if (abs(d[c]) > *max_diff) *max_diff = abs(d[c]);
+				if (c < 3) sum += d[c] * d[c];
+			}
+		}
+	}
+	if (sum == 0) return INFINITY;
+
+	return 10 * log10(255.0 * 255.0 / (sum / (3.0 * a->sx * a->sy)));
+}
+
+/* adds the comparison of out with ref to path (out is destroyed): pixels,
+ * and the resolution and interlacing gdImageClone() keeps in ref */
+void verify_add(FILE *out, verifyPath *path, const char *image, gdImagePtr ref, gdImagePtr res, int max_diff, double min_psnr) {
+
+	int diff = 255;
+	double psnr = 0;
+	int kept = 0;
+
+	if (res != NULL) {
+		psnr = image_diff(ref, res, &diff);
+		kept = (res->res_x == ref->res_x && res->res_y == ref->res_y && res->interlace == ref->interlace);
+		if (!kept) {
+			fprintf(out, "FAIL %-24s %s\tresolution %ux%u interlace %d (expected %ux%u interlace %d)\n", path->name, image,
+				res->res_x, res->res_y, res->interlace, ref->res_x, ref->res_y, ref->interlace);
+		}
+		gdImageDestroy(res);
+	}
+	path->images++;
+	if (diff > path->max_diff) path->max_diff = diff;
+	if (psnr < path->psnr) path->psnr = psnr;
+	if (diff > max_diff || psnr < min_psnr) {
+		fprintf(out, "FAIL %-24s %s\tmax_diff %d\tpsnr %.2f\n", path->name, image, diff, psnr);
+	}
+	if (diff > max_diff || psnr < min_psnr || !kept) {
+		path->failed++;
+	}
+}
+
+/******************************************************************************
+ * verify()
+ *
+ * Arguments:	out - 		where the results go
+ * 				dir - 		directory of the corpus
+ * 				images - 	images in the corpus
+ * 				texture - 	texture image
+ * 				max_diff - 	largest difference of a channel accepted
+ * 				min_psnr - 	lowest PSNR accepted (dB)
+ *
+ * Return:		(int) images out of the thresholds, over every path
+ *
+ * Description: golden image check of the optimized filter against the gd
+ * 				chain (contrast_image(), smooth_image() with SMOOTH_GD,
+ * 				texture_image() and sepia_image()), before encoding: the
+ * 				smoothing kernel alone, the fused filter with each SIMD
+ * 				level the CPU has, and the fused filter in bands (their
+ * 				seams). Every image of the corpus is checked, and a few tiny
+ * 				ones for the edges and the SIMD tails. The images are given
+ * 				VERIFY_RES dpi and interlacing, which every path must keep.
+ *
+ *****************************************************************************/
+int verify(FILE *out, char *dir, int images, gdImagePtr texture, int max_diff, double min_psnr) {
+
+	static const int tiny[][2] = {{1, 1}, {2, 3}, {17, 5}, {33, 1}, {1, 33}, {65, 9}};
+	int nn_tiny = (int) (sizeof(tiny) / sizeof(tiny[0]));
+	static const int levels[] = {SIMD_SCALAR, SIMD_SSE4, SIMD_AVX2};
+	static const char *level_names[] = {"scalar", "sse4", "avx2"};
+	verifyPath paths[5];
+	char name[strlen(dir) + 32];
+	int failed = 0;
+
+	memset(paths, 0, sizeof(paths));
+	strcpy(paths[0].name, "smooth_image");
+	for (int l = 0; l < 3; l++) {
+		sprintf(paths[1 + l].name, "old_photo_filter %s", level_names[l]);
+	}
+	sprintf(paths[4].name, "bands of %d rows", VERIFY_BAND);
+	for (int p = 0; p < 5; p++) paths[p].psnr = INFINITY;
+
+	for (int i = 0; i < images + nn_tiny; i++) {
+		gdImagePtr img;
+		if (i < images) {
+			sprintf(name, "%s/bench-%02d.jpg", dir, i);
+			img = read_jpeg_file(name);
+		} else {
+			sprintf(name, "%dx%d", tiny[i - images][0], tiny[i - images][1]);
+			img = synthetic_image(tiny[i - images][0], tiny[i - images][1], i);
+		}
+		if (img == NULL) {
+			fprintf(stderr, "Impossible to read %s image\n", name);
+			return failed + 1;
+		}
+		img->res_x = VERIFY_RES;
+		img->res_y = VERIFY_RES;
+		img->interlace = 1;
+		gdImageSetInterpolationMethod(texture, GD_BILINEAR_FIXED);
+		gdImagePtr scalled = gdImageScale(texture, img->sx, img->sy);
+
+		/* -> the reference: gd all the way */
+		smooth_select(SMOOTH_GD);
+		gdImagePtr contrasted = contrast_image(img);
+		gdImagePtr smoothed = smooth_image(contrasted);
+		gdImagePtr textured = texture_image(smoothed, scalled);
+		gdImagePtr ref = sepia_image(textured);
+		gdImageDestroy(textured);
+		smooth_select(SMOOTH_FAST);
+
+		/* -> smoothing kernel, on the same input */
+		verify_add(out, &paths[0], name, smoothed, smooth_image(contrasted), max_diff, min_psnr);
+		gdImageDestroy(contrasted);
+		gdImageDestroy(smoothed);
+
+		/* -> fused filter at each SIMD level (one the CPU doesn't have
+		 * would just repeat a lower one) */
+		for (int l = 0; l < 3; l++) {
+			if (simd_select(levels[l]) == levels[l]) {
+				verify_add(out, &paths[1 + l], name, ref, old_photo_filter(img, scalled, NULL), max_diff, min_psnr);
+			}
+		}
+		simd_select(SIMD_AUTO);
+
+		/* -> fused filter band by band, as split_image() does */
+		gdImagePtr banded = gdImageCreateTrueColor(img->sx, img->sy);
+		if (banded != NULL) {
+			copy_image_attributes(banded, img);
+			for (int y = 0; y < img->sy; y += VERIFY_BAND) {
+				int y1 = (y + VERIFY_BAND < img->sy) ? y + VERIFY_BAND : img->sy;
+				if (!old_photo_filter_rows(img, scalled, banded, y, y1)) {
+					gdImageDestroy(banded);
+					banded = NULL;
+					break;
+				}
+			}
+		}
+		verify_add(out, &paths[4], name, ref, banded, max_diff, min_psnr);
+
+		gdImageDestroy(ref);
+		gdImageDestroy(scalled);
+		gdImageDestroy(img);
+	}
+
+	for (int p = 0; p < 5; p++) {
+		if (paths[p].images == 0) {
+			fprintf(out, "verify %-24s skipped (not supported by the CPU)\n", paths[p].name);
+			continue;
+		}
+		char psnr[16] = "inf";
+		if (!isinf(paths[p].psnr)) sprintf(psnr, "%.2f", paths[p].psnr);
+		fprintf(out, "verify %-24s images %d\tmax_diff %d\tpsnr %s\t%s\n", paths[p].name, paths[p].images,
+			paths[p].max_diff, psnr, paths[p].failed ? "FAIL" : "ok");
+		failed += paths[p].failed;
+	}
+	return failed;
+}
+
+/******************************************************************************
+ * main()
+ *
+ * Arguments: <corpus_dir> [--threads 1,2,4,8] [--runs n] [--images n]
+ *            [--out file] [--verify [--max-diff n] [--min-psnr db]]
+ *            [-- options of old-photo-paral]
+ * Returns: 0 in case of sucess, 1 in case of failure
+ * Side-Effects: writes the corpus and runs old-photo-paral over it
+ *
+ * Description: one line per result, with the same keys in the same order on
+ *              every run, so the results of two commits can be diffed. With
+ *              --verify, only the golden image check runs (see verify())
+ *              and the exit status is 1 if any image fails it.
+ *
+ *****************************************************************************/
+int main(int argc, char **argv) {
+
+	static struct option long_options[] = {
+		{"threads", required_argument, NULL, 't'},
+		{"runs", required_argument, NULL, 'n'},
+		{"images", required_argument, NULL, 'i'},
+		{"out", required_argument, NULL, 'o'},
+		{"program", required_argument, NULL, 'p'},
+		{"verify", no_argument, NULL, 'V'},
+		{"max-diff", required_argument, NULL, 'd'},
+		{"min-psnr", required_argument, NULL, 'P'},
+		{NULL, 0, NULL, 0}
+	};
+	char *sweep = BENCH_THREADS;
+	char *program = PROGRAM;
+	char *outName = NULL;
+	int runs = BENCH_RUNS;
+	int images = BENCH_IMAGES;
+	int verifyMode = 0;
+	int maxDiff = VERIFY_MAX_DIFF;
+	double minPsnr = VERIFY_MIN_PSNR;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "t:n:i:o:p:Vd:P:", long_options, NULL)) != -1) {
+		switch (opt) {
+			case 't':
+				sweep = optarg;
+				break;
+			case 'n':
+				runs = atoi(optarg);
+				if (runs < 1) argc = -1;
+				break;
+			case 'i':
+				images = atoi(optarg);
+				if (images < 1) argc = -1;
+				break;
+			case 'o':
+				outName = optarg;
+				break;
+			case 'p':
+				program = optarg;
+				break;
+			case 'V':
+				verifyMode = 1;
+				break;
+			case 'd':
+				maxDiff = atoi(optarg);
+				if (maxDiff < 0) argc = -1;
+				break;
+			case 'P':
+				minPsnr = atof(optarg);
+				break;
+			default:
+				argc = -1;
+		}
+	}
+	if (argc - optind < 1) {
+		fprintf(stdout, "\n\tUse the command:\n\n\t./old-photo-bench <corpus_dir> [--threads 1,2,4,8] [--runs <n>] [--images <n>]\n\t\t[--out <file>] [--program ./old-photo-paral] [--verify [--max-diff <n>] [--min-psnr <db>]]\n\t\t[-- <old-photo-paral options>]\n\n");
+		exit(0);
+	}
+	char *dir = argv[optind];
+	char **extra = &argv[optind + 1];	/* after the directory (getopt stops at --) */
+
+	/* thread counts of the sweep */
+	int threads[MAX_SWEEP];
+	int nn_sweep = 0;
+	for (char *p = sweep; *p != '\0' && nn_sweep < MAX_SWEEP; p++) {
+		threads[nn_sweep] = (int) strtol(p, &p, 10);
+		if (threads[nn_sweep] < 1) {
+			fprintf(stderr, "Wrong thread counts - %s\n", sweep);
+			exit(1);
+		}
+		nn_sweep++;
+		if (*p == '\0') break;
+	}
+
+	FILE *out = (outName != NULL) ? fopen(outName, "w") : stdout;
+	if (out == NULL) {
+		fprintf(stderr, "Impossible to write %s\n", outName);
+		exit(1);
+	}
+
+	long long pixels, bytes;
+	if (!make_corpus(dir, images, &pixels, &bytes)) {
+		fprintf(stderr, "Impossible to write the corpus in %s\n", dir);
+		exit(1);
+	}
+	simd_select(SIMD_AUTO);
+	fprintf(out, "# old-photo-bench 1\n");
+	fprintf(out, "corpus images %d\tmegapixels %.3f\tbytes %lld\n", images, pixels / 1e6, bytes);
+	fprintf(out, "machine cpus %ld\tkernels %s\n", sysconf(_SC_NPROCESSORS_ONLN), simd_name());
+
+	/* -> golden image check instead of the benchmark */
+	if (verifyMode) {
+		gdImagePtr texture = read_png_file(PAPER_TEXTURE);
+		if (texture == NULL) {
+			fprintf(stderr, "Impossible to read %s texture\n", PAPER_TEXTURE);
+			exit(1);
+		}
+		fprintf(out, "thresholds max_diff %d\tpsnr %.2f\n", maxDiff, minPsnr);
+		int failed = verify(out, dir, images, texture, maxDiff, minPsnr);
+		gdImageDestroy(texture);
+		if (out != stdout) fclose(out);
+		exit(failed ? 1 : 0);
+	}
+
+	fprintf(out, "options");
+	for (int i = 0; extra[i] != NULL; i++) fprintf(out, " %s", extra[i]);
+	fprintf(out, "\n");
+
+	/* -> thread sweep: the median of the runs */
+	double wall[MAX_SWEEP];
+	for (int s = 0; s < nn_sweep; s++) {
+		double times[runs];
+		for (int r = 0; r < runs; r++) {
+			times[r] = run_program(program, dir, threads[s], extra);
+			if (times[r] < 0) {
+				fprintf(stderr, "Impossible to run %s over %s with %d threads\n", program, dir, threads[s]);
+				exit(1);
+			}
+		}
+		qsort(times, runs, sizeof(double), cmp_seconds);
+		wall[s] = times[runs / 2];
+	}
+
+	/* against one thread: without 1 in the sweep, the first count taken as
+	 * perfectly efficient */
+	double base = wall[0] * threads[0];
+	for (int s = 0; s < nn_sweep; s++) {
+		if (threads[s] == 1) base = wall[s];
+	}
+	for (int s = 0; s < nn_sweep; s++) {
+		double speedup = base / wall[s];
+		fprintf(out, "sweep threads %2d\twall_s %.3f\timages_per_s %.2f\tmegapixels_per_s %.2f\tspeedup %.2f\tefficiency %.2f\n",
+			threads[s], wall[s], images / wall[s], pixels / 1e6 / wall[s], speedup, speedup / threads[s]);
+	}
+
+	char outputs[strlen(dir) + 64];
+	sprintf(outputs, "rm -rf '%s%s' %s/timming_*.txt", dir, OLD_IMAGE_DIR, dir);
+	if (system(outputs) != 0) fprintf(stderr, "Impossible to remove %s%s\n", dir, OLD_IMAGE_DIR);
+
+	/* -> micro-benchmarks of each filter function, on one image */
+	gdImagePtr texture = read_png_file(PAPER_TEXTURE);
+	gdImagePtr img = synthetic_image(MICRO_WIDTH, MICRO_HEIGTH, 0);
+	if (texture == NULL || img == NULL) {
+		fprintf(stderr, "Impossible to read %s texture\n", PAPER_TEXTURE);
+		exit(1);
+	}
+	gdImageSetInterpolationMethod(texture, GD_BILINEAR_FIXED);
+	gdImagePtr scalled = gdImageScale(texture, MICRO_WIDTH, MICRO_HEIGTH);
+	encode_file = (char *) malloc(strlen(dir) + 32);
+	sprintf(encode_file, "%s/micro.jpg", dir);
+
+	micro(out, "contrast_image", bench_contrast, img, scalled);
+	micro(out, "smooth_image", bench_smooth, img, scalled);
+	micro(out, "texture_image", bench_texture, img, scalled);
+	micro(out, "sepia_image", bench_sepia, img, scalled);
+	micro(out, "old_photo_filter", bench_fused, img, scalled);
+	micro(out, "write_jpeg_file", bench_encode, img, scalled);
+	micro(out, "read_jpeg_file", bench_decode, img, scalled);
+
+	unlink(encode_file);
+	free(encode_file);
+	gdImageDestroy(scalled);
+	gdImageDestroy(texture);
+	gdImageDestroy(img);
+	if (out != stdout) fclose(out);
+
+	exit(0);
+}
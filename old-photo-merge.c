@@ -0,0 +1,397 @@
+/******************************************************************************
+ * Programacao Concorrente
+ * MEEC 21/22
+ *
+ * Projecto - Parte1
+ *                           old-photo-merge.c
+ *
+ * Merges the reports (--report) of the shards of a run split with --shard
+ * into one: every image, the stages over all of them and the throughput of
+ * the shards together.
+ *
+ * Compilacao: make old-photo-merge
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "image-lib.h"
+
+/* an image of a shard's report */
+typedef struct {
+
+	char *file;
+	int width;
+	int heigth;
+	long long ns[STAGES];
+
+} mergedImage;
+
+/******************************************************************************
+ * struct shardReport
+ *
+ * Atributes:	file - 		report of the shard
+ * 				threads - 	threads of the shard
+ * 				images - 	images it processed
+ * 				wall_s - 	time its threads took
+ * 				megapixels - 	pixels of its images
+ *
+ * Description: the throughput of a shard, from its report
+ *
+ *****************************************************************************/
+typedef struct {
+
+	const char *file;
+	int threads;
+	int images;
+	double wall_s;
+	double megapixels;
+
+} shardReport;
+
+mergedImage *images = NULL;		/* images of every report read so far */
+int nn_images = 0;
+int capacity = 0;
+
+/* for qsort() of stage times */
+int cmp_ns(const void *a, const void *b) {
+
+	long long x = *(const long long *) a;
+	long long y = *(const long long *) b;
+	return (x > y) - (x < y);
+}
+
+/* images by name, so the merged report doesn't depend on the order of
+ * the shards */
+int cmp_image(const void *a, const void *b) {
+
+	return strcmp(((const mergedImage *) a)->file, ((const mergedImage *) b)->file);
+}
+
+/* value at percentile p of n sorted times (nearest rank) */
+long long percentile(const long long *sorted, int n, int p) {
+
+	int rank = (int) (((long long) p * n + 99) / 100);
+	return (n > 0) ? sorted[(rank > 0 ? rank : 1) - 1] : 0;
+}
+
+/* a file name as a JSON string or CSV field */
+void put_name(FILE *fp, const char *name, int json) {
+
+	fputc('"', fp);
+	for (const char *c = name; *c; c++) {
+		if (json && (*c == '"' || *c == '\\')) fprintf(fp, "\\%c", *c);
+		else if (json && (unsigned char) *c < 0x20) fprintf(fp, "\\u%04x", *c);
+		else if (!json && *c == '"') fputs("\"\"", fp);
+		else fputc(*c, fp);
+	}
+	fputc('"', fp);
+}
+
+/* a name as put_name() wrote it, from p (at the opening quote); returns
+ * where it ends, NULL if it doesn't */
+char *get_name(char *p, char **name, int json) {
+
+	char *out;
+
+	if (*p != '"' || (out = *name = (char *) malloc(strlen(p))) == NULL) return NULL;
+	for (p++; *p != '\0'; p++) {
+		if (*p == '"' && !(!json && p[1] == '"')) {
+			*out = '\0';
+			return p + 1;
+		}
+		if (!json && *p == '"') p++;
+		else if (json && *p == '\\' && p[1] == 'u') {
+			unsigned int c;
+			if (sscanf(p + 2, "%4x", &c) != 1) break;
+			*out++ = (char) c;
+			p += 5;
+			continue;
+		} else if (json && *p == '\\') p++;
+		*out++ = *p;
+	}
+	free(*name);
+	return NULL;
+}
+
+/* appends an image to the merged ones */
+int add_image(mergedImage *img) {
+
+	if (nn_images == capacity) {
+		int grown = capacity ? 2 * capacity : 64;
+		mergedImage *more = (mergedImage *) realloc(images, grown * sizeof(mergedImage));
+		if (!more) return 0;
+		images = more;
+		capacity = grown;
+	}
+	images[nn_images++] = *img;
+	return 1;
+}
+
+/******************************************************************************
+ * read_report()
+ *
+ * Arguments:	file_name - 	report of a shard (JSON if it ends in .json,
+ * 								CSV otherwise, as old-photo-paral wrote it)
+ * 				shard - 	where its throughput is stored
+ *
+ * Return:		(bool)	1 in case of success, 0 otherwise
+ *
+ * Description: adds the images of the report to the merged ones. Stages
+ * 				are matched by name, so a stage the report doesn't have
+ * 				counts as 0.
+ *
+ *****************************************************************************/
+int read_report(const char *file_name, shardReport *shard) {
+
+	int json = strlen(file_name) > 5 && strcmp(file_name + strlen(file_name) - 5, ".json") == 0;
+	int column[STAGES + 8];		/* stage of each CSV column after height */
+	int columns = 0, section = 0;
+	char *line = NULL, *p;
+	size_t line_cap = 0;
+	FILE *fp;
+
+	memset(shard, 0, sizeof(shardReport));
+	shard->file = file_name;
+	shard->wall_s = -1;
+	fp = fopen(file_name, "r");
+	if (!fp) {
+		return 0;
+	}
+
+	while (getline(&line, &line_cap, fp) != -1) {
+		line[strcspn(line, "\r\n")] = '\0';
+		mergedImage img;
+		memset(&img, 0, sizeof(img));
+
+		/* -> JSON: one line per image, the throughput at the top */
+		if (json) {
+			if ((p = strstr(line, "{\"file\": ")) != NULL) {
+				if ((p = get_name(p + 9, &img.file, 1)) == NULL) break;
+				char *field;
+				if ((field = strstr(p, "\"width\": ")) != NULL) img.width = atoi(field + 9);
+				if ((field = strstr(p, "\"height\": ")) != NULL) img.heigth = atoi(field + 10);
+				for (int s = 0; s < STAGES; s++) {
+					char key[32];
+					sprintf(key, "\"%s_ms\": ", stage_name(s));
+					if ((field = strstr(p, key)) != NULL) img.ns[s] = (long long) (atof(field + strlen(key)) * 1e6 + 0.5);
+				}
+				if (!add_image(&img)) break;
+			} else if ((p = strstr(line, "\"threads\": ")) != NULL) {
+				shard->threads = atoi(p + 11);
+			} else if ((p = strstr(line, "\"wall_s\": ")) != NULL) {
+				shard->wall_s = atof(p + 10);
+			}
+			continue;
+		}
+
+		/* -> CSV: images, then stages, then throughput, apart by an
+		 *    empty line */
+		if (line[0] == '\0') {
+			section++;
+			continue;
+		}
+		if (section == 0 && strncmp(line, "file,", 5) == 0) {
+			/* header: the stage of each column */
+			char *name = strtok(line, ",");
+			for (int c = 0; name != NULL; c++, name = strtok(NULL, ",")) {
+				if (c < 3 || columns == STAGES + 8) continue;
+				column[columns] = -1;
+				for (int s = 0; s < STAGES; s++) {
+					if (strncmp(name, stage_name(s), strlen(stage_name(s))) == 0 && strcmp(name + strlen(stage_name(s)), "_ms") == 0) {
+						column[columns] = s;
+					}
+				}
+				columns++;
+			}
+		} else if (section == 0) {
+			if ((p = get_name(line, &img.file, 0)) == NULL) break;
+			img.width = (int) strtol(p + 1, &p, 10);
+			img.heigth = (int) strtol(p + 1, &p, 10);
+			for (int c = 0; c < columns && *p == ','; c++) {
+				double ms = strtod(p + 1, &p);
+				if (column[c] >= 0) img.ns[column[c]] = (long long) (ms * 1e6 + 0.5);
+			}
+			if (!add_image(&img)) break;
+		} else if (section == 2 && strncmp(line, "threads,", 8) != 0) {
+			shard->threads = (int) strtol(line, &p, 10);
+			strtol(p + 1, &p, 10);
+			shard->wall_s = strtod(p + 1, &p);
+		}
+	}
+	free(line);
+	int ok = shard->wall_s >= 0 && !ferror(fp);
+	fclose(fp);
+
+	return ok;
+}
+
+/******************************************************************************
+ * write_merged()
+ *
+ * Arguments:	file_name - 	merged report (JSON if it ends in .json, CSV
+ * 								otherwise)
+ * 				shards - 	throughput of each shard
+ * 				nn_shards - 	number of shards
+ *
+ * Return:		(bool)	1 in case of success, 0 otherwise
+ *
+ * Description: writes the report of the whole run as old-photo-paral
+ * 				would (every image, then p50/p95/p99 of each stage), then
+ * 				each shard and the throughput of all of them: shards run at
+ * 				once, so the run took as long as the slowest one. Imbalance
+ * 				is the slowest shard over the mean of them (1: even).
+ *
+ *****************************************************************************/
+int write_merged(const char *file_name, shardReport *shards, int nn_shards) {
+
+	int json = strlen(file_name) > 5 && strcmp(file_name + strlen(file_name) - 5, ".json") == 0;
+	double wall_s = 0, sum_s = 0, megapixels = 0;
+	long long *sorted;
+	int threads = 0;
+	FILE *fp;
+
+	sorted = (long long *) malloc((nn_images + 1) * sizeof(long long));
+	fp = fopen(file_name, "w");
+	if (!sorted || !fp) {
+		free(sorted);
+		if (fp) fclose(fp);
+		return 0;
+	}
+	for (int i = 0; i < nn_shards; i++) {
+		if (shards[i].wall_s > wall_s) wall_s = shards[i].wall_s;
+		sum_s += shards[i].wall_s;
+		megapixels += shards[i].megapixels;
+		threads += shards[i].threads;
+	}
+	double imbalance = sum_s > 0 ? wall_s * nn_shards / sum_s : 1.0;
+
+	/* -> throughput of the run and of each shard */
+	if (json) {
+		fprintf(fp, "{\n  \"shards\": %d,\n  \"threads\": %d,\n  \"images\": %d,\n  \"wall_s\": %.6f,\n", nn_shards, threads, nn_images, wall_s);
+		fprintf(fp, "  \"images_per_s\": %.3f,\n  \"megapixels_per_s\": %.3f,\n  \"imbalance\": %.3f,\n",
+			wall_s > 0 ? nn_images / wall_s : 0.0, wall_s > 0 ? megapixels / wall_s : 0.0, imbalance);
+		fprintf(fp, "  \"per_shard\": [\n");
+		for (int i = 0; i < nn_shards; i++) {
+			fprintf(fp, "    {\"report\": ");
+			put_name(fp, shards[i].file, 1);
+			fprintf(fp, ", \"threads\": %d, \"images\": %d, \"wall_s\": %.6f, \"images_per_s\": %.3f, \"megapixels_per_s\": %.3f}%s\n",
+				shards[i].threads, shards[i].images, shards[i].wall_s, shards[i].wall_s > 0 ? shards[i].images / shards[i].wall_s : 0.0,
+				shards[i].wall_s > 0 ? shards[i].megapixels / shards[i].wall_s : 0.0, (i + 1 < nn_shards) ? "," : "");
+		}
+		fprintf(fp, "  ],\n  \"per_image\": [\n");
+	} else {
+		fprintf(fp, "file,width,height");
+		for (int s = 0; s < STAGES; s++) fprintf(fp, ",%s_ms", stage_name(s));
+		fprintf(fp, "\n");
+	}
+
+	/* -> per image */
+	for (int i = 0; i < nn_images; i++) {
+		if (json) {
+			fprintf(fp, "    {\"file\": ");
+			put_name(fp, images[i].file, 1);
+			fprintf(fp, ", \"width\": %d, \"height\": %d", images[i].width, images[i].heigth);
+			for (int s = 0; s < STAGES; s++) fprintf(fp, ", \"%s_ms\": %.3f", stage_name(s), images[i].ns[s] / 1e6);
+			fprintf(fp, "}%s\n", (i + 1 < nn_images) ? "," : "");
+		} else {
+			put_name(fp, images[i].file, 0);
+			fprintf(fp, ",%d,%d", images[i].width, images[i].heigth);
+			for (int s = 0; s < STAGES; s++) fprintf(fp, ",%.3f", images[i].ns[s] / 1e6);
+			fprintf(fp, "\n");
+		}
+	}
+
+	/* -> per stage */
+	if (json) {
+		fprintf(fp, "  ],\n  \"stages\": {\n");
+	} else {
+		fprintf(fp, "\nstage,images,total_ms,mean_ms,p50_ms,p95_ms,p99_ms\n");
+	}
+	for (int s = 0; s < STAGES; s++) {
+		long long total = 0;
+		for (int i = 0; i < nn_images; i++) {
+			sorted[i] = images[i].ns[s];
+			total += sorted[i];
+		}
+		qsort(sorted, nn_images, sizeof(long long), cmp_ns);
+		if (json) {
+			fprintf(fp, "    \"%s\": {\"total_ms\": %.3f, \"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p95_ms\": %.3f, \"p99_ms\": %.3f}%s\n",
+				stage_name(s), total / 1e6, nn_images ? total / 1e6 / nn_images : 0.0, percentile(sorted, nn_images, 50) / 1e6,
+				percentile(sorted, nn_images, 95) / 1e6, percentile(sorted, nn_images, 99) / 1e6, (s + 1 < STAGES) ? "," : "");
+		} else {
+			fprintf(fp, "%s,%d,%.3f,%.3f,%.3f,%.3f,%.3f\n", stage_name(s), nn_images, total / 1e6, nn_images ? total / 1e6 / nn_images : 0.0,
+				percentile(sorted, nn_images, 50) / 1e6, percentile(sorted, nn_images, 95) / 1e6, percentile(sorted, nn_images, 99) / 1e6);
+		}
+	}
+
+	if (json) {
+		fprintf(fp, "  }\n}\n");
+	} else {
+		fprintf(fp, "\nreport,threads,images,wall_s,images_per_s,megapixels_per_s\n");
+		for (int i = 0; i < nn_shards; i++) {
+			put_name(fp, shards[i].file, 0);
+			fprintf(fp, ",%d,%d,%.6f,%.3f,%.3f\n", shards[i].threads, shards[i].images, shards[i].wall_s,
+				shards[i].wall_s > 0 ? shards[i].images / shards[i].wall_s : 0.0, shards[i].wall_s > 0 ? shards[i].megapixels / shards[i].wall_s : 0.0);
+		}
+		fprintf(fp, "\nshards,threads,images,wall_s,images_per_s,megapixels_per_s,imbalance\n");
+		fprintf(fp, "%d,%d,%d,%.6f,%.3f,%.3f,%.3f\n", nn_shards, threads, nn_images, wall_s,
+			wall_s > 0 ? nn_images / wall_s : 0.0, wall_s > 0 ? megapixels / wall_s : 0.0, imbalance);
+	}
+
+	free(sorted);
+	return fclose(fp) == 0;
+}
+
+/******************************************************************************
+ * main()
+ *
+ * Arguments: (none)
+ * Returns: 0 in case of sucess, 1 in case of failure
+ * Side-Effects: writes the merged report
+ *
+ * Description: reads the report of each shard and writes the merged one.
+ *              An image in more than one report (shards that overlapped)
+ *              is counted each time, and said so.
+ *
+ *****************************************************************************/
+int main(int argc, char **argv) {
+
+	if (argc < 3) {
+		fprintf(stdout, "\n\tUse the command:\n\n\t./old-photo-merge <merged.csv|merged.json> <shard report>...\n\n");
+		exit(0);
+	}
+	int nn_shards = argc - 2;
+	shardReport shards[nn_shards];
+
+	for (int i = 0; i < nn_shards; i++) {
+		int first = nn_images;
+		if (!read_report(argv[i + 2], &shards[i])) {
+			fprintf(stderr, "Impossible to read %s report\n", argv[i + 2]);
+			exit(1);
+		}
+		shards[i].images = nn_images - first;
+		for (int j = first; j < nn_images; j++) {
+			shards[i].megapixels += (double) images[j].width * images[j].heigth / 1e6;
+		}
+	}
+
+	qsort(images, nn_images, sizeof(mergedImage), cmp_image);
+	for (int i = 1; i < nn_images; i++) {
+		if (strcmp(images[i].file, images[i - 1].file) == 0) {
+			fprintf(stderr, "In more than one shard - %s\n", images[i].file);
+		}
+	}
+
+	if (!write_merged(argv[1], shards, nn_shards)) {
+		fprintf(stderr, "Impossible to write %s report\n", argv[1]);
+		exit(1);
+	}
+	for (int i = 0; i < nn_images; i++) {
+		free(images[i].file);
+	}
+	free(images);
+
+	exit(0);
+}
@@ -18,18 +18,30 @@
 #include <pthread.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <sys/resource.h>
 #include "image-lib.h"
 
 /* the directories wher output files will be placed */
 #define OLD_IMAGE_DIR "/old_photo_PAR_A"
 /* the paper texture file path */
 #define PAPER_TEXTURE "./paper-texture.png"
+/* how many scaled textures (one per image size) are kept */
+#define TEXTURE_CACHE_SIZE 8
+/* images from this size (megapixels) up are filtered as a stream of rows */
+#define STREAM_MEGAPIXELS 64
+/* imageTimes records allocated at a time by each thread */
+#define TIMES_CHUNK 256
+/* trace events kept per thread with --trace (the latest ones) */
+#define TRACE_EVENTS 65536
 
 /******************************************************************************
  * struct argsPack
  *
- * Atributes:	st - 		start index
- * 				end - 		end index
+ * Atributes:	id - 		thread number
  *
  * Description: the atributes of this struct correlate directly to the arguments
  * 				of the function:
@@ -38,15 +50,73 @@
  *****************************************************************************/
 typedef struct {
 
-	int rem;
+	int id;
 
 } argsPack;
 
+/******************************************************************************
+ * struct imageTimes
+ *
+ * Atributes:	index - 	index of the image in the list
+ * 				width, heigth - 	size of the image
+ * 				t - 		time in each stage
+ * 				hash, size, mtime - 	the input as it was read, for the
+ * 							manifest
+ * 				writer - 	writer stage thread that wrote it, plus one
+ * 							(0: none)
+ * 				queued - 	set once its output is left to the writer
+ * 							(the writer says when it's done with it)
+ *
+ * Description: the stages of one image. Filled by the threads the image
+ * 				goes through (one stage each), the writer last.
+ *
+ *****************************************************************************/
+typedef struct {
+
+	int index;
+	int width;
+	int heigth;
+	stageTimes t;
+	uint64_t hash;
+	long long size;
+	struct timespec mtime;
+	int writer;
+	int queued;
+
+} imageTimes;
+
+/******************************************************************************
+ * struct timesChunk
+ *
+ * Atributes:	rec - 		records
+ * 				used - 		records taken
+ * 				next - 		previous chunk of the thread
+ *
+ * Description: records of the images a thread took. Only the thread adds
+ * 				to its chunks, and they never move, so other threads can
+ * 				fill in their stages without locks.
+ *
+ *****************************************************************************/
+typedef struct timesChunk {
+
+	imageTimes rec[TIMES_CHUNK];
+	int used;
+	struct timesChunk *next;
+
+} timesChunk;
+
 /******************************************************************************
  * struct retPack
  *
  * Atributes:	cnt - 		number of files read
+ * 				bands - 	number of bands filtered for other threads
  * 				times - 	time struct storing thread execution time
+ * 				idle_ns - 	time spent waiting for work (nanoseconds)
+ * 				pool_* - 	image pool high-water marks and counters
+ * 				streamed - 	number of images filtered as a stream of rows
+ * 				stream_peak - 	most memory a streamed image used (bytes)
+ * 				input - 	bytes read, time reading and time decoding
+ * 				records - 	stages of every image the thread took
  *
  * Description: struct to store how many files were read and time of execution
  * 				of each thread
@@ -55,108 +125,1297 @@ typedef struct {
 typedef struct {
 
 	struct timespec times;
+	long long idle_ns;
 	int cnt;
+	int bands;
+	size_t pool_high_water;
+	int pool_buffers;
+	long pool_allocs;
+	long pool_reuses;
+	long pool_fallbacks;
+	int streamed;
+	size_t stream_peak;
+	readStats input;
+	timesChunk *records;
 
 } retPack;
 
+/******************************************************************************
+ * struct bandJob
+ *
+ * Atributes:	in, texture, out - 	images given to old_photo_filter_rows()
+ * 				nn_bands - 			number of bands the image is split in
+ * 				band_rows - 		rows in each band (the last may have less)
+ * 				next_band - 		next band to be taken by a thread
+ * 				done_bands - 		bands already filtered
+ * 				failed - 			set if a band couldn't be filtered
+ * 				times - 			stages of the bands (with --report)
+ * 				next - 				next image being split
+ *
+ * Description: an image split in horizontal bands, so idle threads can help
+ * 				the thread that read it. Protected by band_lock.
+ *
+ *****************************************************************************/
+typedef struct bandJob {
+
+	gdImagePtr in;
+	gdImagePtr texture;
+	gdImagePtr out;
+	int nn_bands;
+	int band_rows;
+	int next_band;
+	int done_bands;
+	int failed;
+	stageTimes times;
+	struct bandJob *next;
+
+} bandJob;
+
+/* when images are split in bands */
+#define BANDS_OFF		0
+#define BANDS_AUTO		1
+#define BANDS_ALWAYS	2
+/* bands per thread when splitting, so faster threads can take more */
+#define BANDS_PER_THREAD 4
+/* smallest band worth giving to another thread */
+#define BAND_MIN_ROWS	32
+
+/* slots in each queue between pipeline stages, per consumer thread */
+#define PIPELINE_QUEUE_SLOTS 2
+
+/******************************************************************************
+ * struct pipelineItem
+ *
+ * Atributes:	file - 		path of the file (an entry of the list)
+ * 				rec - 		its stages (and index in the list)
+ * 				img - 		the decoded image, then the filtered one
+ * 				bytes - 	memory reserved for it (with --mem-budget)
+ *
+ * Description: an image travelling between the stages of the pipeline
+ *
+ *****************************************************************************/
+typedef struct {
+
+	char *file;
+	imageTimes *rec;
+	gdImagePtr img;
+	size_t bytes;
+
+} pipelineItem;
+
+/******************************************************************************
+ * struct deferredFile
+ *
+ * Atributes:	index - 	index of the file in the list
+ * 				file - 		the file (an entry of the list, already checked)
+ * 				bytes - 	memory it needs (see filter_memory())
+ *
+ * Description: an image put aside by take_file() because it didn't fit the
+ * 				memory budget when its turn came
+ *
+ *****************************************************************************/
+typedef struct {
+
+	int index;
+	char *file;
+	size_t bytes;
+
+} deferredFile;
+
 /* declare all global variables */
 char *dir;				/* directory passed as argument */
-char **files;			/* files in given directory to be processed */
+fileList *list;			/* files in given directory to be processed */
 gdImagePtr texture;		/* texture image */
-int nn_files = 0;
+textureCache *textures;	/* texture scaled to each image size */
 int nn_threads = 0;
+atomic_int next_file;	/* index of the next file to be taken by a thread */
+int bandMode = BANDS_AUTO;
+int smoothMode = SMOOTH_FAST;
+int hugePages = 0;		/* back the image pools with huge pages */
+long long streamPixels = STREAM_MEGAPIXELS * 1000000LL;	/* -1: never stream */
+int writerMode = WRITER_URING;	/* -1: each thread writes its own files */
+asyncWriter *writer = NULL;		/* writes the output files in the background */
+int manifestMode = 1;			/* 0: an existing output is always taken as done */
+manifest *outputs = NULL;		/* inputs whose outputs earlier runs wrote */
+int watchMode = 0;				/* go on with the files that show up */
+char *reportFile = NULL;		/* per image, per stage report (CSV or JSON) */
+char *traceFile = NULL;			/* Chrome trace of every thread */
+int perfMode = 0;				/* hardware counters of each stage */
+int maxDimension = 0;			/* longest side of the outputs, 0: full size */
+int timeStages = 0;				/* stages timed (--report or --perf) */
+size_t memBudgetBytes = 0;		/* memory of the images in flight, 0: no limit */
+memBudget *budget = NULL;
+int shard = 0, shards = 1;		/* this process' share of the list (--shard) */
+int shardMode = SHARD_HASH;
+
+/* images put aside for smaller ones while the budget is used up (up to
+ * nn_threads), and how many were */
+deferredFile *deferred = NULL;
+int deferred_nr = 0;
+atomic_int deferred_cnt;
+pthread_mutex_t deferred_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* time from a watched file showing up to its output being written */
+atomic_int latency_cnt;
+atomic_llong latency_sum;
+atomic_llong latency_max;
+
+/* images being split in bands, and threads that may still split one */
+bandJob *band_jobs = NULL;
+int busy_threads = 0;
+pthread_mutex_t band_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t band_cond = PTHREAD_COND_INITIALIZER;
+
+/* staged pipeline (--readers/--writers): readers -> decoded -> filter
+ * threads -> filtered -> writers */
+int nn_readers = 0;
+int nn_writers = 0;
+workQueue *decoded;
+workQueue *filtered;
+atomic_int readers_left;
+atomic_int filters_left;
+atomic_int *writes_done;	/* outputs in place of each writer stage thread */
+
+/* pixels filtered so far, to estimate the work left in the queue */
+atomic_llong done_pixels;
+atomic_int done_images;
+
+/******************************************************************************
+ * add_stages()
+ *
+ * Arguments:	sum - 	where the stages are added
+ * 				t - 	stages to add
+ *
+ * Return:		(void)
+ *
+ * Description: adds the time and the counters of each stage
+ *
+ *****************************************************************************/
+void add_stages(stageTimes *sum, const stageTimes *t) {
+
+	for (int s = 0; s < STAGES; s++) {
+		sum->ns[s] += t->ns[s];
+		for (int c = 0; c < PERF_COUNTERS; c++) {
+			sum->events[s][c] += t->events[s][c];
+		}
+	}
+}
+
+/******************************************************************************
+ * take_band()
+ *
+ * Arguments:	job - 	image to take the band from, or NULL for any image
+ * 				band - 	where the band number is stored
+ *
+ * Return:		(bandJob *)	the image the band belongs to, NULL if there is no
+ * 							band left
+ *
+ * Description: takes the next band nobody is filtering yet. band_lock must be
+ * 				held.
+ *
+ *****************************************************************************/
+bandJob *take_band(bandJob *job, int *band) {
+
+	for (bandJob *j = (job != NULL) ? job : band_jobs; j != NULL; j = j->next) {
+		if (j->next_band < j->nn_bands) {
+			*band = j->next_band++;
+			return j;
+		}
+		if (job != NULL) break;
+	}
+	return NULL;
+}
+
+/******************************************************************************
+ * filter_band()
+ *
+ * Arguments:	job - 	image the band belongs to
+ * 				band - 	band number
+ *
+ * Return:		(void)
+ *
+ * Description: filters one band of an image split by split_image() and wakes
+ * 				up its owner when it was the last one
+ *
+ *****************************************************************************/
+void filter_band(bandJob *job, int band) {
+
+	int y0 = band * job->band_rows;
+	int y1 = y0 + job->band_rows;
+	if (y1 > job->in->sy) y1 = job->in->sy;
+
+	/* the stages of a band go to the image, whichever thread filters it */
+	stageTimes times = {0};
+	stageTimes *prev = timeStages ? stage_sink(&times) : NULL;
+	long long start = stage_clock();
+
+	int ok = old_photo_filter_rows(job->in, job->texture, job->out, y0, y1);
+
+	trace_event("band", start, stage_clock());
+	if (timeStages) stage_sink(prev);
+
+	pthread_mutex_lock(&band_lock);
+	if (!ok) job->failed = 1;
+	add_stages(&job->times, &times);
+	if (++job->done_bands == job->nn_bands) {
+		pthread_cond_broadcast(&band_cond);
+	}
+	pthread_mutex_unlock(&band_lock);
+}
+
+/******************************************************************************
+ * should_split()
+ *
+ * Arguments:	img - 	image just read
+ *
+ * Return:		(bool)	1 if img should be split in bands
+ *
+ * Description: in auto mode an image is split when the other threads would run
+ * 				out of images before it is done: the work left in the queue
+ * 				(files left x pixels per image so far) is less than what this
+ * 				image takes one thread, times the number of other threads.
+ * 				While the list is still being read only the entries read so
+ * 				far count. Never while watching: the other threads wait for
+ * 				the next file in file_list_get(), not for bands, so the
+ * 				image would be split for its own thread alone.
+ *
+ *****************************************************************************/
+int should_split(gdImagePtr img) {
+
+	if (bandMode == BANDS_OFF || nn_threads < 2 || !img->trueColor) return 0;
+	/* bands only exist for the fused kernel, not for gdImageSmooth() or a
+	 * pipeline that smooths more than once */
+	if (smoothMode == SMOOTH_GD || !pipeline_fused()) return 0;
+	if (img->sy < 2 * BAND_MIN_ROWS) return 0;
+	if (bandMode == BANDS_ALWAYS) return 1;
+	if (watchMode) return 0;
+
+	long long pixels = (long long) img->sx * img->sy;
+	long long left = file_list_count(list) - atomic_load(&next_file);
+	int images = atomic_load(&done_images);
+	long long avg = (images > 0) ? atomic_load(&done_pixels) / images : pixels;
+
+	if (left < 0) left = 0;
+	return left * avg < pixels * (nn_threads - 1);
+}
+
+/******************************************************************************
+ * split_image()
+ *
+ * Arguments:	img - 		image to filter
+ * 				scalled - 	texture at the image size
+ * 				pool - 		pool of the thread, for the output image
+ * 				times - 	where the stages of all the bands are added
+ *
+ * Return:		(gdImagePtr)	the filtered image, NULL in case of failure
+ *
+ * Description: filters img split in bands of rows, taken by this thread and by
+ * 				any thread without an image, and waits for all of them
+ *
+ *****************************************************************************/
+gdImagePtr split_image(gdImagePtr img, gdImagePtr scalled, imagePool *pool, stageTimes *times) {
+
+	bandJob job;
+	bandJob **prev;
+	int band;
+
+	job.in = img;
+	job.texture = scalled;
+	job.out = pool_image_create(pool, img->sx, img->sy);
+	if (job.out == NULL) return NULL;
+	copy_image_attributes(job.out, img);
+	job.nn_bands = nn_threads * BANDS_PER_THREAD;
+	job.band_rows = (img->sy + job.nn_bands - 1) / job.nn_bands;
+	if (job.band_rows < BAND_MIN_ROWS) job.band_rows = BAND_MIN_ROWS;
+	job.nn_bands = (img->sy + job.band_rows - 1) / job.band_rows;
+	job.next_band = 0;
+	job.done_bands = 0;
+	job.failed = 0;
+	memset(&job.times, 0, sizeof(job.times));
+
+	/* publish it to the other threads */
+	pthread_mutex_lock(&band_lock);
+	job.next = band_jobs;
+	band_jobs = &job;
+	pthread_cond_broadcast(&band_cond);
+
+	while (take_band(&job, &band) != NULL) {
+		pthread_mutex_unlock(&band_lock);
+		filter_band(&job, band);
+		pthread_mutex_lock(&band_lock);
+	}
+
+	/* wait for the bands other threads took */
+	while (job.done_bands < job.nn_bands) {
+		pthread_cond_wait(&band_cond, &band_lock);
+	}
+	for (prev = &band_jobs; *prev != &job; prev = &(*prev)->next);
+	*prev = job.next;
+	pthread_mutex_unlock(&band_lock);
+
+	add_stages(times, &job.times);
+	if (job.failed) {
+		pool_image_destroy(pool, job.out);
+		return NULL;
+	}
+	return job.out;
+}
+
+/******************************************************************************
+ * times_new()
+ *
+ * Arguments:	records - 	chunks of the thread
+ * 				i - 		index of the image in the list
+ *
+ * Return:		(imageTimes *)	a new record, NULL in case of failure
+ *
+ * Description: takes a record for an image from the chunks of the thread
+ * 				(a new chunk when the last one is full)
+ *
+ *****************************************************************************/
+imageTimes *times_new(timesChunk **records, int i) {
+
+	timesChunk *chunk = *records;
+
+	if (chunk == NULL || chunk->used == TIMES_CHUNK) {
+		chunk = (timesChunk *) malloc(sizeof(timesChunk));
+		if (chunk == NULL) return NULL;
+		chunk->used = 0;
+		chunk->next = *records;
+		*records = chunk;
+	}
+
+	imageTimes *rec = &chunk->rec[chunk->used++];
+	memset(rec, 0, sizeof(imageTimes));
+	rec->index = i;
+	return rec;
+}
+
+/******************************************************************************
+ * times_free()
+ *
+ * Arguments:	records - 	chunks of a thread
+ *
+ * Return:		(void)
+ *
+ * Description: frees the chunks of a thread
+ *
+ *****************************************************************************/
+void times_free(timesChunk *records) {
+
+	while (records != NULL) {
+		timesChunk *next = records->next;
+		free(records);
+		records = next;
+	}
+}
+
+/******************************************************************************
+ * input_read()
+ *
+ * Arguments:	rec - 		record of the input
+ * 				input - 	counters of the thread that just read it
+ *
+ * Return:		(void)
+ *
+ * Description: keeps what the input was when it was read (hash, size and
+ * 				mtime), so the manifest records the file the output was
+ * 				made from, even if it changes before the output is written
+ *
+ *****************************************************************************/
+void input_read(imageTimes *rec, const readStats *input) {
+
+	rec->hash = input->hash;
+	rec->size = input->size;
+	rec->mtime = input->mtime;
+}
+
+/******************************************************************************
+ * output_written()
+ *
+ * Arguments:	arg - 		record of the input (imageTimes)
+ * 				write_ns - 	time the writer took, 0 if it was timed already,
+ * 							-1 if the writer couldn't write it
+ *
+ * Return:		(void)
+ *
+ * Description: the output of an input is in place: counts it for its writer
+ * 				stage thread (the background writer calls this once a file
+ * 				is written), records the input in the manifest, so
+ * 				later runs skip it while it doesn't change, and for a
+ * 				watched file how long it took since it showed up. Either
+ * 				way the entry is done with (file_list_done()).
+ *
+ *****************************************************************************/
+void output_written(void *arg, long long write_ns) {
+
+	imageTimes *rec = (imageTimes *) arg;
+	char *file = file_list_peek(list, rec->index);
+	long long arrived = file_list_arrival(list, rec->index);
+
+	if (write_ns < 0) {
+		file_list_done(list, rec->index);
+		return;
+	}
+	rec->t.ns[STAGE_WRITE] += write_ns;
+	if (rec->writer > 0) {
+		atomic_fetch_add(&writes_done[rec->writer - 1], 1);
+	}
+
+	if (outputs != NULL) {
+		manifest_record(outputs, file + strlen(dir) + 1, rec->hash, rec->size, &rec->mtime);
+	}
+
+	if (arrived > 0) {
+		long long latency = stage_clock() - arrived;
+		long long max = atomic_load(&latency_max);
+		while (latency > max && !atomic_compare_exchange_weak(&latency_max, &max, latency));
+		atomic_fetch_add(&latency_sum, latency);
+		atomic_fetch_add(&latency_cnt, 1);
+		fprintf(stdout, "Written:\t%s\tlatency %lld.%03lld s\n", file, latency / 1000000000, (latency % 1000000000) / 1000000);
+	}
+	file_list_done(list, rec->index);
+}
+
+/******************************************************************************
+ * image_memory()
+ *
+ * Arguments:	file - 	the file (an entry of the list, already checked)
+ *
+ * Return:		(size_t)	memory the image is expected to take
+ *
+ * Description: reads the size of the image from its header (nothing is
+ * 				decoded) and estimates its memory with filter_memory(), as
+ * 				it will go: streamed or whole
+ *
+ *****************************************************************************/
+size_t image_memory(char *file) {
+
+	int width, heigth, format;
+
+	/* size unknown: it fails before taking any memory */
+	format = read_image_dimensions(file, &width, &heigth);
+	if (format == FORMAT_UNKNOWN) return 0;
+
+	return filter_memory(width, heigth, format, nn_readers == 0 && format == FORMAT_JPEG
+		&& output_format(NULL) == FORMAT_JPEG && streamPixels >= 0 && maxDimension == 0
+		&& (long long) width * heigth >= streamPixels);
+}
+
+/******************************************************************************
+ * take_file()
+ *
+ * Arguments:	index - 	where the index of the file in the list is stored
+ * 				bytes - 	where the memory reserved for it is stored (0
+ * 							without a budget)
+ *
+ * Return:		(char *)	the next file to process (already checked, see
+ * 							file_list_check()), NULL if there are none left
+ *
+ * Description: takes the next file from the list. With --mem-budget the
+ * 				image reserves its memory first: one that doesn't fit is put
+ * 				aside for the next ones, so a thread picks a smaller image
+ * 				instead of waiting; images put aside are taken back as soon
+ * 				as they fit. With nn_threads of them aside (or when watching,
+ * 				where the list may never end) the thread waits for the
+ * 				oldest one to fit instead, and so does it for the ones left
+ * 				when the list is done.
+ *
+ *****************************************************************************/
+char *take_file(int *index, size_t *bytes) {
+
+	deferredFile wait = {0, NULL, 0};
+	char *file;
+	int i;
+
+	*bytes = 0;
+
+	/* an image put aside that fits now */
+	if (budget != NULL) {
+		pthread_mutex_lock(&deferred_lock);
+		for (int d = 0; d < deferred_nr; d++) {
+			if (mem_budget_try(budget, deferred[d].bytes)) {
+				*index = deferred[d].index;
+				*bytes = deferred[d].bytes;
+				file = deferred[d].file;
+				memmove(&deferred[d], &deferred[d + 1], (deferred_nr - d - 1) * sizeof(deferredFile));
+				deferred_nr--;
+				pthread_mutex_unlock(&deferred_lock);
+				return file;
+			}
+		}
+		pthread_mutex_unlock(&deferred_lock);
+	}
+
+	/* the next files of the list */
+	while ((file = file_list_get(list, i = atomic_fetch_add(&next_file, 1))) != NULL) {
+		if (!file_list_check(list, file)) {
+			file_list_done(list, i);
+			continue;
+		}
+		*index = i;
+		if (budget == NULL) {
+			return file;
+		}
+		*bytes = image_memory(file);
+		if (mem_budget_try(budget, *bytes)) {
+			return file;
+		}
+
+		/* doesn't fit: aside, or in place of the oldest one aside */
+		pthread_mutex_lock(&deferred_lock);
+		if (!watchMode) {
+			if (deferred_nr == nn_threads) {
+				wait = deferred[0];
+				memmove(&deferred[0], &deferred[1], (deferred_nr - 1) * sizeof(deferredFile));
+				deferred_nr--;
+			}
+			deferred[deferred_nr].index = i;
+			deferred[deferred_nr].file = file;
+			deferred[deferred_nr].bytes = *bytes;
+			deferred_nr++;
+			atomic_fetch_add(&deferred_cnt, 1);
+		} else {
+			wait.index = i;
+			wait.file = file;
+			wait.bytes = *bytes;
+		}
+		pthread_mutex_unlock(&deferred_lock);
+		if (wait.file != NULL) break;
+	}
+
+	/* the list is done: the oldest image put aside */
+	if (budget != NULL && wait.file == NULL) {
+		pthread_mutex_lock(&deferred_lock);
+		if (deferred_nr > 0) {
+			wait = deferred[0];
+			memmove(&deferred[0], &deferred[1], (deferred_nr - 1) * sizeof(deferredFile));
+			deferred_nr--;
+		}
+		pthread_mutex_unlock(&deferred_lock);
+	}
+	if (wait.file == NULL) {
+		return NULL;
+	}
+	mem_budget_reserve(budget, wait.bytes, NULL);
+	*index = wait.index;
+	*bytes = wait.bytes;
+	return wait.file;
+}
+
+/******************************************************************************
+ * filter_image()
+ *
+ * Arguments:	rec - 	record of the image (index of the file in the list)
+ * 				file - 	the file (an entry of the list, already checked)
+ * 				pool - 	pool of the thread, for the decoded and output image
+ * 				ret - 	where the streaming and input counters are kept
+ *
+ * Return:		(bool)	1 if the image was read, 0 otherwise
+ *
+ * Description: reads the image, applies the old photo filter to it (split in
+ * 				bands if other threads are running out of work) and writes
+ * 				it to the output directory. Images of streamPixels or more
+ * 				are never held whole: they go through
+ * 				old_photo_filter_stream() a band of rows at a time.
+ * 				The file nn_threads places ahead (likely the next one this
+ * 				thread takes) is prefetched while this one is processed.
+ * 				The output is encoded in memory and left to the writer.
+ *
+ *****************************************************************************/
+int filter_image(imageTimes *rec, char *file, imagePool *pool, retPack *ret) {
+
+	/* declare image ptrs */
+	gdImagePtr img;
+	gdImagePtr oldImage;
+	gdImagePtr scalledTexture;
+	int width, heigth;
+	size_t peak;
+	long long t;
+
+	char outFileName[128];
+	char *ahead;
+
+	/* outFileName, with the extension of the output format */
+	sprintf(outFileName, "%s%s%s", dir,  OLD_IMAGE_DIR, strrchr(file, '/'));
+	if (!output_name(outFileName, sizeof(outFileName))) {
+		fprintf(stderr, "Impossible to write %s image\n", outFileName);
+		return 0;
+	}
+
+	fprintf(stdout, "%s\n", file);
+
+	if ((ahead = file_list_peek(list, rec->index + nn_threads)) != NULL) {
+		prefetch_file(ahead);
+	}
+
+	/* very large JPEGs to JPEG: decode, filter and encode a band at a time
+	 * (not when they are brought down to maxDimension anyway) */
+	if (streamPixels >= 0 && maxDimension == 0 && output_format(NULL) == FORMAT_JPEG && read_jpeg_dimensions(file, &width, &heigth)
+		&& (long long) width * heigth >= streamPixels) {
+		switch (old_photo_filter_stream(file, outFileName, texture, &peak, &ret->input)) {
+			case 1:
+				rec->width = width;
+				rec->heigth = heigth;
+				input_read(rec, &ret->input);
+				output_written(rec, 0);
+				ret->streamed++;
+				if (peak > ret->stream_peak) ret->stream_peak = peak;
+				atomic_fetch_add(&done_pixels, (long long) width * heigth);
+				atomic_fetch_add(&done_images, 1);
+				return 1;
+			case 0:
+				fprintf(stderr, "Impossible to filter %s image\n", file);
+				return 0;
+		}
+		/* can't be streamed: read it whole */
+	}
+
+	/* load of the input file */
+	img = read_image_file_pool(file, pool, &ret->input);
+	if (img == NULL){
+		fprintf(stderr, "Impossible to read %s image\n", file); 
+		return 0;
+	}
+	input_read(rec, &ret->input);
+	rec->width = img->sx;
+	rec->heigth = img->sy;
+
+	/* texture at the image size, shared with the other threads */
+	t = stage_clock();
+	scalledTexture = texture_cache_get(textures, img->sx, img->sy);
+	stage_add(STAGE_TEXTURE, t);
+	if (scalledTexture == NULL){
+		fprintf(stderr, "Impossible to scale texture for %s image\n", file);
+		pool_image_destroy(pool, img);
+		return 1;
+	}
+
+	/* apply filter (contrast, smooth, texture and sepia in one pass) */
+	if (should_split(img)) {
+		oldImage = split_image(img, scalledTexture, pool, &rec->t);
+	} else {
+		oldImage = old_photo_filter(img, scalledTexture, pool);
+	}
+	texture_cache_release(textures, scalledTexture);
+	atomic_fetch_add(&done_pixels, (long long) img->sx * img->sy);
+	atomic_fetch_add(&done_images, 1);
+	pool_image_destroy(pool, img);
+	if (oldImage == NULL){
+		fprintf(stderr, "Impossible to filter %s image\n", file);
+		return 1;
+	}
+
+	/* save resized */ 
+	if (writer != NULL) {
+		if (write_image_async(writer, oldImage, outFileName, output_written, rec) == 0) {
+			fprintf(stderr, "Impossible to write %s image\n", outFileName);
+		} else {
+			rec->queued = 1;
+		}
+	} else if(write_image_file(oldImage, outFileName) == 0){
+		fprintf(stderr, "Impossible to write %s image\n", outFileName);
+	} else {
+		output_written(rec, 0);
+	}
+	pool_image_destroy(pool, oldImage);
+
+	return 1;
+}
+
+/******************************************************************************
+ * filter_file()
+ *
+ * Arguments:	i - 	index of the file in the list
+ * 				file - 	the file (entry i of the list)
+ * 				pool - 	pool of the thread, for the decoded and output image
+ * 				ret - 	where the counters and image records are kept
+ *
+ * Return:		(bool)	1 if the image was read, 0 otherwise
+ *
+ * Description: filters an entry (checked by take_file()) with
+ * 				filter_image(), with a record of its stages (timed stage by
+ * 				stage with --report)
+ *
+ *****************************************************************************/
+int filter_file(int i, char *file, imagePool *pool, retPack *ret) {
+
+	imageTimes *rec;
+	int read;
+
+	rec = times_new(&ret->records, i);
+	if (rec == NULL) {
+		fprintf(stderr, "Impossible to filter %s image\n", file);
+		file_list_done(list, i);
+		return 0;
+	}
+
+	if (timeStages) stage_sink(&rec->t);
+	trace_detail(file);
+	long long start = stage_clock();
+	read = filter_image(rec, file, pool, ret);
+	trace_event("image", start, stage_clock());
+	trace_detail(NULL);
+	if (timeStages) stage_sink(NULL);
+
+	/* written or not; one left to the writer is done when it says so */
+	if (!rec->queued) file_list_done(list, i);
+
+	return read;
+}
 
 /******************************************************************************
  * oldFilter()
  *
  * Arguments:	args - 		a pointer to a struct with all the args
  * 							(as in argsPack):
- * 					rem -	essentially the thread number that decides what
- * 							images to process
+ * 					id -	the thread number
  *
  * Return:		(void *)	ret -	a pointer with all return information
  * 									(as in retPack):
  * 								cnt - file counter
+ * 								bands - bands done for other threads
  * 								times - execution time
+ * 								idle_ns - time waiting for work
+ * 								pool_* - image pool high-water marks
+ * 								input - time reading and decoding files
  * 
- * Description: iterates through files[st] to files[end] (excluding), checks
- * 				if file was already processed before.
+ * Description: takes the next file from the list until there are none left,
+ * 				so a thread that got big images just takes fewer of them.
  * 				Then tries to get JPEG image out of fileand applies a old photo
- * 				filter to it.
+ * 				filter to it. Big images near the end of the queue are split
+ * 				in bands (see should_split()); a thread with nothing to do
+ * 				filters bands of those until every image is done.
+ * 				Decoded and filtered images live in the thread's own pool, so
+ * 				their buffers are reused from one image to the next.
  *
  *****************************************************************************/
 void *oldFilter(void *args) {
 
 	struct timespec start_time_thread, end_time_thread;
+	struct timespec start_idle, end_idle, idle;
 
 	clock_gettime(CLOCK_MONOTONIC, &start_time_thread);
 
 	/* local stores all "local variables" of oldFilter */
 	argsPack *local = (argsPack *) args;
+	char name[32];
 
-	int rem = local->rem;
+	sprintf(name, "filter_%d", local->id);
+	trace_thread(name);
+	if (perfMode) perf_open();
 
 	/* free local */
 	free(local);
 
 	int cnt = 0;			/* counter of processed files */
+	int bands = 0;			/* counter of bands done for other threads */
+	long long idle_ns = 0;
+	bandJob *job;
+	int band, i;
+	char *file;
+	size_t bytes;
+	imagePool *pool = pool_create(hugePages);	/* NULL: plain gd images */
+	retPack *ret = (retPack *) calloc(1, sizeof(retPack));
+	ret->input.identify = (outputs != NULL);
+
+	while (1) {
+
+		/* help with an image split by another thread, or take a file */
+		pthread_mutex_lock(&band_lock);
+		job = take_band(NULL, &band);
+		if (job == NULL) busy_threads++;
+		pthread_mutex_unlock(&band_lock);
+
+		if (job == NULL) {
+			file = take_file(&i, &bytes);
+			if (file != NULL) {
+				cnt += filter_file(i, file, pool, ret);
+				/* with a budget, only the memory of what's in flight */
+				if (budget != NULL) {
+					pool_trim(pool);
+					mem_budget_release(budget, bytes);
+				}
+			}
+
+			pthread_mutex_lock(&band_lock);
+			busy_threads--;
+			pthread_cond_broadcast(&band_cond);
+			if (file != NULL) {
+				pthread_mutex_unlock(&band_lock);
+				continue;
+			}
+
+			/* no files left, wait while some thread may still split one */
+			clock_gettime(CLOCK_MONOTONIC, &start_idle);
+			while (busy_threads > 0 && (job = take_band(NULL, &band)) == NULL) {
+				pthread_cond_wait(&band_cond, &band_lock);
+			}
+			pthread_mutex_unlock(&band_lock);
+			clock_gettime(CLOCK_MONOTONIC, &end_idle);
+			idle = diff_timespec(&end_idle, &start_idle);
+			idle_ns += idle.tv_sec * 1000000000LL + idle.tv_nsec;
+			trace_event("idle", start_idle.tv_sec * 1000000000LL + start_idle.tv_nsec,
+				end_idle.tv_sec * 1000000000LL + end_idle.tv_nsec);
+
+			/* every thread is done with its image */
+			if (job == NULL) break;
+		}
 
-	/* declare image ptrs */
-	gdImagePtr img;
+		filter_band(job, band);
+		bands++;
+	}
 
-	gdImagePtr contrastImage;
-	gdImagePtr smoothImage;
-	gdImagePtr textureImage;
-	gdImagePtr sepiaImage;
+	clock_gettime(CLOCK_MONOTONIC, &end_time_thread);
 
-	char outFileName[128];
+	ret->times = diff_timespec(&end_time_thread, &start_time_thread);
+	ret->idle_ns = idle_ns;
+	ret->cnt = cnt;
+	ret->bands = bands;
+	if (pool != NULL) {
+		ret->pool_high_water = pool->high_water;
+		ret->pool_buffers = pool->in_use_high;
+		ret->pool_allocs = pool->allocs;
+		ret->pool_reuses = pool->reuses;
+		ret->pool_fallbacks = pool->fallbacks;
+		pool_destroy(pool);
+	}
+
+	perf_close();
+	return (void *) ret;
 
-	for (int i = 0; i < nn_files; i++){	
+}
+
+/******************************************************************************
+ * readStage()
+ *
+ * Arguments:	args - 		a pointer to argsPack (id - the thread number)
+ *
+ * Return:		(void *)	ret -	retPack with the images read, execution
+ * 									time, time stalled on a full queue and
+ * 									time reading and decoding
+ *
+ * Description: reader of the pipeline: takes the next file from the list,
+ * 				decodes it and queues it for the filter threads. The last
+ * 				reader to finish closes the queue.
+ *
+ *****************************************************************************/
+void *readStage(void *args) {
 
-		/* check if the thread is responsible for this image file */
-		if (i % nn_threads != rem) continue;
+	struct timespec start_time_thread, end_time_thread;
+	long long stall_ns = 0;
+	pipelineItem *item;
+	gdImagePtr img;
+	readStats input = {0};
+	timesChunk *records = NULL;
+	imageTimes *rec;
+	int cnt = 0;
+	char name[32];
 
-		/* outFileName */
-		sprintf(outFileName, "%s%s%s", dir,  OLD_IMAGE_DIR, strrchr(files[i], '/'));
+	clock_gettime(CLOCK_MONOTONIC, &start_time_thread);
+	sprintf(name, "reader_%d", ((argsPack *) args)->id);
+	trace_thread(name);
+	if (perfMode) perf_open();
+	free(args);
+	input.identify = (outputs != NULL);
+
+	char *file, *ahead;
+	size_t bytes;
+	int i;
+
+	while ((file = take_file(&i, &bytes)) != NULL) {
 
-		fprintf(stdout, "%s\n", files[i]);
+		fprintf(stdout, "%s\n", file);
 
-		/* load of the input file */
-	    img = read_jpeg_file(files[i]);
+		if ((ahead = file_list_peek(list, i + nn_readers)) != NULL) {
+			prefetch_file(ahead);
+		}
+
+		rec = times_new(&records, i);
+		if (rec == NULL) {
+			fprintf(stderr, "Impossible to read %s image\n", file);
+			if (budget != NULL) mem_budget_release(budget, bytes);
+			file_list_done(list, i);
+			continue;
+		}
+		if (timeStages) stage_sink(&rec->t);
+		trace_detail(file);
+		img = read_image_file_pool(file, NULL, &input);
+		trace_detail(NULL);
+		if (timeStages) stage_sink(NULL);
 		if (img == NULL){
-			fprintf(stderr, "Impossible to read %s image\n", files[i]); 
+			fprintf(stderr, "Impossible to read %s image\n", file);
+			if (budget != NULL) mem_budget_release(budget, bytes);
+			file_list_done(list, i);
 			continue;
 		}
-
-		/* increment files read */
+		input_read(rec, &input);
+		rec->width = img->sx;
+		rec->heigth = img->sy;
 		cnt++;
 
-		/* apply filter */
-		contrastImage = contrast_image(img);
-		gdImageDestroy(img);
-		smoothImage = smooth_image(contrastImage);
-		gdImageDestroy(contrastImage);
-		textureImage = texture_image(smoothImage, texture);
-		gdImageDestroy(smoothImage);
-		sepiaImage = sepia_image(textureImage);
-		gdImageDestroy(textureImage);
-
-		/* save resized */ 
-		if(write_jpeg_file(sepiaImage, outFileName) == 0){
-			fprintf(stderr, "Impossible to write %s image\n", outFileName);
+		item = (pipelineItem *) malloc(sizeof(pipelineItem));
+		item->file = file;
+		item->rec = rec;
+		item->img = img;
+		item->bytes = bytes;
+		queue_push(decoded, item, &stall_ns);
+	}
+
+	if (atomic_fetch_sub(&readers_left, 1) == 1) {
+		queue_close(decoded);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end_time_thread);
+
+	retPack *ret = (retPack *) calloc(1, sizeof(retPack));
+	ret->times = diff_timespec(&end_time_thread, &start_time_thread);
+	ret->idle_ns = stall_ns;
+	ret->cnt = cnt;
+	ret->input = input;
+	ret->records = records;
+
+	perf_close();
+	return (void *) ret;
+}
+
+/******************************************************************************
+ * filterStage()
+ *
+ * Arguments:	args - 		a pointer to argsPack (id - the thread number)
+ *
+ * Return:		(void *)	ret -	retPack with the images filtered, execution
+ * 									time and time stalled on the queues
+ *
+ * Description: filter thread of the pipeline: applies the old photo filter
+ * 				to decoded images and queues them for the writers. The last
+ * 				filter thread to finish closes the queue.
+ *
+ *****************************************************************************/
+void *filterStage(void *args) {
+
+	struct timespec start_time_thread, end_time_thread;
+	long long stall_ns = 0;
+	pipelineItem *item;
+	gdImagePtr scalledTexture;
+	gdImagePtr oldImage;
+	int cnt = 0;
+	char name[32];
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time_thread);
+	sprintf(name, "filter_%d", ((argsPack *) args)->id);
+	trace_thread(name);
+	if (perfMode) perf_open();
+	free(args);
+
+	while (queue_pop(decoded, (void **) &item, &stall_ns)) {
+
+		cnt++;
+		if (timeStages) stage_sink(&item->rec->t);
+		trace_detail(item->file);
+
+		/* texture at the image size, shared with the other threads */
+		long long t = stage_clock();
+		scalledTexture = texture_cache_get(textures, item->img->sx, item->img->sy);
+		stage_add(STAGE_TEXTURE, t);
+		if (scalledTexture == NULL){
+			fprintf(stderr, "Impossible to scale texture for %s image\n", item->file);
+			oldImage = NULL;
+		} else {
+			oldImage = old_photo_filter(item->img, scalledTexture, NULL);
+			texture_cache_release(textures, scalledTexture);
+			if (oldImage == NULL){
+				fprintf(stderr, "Impossible to filter %s image\n", item->file);
+			}
 		}
-		gdImageDestroy(sepiaImage);
+		gdImageDestroy(item->img);
+		trace_detail(NULL);
+		if (timeStages) stage_sink(NULL);
+
+		if (oldImage == NULL){
+			if (budget != NULL) mem_budget_release(budget, item->bytes);
+			file_list_done(list, item->rec->index);
+			free(item);
+			continue;
+		}
+		item->img = oldImage;
+		queue_push(filtered, item, &stall_ns);
+	}
 
+	if (atomic_fetch_sub(&filters_left, 1) == 1) {
+		queue_close(filtered);
 	}
 
 	clock_gettime(CLOCK_MONOTONIC, &end_time_thread);
 
-	retPack *ret = (retPack *) malloc(sizeof(retPack));
+	retPack *ret = (retPack *) calloc(1, sizeof(retPack));
 	ret->times = diff_timespec(&end_time_thread, &start_time_thread);
+	ret->idle_ns = stall_ns;
 	ret->cnt = cnt;
 
+	perf_close();
 	return (void *) ret;
+}
+
+/******************************************************************************
+ * writeStage()
+ *
+ * Arguments:	args - 		a pointer to argsPack (id - the thread number)
+ *
+ * Return:		(void *)	ret -	retPack with the execution time and time
+ * 									stalled on an empty queue (the images
+ * 									written are counted in writes_done, as
+ * 									they are in place)
+ *
+ * Description: writer of the pipeline: encodes filtered images to JPEG in
+ * 				the output directory (handed to the writer, if there is one)
+ *
+ *****************************************************************************/
+void *writeStage(void *args) {
 
+	struct timespec start_time_thread, end_time_thread;
+	long long stall_ns = 0;
+	pipelineItem *item;
+	char outFileName[128];
+	int id = ((argsPack *) args)->id;
+	char name[32];
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time_thread);
+	sprintf(name, "writer_%d", id);
+	trace_thread(name);
+	if (perfMode) perf_open();
+	free(args);
+
+	while (queue_pop(filtered, (void **) &item, &stall_ns)) {
+
+		/* outFileName */
+		sprintf(outFileName, "%s%s%s", dir,  OLD_IMAGE_DIR, strrchr(item->file, '/'));
+
+		if (timeStages) stage_sink(&item->rec->t);
+		trace_detail(item->file);
+		item->rec->writer = id + 1;
+		if (!output_name(outFileName, sizeof(outFileName))) {
+			fprintf(stderr, "Impossible to write %s image\n", outFileName);
+		} else if (writer != NULL ? write_image_async(writer, item->img, outFileName, output_written, item->rec) == 0
+			: write_image_file(item->img, outFileName) == 0) {
+			fprintf(stderr, "Impossible to write %s image\n", outFileName);
+		} else if (writer == NULL) {
+			output_written(item->rec, 0);
+		} else {
+			item->rec->queued = 1;
+		}
+		/* written or not; one left to the writer is done when it says so */
+		if (!item->rec->queued) file_list_done(list, item->rec->index);
+		trace_detail(NULL);
+		if (timeStages) stage_sink(NULL);
+		gdImageDestroy(item->img);
+		if (budget != NULL) mem_budget_release(budget, item->bytes);
+		free(item);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end_time_thread);
+
+	retPack *ret = (retPack *) calloc(1, sizeof(retPack));
+	ret->times = diff_timespec(&end_time_thread, &start_time_thread);
+	ret->idle_ns = stall_ns;
+
+	perf_close();
+	return (void *) ret;
+}
+
+/* for qsort() of stage times */
+int cmp_ns(const void *a, const void *b) {
+
+	long long x = *(const long long *) a;
+	long long y = *(const long long *) b;
+	return (x > y) - (x < y);
+}
+
+/* value at percentile p of n sorted times (nearest rank) */
+long long percentile(const long long *sorted, int n, int p) {
+
+	int rank = (int) (((long long) p * n + 99) / 100);
+	return (n > 0) ? sorted[(rank > 0 ? rank : 1) - 1] : 0;
+}
+
+/* a file name as a JSON string or CSV field */
+void put_name(FILE *fp, const char *name, int json) {
+
+	fputc('"', fp);
+	for (const char *c = name; *c; c++) {
+		if (json && (*c == '"' || *c == '\\')) fprintf(fp, "\\%c", *c);
+		else if (json && (unsigned char) *c < 0x20) fprintf(fp, "\\u%04x", *c);
+		else if (!json && *c == '"') fputs("\"\"", fp);
+		else fputc(*c, fp);
+	}
+	fputc('"', fp);
+}
+
+/******************************************************************************
+ * write_report()
+ *
+ * Arguments:	file_name - 	report to write (JSON if it ends in .json,
+ * 								CSV otherwise)
+ * 				rets - 		threads that took the images (their records)
+ * 				nn_rets - 	number of threads
+ * 				wall - 		time the threads took
+ *
+ * Return:		(bool)	1 in case of success, 0 otherwise
+ *
+ * Description: writes the stages of every image, then p50/p95/p99 of each
+ * 				stage over the images and the throughput in images/s and
+ * 				megapixels/s. Written again on every run.
+ *
+ *****************************************************************************/
+int write_report(const char *file_name, retPack **rets, int nn_rets, struct timespec wall) {
+
+	int json = strlen(file_name) > 5 && strcmp(file_name + strlen(file_name) - 5, ".json") == 0;
+	double wall_s = wall.tv_sec + wall.tv_nsec / 1e9;
+	imageTimes **recs;
+	long long *sorted;
+	double megapixels = 0;
+	int n = 0;
+	FILE *fp;
+
+	/* every image read, from the chunks of each thread */
+	for (int i = 0; i < nn_rets; i++) {
+		for (timesChunk *c = rets[i]->records; c != NULL; c = c->next) n += c->used;
+	}
+	recs = (imageTimes **) malloc((n + 1) * sizeof(imageTimes *));
+	sorted = (long long *) malloc((n + 1) * sizeof(long long));
+	fp = fopen(file_name, "w");
+	if (!recs || !sorted || !fp) {
+		free(recs);
+		free(sorted);
+		if (fp) fclose(fp);
+		return 0;
+	}
+	n = 0;
+	for (int i = 0; i < nn_rets; i++) {
+		for (timesChunk *c = rets[i]->records; c != NULL; c = c->next) {
+			for (int j = 0; j < c->used; j++) {
+				if (c->rec[j].width == 0) continue;
+				recs[n++] = &c->rec[j];
+				megapixels += (double) c->rec[j].width * c->rec[j].heigth / 1e6;
+			}
+		}
+	}
+
+	/* -> per image */
+	if (json) {
+		fprintf(fp, "{\n  \"threads\": %d,\n  \"images\": %d,\n  \"wall_s\": %.6f,\n", nn_threads, n, wall_s);
+		fprintf(fp, "  \"images_per_s\": %.3f,\n  \"megapixels_per_s\": %.3f,\n",
+			wall_s > 0 ? n / wall_s : 0.0, wall_s > 0 ? megapixels / wall_s : 0.0);
+		fprintf(fp, "  \"per_image\": [\n");
+	} else {
+		fprintf(fp, "file,width,height");
+		for (int s = 0; s < STAGES; s++) fprintf(fp, ",%s_ms", stage_name(s));
+		fprintf(fp, "\n");
+	}
+	for (int i = 0; i < n; i++) {
+		if (json) {
+			fprintf(fp, "    {\"file\": ");
+			put_name(fp, file_list_peek(list, recs[i]->index), 1);
+			fprintf(fp, ", \"width\": %d, \"height\": %d", recs[i]->width, recs[i]->heigth);
+			for (int s = 0; s < STAGES; s++) fprintf(fp, ", \"%s_ms\": %.3f", stage_name(s), recs[i]->t.ns[s] / 1e6);
+			fprintf(fp, "}%s\n", (i + 1 < n) ? "," : "");
+		} else {
+			put_name(fp, file_list_peek(list, recs[i]->index), 0);
+			fprintf(fp, ",%d,%d", recs[i]->width, recs[i]->heigth);
+			for (int s = 0; s < STAGES; s++) fprintf(fp, ",%.3f", recs[i]->t.ns[s] / 1e6);
+			fprintf(fp, "\n");
+		}
+	}
+
+	/* -> per stage */
+	if (json) {
+		fprintf(fp, "  ],\n  \"stages\": {\n");
+	} else {
+		fprintf(fp, "\nstage,images,total_ms,mean_ms,p50_ms,p95_ms,p99_ms\n");
+	}
+	for (int s = 0; s < STAGES; s++) {
+		long long total = 0;
+		for (int i = 0; i < n; i++) {
+			sorted[i] = recs[i]->t.ns[s];
+			total += sorted[i];
+		}
+		qsort(sorted, n, sizeof(long long), cmp_ns);
+		if (json) {
+			fprintf(fp, "    \"%s\": {\"total_ms\": %.3f, \"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p95_ms\": %.3f, \"p99_ms\": %.3f}%s\n",
+				stage_name(s), total / 1e6, n ? total / 1e6 / n : 0.0, percentile(sorted, n, 50) / 1e6,
+				percentile(sorted, n, 95) / 1e6, percentile(sorted, n, 99) / 1e6, (s + 1 < STAGES) ? "," : "");
+		} else {
+			fprintf(fp, "%s,%d,%.3f,%.3f,%.3f,%.3f,%.3f\n", stage_name(s), n, total / 1e6, n ? total / 1e6 / n : 0.0,
+				percentile(sorted, n, 50) / 1e6, percentile(sorted, n, 95) / 1e6, percentile(sorted, n, 99) / 1e6);
+		}
+	}
+
+	/* -> throughput */
+	if (json) {
+		fprintf(fp, "  }\n}\n");
+	} else {
+		fprintf(fp, "\nthreads,images,wall_s,images_per_s,megapixels_per_s\n");
+		fprintf(fp, "%d,%d,%.6f,%.3f,%.3f\n", nn_threads, n, wall_s,
+			wall_s > 0 ? n / wall_s : 0.0, wall_s > 0 ? megapixels / wall_s : 0.0);
+	}
+
+	free(recs);
+	free(sorted);
+	return fclose(fp) == 0;
+}
+
+/******************************************************************************
+ * write_perf()
+ *
+ * Arguments:	timing - 	timing file
+ * 				sum - 		stages of every image
+ * 				megapixels - pixels of every image
+ * 				counters - 	counters that were open (see perf_open())
+ *
+ * Return:		(void)
+ *
+ * Description: writes a line per stage with its time, the instructions per
+ * 				cycle and the LLC and branch misses per megapixel: many LLC
+ * 				misses and a low IPC point at memory, a high IPC at compute
+ *
+ *****************************************************************************/
+void write_perf(FILE *timing, const stageTimes *sum, double megapixels, int counters) {
+
+	for (int s = 0; s < STAGES; s++) {
+		const long long *e = sum->events[s];
+		char ipc[32] = "n/a", llc[32] = "n/a", branch[32] = "n/a";
+
+		if (sum->ns[s] == 0) continue;
+		if ((counters & (1 << PERF_INSTRUCTIONS)) && e[PERF_CYCLES] > 0) {
+			sprintf(ipc, "%.2f", (double) e[PERF_INSTRUCTIONS] / e[PERF_CYCLES]);
+		}
+		if ((counters & (1 << PERF_LLC_MISSES)) && megapixels > 0) {
+			sprintf(llc, "%.0f", e[PERF_LLC_MISSES] / megapixels);
+		}
+		if ((counters & (1 << PERF_BRANCH_MISSES)) && megapixels > 0) {
+			sprintf(branch, "%.0f", e[PERF_BRANCH_MISSES] / megapixels);
+		}
+		fprintf(timing, "perf_%s \t %.1f ms\tcycles/pixel %.1f\tipc %s\tllc_misses/MP %s\tbranch_misses/MP %s\n", stage_name(s),
+			sum->ns[s] / 1e6, megapixels > 0 ? e[PERF_CYCLES] / (megapixels * 1e6) : 0.0, ipc, llc, branch);
+	}
+}
+
+/******************************************************************************
+ * phase_end()
+ *
+ * Arguments:	name - 	phase of main()
+ * 				start - stage_clock() when it started
+ *
+ * Return:		(long long)	stage_clock() now, the start of the next phase
+ *
+ * Description: records a phase of main() in the trace (if tracing)
+ *
+ *****************************************************************************/
+long long phase_end(const char *name, long long start) {
+
+	long long now = stage_clock();
+	trace_event(name, start, now);
+	return now;
 }
 
 /******************************************************************************
@@ -176,17 +1435,180 @@ int main(int argc, char **argv){
     struct timespec start_time_seq, end_time_seq;
     struct timespec start_time_par, end_time_par;
 	struct timespec start_time_seq2, end_time_seq2;
+	long long phase, start_phase;
 
 	clock_gettime(CLOCK_MONOTONIC, &start_time_total);
 	clock_gettime(CLOCK_MONOTONIC, &start_time_seq);
+	start_phase = phase = stage_clock();
+
+	/* options */
+	static struct option long_options[] = {
+		{"sort", required_argument, NULL, 's'},
+		{"bands", required_argument, NULL, 'b'},
+		{"readers", required_argument, NULL, 'r'},
+		{"writers", required_argument, NULL, 'w'},
+		{"simd", required_argument, NULL, 'v'},
+		{"smooth", required_argument, NULL, 'm'},
+		{"hugepages", no_argument, NULL, 'H'},
+		{"stream", required_argument, NULL, 'S'},
+		{"writer", required_argument, NULL, 'W'},
+		{"manifest", required_argument, NULL, 'M'},
+		{"watch", no_argument, NULL, 'D'},
+		{"report", required_argument, NULL, 'R'},
+		{"trace", required_argument, NULL, 'T'},
+		{"perf", no_argument, NULL, 'P'},
+		{"max-dimension", required_argument, NULL, 'X'},
+		{"pipeline", required_argument, NULL, 'p'},
+		{"pipeline-file", required_argument, NULL, 'F'},
+		{"mem-budget", required_argument, NULL, 'B'},
+		{"shard", required_argument, NULL, 'k'},
+		{"shard-by", required_argument, NULL, 'y'},
+		{"output-format", required_argument, NULL, 'O'},
+		{NULL, 0, NULL, 0}
+	};
+	int sortMode = SORT_NONE;
+	int simdLevel = SIMD_AUTO;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "s:b:r:w:v:m:HS:W:M:DR:T:PX:p:F:B:k:y:O:", long_options, NULL)) != -1) {
+		switch (opt) {
+			case 's':
+				if (strcmp(optarg, "size") == 0) sortMode = SORT_SIZE;
+				else if (strcmp(optarg, "pixels") == 0) sortMode = SORT_PIXELS;
+				else if (strcmp(optarg, "none") == 0) sortMode = SORT_NONE;
+				else argc = -1;
+				break;
+			case 'b':
+				if (strcmp(optarg, "auto") == 0) bandMode = BANDS_AUTO;
+				else if (strcmp(optarg, "off") == 0) bandMode = BANDS_OFF;
+				else if (strcmp(optarg, "always") == 0) bandMode = BANDS_ALWAYS;
+				else argc = -1;
+				break;
+			case 'r':
+				nn_readers = atoi(optarg);
+				if (nn_readers < 1) argc = -1;
+				break;
+			case 'w':
+				nn_writers = atoi(optarg);
+				if (nn_writers < 1) argc = -1;
+				break;
+			case 'v':
+				if (strcmp(optarg, "auto") == 0) simdLevel = SIMD_AUTO;
+				else if (strcmp(optarg, "scalar") == 0) simdLevel = SIMD_SCALAR;
+				else if (strcmp(optarg, "sse4") == 0) simdLevel = SIMD_SSE4;
+				else if (strcmp(optarg, "avx2") == 0) simdLevel = SIMD_AVX2;
+				else argc = -1;
+				break;
+			case 'm':
+				if (strcmp(optarg, "fast") == 0) smoothMode = SMOOTH_FAST;
+				else if (strcmp(optarg, "gd") == 0) smoothMode = SMOOTH_GD;
+				else argc = -1;
+				break;
+			case 'H':
+				hugePages = 1;
+				break;
+			case 'S': {
+				/* megapixels, fractions too (0.5: half a megapixel) */
+				char *end;
+				double mp = strtod(optarg, &end);
+				if (strcmp(optarg, "off") == 0) streamPixels = -1;
+				else if (end == optarg || *end != '\0' || !(mp > 0) || mp > 1e12) argc = -1;
+				else streamPixels = (long long) (mp * 1e6);
+				break;
+			}
+			case 'W':
+				if (strcmp(optarg, "uring") == 0) writerMode = WRITER_URING;
+				else if (strcmp(optarg, "thread") == 0) writerMode = WRITER_THREAD;
+				else if (strcmp(optarg, "sync") == 0) writerMode = -1;
+				else argc = -1;
+				break;
+			case 'M':
+				if (strcmp(optarg, "on") == 0) manifestMode = 1;
+				else if (strcmp(optarg, "off") == 0) manifestMode = 0;
+				else argc = -1;
+				break;
+			case 'D':
+				watchMode = 1;
+				break;
+			case 'R':
+				reportFile = optarg;
+				break;
+			case 'T':
+				traceFile = optarg;
+				break;
+			case 'P':
+				perfMode = 1;
+				break;
+			case 'X':
+				maxDimension = atoi(optarg);
+				if (maxDimension < 1) argc = -1;
+				break;
+			case 'p':
+				if (!pipeline_set(optarg)) argc = -1;
+				break;
+			case 'F':
+				if (!pipeline_load(optarg)) argc = -1;
+				break;
+			case 'B': {
+				/* megabytes, or with a M/G suffix */
+				char *end;
+				double mb = strtod(optarg, &end);
+				if (*end == 'G' || *end == 'g') mb *= 1000, end++;
+				else if (*end == 'M' || *end == 'm') end++;
+				if (end == optarg || *end != '\0' || mb <= 0) argc = -1;
+				else memBudgetBytes = (size_t) (mb * 1e6);
+				break;
+			}
+			case 'k': {
+				/* k/N, k from 1 to N */
+				char *end;
+				shard = (int) strtol(optarg, &end, 10) - 1;
+				if (*end == '/') shards = (int) strtol(end + 1, &end, 10);
+				if (*end != '\0' || shards < 1 || shard < 0 || shard >= shards) argc = -1;
+				break;
+			}
+			case 'y':
+				if (strcmp(optarg, "hash") == 0) shardMode = SHARD_HASH;
+				else if (strcmp(optarg, "size") == 0) shardMode = SHARD_SIZE;
+				else argc = -1;
+				break;
+			case 'O':
+				if (!output_format_set(optarg)) argc = -1;
+				break;
+			default:
+				argc = -1;
+		}
+	}
 
-	/* if argc isn't three we quit*/
-	if (argc != 3) {
-		fprintf(stdout, "\n\tUse the command:\n\n\t.old-photo-paral <files_dir> <nn_threads>\n\n");
+	/* if there aren't two arguments left we quit (sorting and splitting by
+	 * size need the whole list, a watched one never ends) */
+	if (argc - optind != 2 || (watchMode && (sortMode != SORT_NONE || shardMode == SHARD_SIZE))) {
+		fprintf(stdout, "\n\tUse the command:\n\n\t.old-photo-paral <files_dir> <nn_threads> [--sort size|pixels] [--bands auto|off|always]\n\t\t[--readers <n>] [--writers <n>]\n\t\t[--simd auto|scalar|sse4|avx2] [--smooth fast|gd] [--hugepages]\n\t\t[--stream <megapixels>|off] [--writer uring|thread|sync]\n\t\t[--manifest on|off] [--watch]\n\t\t[--report <file.csv|file.json>] [--trace <file.json>] [--perf]\n\t\t[--max-dimension <pixels>] [--pipeline <stages>|--pipeline-file <file>]\n\t\t[--mem-budget <MB>] [--shard <k>/<N>] [--shard-by hash|size]\n\t\t[--output-format jpeg|webp|heif|png[:<quality>]]\n\n");
 		exit(0);
 	}
 
-	dir = argv[1];						/* directory of files */
+	/* every thread records its events from now on */
+	if (traceFile != NULL) {
+		trace_start(TRACE_EVENTS);
+		trace_thread("main");
+	}
+
+	/* stages are timed for the report and for the counters; each thread
+	 * opens its own counters, if the machine lets this one */
+	timeStages = (reportFile != NULL || perfMode);
+	int perfCounters = 0;
+	char perfError[128] = "";
+	if (perfMode) {
+		perfCounters = perf_open();
+		if (perfCounters == 0) {
+			snprintf(perfError, sizeof(perfError), "%s", strerror(errno));
+			fprintf(stderr, "Hardware counters unavailable (%s), timing the stages only\n", perfError);
+			perfMode = 0;
+		}
+		perf_close();
+	}
+
+	dir = argv[optind];					/* directory of files */
 
 	if (dir[strlen(dir) - 1] == '/') dir[strlen(dir) - 1] = '\0';
  
@@ -196,14 +1618,44 @@ int main(int argc, char **argv){
 		exit(1);
 	}
 
-	files = readFiles(dir, &nn_files);	/* read files list */
-	nn_threads = atoi(argv[2]);
+	nn_threads = atoi(argv[optind + 1]);
+	if (nn_threads < 1) {
+		fprintf(stderr, "The number of threads must be at least 1\n");
+		exit(1);
+	}
+
+	/* staged pipeline: a stage left out gets one thread */
+	if (nn_readers > 0 || nn_writers > 0) {
+		if (nn_readers == 0) nn_readers = 1;
+		if (nn_writers == 0) nn_writers = 1;
+		decoded = queue_create(PIPELINE_QUEUE_SLOTS * nn_threads);
+		filtered = queue_create(PIPELINE_QUEUE_SLOTS * nn_writers);
+		atomic_init(&readers_left, nn_readers);
+		atomic_init(&filters_left, nn_threads);
+		writes_done = (atomic_int *) calloc(nn_writers, sizeof(atomic_int));
+	}
+
+	/* admission control: images in flight share the budget, and up to
+	 * nn_threads of them wait aside for memory */
+	if (memBudgetBytes > 0) {
+		budget = mem_budget_create(memBudgetBytes);
+		deferred = malloc(nn_threads * sizeof(deferredFile));
+		if (budget == NULL || deferred == NULL) {
+			fprintf(stderr, "Impossible to create the memory budget\n");
+			exit(1);
+		}
+		atomic_init(&deferred_cnt, 0);
+	}
 
 	/* array of threads */
 	pthread_t threads[nn_threads];
+	pthread_t readers[nn_readers + 1];
+	pthread_t writers[nn_writers + 1];
 
 	/* return of threads */
 	retPack *retThreads[nn_threads];
+	retPack *retReaders[nn_readers + 1];
+	retPack *retWriters[nn_writers + 1];
 
 	/* creation of output directories */
 	char oldImgsPath[strlen(dir) + 18]; 
@@ -212,8 +1664,78 @@ int main(int argc, char **argv){
 		fprintf(stderr, "Impossible to create %s directory\n", oldImgsPath);
 		exit(-1);
 	}
+	/* held until the end, so other runs leave its .part files alone */
+	int outLock = output_dir_lock(oldImgsPath);
+	if (outLock < 0){
+		fprintf(stderr, "Impossible to lock %s directory\n", oldImgsPath);
+		exit(-1);
+	}
+	phase = phase_end("options", phase);
 
 	texture = read_png_file(PAPER_TEXTURE);
+	if (texture == NULL){
+		fprintf(stderr, "Impossible to read %s texture\n", PAPER_TEXTURE);
+		exit(-1);
+	}
+	/* with a budget, only the textures of the images in flight are kept */
+	textures = texture_cache_create(texture, (budget != NULL && nn_threads < TEXTURE_CACHE_SIZE) ? nn_threads : TEXTURE_CACHE_SIZE);
+	phase = phase_end("texture", phase);
+
+	/* images bigger than maxDimension are decoded to its size (also a
+	 * parameter of the manifest) */
+	jpeg_max_dimension(maxDimension);
+
+	/* manifest of the outputs, for the parameters and texture of this run */
+	if (manifestMode) {
+		char params[512];
+		uint64_t textureHash = 0;
+		filter_params(params, sizeof(params) - 32);
+		hash_file(PAPER_TEXTURE, &textureHash);
+		sprintf(params + strlen(params), " texture %016llx", (unsigned long long) textureHash);
+		outputs = manifest_open(oldImgsPath, params);
+		if (outputs == NULL) {
+			fprintf(stderr, "Impossible to open the manifest, checking outputs only\n");
+		}
+		phase = phase_end("manifest", phase);
+	}
+
+	/* files list, read while the threads already take the first ones;
+	 * sorting and splitting by size need all of it first. A shard by
+	 * hash only ever sees its own entries. */
+	list = file_list_open(dir, outputs, watchMode, (shardMode == SHARD_HASH) ? shard : 0, (shardMode == SHARD_HASH) ? shards : 1);
+	if (list == NULL) {
+		fprintf(stderr, "Impossible to read %s/image-list.txt\n", dir);
+		exit(1);
+	}
+	if (shardMode == SHARD_SIZE && !file_list_balance(list, shard, shards)) {
+		fprintf(stderr, "Impossible to split %s/image-list.txt\n", dir);
+		exit(1);
+	}
+	if (watchMode) {
+		if (list->watch_fd < 0) {
+			fprintf(stderr, "Impossible to watch %s directory\n", dir);
+			exit(1);
+		}
+		fprintf(stdout, "Watching %s (SIGINT or SIGTERM to stop)\n", dir);
+	}
+	if (sortMode != SORT_NONE) {
+		file_list_filter(list, sortMode);	/* largest first */
+	}
+	phase = phase_end("file_list", phase);
+
+	/* background writer for the output files */
+	if (writerMode >= 0) {
+		writer = writer_create(writerMode);
+		if (writer == NULL) {
+			fprintf(stderr, "Impossible to start the writer, writing from the threads\n");
+		}
+	}
+
+	/* filter kernels for this CPU */
+	simd_select(simdLevel);
+	smooth_select(smoothMode);
+	phase = phase_end("writer", phase);
+	start_phase = phase = phase_end("setup", start_phase);
 
 	clock_gettime(CLOCK_MONOTONIC, &end_time_seq);
 	clock_gettime(CLOCK_MONOTONIC, &start_time_par);
@@ -227,14 +1749,26 @@ int main(int argc, char **argv){
 
 		args = (argsPack *) malloc(sizeof(argsPack));
 
-		/* pass index of the thread that is the chosen remainder */
-		args->rem = i;
+		/* pass the thread number */
+		args->id = i;
 
 		/* initialize thread */					  //send args
-		pthread_create(&threads[i], NULL, oldFilter, args);
+		pthread_create(&threads[i], NULL, (nn_readers > 0) ? filterStage : oldFilter, args);
 
 	}
 
+	/* pipeline readers and writers */
+	for (int i = 0; i < nn_readers; i++) {
+		args = (argsPack *) malloc(sizeof(argsPack));
+		args->id = i;
+		pthread_create(&readers[i], NULL, readStage, args);
+	}
+	for (int i = 0; i < nn_writers; i++) {
+		args = (argsPack *) malloc(sizeof(argsPack));
+		args->id = i;
+		pthread_create(&writers[i], NULL, writeStage, args);
+	}
+
 
 	/* Iteration over all the threads
 	 */
@@ -244,18 +1778,97 @@ int main(int argc, char **argv){
 		pthread_join(threads[i], (void *) &retThreads[i]);
 
 	}
+	for (int i = 0; i < nn_readers; i++) {
+		pthread_join(readers[i], (void *) &retReaders[i]);
+	}
+	for (int i = 0; i < nn_writers; i++) {
+		pthread_join(writers[i], (void *) &retWriters[i]);
+	}
+	phase = phase_end("join", phase);
+
+	/* every file written before anything is timed */
+	struct timespec start_drain, end_drain, drain_time = {0, 0};
+	if (writer != NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &start_drain);
+		writer_finish(writer);
+		clock_gettime(CLOCK_MONOTONIC, &end_drain);
+		drain_time = diff_timespec(&end_drain, &start_drain);
+		phase = phase_end("drain", phase);
+	}
+	start_phase = phase = phase_end("parallel", start_phase);
 
 	clock_gettime(CLOCK_MONOTONIC, &end_time_par);
 	clock_gettime(CLOCK_MONOTONIC, &start_time_seq2);
 
-	destroyFiles(files, nn_files);
+	/* per image, per stage report (needs the list for the names) */
+	retPack **retRecords = (nn_readers > 0) ? retReaders : retThreads;
+	int nn_records = (nn_readers > 0) ? nn_readers : nn_threads;
+	if (reportFile != NULL) {
+		if (!write_report(reportFile, retRecords, nn_records, diff_timespec(&end_time_par, &start_time_par))) {
+			fprintf(stderr, "Impossible to write %s report\n", reportFile);
+		}
+	}
+	stageTimes stageSum;
+	double stageMegapixels = 0;
+	memset(&stageSum, 0, sizeof(stageSum));
+	for (int i = 0; i < nn_records; i++) {
+		for (timesChunk *c = retRecords[i]->records; c != NULL; c = c->next) {
+			for (int j = 0; j < c->used; j++) {
+				if (c->rec[j].width == 0) continue;
+				add_stages(&stageSum, &c->rec[j].t);
+				stageMegapixels += (double) c->rec[j].width * c->rec[j].heigth / 1e6;
+			}
+		}
+		times_free(retRecords[i]->records);
+	}
+	phase = phase_end("report", phase);
+
+	int listEntries = file_list_count(list);
+	int listListed = list->listed;
+	file_list_destroy(list);
+	long manifestUnchanged = -1, manifestRecorded = 0;
+	if (outputs != NULL) {
+		manifestUnchanged = atomic_load(&outputs->unchanged);
+		manifestRecorded = atomic_load(&outputs->recorded);
+		manifest_close(outputs);
+		outputs = NULL;
+	}
+	close(outLock);
+	long cacheHits = textures->hits;
+	long cacheMisses = textures->misses;
+	long cacheEvictions = textures->evictions;
+	texture_cache_destroy(textures);
 	gdImageDestroy(texture);
+	long queueMax[2] = {0, 0};
+	double queueAvg[2] = {0.0, 0.0};
+	if (nn_readers > 0) {
+		queueMax[0] = atomic_load(&decoded->max_depth);
+		queueAvg[0] = atomic_load(&decoded->pushes) ? (double) atomic_load(&decoded->depth_sum) / atomic_load(&decoded->pushes) : 0.0;
+		queueMax[1] = atomic_load(&filtered->max_depth);
+		queueAvg[1] = atomic_load(&filtered->pushes) ? (double) atomic_load(&filtered->depth_sum) / atomic_load(&filtered->pushes) : 0.0;
+		queue_destroy(decoded);
+		queue_destroy(filtered);
+	}
+	size_t budgetBytes = 0, budgetPeak = 0;
+	long budgetWaits = 0;
+	long long budgetWait = 0;
+	if (budget != NULL) {
+		budgetBytes = budget->budget;
+		budgetPeak = budget->peak;
+		budgetWaits = budget->waits;
+		budgetWait = budget->wait_ns;
+		mem_budget_destroy(budget);
+		free(deferred);
+	}
+	phase = phase_end("cleanup", phase);
 
 	clock_gettime(CLOCK_MONOTONIC, &end_time_seq2);
 	clock_gettime(CLOCK_MONOTONIC, &end_time_total);
 
 char buffer[256];
-	sprintf(buffer, "%s%s%d%s", dir, "/timming_", nn_threads, ".txt");
+	/* one per shard, as shards may share the directory */
+	if (shards > 1) sprintf(buffer, "%s%s%d_shard%dof%d%s", dir, "/timming_", nn_threads, shard + 1, shards, ".txt");
+	else sprintf(buffer, "%s%s%d%s", dir, "/timming_", nn_threads, ".txt");
 FILE *timing;
 int tCnt = 0;
 
@@ -278,7 +1891,141 @@ if (!isFileExists(buffer)) {
 
 	/* -> write for each thread */
 	for (int i = 0; i < nn_threads; i++) {
-		fprintf(timing, "Thread_%d \t %d\t%10jd.%02ld\n", i, retThreads[i]->cnt, retThreads[i]->times.tv_sec, retThreads[i]->times.tv_nsec / 10000000);
+		/* idle: time the thread had no work while others still had */
+		struct timespec tail = diff_timespec(&par_time, &retThreads[i]->times);
+		long long idle = tail.tv_sec * 1000000000LL + tail.tv_nsec + retThreads[i]->idle_ns;
+		fprintf(timing, "Thread_%d \t %d\t%10jd.%02ld\tidle %lld.%02lld\tbands %d\n", i, retThreads[i]->cnt, retThreads[i]->times.tv_sec, retThreads[i]->times.tv_nsec / 10000000, idle / 1000000000, (idle % 1000000000) / 10000000, retThreads[i]->bands);
+	}
+
+	/* -> write pipeline stages: threads, time stalled on the queues and
+	 *    depth of the queue each stage pushes to */
+	if (nn_readers > 0) {
+		long long stall[3] = {0, 0, 0};
+		for (int i = 0; i < nn_readers; i++) stall[0] += retReaders[i]->idle_ns;
+		for (int i = 0; i < nn_threads; i++) stall[1] += retThreads[i]->idle_ns;
+		for (int i = 0; i < nn_writers; i++) stall[2] += retWriters[i]->idle_ns;
+
+		for (int i = 0; i < nn_readers; i++) {
+			fprintf(timing, "Reader_%d \t %d\t%10jd.%02ld\tstall %lld.%02lld\n", i, retReaders[i]->cnt, retReaders[i]->times.tv_sec, retReaders[i]->times.tv_nsec / 10000000, retReaders[i]->idle_ns / 1000000000, (retReaders[i]->idle_ns % 1000000000) / 10000000);
+		}
+		for (int i = 0; i < nn_writers; i++) {
+			fprintf(timing, "Writer_%d \t %d\t%10jd.%02ld\tstall %lld.%02lld\n", i, atomic_load(&writes_done[i]), retWriters[i]->times.tv_sec, retWriters[i]->times.tv_nsec / 10000000, retWriters[i]->idle_ns / 1000000000, (retWriters[i]->idle_ns % 1000000000) / 10000000);
+		}
+		fprintf(timing, "stage_read \t %d threads\tstall %lld.%02lld\tqueue max %ld avg %.2f\n", nn_readers, stall[0] / 1000000000, (stall[0] % 1000000000) / 10000000,
+			queueMax[0], queueAvg[0]);
+		fprintf(timing, "stage_filter \t %d threads\tstall %lld.%02lld\tqueue max %ld avg %.2f\n", nn_threads, stall[1] / 1000000000, (stall[1] % 1000000000) / 10000000,
+			queueMax[1], queueAvg[1]);
+		fprintf(timing, "stage_write \t %d threads\tstall %lld.%02lld\n", nn_writers, stall[2] / 1000000000, (stall[2] % 1000000000) / 10000000);
+	}
+
+	/* -> write image pool high-water marks (not used by the pipeline) */
+	if (nn_readers == 0) {
+		for (int i = 0; i < nn_threads; i++) {
+			fprintf(timing, "Pool_%d \t high-water %zu KB\tbuffers %d\tallocs %ld\treuses %ld\tfallbacks %ld\n", i, retThreads[i]->pool_high_water / 1024, retThreads[i]->pool_buffers, retThreads[i]->pool_allocs, retThreads[i]->pool_reuses, retThreads[i]->pool_fallbacks);
+		}
+		fprintf(timing, "pool \t\t %s pages\n", hugePages ? "huge" : "normal");
+
+		/* -> write images streamed and the most memory one of them took */
+		int streamed = 0;
+		size_t streamPeak = 0;
+		for (int i = 0; i < nn_threads; i++) {
+			streamed += retThreads[i]->streamed;
+			if (retThreads[i]->stream_peak > streamPeak) streamPeak = retThreads[i]->stream_peak;
+		}
+		fprintf(timing, "stream \t\t images %d\tpeak %zu KB\n", streamed, streamPeak / 1024);
+	}
+
+	/* -> write input: reading the files (mmap and page faults) apart from
+	 *    decoding them; streamed images only count their read time */
+	{
+		int nn_input = (nn_readers > 0) ? nn_readers : nn_threads;
+		retPack **retInput = (nn_readers > 0) ? retReaders : retThreads;
+		readStats input = {0};
+		for (int i = 0; i < nn_input; i++) {
+			fprintf(timing, "Input_%d \t %.1f MB\tread %lld.%02lld\tdecode %lld.%02lld\n", i, retInput[i]->input.bytes / 1e6,
+				retInput[i]->input.read_ns / 1000000000, (retInput[i]->input.read_ns % 1000000000) / 10000000,
+				retInput[i]->input.decode_ns / 1000000000, (retInput[i]->input.decode_ns % 1000000000) / 10000000);
+			input.bytes += retInput[i]->input.bytes;
+			input.read_ns += retInput[i]->input.read_ns;
+			input.decode_ns += retInput[i]->input.decode_ns;
+		}
+		fprintf(timing, "input \t\t %.1f MB\tread %.1f MB/s\tdecode %.1f MB/s\n", input.bytes / 1e6,
+			input.read_ns ? input.bytes * 1e3 / input.read_ns : 0.0, input.decode_ns ? input.bytes * 1e3 / input.decode_ns : 0.0);
+	}
+
+	/* -> write output writer: files written, io_uring submissions and
+	 *    time the main thread waited for the last ones */
+	if (writer != NULL) {
+		fprintf(timing, "writer \t\t %s\twrites %ld\tfailed %ld\t%.1f MB\tbatches %ld\tinflight %d\tdrain %jd.%02ld\n",
+			(writer->mode == WRITER_URING) ? "io_uring" : "thread", writer->writes, writer->failed, writer->bytes / 1e6,
+			writer->batches, writer->max_inflight, drain_time.tv_sec, drain_time.tv_nsec / 10000000);
+	} else {
+		fprintf(timing, "writer \t\t sync\n");
+	}
+
+	/* -> write shard: this process' share of the list */
+	if (shards > 1) {
+		fprintf(timing, "shard \t\t %d/%d\tby %s\tentries %d of %d\n", shard + 1, shards,
+			(shardMode == SHARD_SIZE) ? "size" : "hash", listEntries, listListed);
+	}
+
+	/* -> write manifest: inputs skipped as unchanged and recorded as done */
+	if (manifestUnchanged >= 0) {
+		fprintf(timing, "manifest \t unchanged %ld\trecorded %ld\n", manifestUnchanged, manifestRecorded);
+	} else {
+		fprintf(timing, "manifest \t off\n");
+	}
+
+	/* -> write files that showed up while watching and their latency */
+	if (watchMode) {
+		int latencyCnt = atomic_load(&latency_cnt);
+		long long latencyAvg = latencyCnt ? atomic_load(&latency_sum) / latencyCnt : 0;
+		long long latencyMax = atomic_load(&latency_max);
+		fprintf(timing, "watch \t\t images %d\tlatency avg %lld.%03lld\tmax %lld.%03lld\n", latencyCnt,
+			latencyAvg / 1000000000, (latencyAvg % 1000000000) / 1000000, latencyMax / 1000000000, (latencyMax % 1000000000) / 1000000);
+	}
+
+	/* -> write hardware counters of each stage */
+	if (perfCounters != 0) {
+		write_perf(timing, &stageSum, stageMegapixels, perfCounters);
+	} else if (perfError[0] != '\0') {
+		fprintf(timing, "perf \t\t unavailable (%s)\n", perfError);
+	}
+
+	/* -> write filter kernels in use */
+	fprintf(timing, "kernels \t %s\tsmooth %s\n", simd_name(), (smoothMode == SMOOTH_GD) ? "gd" : "fast");
+	/* -> write the pipeline */
+	char pipeline[512];
+	pipeline_describe(pipeline, sizeof(pipeline));
+	fprintf(timing, "pipeline \t %s\n", pipeline);
+
+	/* -> write the cost of each output format used: encode time per image
+	 *    and per megapixel, and the size of the files it made */
+	int outQuality;
+	int outFormat = output_format(&outQuality);
+	for (int f = 0; f < FORMATS; f++) {
+		encodeStats enc;
+		encode_stats(f, &enc);
+		if (enc.images == 0) continue;
+		fprintf(timing, "encode_%s \t images %ld\tquality %d\t%.2f ms/image\t%.2f ms/megapixel\t%.3f bits/pixel\t%.1f MB\n",
+			format_name(f), enc.images, f == outFormat ? outQuality : -1, enc.ns / 1e6 / enc.images,
+			enc.pixels ? (double) enc.ns / enc.pixels : 0.0, enc.pixels ? enc.bytes * 8.0 / enc.pixels : 0.0, enc.bytes / 1e6);
+	}
+
+	/* -> write texture cache counters */
+	fprintf(timing, "texture_cache \t hits %ld\tmisses %ld\tevictions %ld\n", cacheHits, cacheMisses, cacheEvictions);
+
+	/* -> write memory: the budget, most of it reserved at once, the
+	 *    reservations that waited, the images put aside and the peak RSS
+	 *    of the process */
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	if (budgetBytes > 0) {
+		fprintf(timing, "memory \t\t budget %.1f MB\treserved peak %.1f MB\twaits %ld (%lld.%02lld)\tdeferred %d\trss peak %.1f MB\n",
+			budgetBytes / 1e6, budgetPeak / 1e6, budgetWaits, budgetWait / 1000000000,
+			(budgetWait % 1000000000) / 10000000, atomic_load(&deferred_cnt), usage.ru_maxrss * 1024 / 1e6);
+	} else {
+		fprintf(timing, "memory \t\t rss peak %.1f MB\n", usage.ru_maxrss * 1024 / 1e6);
 	}
 
 	/* close timing_<n>.txt */
@@ -292,5 +2039,15 @@ else fprintf(stdout, "Found file:\t%s\n", buffer);
     printf("\tpar \t %10jd.%09ld\n", par_time.tv_sec, par_time.tv_nsec);
 	printf("\tseq2 \t %10jd.%09ld\n", seq2_time.tv_sec, seq2_time.tv_nsec);
 
+	if (writer != NULL) writer_destroy(writer);
+	free(writes_done);
+	phase = phase_end("timing", phase);
+	phase_end("teardown", start_phase);
+
+	/* every thread is done: the rings can be written */
+	if (traceFile != NULL && !trace_write(traceFile)) {
+		fprintf(stderr, "Impossible to write %s trace\n", traceFile);
+	}
+
 	exit(0);
 }